@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/common/bitfield.h"
+#include "microbench.h"
+
+typedef struct {
+  uint8_t* bits;
+  uint64_t count;
+} bitfield_state_t;
+
+/* Odd stride, visits the indexes in a cache-unfriendly order */
+#define SCATTER_STRIDE 0x9E3779B1ULL
+
+static void run_set_get_clear(void* arg, uint64_t iterations) {
+  bitfield_state_t* state = arg;
+  uint64_t sum = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t index = (i * SCATTER_STRIDE) % state->count;
+    set_bit(state->bits, index);
+    sum += (uint64_t)get_bit(state->bits, index);
+    clear_bit(state->bits, index);
+  }
+  microbench_consume(sum);
+}
+
+/* Search for the next needed piece when only the last one is left */
+static void run_scan(void* arg, uint64_t iterations) {
+  bitfield_state_t* state = arg;
+  uint64_t found = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t index = 0;
+    while (index < state->count && !get_bit(state->bits, index)) {
+      index++;
+    }
+    found += index;
+  }
+  microbench_consume(found);
+}
+
+void bench_bitfield(void) {
+  static const uint64_t counts[] = {1024, 64 * 1024, 1024 * 1024,
+                                    16 * 1024 * 1024};
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    bitfield_state_t state = {calloc((counts[i] + 7) / 8, 1), counts[i]};
+    if (!state.bits) {
+      continue;
+    }
+
+    snprintf(name, sizeof(name), "bitfield/set_get_clear/%lu",
+             (unsigned long)counts[i]);
+    microbench_run(name, 0, run_set_get_clear, &state);
+
+    set_bit(state.bits, counts[i] - 1);
+    snprintf(name, sizeof(name), "bitfield/scan/%lu",
+             (unsigned long)counts[i]);
+    microbench_run(name, counts[i] / 8, run_scan, &state);
+
+    free(state.bits);
+  }
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/common/client_list.h"
+#include "microbench.h"
+
+typedef struct {
+  ClientNode* list;
+  TCPClient_t* clients;
+  TCPClient_t extra;
+  int count;
+} client_list_state_t;
+
+static void run_find(void* arg, uint64_t iterations) {
+  client_list_state_t* state = arg;
+  uint64_t found = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    found += client_list_find(state->list, (int)(i % (uint64_t)state->count))
+                 ? 1
+                 : 0;
+  }
+  microbench_consume(found);
+}
+
+static void run_find_peer(void* arg, uint64_t iterations) {
+  client_list_state_t* state = arg;
+  uint64_t found = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    const TCPClient_t* client = &state->clients[i % (uint64_t)state->count];
+    found += client_list_find_peer(state->list, client->ip, client->port)
+                 ? 1
+                 : 0;
+  }
+  microbench_consume(found);
+}
+
+/* A peer connecting and going away again */
+static void run_add_remove(void* arg, uint64_t iterations) {
+  client_list_state_t* state = arg;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    state->list = client_list_add(state->list, &state->extra);
+    state->list = client_list_remove(state->list, &state->extra);
+  }
+}
+
+void bench_client_list(void) {
+  static const int counts[] = {16, 256, 4096};
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    client_list_state_t state = {client_list_create(), NULL, {0}, counts[i]};
+    state.clients = calloc((size_t)counts[i], sizeof(TCPClient_t));
+    if (!state.clients) {
+      continue;
+    }
+
+    // Fake descriptors, the list never touches them
+    for (int c = 0; c < counts[i]; c++) {
+      TCPClient_t* client = &state.clients[c];
+      client->socket_fd = c;
+      client->port = (in_port_t)(6000 + c % 16);
+      snprintf(client->ip, sizeof(client->ip), "10.0.%d.%d", (c >> 8) & 0xff,
+               c & 0xff);
+      state.list = client_list_add(state.list, client);
+    }
+    state.extra.socket_fd = counts[i];
+
+    snprintf(name, sizeof(name), "client_list/find/%d", counts[i]);
+    microbench_run(name, 0, run_find, &state);
+    snprintf(name, sizeof(name), "client_list/find_peer/%d", counts[i]);
+    microbench_run(name, 0, run_find_peer, &state);
+    snprintf(name, sizeof(name), "client_list/add_remove/%d", counts[i]);
+    microbench_run(name, 0, run_add_remove, &state);
+
+    // client_list_destroy() would close the fake descriptors
+    while (state.list) {
+      ClientNode* next = state.list->next;
+      free(state.list);
+      state.list = next;
+    }
+    free(state.clients);
+  }
+}
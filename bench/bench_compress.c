@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/file/compress.h"
+#include "microbench.h"
+
+#define PIECE_SIZE (1024 * 1024)
+#define CACHE_PIECES 64
+
+typedef struct {
+  uint8_t* piece;
+  uint8_t* compressed;
+  uint8_t* output;
+  int64_t compressed_size;
+} compress_state_t;
+
+static void run_compress(void* arg, uint64_t iterations) {
+  compress_state_t* state = arg;
+  int64_t total = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    total += compress_piece(state->piece, PIECE_SIZE, state->compressed);
+  }
+  microbench_consume((uint64_t)total);
+}
+
+static void run_decompress(void* arg, uint64_t iterations) {
+  compress_state_t* state = arg;
+  uint64_t failed = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    failed += decompress_piece(state->compressed,
+                               (size_t)state->compressed_size, state->output,
+                               PIECE_SIZE) != 0;
+  }
+  microbench_consume(failed);
+}
+
+/* Several leechers asking for the pieces the seeder compressed already */
+static void run_cache_get(void* arg, uint64_t iterations) {
+  piece_cache_t* cache = arg;
+  const uint8_t* data;
+  uint32_t size;
+  uint64_t found = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    found += (uint64_t)piece_cache_get(cache, i % CACHE_PIECES, &data, &size);
+  }
+  microbench_consume(found);
+}
+
+/* Text like data: digits and spaces, compresses to about half */
+static void fill_text(uint8_t* piece, const uint8_t* random) {
+  for (size_t i = 0; i < PIECE_SIZE; i++) {
+    piece[i] = (i % 4 == 3) ? ' ' : (uint8_t)('0' + random[i] % 10);
+  }
+}
+
+void bench_compress(void) {
+  compress_state_t state = {
+      .piece = malloc(PIECE_SIZE),
+      .compressed = malloc(compress_bound(PIECE_SIZE)),
+      .output = malloc(PIECE_SIZE),
+  };
+  uint8_t* random = microbench_random_buffer(PIECE_SIZE);
+  if (!state.piece || !state.compressed || !state.output || !random) {
+    goto cleanup;
+  }
+
+  static const char* const kinds[] = {"text", "random"};
+  char name[64];
+  for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+    if (k == 0) {
+      fill_text(state.piece, random);
+    } else {
+      memcpy(state.piece, random, PIECE_SIZE);
+    }
+    state.compressed_size =
+        compress_piece(state.piece, PIECE_SIZE, state.compressed);
+    if (state.compressed_size < 0) {
+      goto cleanup;
+    }
+
+    snprintf(name, sizeof(name), "compress/deflate/%s", kinds[k]);
+    microbench_run(name, PIECE_SIZE, run_compress, &state);
+    snprintf(name, sizeof(name), "compress/inflate/%s", kinds[k]);
+    microbench_run(name, PIECE_SIZE, run_decompress, &state);
+  }
+
+  piece_cache_t* cache = piece_cache_create(COMPRESS_CACHE_BYTES);
+  if (cache) {
+    for (uint64_t i = 0; i < CACHE_PIECES; i++) {
+      piece_cache_put(cache, i, state.compressed, 4096);
+    }
+    microbench_run("compress/cache_get", 0, run_cache_get, cache);
+    piece_cache_destroy(cache);
+  }
+
+cleanup:
+  free(random);
+  free(state.output);
+  free(state.compressed);
+  free(state.piece);
+}
@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../src/file/file_assembler.h"
+#include "../src/file/file_reader.h"
+#include "microbench.h"
+
+/* Fits the page cache, so the numbers are about the code and not the disk */
+#define BENCH_FILE_SIZE (64 * MIB)
+
+typedef struct {
+  int fd;
+  uint8_t* buffer;
+  uint32_t size;
+  uint64_t offset;
+  int flush;
+} file_state_t;
+
+static void temp_path(char* path, size_t size, const char* name) {
+  const char* dir = getenv("TMPDIR");
+  snprintf(path, size, "%s/eltextorrent-%s-%d", dir ? dir : "/tmp", name,
+           (int)getpid());
+}
+
+static uint64_t next_offset(file_state_t* state) {
+  uint64_t offset = state->offset;
+  state->offset += state->size;
+  if (state->offset + state->size > BENCH_FILE_SIZE) {
+    state->offset = 0;
+  }
+  return offset;
+}
+
+static void run_read(void* arg, uint64_t iterations) {
+  file_state_t* state = arg;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    read_file_range(state->fd, next_offset(state), state->size, state->buffer);
+  }
+  microbench_consume(state->buffer[0]);
+}
+
+static void run_write(void* arg, uint64_t iterations) {
+  file_state_t* state = arg;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    write_range_to_file(next_offset(state), state->buffer, state->size);
+  }
+  // Queued writes count too
+  if (state->flush) {
+    file_assembler_flush();
+  }
+}
+
+void bench_file_reader(void) {
+  static const uint32_t sizes[] = {16 * KIB, 256 * KIB, 4 * MIB};
+  char path[256], name[64];
+
+  uint8_t* data = microbench_random_buffer(BENCH_FILE_SIZE);
+  temp_path(path, sizeof(path), "reader");
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (!data || fd < 0 || write(fd, data, BENCH_FILE_SIZE) != BENCH_FILE_SIZE) {
+    fprintf(stderr, "Failed to create %s\n", path);
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    file_state_t state = {fd, data, sizes[i], 0, 0};
+    snprintf(name, sizeof(name), "file_reader/read_file_range/%uK",
+             sizes[i] / (uint32_t)KIB);
+    microbench_run(name, sizes[i], run_read, &state);
+  }
+
+cleanup:
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  free(data);
+}
+
+void bench_file_assembler(void) {
+  static const uint32_t sizes[] = {16 * KIB, 256 * KIB, 4 * MIB};
+  char path[256], name[64];
+
+  uint8_t* data = microbench_random_buffer(4 * MIB);
+  temp_path(path, sizeof(path), "assembler");
+  if (!data || file_assembler_init(path, BENCH_FILE_SIZE) != 0) {
+    fprintf(stderr, "Failed to create %s\n", path);
+    free(data);
+    return;
+  }
+
+  // pwrite() from the caller first, then the write-back thread
+  for (int async = 0; async <= 1; async++) {
+    if (async && file_assembler_writeback(DURABILITY_NONE) != 0) {
+      break;
+    }
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      file_state_t state = {-1, data, sizes[i], 0, async};
+      snprintf(name, sizeof(name), "file_assembler/%s/%uK",
+               async ? "write_queued" : "write", sizes[i] / (uint32_t)KIB);
+      microbench_run(name, sizes[i], run_write, &state);
+    }
+  }
+
+  file_assembler_abort();
+  free(data);
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/hash/digest.h"
+#include "../src/hash/hash.h"
+#include "../src/hash/merkle.h"
+#include "microbench.h"
+
+typedef struct {
+  digest_algo_t algo;
+  const uint8_t* data;
+  size_t size;
+  eltextorrent_file_t* torrent;
+} hash_state_t;
+
+static void run_piece_hash(void* arg, uint64_t iterations) {
+  hash_state_t* state = arg;
+  uint8_t hash[DIGEST_MAX_SIZE];
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    calculate_piece_hash(state->algo, state->data, state->size, 0, hash);
+  }
+  microbench_consume(hash[0]);
+}
+
+static void run_verify_block(void* arg, uint64_t iterations) {
+  hash_state_t* state = arg;
+  uint64_t valid = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    valid += (uint64_t)verify_block_hash(state->torrent, state->data,
+                                         state->size, 0);
+  }
+  microbench_consume(valid);
+}
+
+void bench_hash(void) {
+  static const size_t sizes[] = {16 * KIB, 256 * KIB, 4 * MIB};
+  char name[64];
+
+  uint8_t* data = microbench_random_buffer(4 * MIB);
+  if (!data) {
+    return;
+  }
+
+  for (int algo = 0; algo < DIGEST_COUNT; algo++) {
+    hash_state_t state = {(digest_algo_t)algo, data, 0, NULL};
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      state.size = sizes[i];
+      snprintf(name, sizeof(name), "hash/%s/%zuK", digest_name(state.algo),
+               sizes[i] / (size_t)KIB);
+      microbench_run(name, sizes[i], run_piece_hash, &state);
+    }
+
+    // A torrent with a single Merkle leaf, the check done per 16 KiB block
+    uint8_t leaf[DIGEST_MAX_SIZE];
+    eltextorrent_file_t torrent = {0};
+    torrent.digest = (uint32_t)algo;
+    torrent.hash_size = (uint32_t)digest_size(state.algo);
+    torrent.block_size = MERKLE_BLOCK_SIZE_16KB;
+    torrent.blocks_count = 1;
+    torrent.blocks_hashes = leaf;
+    if (merkle_leaf_hash(state.algo, data, MERKLE_BLOCK_SIZE_16KB, leaf) != 0) {
+      continue;
+    }
+
+    state.size = MERKLE_BLOCK_SIZE_16KB;
+    state.torrent = &torrent;
+    snprintf(name, sizeof(name), "hash/verify_block/%s",
+             digest_name(state.algo));
+    microbench_run(name, MERKLE_BLOCK_SIZE_16KB, run_verify_block, &state);
+  }
+
+  free(data);
+}
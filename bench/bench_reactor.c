@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "../src/common/reactor.h"
+#include "microbench.h"
+
+typedef struct {
+  reactor_t* reactor;
+  reactor_source_t* sources;
+  int count;
+  uint64_t handled;
+} reactor_state_t;
+
+static void on_ready(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  reactor_state_t* state = source->ctx;
+  state->handled++;
+}
+
+/* Peers that all have data waiting, one operation is one dispatched event */
+static void run_dispatch(void* arg, uint64_t iterations) {
+  reactor_state_t* state = arg;
+  uint64_t dispatched = 0;
+
+  while (dispatched < iterations) {
+    int ready = reactor_run_once(state->reactor, 0);
+    if (ready <= 0) {
+      return;
+    }
+    dispatched += (uint64_t)ready;
+  }
+}
+
+void bench_reactor(void) {
+  static const int counts[] = {1, 64, 1024};
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    reactor_state_t state = {reactor_create(), NULL, counts[i], 0};
+    state.sources = calloc((size_t)counts[i], sizeof(reactor_source_t));
+    if (!state.reactor || !state.sources) {
+      reactor_destroy(state.reactor);
+      free(state.sources);
+      continue;
+    }
+
+    // Level-triggered and never read, so every eventfd stays ready
+    int added = 0;
+    for (; added < counts[i]; added++) {
+      int fd = eventfd(1, EFD_NONBLOCK);
+      if (fd < 0 || reactor_add(state.reactor, &state.sources[added], fd,
+                                EPOLLIN, on_ready, &state) < 0) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        break;
+      }
+    }
+
+    if (added == counts[i]) {
+      snprintf(name, sizeof(name), "reactor/dispatch/%d", counts[i]);
+      microbench_run(name, 0, run_dispatch, &state);
+    }
+
+    for (int s = 0; s < added; s++) {
+      int fd = state.sources[s].fd;
+      reactor_remove(state.reactor, &state.sources[s]);
+      close(fd);
+    }
+    reactor_destroy(state.reactor);
+    free(state.sources);
+  }
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/hash/table.h"
+#include "microbench.h"
+
+typedef struct {
+  Leechees_t* table;
+  char (*ips)[INET_ADDRSTRLEN];
+  int count;
+} table_state_t;
+
+static void run_find(void* arg, uint64_t iterations) {
+  table_state_t* state = arg;
+  uint64_t found = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    found += find_leech(&state->table, state->ips[i % (uint64_t)state->count])
+                 ? 1
+                 : 0;
+  }
+  microbench_consume(found);
+}
+
+/* A leecher discovering the seeder and disconnecting */
+static void run_add_delete(void* arg, uint64_t iterations) {
+  table_state_t* state = arg;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    add_leech(&state->table, "192.168.255.254");
+    delete_leech(&state->table, find_leech(&state->table, "192.168.255.254"));
+  }
+}
+
+void bench_table(void) {
+  static const int counts[] = {16, 1024, 16384};
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    table_state_t state = {NULL, calloc((size_t)counts[i], INET_ADDRSTRLEN),
+                           counts[i]};
+    if (!state.ips) {
+      continue;
+    }
+
+    for (int c = 0; c < counts[i]; c++) {
+      snprintf(state.ips[c], INET_ADDRSTRLEN, "10.%d.%d.%d",
+               (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+      add_leech(&state.table, state.ips[c]);
+    }
+
+    snprintf(name, sizeof(name), "table/find/%d", counts[i]);
+    microbench_run(name, 0, run_find, &state);
+    snprintf(name, sizeof(name), "table/add_delete/%d", counts[i]);
+    microbench_run(name, 0, run_add_delete, &state);
+
+    clean_hashtable(&state.table);
+    free(state.ips);
+  }
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/common/timer_wheel.h"
+#include "microbench.h"
+
+typedef struct {
+  timer_wheel_t* wheel;
+  wheel_timer_t* timers;
+  int count;
+} timer_wheel_state_t;
+
+static void on_timer(wheel_timer_t* timer, void* arg) {
+  (void)timer;
+  (void)arg;
+}
+
+/* Delays of request timeouts and backoff, spread over all levels */
+static uint64_t delay_of(uint64_t i) {
+  return 1 + (i * 2654435761ULL) % 300000;
+}
+
+/* A response arriving and pushing its request deadline back */
+static void run_rearm(void* arg, uint64_t iterations) {
+  timer_wheel_state_t* state = arg;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    timer_wheel_schedule(state->wheel,
+                         &state->timers[i % (uint64_t)state->count],
+                         delay_of(i));
+  }
+}
+
+/* A connection going away with its deadline */
+static void run_schedule_cancel(void* arg, uint64_t iterations) {
+  timer_wheel_state_t* state = arg;
+  wheel_timer_t timer;
+  timer_init(&timer, on_timer, NULL);
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    timer_wheel_schedule(state->wheel, &timer, delay_of(i));
+    timer_wheel_cancel(state->wheel, &timer);
+  }
+}
+
+void bench_timer_wheel(void) {
+  static const int counts[] = {16, 4096, 65536};
+  char name[64];
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    timer_wheel_state_t state = {timer_wheel_create(), NULL, counts[i]};
+    state.timers = calloc((size_t)counts[i], sizeof(wheel_timer_t));
+    if (!state.wheel || !state.timers) {
+      timer_wheel_destroy(state.wheel);
+      free(state.timers);
+      continue;
+    }
+
+    // The first one is due soonest, so the timerfd is rarely re-armed
+    for (int t = 0; t < counts[i]; t++) {
+      timer_init(&state.timers[t], on_timer, NULL);
+      timer_wheel_schedule(state.wheel, &state.timers[t], t == 0 ? 1 : 1000);
+    }
+
+    snprintf(name, sizeof(name), "timer_wheel/rearm/%d", counts[i]);
+    microbench_run(name, 0, run_rearm, &state);
+    snprintf(name, sizeof(name), "timer_wheel/schedule_cancel/%d", counts[i]);
+    microbench_run(name, 0, run_schedule_cancel, &state);
+
+    timer_wheel_destroy(state.wheel);
+    free(state.timers);
+  }
+}
@@ -0,0 +1,269 @@
+#!/bin/bash
+# End-to-end benchmark on loopback: K seeders and M leechers of one
+# synthetic file, every process on its own port. Prints one JSON document
+# with time-to-complete, throughput, CPU time and peak RSS of each process.
+#
+# Settings come from the environment (see `make bench`):
+#   BENCH_SIZE            File size, suffixes K/M/G (default 256M)
+#   BENCH_PIECE_SIZE      Piece size passed to the creator, auto for the
+#                         one it picks for the file size (default 1M)
+#   BENCH_SEEDERS         Number of seeders (default 1)
+#   BENCH_LEECHERS        Number of leechers (default 1)
+#   BENCH_PORT            TCP port of the first seeder (default 16000)
+#   BENCH_DISCOVERY_PORT  UDP discovery port, PORT + 1 too (default 15000)
+#   BENCH_TIMEOUT         Seconds a leecher may take (default 300)
+#   BENCH_SCENARIO        netem scenario file: every seeder gets a proxy on
+#                         PORT + 1000 + i and every process the disk rules
+#   BENCH_TLS             Peers talk TLS if set to 1, with a self-signed
+#                         certificate for 127.0.0.1
+#   BENCH_TRANSPORT       Peer connections over tcp or udp (default tcp),
+#                         the netem proxy of BENCH_SCENARIO is TCP only
+#   BENCH_MULTICAST       Multicast group GROUP[:PORT], the first seeder
+#                         sends pieces there and every leecher joins it
+#                         (default: off)
+#   BENCH_LOCAL           Leechers read pieces from the file of the seeders
+#                         through a Unix socket if set to 1, as peers on
+#                         the same host do by default (default 0: over
+#                         the loopback like peers on other hosts)
+#   BENCH_COMPRESS        Compression mode of the seeders: off, auto or
+#                         always (default off)
+#   BENCH_DATA            random, or text that compresses to about half
+#                         (default random)
+#   BENCH_OUTPUT          File for the JSON, stdout if empty
+#   BENCH_KEEP            Keep the work directory if set to 1
+
+set -u
+
+BIN_DIR=${BIN_DIR:-$(cd "$(dirname "$0")/.." && pwd)/bin}
+SIZE=$(numfmt --from=iec "${BENCH_SIZE:-256M}") || exit 1
+PIECE_SIZE=${BENCH_PIECE_SIZE:-1M}
+SEEDERS=${BENCH_SEEDERS:-1}
+LEECHERS=${BENCH_LEECHERS:-1}
+PORT=${BENCH_PORT:-16000}
+DISCOVERY_PORT=${BENCH_DISCOVERY_PORT:-15000}
+TIMEOUT=${BENCH_TIMEOUT:-300}
+OUTPUT=${BENCH_OUTPUT:-}
+SCENARIO=${BENCH_SCENARIO:-}
+TLS=${BENCH_TLS:-0}
+TRANSPORT=${BENCH_TRANSPORT:-tcp}
+MULTICAST=${BENCH_MULTICAST:-}
+LOCAL=${BENCH_LOCAL:-0}
+COMPRESS=${BENCH_COMPRESS:-off}
+DATA=${BENCH_DATA:-random}
+NETEM_PORT=$((PORT + 1000))
+PIECE_SIZE_ARGS=()
+if [ "$PIECE_SIZE" != auto ]; then
+  PIECE_SIZE_ARGS=(-p "$PIECE_SIZE")
+fi
+SCENARIO_ARGS=()
+if [ -n "$SCENARIO" ]; then
+  SCENARIO=$(realpath "$SCENARIO") || exit 1
+  SCENARIO_ARGS=(-S "$SCENARIO")
+fi
+SEEDER_TLS_ARGS=()
+LEECHER_TLS_ARGS=()
+if [ "$TLS" = 1 ]; then
+  SEEDER_TLS_ARGS=(-E tls.pem)
+  LEECHER_TLS_ARGS=(-a tls.pem)
+fi
+LOCAL_ARGS=()
+if [ "$LOCAL" != 1 ]; then
+  LOCAL_ARGS=(-s off)
+fi
+MULTICAST_ARGS=()
+if [ -n "$MULTICAST" ]; then
+  MULTICAST_ARGS=(-g "$MULTICAST")
+fi
+case "$DATA" in
+  random | text) ;;
+  *) echo "BENCH_DATA must be random or text" >&2; exit 1 ;;
+esac
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/eltextorrent-bench.XXXXXX") || exit 1
+SEEDER_PIDS=()
+
+cleanup() {
+  if [ ${#SEEDER_PIDS[@]} -gt 0 ]; then
+    kill "${SEEDER_PIDS[@]}" 2>/dev/null
+  fi
+  if [ "${BENCH_KEEP:-0}" = 1 ]; then
+    echo "Work directory: $WORK_DIR" >&2
+  else
+    rm -rf "$WORK_DIR"
+  fi
+}
+trap cleanup EXIT
+
+now_ns() { date +%s%N; }
+
+seconds_between() {
+  awk -v s="$1" -v e="$2" 'BEGIN { printf "%.3f", (e - s) / 1e9 }'
+}
+
+per_second() {
+  awk -v n="$1" -v s="$2" 'BEGIN { printf "%.0f", (s > 0 ? n / s : 0) }'
+}
+
+max_of() { awk -v a="$1" -v b="$2" 'BEGIN { print (b > a ? b : a) }'; }
+
+# Prints `user system max_rss_kb` from the resource line of a log
+resource_usage() {
+  sed -n 's/.*Resource usage: user=\([0-9.]*\) system=\([0-9.]*\) '`
+         `'max_rss_kb=\([0-9]*\).*/\1 \2 \3/p' "$1" | tail -n 1
+}
+
+wait_for_log() {
+  local log=$1 pattern=$2
+  for _ in $(seq 100); do
+    grep -q "$pattern" "$log" 2>/dev/null && return 0
+    sleep 0.1
+  done
+  return 1
+}
+
+mkdir -p "$WORK_DIR/seed"
+echo "Generating $SIZE bytes in $WORK_DIR" >&2
+if [ "$DATA" = text ]; then
+  # Decimal dump of random bytes, deflate at level 1 keeps about 40%
+  od -An -tu1 -v /dev/urandom | head -c "$SIZE" > "$WORK_DIR/seed/bench.bin"
+else
+  head -c "$SIZE" /dev/urandom > "$WORK_DIR/seed/bench.bin"
+fi
+(cd "$WORK_DIR" &&
+  "$BIN_DIR/creator" -q "${PIECE_SIZE_ARGS[@]}" seed/bench.bin \
+  > creator.log 2>&1) || { cat "$WORK_DIR/creator.log" >&2; exit 1; }
+if [ "$TLS" = 1 ]; then
+  # Certificate and key in one file, the leechers trust it as their CA
+  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 \
+    -nodes -days 1 -subj /CN=eltextorrent-bench \
+    -addext subjectAltName=IP:127.0.0.1 -keyout "$WORK_DIR/tls.key" \
+    -out "$WORK_DIR/tls.crt" > "$WORK_DIR/openssl.log" 2>&1 ||
+    { cat "$WORK_DIR/openssl.log" >&2; exit 1; }
+  cat "$WORK_DIR/tls.crt" "$WORK_DIR/tls.key" > "$WORK_DIR/tls.pem"
+fi
+
+for ((i = 0; i < SEEDERS; i++)); do
+  announce=127.0.0.1
+  # One sender per group, or every piece would go out once per seeder
+  seeder_multicast=()
+  if [ "$i" = 0 ]; then
+    seeder_multicast=("${MULTICAST_ARGS[@]}")
+  fi
+  if [ -n "$SCENARIO" ]; then
+    # Leechers are sent to the proxy, which forwards to the seeder
+    announce=127.0.0.1:$((NETEM_PORT + i))
+    (cd "$WORK_DIR" && exec "$BIN_DIR/netem" -l $((NETEM_PORT + i)) \
+      -t 127.0.0.1:$((PORT + i)) -s "$SCENARIO" > "netem$i.log" 2>&1) &
+    SEEDER_PIDS+=($!)
+  fi
+  (cd "$WORK_DIR" && exec "$BIN_DIR/main" -m seed -t torrent_file.torrent \
+    -d seed -P $((PORT + i)) -U "$DISCOVERY_PORT" -A "$announce" \
+    "${SCENARIO_ARGS[@]}" "${SEEDER_TLS_ARGS[@]}" -z "$COMPRESS" \
+    -u "$TRANSPORT" "${seeder_multicast[@]}" "${LOCAL_ARGS[@]}" \
+    -L "seeder$i.log" > /dev/null 2>&1) &
+  SEEDER_PIDS+=($!)
+done
+for ((i = 0; i < SEEDERS; i++)); do
+  wait_for_log "$WORK_DIR/seeder$i.log" "Listening on" ||
+    { echo "Seeder $i did not start" >&2; cat "$WORK_DIR/seeder$i.log" >&2;
+      exit 1; }
+done
+
+echo "Running $SEEDERS seeder(s) and $LEECHERS leecher(s)" >&2
+LEECHER_PIDS=()
+for ((j = 0; j < LEECHERS; j++)); do
+  mkdir -p "$WORK_DIR/leech$j"
+  (
+    cd "$WORK_DIR" || exit 1
+    start=$(now_ns)
+    timeout "$TIMEOUT" "$BIN_DIR/main" -m leech -t torrent_file.torrent \
+      -d "leech$j" -U "$DISCOVERY_PORT" "${SCENARIO_ARGS[@]}" \
+      "${LEECHER_TLS_ARGS[@]}" -u "$TRANSPORT" "${MULTICAST_ARGS[@]}" \
+      -L "leecher$j.log" > /dev/null 2>&1
+    status=$?
+    echo "$status $start $(now_ns)" > "leecher$j.time"
+  ) &
+  LEECHER_PIDS+=($!)
+done
+wait "${LEECHER_PIDS[@]}"
+
+kill -TERM "${SEEDER_PIDS[@]}" 2>/dev/null
+wait "${SEEDER_PIDS[@]}" 2>/dev/null
+SEEDER_PIDS=()
+
+# Prints off, kernel if the kernel did all the record work on both sides of
+# every connection of the leechers, user-space otherwise. Connections over
+# a local socket have no TLS
+tls_mode() {
+  if [ "$TLS" != 1 ] || ! grep -qh "TLS with" "$WORK_DIR"/leecher*.log; then
+    echo off
+  elif grep -h "TLS with" "$WORK_DIR"/leecher*.log |
+    grep -qv "send on, receive on"; then
+    echo user-space
+  else
+    echo kernel
+  fi
+}
+
+json_process() {
+  local log=$1 usage
+  usage=($(resource_usage "$log"))
+  printf '"user_seconds": %s, "system_seconds": %s, "max_rss_kb": %s' \
+    "${usage[0]:-null}" "${usage[1]:-null}" "${usage[2]:-null}"
+}
+
+{
+  printf '{\n  "commit": "%s",\n' \
+    "$(git -C "$BIN_DIR/.." rev-parse --short HEAD 2>/dev/null)"
+  printf '  "size_bytes": %s,\n  "piece_size": "%s",\n' "$SIZE" "$PIECE_SIZE"
+  printf '  "seeders": %s,\n  "leechers": %s,\n' "$SEEDERS" "$LEECHERS"
+  printf '  "scenario": "%s",\n' "$SCENARIO"
+  printf '  "tls": "%s",\n' "$(tls_mode)"
+  printf '  "transport": "%s",\n' "$TRANSPORT"
+  printf '  "multicast": "%s",\n' "$MULTICAST"
+  printf '  "local": %s,\n' "$([ "$LOCAL" = 1 ] && echo true || echo false)"
+  printf '  "compress": "%s",\n  "data": "%s",\n' "$COMPRESS" "$DATA"
+
+  printf '  "leecher_results": [\n'
+  slowest=0
+  completed=0
+  for ((j = 0; j < LEECHERS; j++)); do
+    read -r status start end < "$WORK_DIR/leecher$j.time"
+    seconds=$(seconds_between "$start" "$end")
+    ok=false
+    if [ "$status" = 0 ] &&
+      cmp -s "$WORK_DIR/seed/bench.bin" "$WORK_DIR/leech$j/bench.bin"; then
+      ok=true
+      completed=$((completed + 1))
+    fi
+    slowest=$(max_of "$slowest" "$seconds")
+    printf '    {"id": %d, "ok": %s, "seconds": %s, "bytes_per_second": %s, ' \
+      "$j" "$ok" "$seconds" \
+      "$(per_second "$SIZE" "$seconds")"
+    json_process "$WORK_DIR/leecher$j.log"
+    printf '}%s\n' "$([ $j -lt $((LEECHERS - 1)) ] && echo ,)"
+  done
+  printf '  ],\n'
+
+  printf '  "seeder_results": [\n'
+  for ((i = 0; i < SEEDERS; i++)); do
+    printf '    {"id": %d, "port": %d, ' "$i" $((PORT + i))
+    json_process "$WORK_DIR/seeder$i.log"
+    printf '}%s\n' "$([ $i -lt $((SEEDERS - 1)) ] && echo ,)"
+  done
+  printf '  ],\n'
+
+  printf '  "completed": %d,\n  "slowest_seconds": %s,\n' "$completed" \
+    "$slowest"
+  printf '  "aggregate_bytes_per_second": %s\n}\n' \
+    "$(per_second $((SIZE * completed)) "$slowest")"
+} > "$WORK_DIR/result.json"
+
+if [ -n "$OUTPUT" ]; then
+  cp "$WORK_DIR/result.json" "$OUTPUT"
+  echo "Results written to $OUTPUT" >&2
+else
+  cat "$WORK_DIR/result.json"
+fi
+
+[ "$completed" = "$LEECHERS" ]
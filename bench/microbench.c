@@ -0,0 +1,170 @@
+#include "microbench.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/common/log.h"
+
+/* Heap calls of the whole process, counted by the --wrap'ed allocator */
+static _Atomic uint64_t k_allocs = 0;
+static _Atomic uint64_t k_alloc_bytes = 0;
+
+static const char* k_filter = NULL;
+static int k_repetitions = MICROBENCH_REPETITIONS;
+static volatile uint64_t k_sink;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  atomic_fetch_add_explicit(&k_allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&k_alloc_bytes, size, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  atomic_fetch_add_explicit(&k_allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&k_alloc_bytes, count * size,
+                            memory_order_relaxed);
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  atomic_fetch_add_explicit(&k_allocs, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&k_alloc_bytes, size, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t timed_run(microbench_fn fn, void* arg, uint64_t iterations) {
+  uint64_t started = now_ns();
+  fn(arg, iterations);
+  return now_ns() - started;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double left = *(const double*)a;
+  double right = *(const double*)b;
+  return left < right ? -1 : left > right;
+}
+
+static void format_rate(double bytes_per_second, char* buffer, size_t size) {
+  static const char* const units[] = {"B/s", "KiB/s", "MiB/s", "GiB/s"};
+  int unit = 0;
+
+  while (bytes_per_second >= 1024.0 && unit < 3) {
+    bytes_per_second /= 1024.0;
+    unit++;
+  }
+  snprintf(buffer, size, "%.2f %s", bytes_per_second, units[unit]);
+}
+
+static int selected(const char* name) {
+  return !k_filter || strstr(name, k_filter) != NULL;
+}
+
+void microbench_run(const char* name, uint64_t bytes_per_op, microbench_fn fn,
+                    void* arg) {
+  if (!selected(name)) {
+    return;
+  }
+
+  // Warm-up doubles as calibration of the iterations per run
+  uint64_t iterations = 1;
+  uint64_t elapsed = timed_run(fn, arg, iterations);
+  while (elapsed < MICROBENCH_WARMUP_MS * 1000000ULL) {
+    iterations *= 2;
+    elapsed = timed_run(fn, arg, iterations);
+  }
+  iterations = (uint64_t)((double)iterations * MICROBENCH_TARGET_MS *
+                          1000000.0 / (double)elapsed);
+  if (iterations == 0) {
+    iterations = 1;
+  }
+
+  double* ns_per_op = malloc(sizeof(double) * (size_t)k_repetitions);
+  if (!ns_per_op) {
+    return;
+  }
+
+  uint64_t allocs = atomic_load(&k_allocs);
+  uint64_t alloc_bytes = atomic_load(&k_alloc_bytes);
+  for (int i = 0; i < k_repetitions; i++) {
+    ns_per_op[i] =
+        (double)timed_run(fn, arg, iterations) / (double)iterations;
+  }
+  allocs = atomic_load(&k_allocs) - allocs;
+  alloc_bytes = atomic_load(&k_alloc_bytes) - alloc_bytes;
+  uint64_t measured = iterations * (uint64_t)k_repetitions;
+
+  qsort(ns_per_op, (size_t)k_repetitions, sizeof(double), compare_doubles);
+  double median = ns_per_op[k_repetitions / 2];
+
+  char rate[32] = "-";
+  if (bytes_per_op > 0 && median > 0) {
+    format_rate((double)bytes_per_op * 1e9 / median, rate, sizeof(rate));
+  }
+  printf("%-40s %12.1f %12.1f %12.1f %14s %10.2f %12.1f\n", name, median,
+         ns_per_op[0], ns_per_op[k_repetitions - 1], rate,
+         (double)allocs / (double)measured,
+         (double)alloc_bytes / (double)measured);
+  fflush(stdout);
+  free(ns_per_op);
+}
+
+void microbench_consume(uint64_t value) { k_sink += value; }
+
+uint8_t* microbench_random_buffer(size_t size) {
+  uint8_t* buffer = malloc(size);
+  if (!buffer) {
+    return NULL;
+  }
+
+  // xorshift64, seeded the same way on every run
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < size; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    buffer[i] = (uint8_t)state;
+  }
+  return buffer;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    k_filter = argv[1];
+  }
+  const char* repetitions = getenv("MICROBENCH_REPETITIONS");
+  if (repetitions && atoi(repetitions) > 0) {
+    k_repetitions = atoi(repetitions);
+  }
+
+  // Only errors, so the modules under test do not print in the loops
+  log_init(NULL, "error");
+
+  printf("%-40s %12s %12s %12s %14s %10s %12s\n", "benchmark", "ns/op",
+         "min ns/op", "max ns/op", "throughput", "allocs/op", "bytes/op");
+
+  bench_bitfield();
+  bench_hash();
+  bench_file_reader();
+  bench_file_assembler();
+  bench_client_list();
+  bench_table();
+  bench_timer_wheel();
+  bench_reactor();
+  bench_compress();
+
+  log_shutdown();
+  return 0;
+}
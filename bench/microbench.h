@@ -0,0 +1,68 @@
+/**
+ * @file microbench.h
+ * @brief Repeatable microbenchmarks of the hot-path modules.
+ *
+ * A benchmark is a function running a number of iterations of one
+ * operation. The harness doubles the iterations until a run takes
+ * MICROBENCH_WARMUP_MS, which also warms caches and the branch predictor,
+ * then sizes runs to MICROBENCH_TARGET_MS and repeats them. The median,
+ * fastest and slowest run are reported per operation, with throughput and
+ * the heap allocations counted by wrapping malloc() at link time.
+ */
+
+#ifndef BENCH_MICROBENCH_H_
+#define BENCH_MICROBENCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MICROBENCH_WARMUP_MS 50
+#define MICROBENCH_TARGET_MS 100
+/* Default number of measured runs, MICROBENCH_REPETITIONS overrides it */
+#define MICROBENCH_REPETITIONS 7
+
+#define KIB (1024ULL)
+#define MIB (1024ULL * 1024ULL)
+
+/**
+ * @brief Runs an operation
+ * @param arg State prepared by the benchmark
+ * @param iterations Number of times to run it
+ */
+typedef void (*microbench_fn)(void* arg, uint64_t iterations);
+
+/**
+ * @brief Measure and print one benchmark
+ * @param name Name, skipped unless it contains the filter
+ * @param bytes_per_op Bytes processed per iteration, `0` if not applicable
+ * @param fn Operation
+ * @param arg State passed to fn
+ */
+void microbench_run(const char* name, uint64_t bytes_per_op, microbench_fn fn,
+                    void* arg);
+
+/**
+ * @brief Keep the compiler from optimizing a result away
+ * @param value Result
+ */
+void microbench_consume(uint64_t value);
+
+/**
+ * @brief Buffer of pseudo-random bytes, the same on every run
+ * @param size Size in bytes
+ * @return Buffer to free() or NULL on error
+ */
+uint8_t* microbench_random_buffer(size_t size);
+
+/* Suites, one per module */
+void bench_bitfield(void);
+void bench_hash(void);
+void bench_file_reader(void);
+void bench_file_assembler(void);
+void bench_client_list(void);
+void bench_table(void);
+void bench_timer_wheel(void);
+void bench_reactor(void);
+void bench_compress(void);
+
+#endif  // BENCH_MICROBENCH_H_
@@ -6,15 +6,55 @@
 #include <stdlib.h>
 
 #define HASH_SIZE 20
+#define DIGEST_MAX_SIZE 32
 #define NAME_MAX 255
-#define MAX_EPOLL_EVENTS 128
 #define PIECE_INDEX_BUF_SIZE 32
 #define SEEDER_TCP_PORT 6000
 #define UDP_BROADCAST_PORT 5001
 #define UDP_RECEIVE_PORT 5000
+#define MULTICAST_PORT 5002
 #define EPOLL_TIMEOUT_MS 1000
 #define TIMER_INTERVAL_SEC 1
+#define CONNECT_TIMEOUT_MS 3000
+#define REQUEST_TIMEOUT_MS 5000
+#define SEEDER_IDLE_TIMEOUT_MS 120000
+#define CONNECT_BACKOFF_MIN_MS 1000
+#define CONNECT_BACKOFF_MAX_MS 60000
+#define CONNECT_BACKOFF_PEERS 64
 #define NETWORK_BUFFER_SIZE 1024
+#define MERKLE_BLOCK_SIZE_16KB (16 * 1024)
+/* Pieces are a power of two in this range so they split into whole blocks */
+#define PIECE_SIZE_MIN (16 * 1024)
+#define PIECE_SIZE_MAX (64 * 1024 * 1024)
+#define BLOCK_REQUEST_PREFIX 'b'
+#define BLOCK_RESPONSE_FLAG (UINT64_C(1) << 63)
+/* Ends the piece requests of leechers that accept compressed pieces */
+#define COMPRESS_REQUEST_SUFFIX 'z'
+#define COMPRESSED_RESPONSE_FLAG (UINT64_C(1) << 62)
+/* Pieces sent raw between two that are compressed to refresh the averages */
+#define COMPRESS_SAMPLE_INTERVAL 64
+/* A piece goes raw unless compressing saves 1/16 of it */
+#define COMPRESS_MIN_SAVING_SHIFT 4
+/* Answers to leechers on the same host, the data is read from the file the
+   seeder passed them */
+#define SHARED_RESPONSE_FLAG (UINT64_C(1) << 61)
+/* Answers start with the 64-bit header and the 32-bit size of the data */
+#define ANSWER_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+
+/* Torrents hashed with anything but SHA1 start with {magic, version, digest} */
+#define TORRENT_MAGIC "\x7f" "ELT"
+#define TORRENT_MAGIC_SIZE 4
+/* Original layout hashed with SHA1, written without the header */
+#define TORRENT_VERSION_LEGACY 1
+#define TORRENT_VERSION 2
+/* Pieces of variable length, so older clients refuse these torrents */
+#define TORRENT_VERSION_CHUNKED 3
+/* Piece hashes are digests of the Merkle leaves of the piece */
+#define TORRENT_VERSION_LEAVES 4
+
+/* Optional sections appended after pieces_hashes as {type, length, payload} */
+#define TORRENT_EXT_MERKLE 1
+#define TORRENT_EXT_CHUNKS 2
 
 struct seeder_info {
   int fd;
@@ -40,20 +80,35 @@ typedef struct {
   uint8_t infohash[HASH_SIZE]; /**< Torrent file hash for peer discovery */
   uint64_t file_size;          /**< Original file size in bytes */
   char name[NAME_MAX + 1];     /**< Original filename */
-  uint32_t piece_size;         /**< Piece size in bytes (64KB) */
+  uint32_t piece_size;         /**< Piece size in bytes (power of two), the
+                                  largest piece of chunked torrents */
   uint32_t pieces_count;       /**< Total number of pieces */
-  uint8_t* pieces_hashes;      /**< Array of piece SHA1 hashes (pieces_count *
-                                  HASH_SIZE) */
+  uint32_t version;            /**< Format version (TORRENT_VERSION_*) */
+  uint32_t digest;             /**< Digest algorithm (digest_algo_t) */
+  uint32_t hash_size;          /**< Size of one piece or block hash */
+  uint8_t* pieces_hashes;      /**< Array of piece hashes (pieces_count *
+                                  hash_size) */
+  uint32_t block_size;         /**< Merkle leaf size in bytes (0 if absent) */
+  uint32_t blocks_count;       /**< Total number of Merkle leaves */
+  uint8_t merkle_root[DIGEST_MAX_SIZE]; /**< Root of the block Merkle tree */
+  uint8_t* blocks_hashes;      /**< Array of raw leaf hashes (blocks_count *
+                                  hash_size) */
+  uint32_t chunk_min_size;     /**< Smallest content-defined piece (0 if
+                                  pieces have a fixed size) */
+  uint32_t chunk_avg_size;     /**< Average content-defined piece */
+  uint64_t* pieces_offsets;    /**< Piece boundaries (pieces_count + 1) of
+                                  chunked torrents, NULL for fixed pieces */
 } eltextorrent_file_t;
 
 struct piece {
-  int index;
+  uint64_t offset; /* Position of the data in the shared file */
   uint32_t piece_size;
   uint8_t* pieces;
 };
 
 typedef struct queue_node {
   struct piece data;
+  uint64_t queued_ns; /* Submission time when tracing, 0 otherwise */
   struct queue_node* next;
 } queue_node_t;
 
@@ -1,6 +1,11 @@
 #include "client_list.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
 
 ClientNode* client_list_create() { return NULL; }
 
@@ -16,7 +21,7 @@ void client_list_destroy(ClientNode* head) {
 ClientNode* client_list_add(ClientNode* head, TCPClient_t* client) {
   ClientNode* new_node = malloc(sizeof(ClientNode));
   if (!new_node) {
-    fprintf(stderr, "[client_list_add] Failed to allocate new memory\n");
+    LOG_ERROR("[client_list_add] Failed to allocate new memory");
     return head;
   }
   new_node->client = client;
@@ -55,3 +60,14 @@ TCPClient_t* client_list_find(ClientNode* head, int fd) {
   }
   return NULL;
 }
+
+TCPClient_t* client_list_find_peer(ClientNode* head, const char* ip,
+                                   in_port_t port) {
+  for (ClientNode* current = head; current; current = current->next) {
+    if (current->client->port == port &&
+        strcmp(current->client->ip, ip) == 0) {
+      return current->client;
+    }
+  }
+  return NULL;
+}
@@ -67,4 +67,15 @@ ClientNode* client_list_remove(ClientNode* head, const TCPClient_t* client);
  */
 TCPClient_t* client_list_find(ClientNode* head, int fd);
 
+/**
+ * @brief Finds a client by peer address.
+ *
+ * @param head Head of the list.
+ * @param ip Peer IPv4 address.
+ * @param port Peer port.
+ * @return Pointer to the TCPClient_t if found, NULL otherwise.
+ */
+TCPClient_t* client_list_find_peer(ClientNode* head, const char* ip,
+                                   in_port_t port);
+
 #endif  // CLIENT_LIST_H_
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+typedef struct {
+  uint64_t time_ns; /* CLOCK_REALTIME */
+  uint8_t level;
+  uint8_t module;
+  uint16_t length;
+  char text[LOG_MESSAGE_MAX];
+} log_record_t;
+
+typedef struct log_ring {
+  _Alignas(64) _Atomic uint64_t head; /* Next record the owner writes */
+  _Alignas(64) _Atomic uint64_t tail; /* Next record the drain reads */
+  _Atomic int orphaned;               /* Owner thread exited */
+  struct log_ring* next;
+  log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+static const char* const k_level_names[] = {"ERROR", "WARN", "INFO",
+                                            "DEBUG"};
+static const char* const k_module_names[LOG_MODULE_COUNT] = {
+    [LOG_MODULE_MAIN] = "main",       [LOG_MODULE_SEEDER] = "seeder",
+    [LOG_MODULE_LEECHER] = "leecher", [LOG_MODULE_NETWORK] = "network",
+    [LOG_MODULE_FILE] = "file",       [LOG_MODULE_HASH] = "hash",
+};
+
+/* Changed at runtime by log_set_levels(), read by every thread */
+static _Atomic log_level_t k_levels[LOG_MODULE_COUNT] = {
+    LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO,
+    LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO,
+};
+
+static FILE* k_output = NULL;
+static _Atomic int k_running = 0;
+static _Atomic int k_stop = 0;
+static int k_atexit_registered = 0;
+static _Atomic uint64_t k_dropped = 0;
+static uint64_t k_dropped_reported = 0;
+static pthread_t k_thread;
+
+/* Rings of every thread that logged, only the list is guarded */
+static log_ring_t* k_rings = NULL;
+static pthread_mutex_t k_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t k_ring_key;
+static _Thread_local log_ring_t* k_ring = NULL;
+
+static int parse_level(const char* name, size_t length, log_level_t* level) {
+  for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+    if (strlen(k_level_names[i]) == length &&
+        strncasecmp(name, k_level_names[i], length) == 0) {
+      *level = (log_level_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int parse_levels(const char* spec, log_level_t* levels) {
+  const char* token = spec;
+
+  while (*token) {
+    size_t length = strcspn(token, ",");
+    const char* equals = memchr(token, '=', length);
+    log_level_t level;
+
+    if (!equals) {
+      if (parse_level(token, length, &level) != 0) {
+        return -1;
+      }
+      for (int i = 0; i < LOG_MODULE_COUNT; i++) {
+        levels[i] = level;
+      }
+    } else {
+      size_t name_length = (size_t)(equals - token);
+      int module = 0;
+      while (module < LOG_MODULE_COUNT &&
+             (strlen(k_module_names[module]) != name_length ||
+              strncmp(token, k_module_names[module], name_length) != 0)) {
+        module++;
+      }
+      if (module == LOG_MODULE_COUNT ||
+          parse_level(equals + 1, length - name_length - 1, &level) != 0) {
+        return -1;
+      }
+      levels[module] = level;
+    }
+
+    token += length;
+    if (*token == ',') {
+      token++;
+    }
+  }
+  return 0;
+}
+
+static uint64_t realtime_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void print_record(FILE* out, const log_record_t* record) {
+  time_t seconds = (time_t)(record->time_ns / 1000000000ULL);
+  unsigned millis = (unsigned)(record->time_ns / 1000000ULL % 1000);
+  struct tm local;
+  char stamp[32];
+
+  localtime_r(&seconds, &local);
+  strftime(stamp, sizeof(stamp), "%H:%M:%S", &local);
+  fprintf(out, "%s.%03u %-5s %s: %.*s\n", stamp, millis,
+          k_level_names[record->level], k_module_names[record->module],
+          (int)record->length, record->text);
+}
+
+/**
+ * @brief Ring of the calling thread, created on first use.
+ */
+static log_ring_t* thread_ring(void) {
+  if (k_ring) {
+    return k_ring;
+  }
+
+  log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+  if (!ring) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&k_rings_lock);
+  ring->next = k_rings;
+  k_rings = ring;
+  pthread_mutex_unlock(&k_rings_lock);
+
+  // The drain thread frees the ring once the thread is gone and it is empty
+  pthread_setspecific(k_ring_key, ring);
+  k_ring = ring;
+  return ring;
+}
+
+static void release_ring(void* ring) {
+  atomic_store_explicit(&((log_ring_t*)ring)->orphaned, 1,
+                        memory_order_release);
+}
+
+void log_write(log_level_t level, log_module_t module, const char* format,
+               ...) {
+  if (module >= LOG_MODULE_COUNT ||
+      level > atomic_load_explicit(&k_levels[module], memory_order_relaxed)) {
+    return;
+  }
+
+  log_record_t local;
+  log_record_t* record = &local;
+  log_ring_t* ring = NULL;
+  uint64_t head = 0;
+
+  if (atomic_load_explicit(&k_running, memory_order_acquire) &&
+      (ring = thread_ring())) {
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SLOTS) {
+      atomic_fetch_add_explicit(&k_dropped, 1, memory_order_relaxed);
+      return;
+    }
+    record = &ring->records[head & (LOG_RING_SLOTS - 1)];
+  }
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(record->text, LOG_MESSAGE_MAX, format, args);
+  va_end(args);
+
+  record->time_ns = realtime_ns();
+  record->level = (uint8_t)level;
+  record->module = (uint8_t)module;
+  record->length = (uint16_t)(length < 0                  ? 0
+                              : length >= LOG_MESSAGE_MAX ? LOG_MESSAGE_MAX - 1
+                                                          : length);
+
+  if (ring) {
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  } else {
+    print_record(stderr, record);
+  }
+}
+
+/**
+ * @brief Writes out everything queued and frees rings of exited threads.
+ *
+ * @return Number of records written
+ */
+static size_t drain_rings(void) {
+  size_t drained = 0;
+
+  pthread_mutex_lock(&k_rings_lock);
+  log_ring_t** link = &k_rings;
+  while (*link) {
+    log_ring_t* ring = *link;
+    int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (; tail < head; tail++) {
+      print_record(k_output, &ring->records[tail & (LOG_RING_SLOTS - 1)]);
+      drained++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    if (orphaned) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+  pthread_mutex_unlock(&k_rings_lock);
+
+  uint64_t dropped = atomic_load_explicit(&k_dropped, memory_order_relaxed);
+  if (dropped != k_dropped_reported) {
+    fprintf(k_output, "Log ring full, dropped %llu messages\n",
+            (unsigned long long)(dropped - k_dropped_reported));
+    k_dropped_reported = dropped;
+    drained++;
+  }
+
+  if (drained > 0) {
+    fflush(k_output);
+  }
+  return drained;
+}
+
+static void* drain_thread(void* arg) {
+  (void)arg;
+  struct timespec interval = {0, LOG_DRAIN_INTERVAL_MS * 1000000L};
+
+  for (;;) {
+    int stop = atomic_load_explicit(&k_stop, memory_order_acquire);
+    if (drain_rings() == 0) {
+      if (stop) {
+        break;
+      }
+      nanosleep(&interval, NULL);
+    }
+  }
+  return NULL;
+}
+
+int log_set_levels(const char* levels) {
+  log_level_t parsed[LOG_MODULE_COUNT];
+  for (int i = 0; i < LOG_MODULE_COUNT; i++) {
+    parsed[i] = LOG_LEVEL_INFO;
+  }
+
+  // Nothing changes unless the whole spec is valid
+  if (levels && *levels && parse_levels(levels, parsed) != 0) {
+    return -1;
+  }
+  for (int i = 0; i < LOG_MODULE_COUNT; i++) {
+    atomic_store_explicit(&k_levels[i], parsed[i], memory_order_relaxed);
+  }
+  return 0;
+}
+
+int log_init(const char* path, const char* levels) {
+  if (atomic_load(&k_running)) {
+    return 0;
+  }
+  if (log_set_levels(levels) != 0) {
+    fprintf(stderr, "Invalid log levels: %s\n", levels);
+    return -1;
+  }
+
+  k_output = stderr;
+  if (path && *path && !(k_output = fopen(path, "a"))) {
+    perror("Failed to open log file");
+    k_output = stderr;
+    return -1;
+  }
+
+  // Signals are left to the main thread, which reads them from a signalfd
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+  atomic_store(&k_stop, 0);
+  int failed = pthread_key_create(&k_ring_key, release_ring) != 0 ||
+               pthread_create(&k_thread, NULL, drain_thread, NULL) != 0;
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if (failed) {
+    if (k_output != stderr) {
+      fclose(k_output);
+    }
+    k_output = stderr;
+    return -1;
+  }
+
+  atomic_store(&k_running, 1);
+  if (!k_atexit_registered) {
+    atexit(log_shutdown);
+    k_atexit_registered = 1;
+  }
+  return 0;
+}
+
+void log_shutdown(void) {
+  if (!atomic_exchange(&k_running, 0)) {
+    return;
+  }
+
+  // Producers write directly from now on, the drain empties the rings
+  atomic_store(&k_stop, 1);
+  pthread_join(k_thread, NULL);
+
+  if (k_output != stderr) {
+    fclose(k_output);
+  }
+  k_output = stderr;
+}
+
+uint64_t log_dropped(void) {
+  return atomic_load_explicit(&k_dropped, memory_order_relaxed);
+}
@@ -0,0 +1,91 @@
+/**
+ * @file log.h
+ * @brief Asynchronous logger with levels and per-module filtering.
+ *
+ * A message is formatted straight into a ring owned by the calling thread,
+ * with no lock and no system call. A background thread drains every ring
+ * to stderr or a file. When a ring is full the message is dropped and
+ * counted, so a slow terminal can never stall the event loop.
+ *
+ * Every source file names its module once with LOG_DEFINE_MODULE() and then
+ * logs with LOG_ERROR(), LOG_WARN(), LOG_INFO() and LOG_DEBUG(). Before
+ * log_init() and after log_shutdown() messages are written synchronously.
+ */
+
+#ifndef COMMON_LOG_H_
+#define COMMON_LOG_H_
+
+#include <stdint.h>
+
+/* Records per thread ring, a power of two */
+#define LOG_RING_SLOTS 512
+/* Longer messages are truncated */
+#define LOG_MESSAGE_MAX 240
+/* How long the drain thread sleeps when every ring is empty */
+#define LOG_DRAIN_INTERVAL_MS 10
+
+typedef enum {
+  LOG_LEVEL_ERROR = 0,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+} log_level_t;
+
+typedef enum {
+  LOG_MODULE_MAIN = 0,
+  LOG_MODULE_SEEDER,
+  LOG_MODULE_LEECHER,
+  LOG_MODULE_NETWORK,
+  LOG_MODULE_FILE,
+  LOG_MODULE_HASH,
+  LOG_MODULE_COUNT
+} log_module_t;
+
+#define LOG_DEFINE_MODULE(module) \
+  static const log_module_t k_log_module __attribute__((unused)) = (module)
+
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, k_log_module, __VA_ARGS__)
+#define LOG_WARN(...) log_write(LOG_LEVEL_WARN, k_log_module, __VA_ARGS__)
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, k_log_module, __VA_ARGS__)
+#define LOG_DEBUG(...) log_write(LOG_LEVEL_DEBUG, k_log_module, __VA_ARGS__)
+
+/**
+ * @brief Start the drain thread
+ * @param path File to append to, NULL or empty for stderr
+ * @param levels `<level>` and/or `<module>=<level>` separated by commas,
+ * e.g. `info,network=debug`. NULL or empty keeps `info` everywhere.
+ * @return `0` on success or `-1` on error
+ */
+int log_init(const char* path, const char* levels);
+
+/**
+ * @brief Change the levels while running
+ * @param levels Level spec as for log_init(), modules it does not name go
+ * back to `info`
+ * @return `0` on success or `-1` if the spec is invalid
+ */
+int log_set_levels(const char* levels);
+
+/**
+ * @brief Write everything queued and stop the drain thread
+ *
+ * Registered with atexit() by log_init(), safe to call more than once.
+ */
+void log_shutdown(void);
+
+/**
+ * @brief Queue a message
+ * @param level Severity
+ * @param module Module the message comes from
+ * @param format printf() format, a trailing newline is added
+ */
+void log_write(log_level_t level, log_module_t module, const char* format,
+               ...) __attribute__((format(printf, 3, 4)));
+
+/**
+ * @brief Number of messages dropped because a ring was full
+ * @return Dropped messages since start
+ */
+uint64_t log_dropped(void);
+
+#endif  // COMMON_LOG_H_
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../thirdparty/uthash.h"
+
+#define METRICS_PREFIX "eltextorrent_"
+#define METRICS_LABEL_MAX 64
+
+typedef enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM } metric_type_t;
+
+typedef struct {
+  const char* name;
+  const char* help;
+  metric_type_t type;
+  const char* label; /* Label name or NULL */
+} metric_def_t;
+
+struct labeled_series {
+  char key[METRICS_LABEL_MAX + 8]; /* "<id>/<label value>" */
+  metric_id_t id;
+  char label[METRICS_LABEL_MAX];
+  _Atomic int64_t value;
+  UT_hash_handle hh;
+};
+typedef struct labeled_series labeled_series_t;
+
+static const metric_def_t k_defs[METRIC_COUNT] = {
+    [METRIC_PEER_RECEIVED_BYTES] = {"peer_received_bytes_total",
+                                    "Bytes received from a peer",
+                                    METRIC_COUNTER, "peer"},
+    [METRIC_PEER_SENT_BYTES] = {"peer_sent_bytes_total",
+                                "Bytes sent to a peer", METRIC_COUNTER,
+                                "peer"},
+    [METRIC_PIECES_REQUESTED] = {"pieces_requested_total",
+                                 "Piece requests sent", METRIC_COUNTER, NULL},
+    [METRIC_PIECES_RECEIVED] = {"pieces_received_total",
+                                "Pieces received from peers", METRIC_COUNTER,
+                                NULL},
+    [METRIC_PIECES_VERIFIED] = {"pieces_verified_total",
+                                "Pieces that matched their hash",
+                                METRIC_COUNTER, NULL},
+    [METRIC_PIECES_FAILED] = {"pieces_failed_total",
+                              "Pieces or blocks that failed verification",
+                              METRIC_COUNTER, NULL},
+    [METRIC_BLOCKS_REQUESTED] = {"blocks_requested_total",
+                                 "Block requests sent", METRIC_COUNTER, NULL},
+    [METRIC_REQUESTS_SERVED] = {"requests_served_total",
+                                "Piece and block requests answered",
+                                METRIC_COUNTER, NULL},
+    [METRIC_PIECES_COMPRESSED] = {"pieces_compressed_total",
+                                  "Pieces sent compressed", METRIC_COUNTER,
+                                  NULL},
+    [METRIC_COMPRESSION_SAVED_BYTES] = {"compression_saved_bytes_total",
+                                        "Bytes compression kept off the wire",
+                                        METRIC_COUNTER, NULL},
+    [METRIC_CONNECT_FAILURES] = {"connect_failures_total",
+                                 "Connection attempts that failed or timed out",
+                                 METRIC_COUNTER, "peer"},
+    [METRIC_REQUEST_TIMEOUTS] = {"request_timeouts_total",
+                                 "Requests a seeder did not answer in time",
+                                 METRIC_COUNTER, "peer"},
+    [METRIC_UDP_RETRANSMITS] = {"udp_retransmits_total",
+                                "Segments of UDP streams sent again",
+                                METRIC_COUNTER, "peer"},
+    [METRIC_REQUEST_RTT] = {"request_rtt_seconds",
+                            "Time from sending a request to its response",
+                            METRIC_HISTOGRAM, NULL},
+    [METRIC_HASH_DURATION] = {"hash_duration_seconds",
+                              "Time to verify a received piece or block",
+                              METRIC_HISTOGRAM, NULL},
+    [METRIC_DISK_READ_DURATION] = {"disk_read_duration_seconds",
+                                   "Time to read or send a range of the file",
+                                   METRIC_HISTOGRAM, NULL},
+    [METRIC_DISK_WRITE_DURATION] = {"disk_write_duration_seconds",
+                                    "Time of one write system call",
+                                    METRIC_HISTOGRAM, NULL},
+    [METRIC_WRITE_QUEUE_BYTES] = {"write_queue_bytes",
+                                  "Bytes waiting to be written to disk",
+                                  METRIC_GAUGE, NULL},
+    [METRIC_CONNECTIONS] = {"connections", "Open peer connections",
+                            METRIC_GAUGE, NULL},
+    [METRIC_MULTICAST_SENT_BYTES] = {"multicast_sent_bytes_total",
+                                     "Piece bytes sent to the multicast group",
+                                     METRIC_COUNTER, NULL},
+    [METRIC_MULTICAST_RECEIVED_BYTES] = {
+        "multicast_received_bytes_total",
+        "Needed piece bytes received from the multicast group",
+        METRIC_COUNTER, NULL},
+    [METRIC_MULTICAST_NAKS] = {"multicast_naks_total",
+                               "Multicast NAK datagrams sent or received",
+                               METRIC_COUNTER, NULL},
+    [METRIC_SHARED_READ_BYTES] = {
+        "shared_read_bytes_total",
+        "Bytes read from the file of a seeder on the same host",
+        METRIC_COUNTER, NULL},
+    [METRIC_DISCOVERY_SENT] = {"discovery_packets_sent_total",
+                               "Peer discovery packets sent", METRIC_COUNTER,
+                               NULL},
+    [METRIC_DISCOVERY_RECEIVED] = {"discovery_packets_received_total",
+                                   "Peer discovery packets received",
+                                   METRIC_COUNTER, NULL},
+};
+
+static _Atomic int64_t k_values[METRIC_COUNT];
+static _Atomic uint64_t k_buckets[METRIC_COUNT][METRICS_BUCKETS];
+static _Atomic uint64_t k_sums[METRIC_COUNT];
+
+static labeled_series_t* k_series = NULL;
+static pthread_mutex_t k_series_lock = PTHREAD_MUTEX_INITIALIZER;
+
+metrics_series_t* metrics_series(metric_id_t id, const char* label) {
+  if (id >= METRIC_COUNT || !k_defs[id].label) {
+    return NULL;
+  }
+
+  char key[METRICS_LABEL_MAX + 8];
+  snprintf(key, sizeof(key), "%d/%s", (int)id, label ? label : "");
+
+  pthread_mutex_lock(&k_series_lock);
+  labeled_series_t* series;
+  HASH_FIND_STR(k_series, key, series);
+  if (!series) {
+    series = calloc(1, sizeof(labeled_series_t));
+    if (series) {
+      strcpy(series->key, key);
+      series->id = id;
+      snprintf(series->label, sizeof(series->label), "%s",
+               label ? label : "");
+      HASH_ADD_STR(k_series, key, series);
+    }
+  }
+  pthread_mutex_unlock(&k_series_lock);
+  return series;
+}
+
+void metrics_series_add(metrics_series_t* series, int64_t delta) {
+  if (series) {
+    atomic_fetch_add_explicit(&series->value, delta, memory_order_relaxed);
+  }
+}
+
+void metrics_add(metric_id_t id, const char* label, int64_t delta) {
+  if (id >= METRIC_COUNT) {
+    return;
+  }
+  if (!k_defs[id].label) {
+    atomic_fetch_add_explicit(&k_values[id], delta, memory_order_relaxed);
+    return;
+  }
+  metrics_series_add(metrics_series(id, label), delta);
+}
+
+void metrics_set(metric_id_t id, int64_t value) {
+  if (id < METRIC_COUNT) {
+    atomic_store_explicit(&k_values[id], value, memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief Bucket of a duration: 0 up to 1 us, then METRICS_SUB_BUCKETS per
+ * power of two of microseconds, the last one catches everything above.
+ * Bounds are inclusive, as `le` is.
+ */
+static int bucket_index(uint64_t nanoseconds) {
+  uint64_t below = nanoseconds > 0 ? nanoseconds - 1 : 0;
+  uint64_t us = below / 1000;
+  if (us == 0) {
+    return 0;
+  }
+
+  int octave = 63 - __builtin_clzll(us);
+  if (octave >= METRICS_OCTAVES) {
+    return METRICS_BUCKETS - 1;
+  }
+  // In nanoseconds, the first octaves are narrower than a sub-bucket in
+  // whole microseconds
+  uint64_t base = UINT64_C(1000) << octave;
+  uint64_t sub = (below - base) * METRICS_SUB_BUCKETS / base;
+  return 1 + octave * METRICS_SUB_BUCKETS + (int)sub;
+}
+
+/**
+ * @brief Upper bound of a finite bucket in seconds
+ */
+static double bucket_bound(int index) {
+  if (index == 0) {
+    return 1e-6;
+  }
+  int octave = (index - 1) / METRICS_SUB_BUCKETS;
+  int sub = (index - 1) % METRICS_SUB_BUCKETS;
+  double base = (double)(UINT64_C(1) << octave) * 1e-6;
+  return base * (METRICS_SUB_BUCKETS + sub + 1) / METRICS_SUB_BUCKETS;
+}
+
+void metrics_observe(metric_id_t id, uint64_t nanoseconds) {
+  if (id >= METRIC_COUNT) {
+    return;
+  }
+  atomic_fetch_add_explicit(&k_buckets[id][bucket_index(nanoseconds)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&k_sums[id], nanoseconds, memory_order_relaxed);
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void render_histogram(FILE* out, metric_id_t id) {
+  const char* name = k_defs[id].name;
+  uint64_t count = 0;
+
+  for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+    count += atomic_load_explicit(&k_buckets[id][i], memory_order_relaxed);
+    fprintf(out, METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n", name,
+            bucket_bound(i), (unsigned long long)count);
+  }
+  count += atomic_load_explicit(&k_buckets[id][METRICS_BUCKETS - 1],
+                                memory_order_relaxed);
+  fprintf(out, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name,
+          (unsigned long long)count);
+  fprintf(out, METRICS_PREFIX "%s_sum %.9f\n", name,
+          (double)atomic_load_explicit(&k_sums[id], memory_order_relaxed) /
+              1e9);
+  fprintf(out, METRICS_PREFIX "%s_count %llu\n", name,
+          (unsigned long long)count);
+}
+
+static void render_labeled(FILE* out, metric_id_t id) {
+  labeled_series_t *series, *tmp;
+
+  pthread_mutex_lock(&k_series_lock);
+  HASH_ITER(hh, k_series, series, tmp) {
+    if (series->id == id) {
+      fprintf(out, METRICS_PREFIX "%s{%s=\"%s\"} %lld\n", k_defs[id].name,
+              k_defs[id].label, series->label,
+              (long long)atomic_load_explicit(&series->value,
+                                              memory_order_relaxed));
+    }
+  }
+  pthread_mutex_unlock(&k_series_lock);
+}
+
+char* metrics_render(size_t* length) {
+  static const char* const type_names[] = {"counter", "gauge", "histogram"};
+  char* text = NULL;
+  FILE* out = open_memstream(&text, length);
+
+  if (!out) {
+    return NULL;
+  }
+
+  for (int id = 0; id < METRIC_COUNT; id++) {
+    const metric_def_t* def = &k_defs[id];
+    fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n", def->name, def->help);
+    fprintf(out, "# TYPE " METRICS_PREFIX "%s %s\n", def->name,
+            type_names[def->type]);
+
+    if (def->type == METRIC_HISTOGRAM) {
+      render_histogram(out, (metric_id_t)id);
+    } else if (def->label) {
+      render_labeled(out, (metric_id_t)id);
+    } else {
+      fprintf(out, METRICS_PREFIX "%s %lld\n", def->name,
+              (long long)atomic_load_explicit(&k_values[id],
+                                              memory_order_relaxed));
+    }
+  }
+
+  if (fclose(out) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+void metrics_free(void) {
+  labeled_series_t *series, *tmp;
+
+  pthread_mutex_lock(&k_series_lock);
+  HASH_ITER(hh, k_series, series, tmp) {
+    HASH_DEL(k_series, series);
+    free(series);
+  }
+  pthread_mutex_unlock(&k_series_lock);
+}
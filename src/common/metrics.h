@@ -0,0 +1,127 @@
+/**
+ * @file metrics.h
+ * @brief Process-wide registry of counters, gauges and latency histograms.
+ *
+ * Every metric is known up front and addressed by its metric_id_t, so
+ * updating one is a single atomic operation and safe from any thread.
+ * Counters may carry one label (the peer address); a series per label value
+ * is created on first use. Hot paths look their series up once with
+ * metrics_series() and then update it as atomically as unlabeled counters.
+ *
+ * Histograms are log-linear in the HDR style: every power of two from 1 us
+ * to about 34 s is split into METRICS_SUB_BUCKETS buckets, so the relative
+ * error stays bounded at any latency without configuring bucket bounds.
+ *
+ * metrics_render() produces the Prometheus text exposition format.
+ */
+
+#ifndef COMMON_METRICS_H_
+#define COMMON_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_OCTAVES 25
+/* Below 1 us, the log-linear ones and everything above */
+#define METRICS_BUCKETS (METRICS_OCTAVES * METRICS_SUB_BUCKETS + 2)
+
+typedef enum {
+  /* Traffic, labeled by peer address */
+  METRIC_PEER_RECEIVED_BYTES = 0,
+  METRIC_PEER_SENT_BYTES,
+  /* Download progress */
+  METRIC_PIECES_REQUESTED,
+  METRIC_PIECES_RECEIVED,
+  METRIC_PIECES_VERIFIED,
+  METRIC_PIECES_FAILED,
+  METRIC_BLOCKS_REQUESTED,
+  /* Seeding */
+  METRIC_REQUESTS_SERVED,
+  METRIC_PIECES_COMPRESSED,
+  METRIC_COMPRESSION_SAVED_BYTES,
+  /* Connection problems, labeled by peer address */
+  METRIC_CONNECT_FAILURES,
+  METRIC_REQUEST_TIMEOUTS,
+  METRIC_UDP_RETRANSMITS,
+  /* Latency histograms */
+  METRIC_REQUEST_RTT,
+  METRIC_HASH_DURATION,
+  METRIC_DISK_READ_DURATION,
+  METRIC_DISK_WRITE_DURATION,
+  /* Gauges */
+  METRIC_WRITE_QUEUE_BYTES,
+  METRIC_CONNECTIONS,
+  /* Multicast distribution */
+  METRIC_MULTICAST_SENT_BYTES,
+  METRIC_MULTICAST_RECEIVED_BYTES,
+  METRIC_MULTICAST_NAKS,
+  /* Same-host transfers */
+  METRIC_SHARED_READ_BYTES,
+  /* Peer discovery */
+  METRIC_DISCOVERY_SENT,
+  METRIC_DISCOVERY_RECEIVED,
+  METRIC_COUNT
+} metric_id_t;
+
+/* Series of a labeled counter for one label value */
+typedef struct labeled_series metrics_series_t;
+
+/**
+ * @brief Add to a counter or gauge
+ * @param id Metric to update
+ * @param label Label value for labeled counters, NULL otherwise
+ * @param delta Amount to add, may be negative for gauges
+ */
+void metrics_add(metric_id_t id, const char* label, int64_t delta);
+
+/**
+ * @brief Find or create the series of a labeled counter, it stays valid
+ * until metrics_free()
+ * @param id Labeled counter
+ * @param label Label value
+ * @return Series or NULL if the counter is not labeled or on error
+ */
+metrics_series_t* metrics_series(metric_id_t id, const char* label);
+
+/**
+ * @brief Add to a series without looking it up
+ * @param series Series from metrics_series(), does nothing if NULL
+ * @param delta Amount to add
+ */
+void metrics_series_add(metrics_series_t* series, int64_t delta);
+
+/**
+ * @brief Set a gauge
+ * @param id Metric to update
+ * @param value New value
+ */
+void metrics_set(metric_id_t id, int64_t value);
+
+/**
+ * @brief Record one observation in a histogram
+ * @param id Histogram to update
+ * @param nanoseconds Observed duration
+ */
+void metrics_observe(metric_id_t id, uint64_t nanoseconds);
+
+/**
+ * @brief Monotonic clock for durations passed to metrics_observe()
+ * @return Current time in nanoseconds
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * @brief Render every metric in the text exposition format
+ * @param length Output parameter for the text length
+ * @return Text on success, caller must free it, or NULL on error
+ */
+char* metrics_render(size_t* length);
+
+/**
+ * @brief Free the labeled series
+ */
+void metrics_free(void);
+
+#endif  // COMMON_METRICS_H_
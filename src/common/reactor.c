@@ -0,0 +1,180 @@
+#include "reactor.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+struct reactor {
+  int epoll_fd;
+  int stopped;
+  timer_wheel_t* wheel;
+  reactor_source_t timers;
+  reactor_task_t* tasks; /* Deferred tasks in FIFO order */
+  reactor_task_t** tasks_tail;
+  /* Current batch, events from next on are not dispatched yet */
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int ready;
+  int next;
+};
+
+static void run_timers(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  timer_wheel_run(source->ctx);
+}
+
+reactor_t* reactor_create(void) {
+  reactor_t* reactor = calloc(1, sizeof(reactor_t));
+  if (!reactor) {
+    LOG_ERROR("calloc failed: %s", strerror(errno));
+    return NULL;
+  }
+  reactor->tasks_tail = &reactor->tasks;
+  reactor->timers.fd = -1;
+
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor->epoll_fd < 0) {
+    LOG_ERROR("epoll_create1 failed: %s", strerror(errno));
+    free(reactor);
+    return NULL;
+  }
+
+  reactor->wheel = timer_wheel_create();
+  if (!reactor->wheel ||
+      reactor_add(reactor, &reactor->timers, timer_wheel_fd(reactor->wheel),
+                  EPOLLIN, run_timers, reactor->wheel) != 0) {
+    reactor_destroy(reactor);
+    return NULL;
+  }
+  return reactor;
+}
+
+timer_wheel_t* reactor_wheel(reactor_t* reactor) { return reactor->wheel; }
+
+int reactor_add(reactor_t* reactor, reactor_source_t* source, int fd,
+                uint32_t events, reactor_handler_t handler, void* ctx) {
+  if (!reactor || !source || fd < 0 || !handler) {
+    return -1;
+  }
+
+  source->fd = fd;
+  source->events = events;
+  source->handler = handler;
+  source->ctx = ctx;
+
+  struct epoll_event event = {0};
+  event.events = events;
+  event.data.ptr = source;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+    LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+    source->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int reactor_modify(reactor_t* reactor, reactor_source_t* source,
+                   uint32_t events) {
+  if (source->events == events) {
+    return 0;
+  }
+
+  struct epoll_event event = {0};
+  event.events = events;
+  event.data.ptr = source;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, source->fd, &event) != 0) {
+    LOG_ERROR("epoll_ctl failed: %s", strerror(errno));
+    return -1;
+  }
+  source->events = events;
+  return 0;
+}
+
+void reactor_remove(reactor_t* reactor, reactor_source_t* source) {
+  if (source->fd < 0) {
+    return;
+  }
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+  source->fd = -1;
+
+  // The source may be freed before its pending events come up
+  for (int i = reactor->next; i < reactor->ready; i++) {
+    if (reactor->events[i].data.ptr == source) {
+      reactor->events[i].data.ptr = NULL;
+    }
+  }
+}
+
+void reactor_task_init(reactor_task_t* task, reactor_task_fn_t callback,
+                       void* arg) {
+  memset(task, 0, sizeof(reactor_task_t));
+  task->callback = callback;
+  task->arg = arg;
+}
+
+void reactor_defer(reactor_t* reactor, reactor_task_t* task) {
+  if (task->queued) {
+    return;
+  }
+  task->queued = 1;
+  task->next = NULL;
+  *reactor->tasks_tail = task;
+  reactor->tasks_tail = &task->next;
+}
+
+static void run_tasks(reactor_t* reactor) {
+  // Tasks deferred from here on run after the next batch
+  reactor_task_t* task = reactor->tasks;
+  reactor->tasks = NULL;
+  reactor->tasks_tail = &reactor->tasks;
+
+  while (task) {
+    reactor_task_t* next = task->next;
+    task->queued = 0;
+    task->callback(task, task->arg);
+    task = next;
+  }
+}
+
+int reactor_run_once(reactor_t* reactor, int timeout_ms) {
+  int ready = epoll_wait(reactor->epoll_fd, reactor->events,
+                         REACTOR_MAX_EVENTS, reactor->tasks ? 0 : timeout_ms);
+  if (ready < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+    return -1;
+  }
+
+  reactor->ready = ready;
+  for (reactor->next = 0; reactor->next < ready;) {
+    struct epoll_event* event = &reactor->events[reactor->next++];
+    reactor_source_t* source = event->data.ptr;
+    if (source) {
+      source->handler(source, event->events);
+    }
+  }
+  reactor->ready = 0;
+  reactor->next = 0;
+
+  run_tasks(reactor);
+  return ready;
+}
+
+void reactor_stop(reactor_t* reactor) { reactor->stopped = 1; }
+
+int reactor_stopped(const reactor_t* reactor) { return reactor->stopped; }
+
+void reactor_destroy(reactor_t* reactor) {
+  if (!reactor) {
+    return;
+  }
+  timer_wheel_destroy(reactor->wheel);
+  close(reactor->epoll_fd);
+  free(reactor);
+}
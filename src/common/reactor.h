@@ -0,0 +1,154 @@
+/**
+ * @file reactor.h
+ * @brief Event loop shared by the seeder and the leecher.
+ *
+ * Every descriptor is registered with a reactor_source_t that carries its
+ * handler and context and is stored in the epoll data.ptr, so an event is
+ * dispatched without looking anything up. Sources are embedded in the
+ * structures they belong to, like timers.
+ *
+ * Sources registered with EPOLLET are reported once per new input, their
+ * handler must read until EAGAIN. The reactor owns a timer wheel whose
+ * timerfd is one more source, and a queue of deferred tasks that run after
+ * the events of the current batch, which is where memory a handler may
+ * still use is released.
+ */
+
+#ifndef COMMON_REACTOR_H_
+#define COMMON_REACTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "timer_wheel.h"
+
+#define REACTOR_MAX_EVENTS 128
+
+typedef struct reactor reactor_t;
+typedef struct reactor_source reactor_source_t;
+typedef struct reactor_task reactor_task_t;
+
+/**
+ * @brief Called when a source is ready
+ * @param source The source, its ctx is the one given to reactor_add()
+ * @param events Ready epoll events
+ */
+typedef void (*reactor_handler_t)(reactor_source_t* source, uint32_t events);
+
+/**
+ * @brief Called once per reactor_defer()
+ * @param task The task, no longer queued
+ * @param arg Argument given to reactor_task_init()
+ */
+typedef void (*reactor_task_fn_t)(reactor_task_t* task, void* arg);
+
+struct reactor_source {
+  int fd;          /* -1 if not registered */
+  uint32_t events; /* Registered epoll events */
+  reactor_handler_t handler;
+  void* ctx;
+};
+
+struct reactor_task {
+  reactor_task_t* next;
+  reactor_task_fn_t callback;
+  void* arg;
+  int queued;
+};
+
+/**
+ * @brief Get the structure a source is embedded in
+ */
+#define REACTOR_CONTAINER(source, type, member) \
+  ((type*)((char*)(source) - offsetof(type, member)))
+
+/**
+ * @brief Create the epoll instance and the timer wheel
+ * @return Reactor on success or NULL on error
+ */
+reactor_t* reactor_create(void);
+
+/**
+ * @brief Wheel whose timers fire from reactor_run_once()
+ * @param reactor Reactor
+ * @return The wheel
+ */
+timer_wheel_t* reactor_wheel(reactor_t* reactor);
+
+/**
+ * @brief Register a descriptor
+ * @param reactor Reactor
+ * @param source Source to fill in, must stay valid until removed
+ * @param fd Descriptor
+ * @param events Epoll events, with EPOLLET for edge-triggered mode
+ * @param handler Called when the descriptor is ready
+ * @param ctx Stored in the source for the handler
+ * @return `0` on success or `-1` on error
+ */
+int reactor_add(reactor_t* reactor, reactor_source_t* source, int fd,
+                uint32_t events, reactor_handler_t handler, void* ctx);
+
+/**
+ * @brief Change the events a source waits for
+ * @param reactor Reactor
+ * @param source Registered source
+ * @param events Epoll events
+ * @return `0` on success or `-1` on error
+ */
+int reactor_modify(reactor_t* reactor, reactor_source_t* source,
+                   uint32_t events);
+
+/**
+ * @brief Unregister a source before its descriptor is closed, events of the
+ * current batch that are not dispatched yet are dropped
+ * @param reactor Reactor
+ * @param source Source, does nothing if not registered
+ */
+void reactor_remove(reactor_t* reactor, reactor_source_t* source);
+
+/**
+ * @brief Set the callback of a task, leaving it not queued
+ * @param task Task
+ * @param callback Called when the task runs
+ * @param arg Passed to the callback
+ */
+void reactor_task_init(reactor_task_t* task, reactor_task_fn_t callback,
+                       void* arg);
+
+/**
+ * @brief Run a task after the events of the current batch, does nothing if
+ * it is already queued
+ * @param reactor Reactor
+ * @param task Initialized task
+ */
+void reactor_defer(reactor_t* reactor, reactor_task_t* task);
+
+/**
+ * @brief Wait for events once, dispatch them, then run the deferred tasks
+ * @param reactor Reactor
+ * @param timeout_ms Longest wait, `-1` to wait for the next event or timer
+ * @return Number of dispatched events or `-1` on error
+ */
+int reactor_run_once(reactor_t* reactor, int timeout_ms);
+
+/**
+ * @brief Make reactor_stopped() return `1`, from a handler or a task
+ * @param reactor Reactor
+ */
+void reactor_stop(reactor_t* reactor);
+
+/**
+ * @brief Check whether reactor_stop() was called
+ * @param reactor Reactor
+ * @return `1` if stopped, `0` otherwise
+ */
+int reactor_stopped(const reactor_t* reactor);
+
+/**
+ * @brief Close the epoll instance and the wheel, sources are not closed
+ * @param reactor Reactor, may be NULL
+ */
+void reactor_destroy(reactor_t* reactor);
+
+#endif  // COMMON_REACTOR_H_
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "scenario.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+#define SCENARIO_LINE_MAX 512
+
+typedef enum { VALUE_DURATION, VALUE_SIZE } value_kind_t;
+
+typedef struct {
+  const char* name;
+  size_t offset;
+  value_kind_t kind;
+  int link_only; /* Resetting a disk makes no sense */
+} scenario_key_t;
+
+static const scenario_key_t k_keys[] = {
+    {"delay", offsetof(scenario_rule_t, delay_us), VALUE_DURATION, 0},
+    {"jitter", offsetof(scenario_rule_t, jitter_us), VALUE_DURATION, 0},
+    {"rate", offsetof(scenario_rule_t, rate), VALUE_SIZE, 0},
+    {"stall_every", offsetof(scenario_rule_t, stall_every_us), VALUE_DURATION,
+     0},
+    {"stall_for", offsetof(scenario_rule_t, stall_for_us), VALUE_DURATION, 0},
+    {"reset_after", offsetof(scenario_rule_t, reset_after), VALUE_SIZE, 1},
+};
+
+/**
+ * @brief Targets a rule line applies to, as a bit mask of scenario_target_t.
+ */
+static unsigned parse_target(const char* name) {
+  static const struct {
+    const char* name;
+    unsigned mask;
+  } targets[] = {
+      {"up", 1U << SCENARIO_UP},
+      {"down", 1U << SCENARIO_DOWN},
+      {"both", (1U << SCENARIO_UP) | (1U << SCENARIO_DOWN)},
+      {"read", 1U << SCENARIO_READ},
+      {"write", 1U << SCENARIO_WRITE},
+      {"disk", (1U << SCENARIO_READ) | (1U << SCENARIO_WRITE)},
+  };
+
+  for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+    if (strcmp(name, targets[i].name) == 0) {
+      return targets[i].mask;
+    }
+  }
+  return 0;
+}
+
+static int parse_value(const char* text, value_kind_t kind, uint64_t* value) {
+  char* end;
+  errno = 0;
+  double number = strtod(text, &end);
+  if (end == text || errno != 0 || number < 0) {
+    return -1;
+  }
+
+  double scale;
+  if (kind == VALUE_DURATION) {
+    if (*end == '\0' || strcmp(end, "ms") == 0) {
+      scale = 1e3;
+    } else if (strcmp(end, "us") == 0) {
+      scale = 1;
+    } else if (strcmp(end, "s") == 0) {
+      scale = 1e6;
+    } else {
+      return -1;
+    }
+  } else {
+    const char* suffixes = "KMG";
+    const char* suffix = *end ? strchr(suffixes, *end) : NULL;
+    if (*end != '\0' && (!suffix || end[1] != '\0')) {
+      return -1;
+    }
+    scale = 1;
+    for (const char* s = suffixes; suffix && s <= suffix; s++) {
+      scale *= 1024;
+    }
+  }
+
+  *value = (uint64_t)(number * scale);
+  return 0;
+}
+
+static int parse_setting(char* setting, unsigned targets, scenario_t* out) {
+  char* value = strchr(setting, '=');
+  if (!value) {
+    return -1;
+  }
+  *value++ = '\0';
+
+  for (size_t i = 0; i < sizeof(k_keys) / sizeof(k_keys[0]); i++) {
+    const scenario_key_t* key = &k_keys[i];
+    if (strcmp(setting, key->name) != 0) {
+      continue;
+    }
+
+    uint64_t parsed;
+    if (parse_value(value, key->kind, &parsed) != 0 ||
+        (key->link_only && (targets >> SCENARIO_READ) != 0)) {
+      return -1;
+    }
+    for (int t = 0; t < SCENARIO_TARGETS; t++) {
+      if (targets & (1U << t)) {
+        *(uint64_t*)((char*)&out->rules[t] + key->offset) = parsed;
+      }
+    }
+    return 0;
+  }
+  return -1;
+}
+
+int scenario_load(const char* path, scenario_t* scenario) {
+  if (!path || !scenario) {
+    return -1;
+  }
+
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    LOG_ERROR("Failed to open scenario %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  memset(scenario, 0, sizeof(*scenario));
+
+  char line[SCENARIO_LINE_MAX];
+  int line_number = 0;
+  int result = 0;
+  while (result == 0 && fgets(line, sizeof(line), file)) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    char* saveptr;
+    char* word = strtok_r(line, " \t\r\n", &saveptr);
+    if (!word) {
+      continue;
+    }
+
+    unsigned targets = parse_target(word);
+    if (targets == 0) {
+      LOG_ERROR("%s:%d: unknown target '%s'", path, line_number, word);
+      result = -1;
+      break;
+    }
+
+    while ((word = strtok_r(NULL, " \t\r\n", &saveptr))) {
+      if (parse_setting(word, targets, scenario) != 0) {
+        LOG_ERROR("%s:%d: invalid setting '%s'", path, line_number, word);
+        result = -1;
+        break;
+      }
+    }
+  }
+
+  fclose(file);
+  return result;
+}
+
+uint64_t scenario_delay(const scenario_rule_t* rule, unsigned* seed) {
+  uint64_t delay = rule->delay_us;
+  if (rule->jitter_us > 0) {
+    delay += (uint64_t)((double)rand_r(seed) / RAND_MAX * rule->jitter_us);
+  }
+  return delay;
+}
+
+uint64_t scenario_after_stall(const scenario_rule_t* rule, uint64_t time_us) {
+  // The first stall starts one period in
+  if (rule->stall_every_us == 0 || time_us < rule->stall_every_us) {
+    return time_us;
+  }
+
+  uint64_t phase = time_us % rule->stall_every_us;
+  return phase < rule->stall_for_us ? time_us - phase + rule->stall_for_us
+                                    : time_us;
+}
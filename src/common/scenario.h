@@ -0,0 +1,68 @@
+/**
+ * @file scenario.h
+ * @brief Impairments of network links and disk operations for experiments.
+ *
+ * A scenario file has one rule per line, `<target> <key>=<value>...`, and
+ * `#` comments. Targets are `up` (leecher to seeder), `down` (seeder to
+ * leecher), `both`, `read`, `write` and `disk` (read and write). Lines for
+ * the same target are merged, later keys win:
+ *
+ *     down delay=40ms jitter=10ms rate=8M
+ *     down stall_every=10s stall_for=2s reset_after=64M
+ *     read delay=2ms
+ *
+ * Durations take us, ms (default) or s, sizes and rates (per second) take
+ * K, M or G. netem applies the link rules, the client the disk ones.
+ */
+
+#ifndef COMMON_SCENARIO_H_
+#define COMMON_SCENARIO_H_
+
+#include <stdint.h>
+
+typedef enum {
+  SCENARIO_UP = 0,
+  SCENARIO_DOWN,
+  SCENARIO_READ,
+  SCENARIO_WRITE,
+  SCENARIO_TARGETS
+} scenario_target_t;
+
+typedef struct {
+  uint64_t delay_us;       /* Added to every chunk or operation */
+  uint64_t jitter_us;      /* Uniform extra delay in [0, jitter_us] */
+  uint64_t rate;           /* Bytes per second, 0 if unlimited */
+  uint64_t stall_every_us; /* Period of stalls, 0 if none */
+  uint64_t stall_for_us;   /* Nothing passes for this long every period */
+  uint64_t reset_after;    /* Bytes until the link is reset, 0 if never */
+} scenario_rule_t;
+
+typedef struct {
+  scenario_rule_t rules[SCENARIO_TARGETS];
+} scenario_t;
+
+/**
+ * @brief Parse a scenario file
+ * @param path File to read
+ * @param scenario Zeroed and filled with the rules
+ * @return `0` on success or `-1` on error
+ */
+int scenario_load(const char* path, scenario_t* scenario);
+
+/**
+ * @brief Delay of one chunk or operation
+ * @param rule Rule to apply
+ * @param seed rand_r() state of the caller
+ * @return delay_us plus a random part of jitter_us
+ */
+uint64_t scenario_delay(const scenario_rule_t* rule, unsigned* seed);
+
+/**
+ * @brief Move a moment out of the stall it falls into
+ * @param rule Rule to apply
+ * @param time_us Microseconds since the start of the experiment
+ * @return time_us, or the end of the stall covering it
+ */
+uint64_t scenario_after_stall(const scenario_rule_t* rule, uint64_t time_us);
+
+#endif  // COMMON_SCENARIO_H_
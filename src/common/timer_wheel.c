@@ -0,0 +1,229 @@
+#include "timer_wheel.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define NS_PER_MS 1000000ULL
+
+struct timer_wheel {
+  int fd;
+  uint64_t start_ns; /* Tick 0 on the monotonic clock */
+  uint64_t now;      /* Last tick processed */
+  uint64_t armed;    /* Tick the timerfd fires at, 0 if disarmed */
+  size_t pending;
+  wheel_timer_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t current_tick(const timer_wheel_t* wheel) {
+  return (monotonic_ns() - wheel->start_ns) / NS_PER_MS;
+}
+
+timer_wheel_t* timer_wheel_create(void) {
+  timer_wheel_t* wheel = calloc(1, sizeof(timer_wheel_t));
+  if (!wheel) {
+    LOG_ERROR("calloc failed: %s", strerror(errno));
+    return NULL;
+  }
+
+  wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (wheel->fd < 0) {
+    LOG_ERROR("timerfd_create failed: %s", strerror(errno));
+    free(wheel);
+    return NULL;
+  }
+  wheel->start_ns = monotonic_ns();
+  return wheel;
+}
+
+int timer_wheel_fd(const timer_wheel_t* wheel) { return wheel->fd; }
+
+void timer_init(wheel_timer_t* timer, timer_callback_t callback, void* arg) {
+  memset(timer, 0, sizeof(wheel_timer_t));
+  timer->callback = callback;
+  timer->arg = arg;
+}
+
+int timer_pending(const wheel_timer_t* timer) { return timer->pprev != NULL; }
+
+/**
+ * @brief Puts a timer in the lowest level whose range covers its delay.
+ */
+static void link_timer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  uint64_t delta = timer->expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= UINT64_C(1) << (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  size_t index = (timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+  wheel_timer_t** head = &wheel->slots[level][index];
+  timer->next = *head;
+  if (*head) {
+    (*head)->pprev = &timer->next;
+  }
+  *head = timer;
+  timer->pprev = head;
+}
+
+static void unlink_timer(wheel_timer_t* timer) {
+  *timer->pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+static void arm(timer_wheel_t* wheel, uint64_t tick) {
+  if (wheel->armed == tick) {
+    return;
+  }
+
+  // Tick 0 never fires, so it stands for disarmed
+  struct itimerspec spec = {0};
+  if (tick > 0) {
+    uint64_t at = wheel->start_ns + tick * NS_PER_MS;
+    spec.it_value.tv_sec = (time_t)(at / 1000000000ULL);
+    spec.it_value.tv_nsec = (long)(at % 1000000000ULL);
+  }
+  if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+    LOG_ERROR("timerfd_settime failed: %s", strerror(errno));
+    return;
+  }
+  wheel->armed = tick;
+}
+
+/**
+ * @brief Earliest tick at which a timer fires or moves down a level.
+ *
+ * @return The tick or 0 if nothing is pending
+ */
+static uint64_t next_tick(const timer_wheel_t* wheel) {
+  uint64_t next = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    int shift = TIMER_WHEEL_BITS * level;
+    for (uint64_t k = 1; k <= TIMER_WHEEL_SLOTS; k++) {
+      uint64_t slot = (wheel->now >> shift) + k;
+      if (wheel->slots[level][slot & SLOT_MASK]) {
+        uint64_t tick = level == 0 ? slot : slot << shift;
+        if (next == 0 || tick < next) {
+          next = tick;
+        }
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+void timer_wheel_schedule(timer_wheel_t* wheel, wheel_timer_t* timer,
+                          uint64_t delay_ms) {
+  if (timer_pending(timer)) {
+    unlink_timer(timer);
+    wheel->pending--;
+  }
+
+  if (delay_ms > TIMER_WHEEL_MAX_MS) {
+    delay_ms = TIMER_WHEEL_MAX_MS;
+  }
+  // The wheel may lag behind the clock, but never fires in the past
+  uint64_t expires = current_tick(wheel) + delay_ms;
+  if (expires <= wheel->now) {
+    expires = wheel->now + 1;
+  }
+  if (expires - wheel->now > TIMER_WHEEL_MAX_MS) {
+    expires = wheel->now + TIMER_WHEEL_MAX_MS;
+  }
+  timer->expires = expires;
+  link_timer(wheel, timer);
+  wheel->pending++;
+
+  if (wheel->armed == 0 || expires < wheel->armed) {
+    arm(wheel, expires);
+  }
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  if (!timer_pending(timer)) {
+    return;
+  }
+  unlink_timer(timer);
+  wheel->pending--;
+  // The timerfd is left armed, an early wakeup only finds nothing due
+}
+
+static void cascade(timer_wheel_t* wheel, int level) {
+  size_t index = (wheel->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+  wheel_timer_t* list = wheel->slots[level][index];
+  wheel->slots[level][index] = NULL;
+  while (list) {
+    wheel_timer_t* timer = list;
+    list = timer->next;
+    link_timer(wheel, timer);
+  }
+}
+
+void timer_wheel_run(timer_wheel_t* wheel) {
+  uint64_t expirations;
+  if (read(wheel->fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    LOG_ERROR("timerfd read failed: %s", strerror(errno));
+  }
+  wheel->armed = 0;
+
+  uint64_t target = current_tick(wheel);
+  while (wheel->now < target) {
+    if (wheel->pending == 0) {
+      wheel->now = target;
+      break;
+    }
+    wheel->now++;
+
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      uint64_t mask = (UINT64_C(1) << (TIMER_WHEEL_BITS * level)) - 1;
+      if ((wheel->now & mask) != 0) {
+        break;
+      }
+      cascade(wheel, level);
+    }
+
+    // Detached first, callbacks may cancel the timers still in the list
+    wheel_timer_t* expired = wheel->slots[0][wheel->now & SLOT_MASK];
+    wheel->slots[0][wheel->now & SLOT_MASK] = NULL;
+    if (expired) {
+      expired->pprev = &expired;
+    }
+    while (expired) {
+      wheel_timer_t* timer = expired;
+      unlink_timer(timer);
+      wheel->pending--;
+      timer->callback(timer, timer->arg);
+    }
+  }
+
+  arm(wheel, next_tick(wheel));
+}
+
+void timer_wheel_destroy(timer_wheel_t* wheel) {
+  if (!wheel) {
+    return;
+  }
+  close(wheel->fd);
+  free(wheel);
+}
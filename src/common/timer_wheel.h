@@ -0,0 +1,112 @@
+/**
+ * @file timer_wheel.h
+ * @brief Hierarchical timing wheel driven by one monotonic timerfd.
+ *
+ * Timers are embedded in the structures they belong to and kept in
+ * intrusive lists, so scheduling, re-arming and cancelling are O(1) and
+ * never allocate. The wheel has TIMER_WHEEL_LEVELS levels of
+ * TIMER_WHEEL_SLOTS slots with a resolution of 1 ms: level 0 holds the
+ * timers due in the next 64 ms, and each level above covers 64 times the
+ * range of the one below. Timers of the upper levels move down when the
+ * wheel reaches their slot, so each is touched at most once per level.
+ *
+ * The timerfd is armed for the earliest slot that holds timers and is
+ * registered in the caller's epoll loop. When it becomes readable, call
+ * timer_wheel_run() to fire the timers that are due. Callbacks run on that
+ * thread and may schedule or cancel any timer, including their own.
+ */
+
+#ifndef COMMON_TIMER_WHEEL_H_
+#define COMMON_TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+/* Longer delays are shortened to this, about 4.6 hours */
+#define TIMER_WHEEL_MAX_MS \
+  ((UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef struct timer_wheel timer_wheel_t;
+typedef struct wheel_timer wheel_timer_t;
+
+/**
+ * @brief Called when a timer is due
+ * @param timer The timer, no longer pending
+ * @param arg Argument given to timer_init()
+ */
+typedef void (*timer_callback_t)(wheel_timer_t* timer, void* arg);
+
+struct wheel_timer {
+  wheel_timer_t* next;
+  wheel_timer_t** pprev; /* NULL if not pending */
+  uint64_t expires;      /* Wheel tick the timer fires at */
+  timer_callback_t callback;
+  void* arg;
+};
+
+/**
+ * @brief Get the structure a timer is embedded in
+ */
+#define TIMER_CONTAINER(timer, type, member) \
+  ((type*)((char*)(timer) - offsetof(type, member)))
+
+/**
+ * @brief Create a wheel and its timerfd
+ * @return Wheel on success or NULL on error
+ */
+timer_wheel_t* timer_wheel_create(void);
+
+/**
+ * @brief Descriptor to register in epoll for reading
+ * @param wheel Wheel
+ * @return The timerfd
+ */
+int timer_wheel_fd(const timer_wheel_t* wheel);
+
+/**
+ * @brief Set the callback of a timer, leaving it not pending
+ * @param timer Timer
+ * @param callback Called when the timer is due
+ * @param arg Passed to the callback
+ */
+void timer_init(wheel_timer_t* timer, timer_callback_t callback, void* arg);
+
+/**
+ * @brief Schedule a timer, re-arming it if it is already pending
+ * @param wheel Wheel
+ * @param timer Initialized timer
+ * @param delay_ms Milliseconds from now, at most TIMER_WHEEL_MAX_MS
+ */
+void timer_wheel_schedule(timer_wheel_t* wheel, wheel_timer_t* timer,
+                          uint64_t delay_ms);
+
+/**
+ * @brief Cancel a timer, does nothing if it is not pending
+ * @param wheel Wheel the timer was scheduled on
+ * @param timer Timer
+ */
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+/**
+ * @brief Check whether a timer is scheduled
+ * @param timer Timer
+ * @return `1` if pending, `0` otherwise
+ */
+int timer_pending(const wheel_timer_t* timer);
+
+/**
+ * @brief Fire the timers that are due and re-arm the timerfd
+ * @param wheel Wheel whose timerfd became readable
+ */
+void timer_wheel_run(timer_wheel_t* wheel);
+
+/**
+ * @brief Close the timerfd and free the wheel, pending timers are dropped
+ * @param wheel Wheel, may be NULL
+ */
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+#endif  // COMMON_TIMER_WHEEL_H_
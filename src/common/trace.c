@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+#define TRACE_THREAD_NAME_MAX 16
+
+typedef struct {
+  uint64_t time_ns;
+  uint64_t duration_ns; /* Spans only */
+  uint64_t id;
+  uint64_t bytes;
+  const char* name;
+  char phase;
+} trace_event_t;
+
+typedef struct trace_buffer {
+  _Atomic size_t count; /* Published by the owner thread */
+  uint64_t dropped;
+  pid_t tid;
+  char thread_name[TRACE_THREAD_NAME_MAX];
+  struct trace_buffer* next;
+  trace_event_t events[TRACE_BUFFER_EVENTS];
+} trace_buffer_t;
+
+int trace_enabled = 0;
+
+static char k_path[PATH_MAX];
+static char k_process_name[TRACE_THREAD_NAME_MAX];
+static trace_buffer_t* k_buffers = NULL;
+static pthread_mutex_t k_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local trace_buffer_t* k_buffer = NULL;
+
+uint64_t trace_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Buffer of the calling thread, allocated on its first event.
+ */
+static trace_buffer_t* thread_buffer(void) {
+  if (k_buffer) {
+    return k_buffer;
+  }
+
+  trace_buffer_t* buffer = calloc(1, sizeof(trace_buffer_t));
+  if (!buffer) {
+    return NULL;
+  }
+  buffer->tid = (pid_t)syscall(SYS_gettid);
+  pthread_getname_np(pthread_self(), buffer->thread_name,
+                     sizeof(buffer->thread_name));
+
+  pthread_mutex_lock(&k_buffers_lock);
+  buffer->next = k_buffers;
+  k_buffers = buffer;
+  pthread_mutex_unlock(&k_buffers_lock);
+
+  k_buffer = buffer;
+  return buffer;
+}
+
+void trace_record(char phase, const char* name, uint64_t id, uint64_t bytes,
+                  uint64_t started) {
+  trace_buffer_t* buffer = thread_buffer();
+  if (!buffer) {
+    return;
+  }
+
+  size_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  if (count == TRACE_BUFFER_EVENTS) {
+    buffer->dropped++;
+    return;
+  }
+
+  trace_event_t* event = &buffer->events[count];
+  uint64_t now = trace_now_ns();
+  event->phase = phase;
+  event->name = name;
+  event->id = id;
+  event->bytes = bytes;
+  if (phase == 'X') {
+    event->time_ns = started;
+    event->duration_ns = now > started ? now - started : 0;
+  } else {
+    event->time_ns = now;
+    event->duration_ns = 0;
+  }
+  atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+int trace_init(const char* path, const char* process_name) {
+  if (!path || !*path) {
+    return -1;
+  }
+  snprintf(k_path, sizeof(k_path), "%s", path);
+  snprintf(k_process_name, sizeof(k_process_name), "%s", process_name);
+
+  // The buffer of the event loop thread is set up before the first event
+  trace_enabled = 1;
+  if (!thread_buffer()) {
+    trace_enabled = 0;
+    LOG_ERROR("Failed to allocate the trace buffer");
+    return -1;
+  }
+  return 0;
+}
+
+static void write_event(FILE* out, const trace_buffer_t* buffer,
+                        const trace_event_t* event, pid_t pid) {
+  fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"piece\",\"ph\":\"%c\","
+          "\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+          event->name, event->phase, (double)event->time_ns / 1000.0, pid,
+          buffer->tid);
+
+  switch (event->phase) {
+    case 'X':
+      fprintf(out, ",\"dur\":%.3f", (double)event->duration_ns / 1000.0);
+      break;
+    case 'b':
+    case 'e':
+      fprintf(out, ",\"id\":\"0x%llx\"", (unsigned long long)event->id);
+      break;
+    case 'i':
+      fputs(",\"s\":\"t\"", out);
+      break;
+  }
+  fprintf(out, ",\"args\":{\"id\":%llu,\"bytes\":%llu}}",
+          (unsigned long long)event->id, (unsigned long long)event->bytes);
+}
+
+static int write_trace(const char* path) {
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    LOG_ERROR("Failed to open trace file %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  pid_t pid = getpid();
+  uint64_t events = 0, dropped = 0;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"%s\"}}",
+          pid, k_process_name);
+
+  for (const trace_buffer_t* buffer = k_buffers; buffer;
+       buffer = buffer->next) {
+    size_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, buffer->tid, buffer->thread_name);
+    for (size_t i = 0; i < count; i++) {
+      write_event(out, buffer, &buffer->events[i], pid);
+    }
+    events += count;
+    dropped += buffer->dropped;
+  }
+  fputs("\n]}\n", out);
+
+  if (fclose(out) != 0) {
+    LOG_ERROR("Failed to write trace file %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  LOG_INFO("Trace with %llu events written to %s",
+           (unsigned long long)events, path);
+  if (dropped > 0) {
+    LOG_WARN("Trace buffers full, dropped %llu events",
+             (unsigned long long)dropped);
+  }
+  return 0;
+}
+
+int trace_shutdown(void) {
+  if (!trace_enabled) {
+    return 0;
+  }
+  trace_enabled = 0;
+
+  pthread_mutex_lock(&k_buffers_lock);
+  int result = write_trace(k_path);
+  while (k_buffers) {
+    trace_buffer_t* next = k_buffers->next;
+    free(k_buffers);
+    k_buffers = next;
+  }
+  pthread_mutex_unlock(&k_buffers_lock);
+
+  k_buffer = NULL;
+  return result;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file trace.h
+ * @brief Optional per-piece tracing in the Chrome trace event format.
+ *
+ * Every stage a piece goes through (request, transfer, hashing, queueing,
+ * the seeder's sendfile(), the pwritev() of the writer thread) is recorded
+ * with the monotonic clock into a buffer owned by the calling thread. The
+ * buffers have a fixed size and are only read when trace_shutdown() writes
+ * the JSON file, which opens in Perfetto or chrome://tracing. Seeder and
+ * leecher on one host share the clock, so their files line up.
+ *
+ * Tracing is off unless trace_init() was called. The TRACE_* macros then
+ * cost a single well-predicted branch on trace_enabled.
+ */
+
+#ifndef COMMON_TRACE_H_
+#define COMMON_TRACE_H_
+
+#include <stdint.h>
+
+/* Events per thread buffer, later events are dropped and counted */
+#define TRACE_BUFFER_EVENTS (1 << 18)
+
+/* Set by trace_init(), checked by the TRACE_* macros */
+extern int trace_enabled;
+
+#define TRACE_ON() __builtin_expect(trace_enabled, 0)
+
+/* Start of a span, 0 when tracing is off */
+#define TRACE_NOW() (TRACE_ON() ? trace_now_ns() : 0)
+
+/* Span from started until now */
+#define TRACE_SPAN(name, id, bytes, started)       \
+  do {                                             \
+    if (TRACE_ON()) {                              \
+      trace_record('X', name, id, bytes, started); \
+    }                                              \
+  } while (0)
+
+/* Stage that starts and ends in different calls, matched by name and id */
+#define TRACE_BEGIN(name, id)            \
+  do {                                   \
+    if (TRACE_ON()) {                    \
+      trace_record('b', name, id, 0, 0); \
+    }                                    \
+  } while (0)
+
+#define TRACE_END(name, id)              \
+  do {                                   \
+    if (TRACE_ON()) {                    \
+      trace_record('e', name, id, 0, 0); \
+    }                                    \
+  } while (0)
+
+#define TRACE_INSTANT(name, id, bytes)       \
+  do {                                       \
+    if (TRACE_ON()) {                        \
+      trace_record('i', name, id, bytes, 0); \
+    }                                        \
+  } while (0)
+
+/**
+ * @brief Enable tracing
+ * @param path File the trace is written to by trace_shutdown()
+ * @param process_name Name shown for the process in the trace viewer
+ * @return `0` on success or `-1` on error
+ */
+int trace_init(const char* path, const char* process_name);
+
+/**
+ * @brief Write the trace file, free the buffers and disable tracing
+ *
+ * Does nothing if tracing is off. Other threads must have stopped tracing.
+ *
+ * @return `0` on success or `-1` if the file could not be written
+ */
+int trace_shutdown(void);
+
+/**
+ * @brief Record an event in the buffer of the calling thread
+ * @param phase `X` (span), `b`/`e` (async begin/end) or `i` (instant)
+ * @param name Static string naming the stage
+ * @param id Piece or block index, or a file offset
+ * @param bytes Bytes the stage handled, `0` if not applicable
+ * @param started Start of a span in trace_now_ns() time, unused otherwise
+ */
+void trace_record(char phase, const char* name, uint64_t id, uint64_t bytes,
+                  uint64_t started);
+
+/**
+ * @brief Monotonic time in nanoseconds
+ * @return Current time
+ */
+uint64_t trace_now_ns(void);
+
+#endif  // COMMON_TRACE_H_
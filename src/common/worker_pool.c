@@ -0,0 +1,45 @@
+#include "worker_pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+unsigned worker_pool_cpus(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (unsigned)cpus : 1;
+}
+
+unsigned worker_pool_start(worker_pool_t* pool, unsigned threads,
+                           worker_pool_fn worker, void* job) {
+  if (threads == 0) {
+    threads = worker_pool_cpus();
+  }
+  pool->count = 0;
+  pool->threads = calloc(threads, sizeof(pthread_t));
+  if (!pool->threads) {
+    return 0;
+  }
+
+  while (pool->count < threads &&
+         pthread_create(&pool->threads[pool->count], NULL, worker, job) ==
+             0) {
+    pool->count++;
+  }
+  return pool->count;
+}
+
+void worker_pool_join(worker_pool_t* pool) {
+  for (unsigned i = 0; i < pool->count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->count = 0;
+}
+
+void worker_pool_run(worker_pool_fn worker, void* job) {
+  worker_pool_t pool;
+  if (worker_pool_start(&pool, 0, worker, job) == 0) {
+    worker(job);
+  }
+  worker_pool_join(&pool);
+}
@@ -0,0 +1,56 @@
+/**
+ * @file worker_pool.h
+ * @brief Threads that run one job function side by side.
+ *
+ * Jobs hand out their work themselves, usually through an atomic index, so
+ * the pool only starts the threads and joins them. Every worker already
+ * keeps a core busy, so workers that hash pass `1` as the digest thread
+ * count instead of splitting each buffer again.
+ */
+
+#ifndef COMMON_WORKER_POOL_H_
+#define COMMON_WORKER_POOL_H_
+
+#include <pthread.h>
+
+typedef void* (*worker_pool_fn)(void* job);
+
+typedef struct {
+  pthread_t* threads;
+  unsigned count; /* Threads actually started */
+} worker_pool_t;
+
+/**
+ * @brief Get the number of online CPUs
+ * @return Online CPUs, at least `1`
+ */
+unsigned worker_pool_cpus(void);
+
+/**
+ * @brief Start threads that run worker(job)
+ * @param pool Pool to fill in, joined with worker_pool_join()
+ * @param threads Number of threads, `0` for every online CPU
+ * @param worker Function every thread runs
+ * @param job Argument shared by all threads
+ * @return Number of started threads, `0` if none could be started
+ */
+unsigned worker_pool_start(worker_pool_t* pool, unsigned threads,
+                           worker_pool_fn worker, void* job);
+
+/**
+ * @brief Wait for every started thread and free the pool
+ * @param pool Pool from worker_pool_start()
+ */
+void worker_pool_join(worker_pool_t* pool);
+
+/**
+ * @brief Run worker(job) on every online CPU and wait for all of them
+ *
+ * When no thread can be started, the worker runs on the calling thread.
+ *
+ * @param worker Function every thread runs
+ * @param job Argument shared by all threads
+ */
+void worker_pool_run(worker_pool_fn worker, void* job);
+
+#endif  // COMMON_WORKER_POOL_H_
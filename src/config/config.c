@@ -1,16 +1,48 @@
 #include "config.h"
 
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "../bit_torrent.h"
+#include "../common/log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
 #define HELP_MSG "Try '%s --help' for more information.\n"
 #define INVALID_MODE_MSG "Error: Invalid mode '%s'. Use 'seed' or 'leech'\n"
 #define INVALID_ARGS_MSG "Error: Invalid arguments\n"
 #define TORRENT_REQUIRED_MSG "Error: Torrent file is required (-t/--torrent)\n"
 #define DATA_REQUIRED_MSG "Error: Data path is required (-d/--data)\n"
+#define COMPRESS_MSG \
+  "Error: Invalid compression '%s'. Use 'off', 'auto' or 'always'\n"
+#define TRANSPORT_MSG "Error: Invalid transport '%s'. Use 'tcp' or 'udp'\n"
+#define UDP_TLS_MSG "Error: TLS needs the TCP transport (-u/--transport)\n"
+#define DURABILITY_MSG \
+  "Error: Invalid durability '%s'. Use 'none', 'periodic' or 'complete'\n"
+#define LOCAL_DIRS_MSG "Error: At most %d local directories (-l/--local)\n"
+#define BASE_REQUIRED_MSG \
+  "Error: Base torrent needs the base file (-b/--base)\n"
+#define TLS_CERT_REQUIRED_MSG \
+  "Error: TLS key needs the certificate (-E/--tls-cert)\n"
+#define INVALID_PORT_MSG "Error: Invalid port '%s'\n"
+#define INVALID_ANNOUNCE_MSG "Error: Invalid address '%s', use IP[:PORT]\n"
+#define INVALID_MULTICAST_MSG \
+  "Error: Invalid group '%s', use a multicast IP[:PORT]\n"
+#define INVALID_LOCAL_SOCKET_MSG \
+  "Error: Invalid local socket '%s', use a path or @name of at most %zu " \
+  "characters\n"
+#define INVALID_SIZE_MSG \
+  "Error: Invalid size '%s'. Use a number with an optional K, M or G\n"
+#define INVALID_TIMEOUT_MSG "Error: Invalid timeout '%s', use milliseconds\n"
+#define CONFIG_LINE_MSG "Error: %s:%d: expected '<option> = <value>'\n"
 
 static void print_help(const char* program_name) {
   printf(
@@ -29,57 +61,545 @@ static void print_help(const char* program_name) {
       "to share\n"
       "                           For leech mode: directory to save "
       "downloaded files\n\n"
-      "  -h, --help               Show this help message and exit\n\n",
+      "  -b, --base <FILE>        Previous version of the file (leech mode)\n"
+      "                           Unchanged pieces are copied from it "
+      "instead\n"
+      "                           of downloaded. May be the output file "
+      "itself\n\n"
+      "  -B, --base-torrent <FILE> Torrent of the previous version\n"
+      "                           Only pieces with unchanged hashes are "
+      "read\n\n"
+      "  -l, --local <DIR>        Directory with data to reuse (leech mode)\n"
+      "                           Pieces found in its files are copied or\n"
+      "                           reflinked instead of downloaded. Can be "
+      "repeated\n\n"
+      "  -i, --index <FILE>       Cache of the local directories index\n"
+      "                           Unchanged files are not hashed again\n\n"
+      "  -D, --durability <MODE>  When downloaded data is forced to disk\n"
+      "                           MODE can be:\n"
+      "                             none     - Left to the kernel (default)\n"
+      "                             periodic - Written back every 32 MiB\n"
+      "                             complete - fdatasync() once complete\n\n"
+      "  -M, --metrics <ADDR>     Serve Prometheus metrics over HTTP\n"
+      "                           ADDR is unix:<PATH>, <HOST>:<PORT> or "
+      "<PORT>\n\n"
+      "  -L, --log-file <FILE>    Append log messages to FILE instead of "
+      "stderr\n\n"
+      "  -v, --log-level <SPEC>   Log level, globally and per module\n"
+      "                           LEVEL is error, warn, info (default) or "
+      "debug,\n"
+      "                           e.g. info,network=debug. Modules: main,\n"
+      "                           seeder, leecher, network, file, hash\n\n"
+      "  -P, --port <PORT>        TCP port of the seeder (default 6000)\n\n"
+      "  -U, --discovery-port <PORT> UDP port seeders listen on for "
+      "discovery,\n"
+      "                           answers go to PORT + 1 (default 5000)\n\n"
+      "  -A, --announce <IP[:PORT]> Address the seeder tells leechers to "
+      "connect\n"
+      "                           to (default: first LAN IPv4 address and "
+      "--port),\n"
+      "                           e.g. the one of a netem proxy in front of "
+      "it\n\n"
+      "  -T, --trace <FILE>       Trace every piece and write a Chrome/"
+      "Perfetto\n"
+      "                           JSON trace to FILE on exit\n\n"
+      "  -S, --scenario <FILE>    Inject the disk latency of the read and "
+      "write\n"
+      "                           rules of a netem scenario file\n\n"
+      "  -W, --connect-timeout <MS> Give up on a seeder that does not accept "
+      "the\n"
+      "                           connection in time (default 3000), it is\n"
+      "                           retried with exponential backoff\n\n"
+      "  -w, --request-timeout <MS> Ask the next seeder for the piece when\n"
+      "                           the one asked does not answer in time\n"
+      "                           (default 5000)\n\n"
+      "  -c, --config <FILE>      Read options from FILE, one '<option> = "
+      "<value>'\n"
+      "                           per line with long option names. The "
+      "command\n"
+      "                           line wins, SIGHUP reloads the file\n\n"
+      "  -C, --control <ADDR>     Serve a control socket for live tuning\n"
+      "                           ADDR is unix:<PATH>, <HOST>:<PORT> or "
+      "<PORT>\n\n",
       program_name);
+  // Split in two, ISO C limits the length of a string literal
+  fputs(
+      "  -E, --tls-cert <FILE>    Serve peers over TLS with this PEM "
+      "certificate\n"
+      "                           chain (seed mode), encrypted by the "
+      "kernel\n"
+      "                           when it supports kTLS\n\n"
+      "  -K, --tls-key <FILE>     PEM private key of the certificate\n"
+      "                           (default: read from --tls-cert)\n\n"
+      "  -a, --tls-ca <FILE>      Connect to seeders over TLS (leech mode)\n"
+      "                           and trust the CA certificates in FILE, "
+      "a\n"
+      "                           seeder certificate must name the IP it is\n"
+      "                           reached at\n\n"
+      "  -z, --compress <MODE>    Send pieces compressed to leechers that\n"
+      "                           accept it (seed mode). MODE can be:\n"
+      "                             off    - Never (default)\n"
+      "                             auto   - When it saves more link time\n"
+      "                                      than it costs CPU time\n"
+      "                             always - Whenever the piece shrinks\n\n"
+      "  -Z, --compress-cache <SIZE> Compressed pieces kept for other\n"
+      "                           leechers (default 64M)\n\n"
+      "  -u, --transport <PROTO>  What peer connections run over, the "
+      "same\n"
+      "                           on seeders and leechers. PROTO can be:\n"
+      "                             tcp - TCP (default)\n"
+      "                             udp - UDP with selective ACKs and "
+      "LEDBAT,\n"
+      "                                   yields to other traffic on the "
+      "link\n\n"
+      "  -g, --multicast <GROUP[:PORT]> Send each piece once to a LAN\n"
+      "                           multicast group (seed mode, at the "
+      "upload\n"
+      "                           rate or 64M/s) or receive it from there\n"
+      "                           (leech mode), missed fragments are asked\n"
+      "                           for again. The port defaults to 5002\n\n"
+      "  -s, --local-socket <NAME> Unix socket peers on the same host use\n"
+      "                           instead of TCP, a path or an abstract\n"
+      "                           @name (seed mode, default\n"
+      "                           @eltextorrent-PORT). 'off' keeps every\n"
+      "                           connection on TCP\n\n"
+      "  -R, --upload-rate <RATE> Upload limit per leecher in bytes/s with\n"
+      "                           K, M or G suffix (default: unlimited)\n\n"
+      "  -Q, --write-queue <SIZE> Downloaded data waiting to be written\n"
+      "                           (default 64M)\n\n"
+      "  -h, --help               Show this help message and exit\n\n",
+      stdout);
 }
 
 void print_client_config(const Config* cfg) {
-  printf(
-      "-- BitTorrent Client Configuration --\n"
-      "  Mode:            %s\n"
-      "  Torrent file:    %s\n"
-      "  Data path:       %s\n"
-      "----------------------------------\n",
-      cfg->mode == SEED ? "seed" : "leech", cfg->torrent_path, cfg->data_path);
+  LOG_INFO("Mode:            %s", cfg->mode == SEED ? "seed" : "leech");
+  LOG_INFO("Torrent file:    %s", cfg->torrent_path);
+  LOG_INFO("Data path:       %s", cfg->data_path);
+  if (strlen(cfg->base_path) > 0) {
+    LOG_INFO("Base file:       %s", cfg->base_path);
+  }
+  if (strlen(cfg->base_torrent_path) > 0) {
+    LOG_INFO("Base torrent:    %s", cfg->base_torrent_path);
+  }
+  for (int i = 0; i < cfg->local_dirs_count; i++) {
+    LOG_INFO("Local data:      %s", cfg->local_dirs[i]);
+  }
+  if (strlen(cfg->index_path) > 0) {
+    LOG_INFO("Local index:     %s", cfg->index_path);
+  }
+  if (cfg->mode == LEECH) {
+    LOG_INFO("Durability:      %s", durability_name(cfg->durability));
+  }
+  if (strlen(cfg->metrics_addr) > 0) {
+    LOG_INFO("Metrics:         %s", cfg->metrics_addr);
+  }
+  if (strlen(cfg->trace_path) > 0) {
+    LOG_INFO("Trace:           %s", cfg->trace_path);
+  }
+  if (strlen(cfg->scenario_path) > 0) {
+    LOG_INFO("Scenario:        %s", cfg->scenario_path);
+  }
+  if (strlen(cfg->config_path) > 0) {
+    LOG_INFO("Config file:     %s", cfg->config_path);
+  }
+  if (strlen(cfg->control_addr) > 0) {
+    LOG_INFO("Control:         %s", cfg->control_addr);
+  }
+  if (cfg->mode == SEED && strlen(cfg->tls_cert_path) > 0) {
+    LOG_INFO("TLS certificate: %s", cfg->tls_cert_path);
+  }
+  if (cfg->mode == LEECH && strlen(cfg->tls_ca_path) > 0) {
+    LOG_INFO("TLS CA:          %s", cfg->tls_ca_path);
+  }
+  if (cfg->mode == SEED && cfg->compress != COMPRESS_OFF) {
+    LOG_INFO("Compression:     %s, %" PRIu64 " B cache",
+             compress_mode_name(cfg->compress), cfg->compress_cache);
+  }
+  if (cfg->transport == TRANSPORT_UDP) {
+    LOG_INFO("Transport:       udp");
+  }
+  if (strlen(cfg->multicast_group) > 0) {
+    LOG_INFO("Multicast group: %s:%d", cfg->multicast_group,
+             cfg->multicast_port);
+  }
+  if (strlen(cfg->local_socket) > 0) {
+    LOG_INFO("Local socket:    %s", cfg->local_socket);
+  }
+  if (cfg->mode == SEED && cfg->upload_rate > 0) {
+    LOG_INFO("Upload rate:     %" PRIu64 " B/s", cfg->upload_rate);
+  }
+  if (cfg->mode == SEED) {
+    LOG_INFO("Port:            %d", cfg->port);
+  }
+  LOG_INFO("Discovery port:  %d", cfg->discovery_port);
 }
 
-int init_config(Config* cfg, int argc, char** argv) {
-  if (!cfg) {
+/**
+ * @brief Parses a port number, leaving room for the discovery answer port.
+ */
+static int parse_port(const char* text, in_port_t* port) {
+  char* end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || value == 0 || value >= 65535) {
+    return -1;
+  }
+  *port = (in_port_t)value;
+  return 0;
+}
+
+/**
+ * @brief Parses `IP[:PORT]`, the port is left alone when not given.
+ */
+static int parse_address(const char* text, char* ip, in_port_t* port) {
+  char address[INET_ADDRSTRLEN] = {0};
+  const char* colon = strchr(text, ':');
+  size_t ip_length = colon ? (size_t)(colon - text) : strlen(text);
+  if (ip_length >= sizeof(address)) {
+    return -1;
+  }
+  memcpy(address, text, ip_length);
+
+  struct in_addr addr;
+  if (inet_pton(AF_INET, address, &addr) != 1 ||
+      (colon && parse_port(colon + 1, port) != 0)) {
+    return -1;
+  }
+  memcpy(ip, address, sizeof(address));
+  return 0;
+}
+
+static struct option k_long_options[] = {
+    {"mode", required_argument, 0, 'm'},
+    {"torrent", required_argument, 0, 't'},
+    {"data", required_argument, 0, 'd'},
+    {"base", required_argument, 0, 'b'},
+    {"base-torrent", required_argument, 0, 'B'},
+    {"local", required_argument, 0, 'l'},
+    {"index", required_argument, 0, 'i'},
+    {"durability", required_argument, 0, 'D'},
+    {"metrics", required_argument, 0, 'M'},
+    {"log-file", required_argument, 0, 'L'},
+    {"log-level", required_argument, 0, 'v'},
+    {"trace", required_argument, 0, 'T'},
+    {"port", required_argument, 0, 'P'},
+    {"discovery-port", required_argument, 0, 'U'},
+    {"announce", required_argument, 0, 'A'},
+    {"scenario", required_argument, 0, 'S'},
+    {"config", required_argument, 0, 'c'},
+    {"control", required_argument, 0, 'C'},
+    {"upload-rate", required_argument, 0, 'R'},
+    {"write-queue", required_argument, 0, 'Q'},
+    {"connect-timeout", required_argument, 0, 'W'},
+    {"request-timeout", required_argument, 0, 'w'},
+    {"tls-cert", required_argument, 0, 'E'},
+    {"tls-key", required_argument, 0, 'K'},
+    {"tls-ca", required_argument, 0, 'a'},
+    {"compress", required_argument, 0, 'z'},
+    {"compress-cache", required_argument, 0, 'Z'},
+    {"transport", required_argument, 0, 'u'},
+    {"multicast", required_argument, 0, 'g'},
+    {"local-socket", required_argument, 0, 's'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}};
+
+int config_parse_size(const char* text, uint64_t* size) {
+  char* end;
+  errno = 0;
+  double number = strtod(text, &end);
+  if (end == text || errno != 0 || number < 0) {
     return -1;
   }
 
-  static struct option long_options[] = {{"mode", required_argument, 0, 'm'},
-                                         {"torrent", required_argument, 0, 't'},
-                                         {"data", required_argument, 0, 'd'},
-                                         {"help", no_argument, 0, 'h'},
-                                         {0, 0, 0, 0}};
+  const char* suffixes = "KMG";
+  const char* suffix = *end ? strchr(suffixes, *end) : NULL;
+  if (*end != '\0' && (!suffix || end[1] != '\0')) {
+    return -1;
+  }
+  double scale = 1;
+  for (const char* s = suffixes; suffix && s <= suffix; s++) {
+    scale *= 1024;
+  }
 
+  *size = (uint64_t)(number * scale);
+  return 0;
+}
+
+static void set_defaults(Config* cfg) {
+  memset(cfg, 0, sizeof(Config));
+  cfg->port = SEEDER_TCP_PORT;
+  cfg->discovery_port = UDP_RECEIVE_PORT;
+  cfg->write_queue = WRITEBACK_QUEUE_BYTES;
+  cfg->compress_cache = COMPRESS_CACHE_BYTES;
+  cfg->connect_timeout_ms = CONNECT_TIMEOUT_MS;
+  cfg->request_timeout_ms = REQUEST_TIMEOUT_MS;
+}
+
+/**
+ * @brief Applies one option, given on the command line or in the config file.
+ * @return 0 on success, -1 on error, 1 if help shown
+ */
+static int apply_option(Config* cfg, int opt, const char* arg,
+                        const char* program_name) {
+  switch (opt) {
+    case 'm':
+      if (strcmp(arg, "seed") == 0) {
+        cfg->mode = SEED;
+      } else if (strcmp(arg, "leech") == 0) {
+        cfg->mode = LEECH;
+      } else {
+        fprintf(stderr, INVALID_MODE_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 't':
+      strncpy(cfg->torrent_path, arg, PATH_MAX - 1);
+      break;
+    case 'd':
+      strncpy(cfg->data_path, arg, PATH_MAX - 1);
+      break;
+    case 'b':
+      strncpy(cfg->base_path, arg, PATH_MAX - 1);
+      break;
+    case 'B':
+      strncpy(cfg->base_torrent_path, arg, PATH_MAX - 1);
+      break;
+    case 'l':
+      if (cfg->local_dirs_count == LOCAL_DIRS_MAX) {
+        fprintf(stderr, LOCAL_DIRS_MSG HELP_MSG, LOCAL_DIRS_MAX, program_name);
+        return -1;
+      }
+      strncpy(cfg->local_dirs[cfg->local_dirs_count++], arg, PATH_MAX - 1);
+      break;
+    case 'i':
+      strncpy(cfg->index_path, arg, PATH_MAX - 1);
+      break;
+    case 'D':
+      if (durability_parse(arg, &cfg->durability) != 0) {
+        fprintf(stderr, DURABILITY_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'M':
+      strncpy(cfg->metrics_addr, arg, PATH_MAX - 1);
+      break;
+    case 'L':
+      strncpy(cfg->log_path, arg, PATH_MAX - 1);
+      break;
+    case 'v':
+      strncpy(cfg->log_levels, arg, sizeof(cfg->log_levels) - 1);
+      break;
+    case 'T':
+      strncpy(cfg->trace_path, arg, PATH_MAX - 1);
+      break;
+    case 'P':
+    case 'U':
+      if (parse_port(arg, opt == 'P' ? &cfg->port : &cfg->discovery_port) !=
+          0) {
+        fprintf(stderr, INVALID_PORT_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'A':
+      if (parse_address(arg, cfg->announce_ip, &cfg->announce_port) != 0) {
+        fprintf(stderr, INVALID_ANNOUNCE_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'S':
+      strncpy(cfg->scenario_path, arg, PATH_MAX - 1);
+      break;
+    case 'c':
+      strncpy(cfg->config_path, arg, PATH_MAX - 1);
+      break;
+    case 'C':
+      strncpy(cfg->control_addr, arg, PATH_MAX - 1);
+      break;
+    case 'E':
+      strncpy(cfg->tls_cert_path, arg, PATH_MAX - 1);
+      break;
+    case 'K':
+      strncpy(cfg->tls_key_path, arg, PATH_MAX - 1);
+      break;
+    case 'a':
+      strncpy(cfg->tls_ca_path, arg, PATH_MAX - 1);
+      break;
+    case 'z':
+      if (compress_mode_parse(arg, &cfg->compress) != 0) {
+        fprintf(stderr, COMPRESS_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'Z':
+      if (config_parse_size(arg, &cfg->compress_cache) != 0) {
+        fprintf(stderr, INVALID_SIZE_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'u':
+      if (strcmp(arg, "tcp") == 0) {
+        cfg->transport = TRANSPORT_TCP;
+      } else if (strcmp(arg, "udp") == 0) {
+        cfg->transport = TRANSPORT_UDP;
+      } else {
+        fprintf(stderr, TRANSPORT_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'g': {
+      cfg->multicast_port = MULTICAST_PORT;
+      struct in_addr group;
+      if (parse_address(arg, cfg->multicast_group, &cfg->multicast_port) !=
+              0 ||
+          inet_pton(AF_INET, cfg->multicast_group, &group) != 1 ||
+          !IN_MULTICAST(ntohl(group.s_addr))) {
+        fprintf(stderr, INVALID_MULTICAST_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    }
+    case 's': {
+      struct sockaddr_un addr;
+      if (*arg == '\0' || strlen(arg) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, INVALID_LOCAL_SOCKET_MSG HELP_MSG, arg,
+                sizeof(addr.sun_path) - 1, program_name);
+        return -1;
+      }
+      strcpy(cfg->local_socket, arg);
+      break;
+    }
+    case 'R':
+    case 'Q':
+      if (config_parse_size(arg, opt == 'R' ? &cfg->upload_rate
+                                            : &cfg->write_queue) != 0 ||
+          (opt == 'Q' && cfg->write_queue == 0)) {
+        fprintf(stderr, INVALID_SIZE_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      break;
+    case 'W':
+    case 'w': {
+      char* end;
+      unsigned long timeout = strtoul(arg, &end, 10);
+      if (*arg == '\0' || *end != '\0' || timeout == 0 ||
+          timeout > UINT32_MAX) {
+        fprintf(stderr, INVALID_TIMEOUT_MSG HELP_MSG, arg, program_name);
+        return -1;
+      }
+      *(opt == 'W' ? &cfg->connect_timeout_ms : &cfg->request_timeout_ms) =
+          (uint32_t)timeout;
+      break;
+    }
+    case 'h':
+      print_help(program_name);
+      return 1;
+    default:
+      fprintf(stderr, INVALID_ARGS_MSG HELP_MSG, program_name);
+      return -1;
+  }
+  return 0;
+}
+
+static int parse_arguments(Config* cfg, int argc, char** argv) {
   int opt;
+  // Start over, the arguments are parsed again after the config file
+  optind = 0;
+  while ((opt = getopt_long(argc, argv,
+                            "m:t:d:b:B:l:i:D:M:L:v:T:P:U:A:S:c:C:E:K:a:"
+                            "z:Z:u:g:s:R:Q:W:w:h",
+                            k_long_options, NULL)) != -1) {
+    int result = apply_option(cfg, opt, optarg, argv[0]);
+    if (result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+static char* trim(char* text) {
+  while (isspace((unsigned char)*text)) {
+    text++;
+  }
+  char* end = text + strlen(text);
+  while (end > text && isspace((unsigned char)end[-1])) {
+    *--end = '\0';
+  }
+  return text;
+}
+
+/**
+ * @brief Applies the `key = value` lines of a config file, keys are the long
+ * option names.
+ */
+static int load_config_file(Config* cfg, const char* path,
+                            const char* program_name) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Error: Cannot open config '%s': %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  char line[PATH_MAX + 64];
+  int line_number = 0;
+  int result = 0;
+  while (result == 0 && fgets(line, sizeof(line), file)) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    char* key = trim(line);
+    if (*key == '\0') {
+      continue;
+    }
 
-  while ((opt = getopt_long(argc, argv, "m:t:d:h", long_options, NULL)) != -1) {
-    switch (opt) {
-      case 'm':
-        if (strcmp(optarg, "seed") == 0) {
-          cfg->mode = SEED;
-        } else if (strcmp(optarg, "leech") == 0) {
-          cfg->mode = LEECH;
-        } else {
-          fprintf(stderr, INVALID_MODE_MSG HELP_MSG, optarg, argv[0]);
-          return -1;
+    char* value = strchr(key, '=');
+    const struct option* option = NULL;
+    if (value) {
+      *value = '\0';
+      value = trim(value + 1);
+      key = trim(key);
+      for (option = k_long_options; option->name; option++) {
+        if (strcmp(option->name, key) == 0) {
+          break;
         }
-        break;
-      case 't':
-        strncpy(cfg->torrent_path, optarg, PATH_MAX - 1);
-        break;
-      case 'd':
-        strncpy(cfg->data_path, optarg, PATH_MAX - 1);
-        break;
-      case 'h':
-        print_help(argv[0]);
-        return 1;
-      default:
-        fprintf(stderr, INVALID_ARGS_MSG HELP_MSG, argv[0]);
-        return -1;
+      }
+    }
+    if (!value || !option->name || option->has_arg != required_argument ||
+        option->val == 'c') {
+      fprintf(stderr, CONFIG_LINE_MSG, path, line_number);
+      result = -1;
+      break;
+    }
+    result = apply_option(cfg, option->val, value, program_name);
+  }
+
+  fclose(file);
+  return result;
+}
+
+int init_config(Config* cfg, int argc, char** argv) {
+  if (!cfg) {
+    return -1;
+  }
+
+  set_defaults(cfg);
+  int result = parse_arguments(cfg, argc, argv);
+  if (result != 0) {
+    return result;
+  }
+
+  // The command line overrides the file, so it is applied once more on top
+  if (strlen(cfg->config_path) > 0) {
+    char config_path[PATH_MAX];
+    memcpy(config_path, cfg->config_path, sizeof(config_path));
+    set_defaults(cfg);
+    if (load_config_file(cfg, config_path, argv[0]) != 0) {
+      return -1;
+    }
+    result = parse_arguments(cfg, argc, argv);
+    if (result != 0) {
+      return result;
     }
   }
 
@@ -93,5 +613,21 @@ int init_config(Config* cfg, int argc, char** argv) {
     return -1;
   }
 
+  if (strlen(cfg->base_torrent_path) > 0 && strlen(cfg->base_path) == 0) {
+    fprintf(stderr, BASE_REQUIRED_MSG HELP_MSG, argv[0]);
+    return -1;
+  }
+
+  if (strlen(cfg->tls_key_path) > 0 && strlen(cfg->tls_cert_path) == 0) {
+    fprintf(stderr, TLS_CERT_REQUIRED_MSG HELP_MSG, argv[0]);
+    return -1;
+  }
+
+  if (cfg->transport == TRANSPORT_UDP &&
+      (strlen(cfg->tls_cert_path) > 0 || strlen(cfg->tls_ca_path) > 0)) {
+    fprintf(stderr, UDP_TLS_MSG HELP_MSG, argv[0]);
+    return -1;
+  }
+
   return 0;
 }
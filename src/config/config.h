@@ -2,12 +2,51 @@
 #define CONFIG_CONFIG_H_
 
 #include <linux/limits.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "../file/compress.h"
+#include "../file/file_writer.h"
+
+#define LOCAL_DIRS_MAX 8
 
 typedef enum Mode { SEED = 0, LEECH = 1 } Mode;
 
+typedef enum Transport { TRANSPORT_TCP = 0, TRANSPORT_UDP = 1 } Transport;
+
 typedef struct Config {
   char data_path[PATH_MAX];
   char torrent_path[PATH_MAX];
+  char base_path[PATH_MAX];         /* Previous version of the file to reuse */
+  char base_torrent_path[PATH_MAX]; /* Torrent of the previous version */
+  char local_dirs[LOCAL_DIRS_MAX][PATH_MAX]; /* Scanned for known pieces */
+  int local_dirs_count;
+  char index_path[PATH_MAX];   /* Cache of the local_dirs piece hashes */
+  durability_t durability;     /* When downloaded data is forced to disk */
+  char metrics_addr[PATH_MAX]; /* Where metrics are served, empty if off */
+  char log_path[PATH_MAX];     /* Log file, empty for stderr */
+  char log_levels[256];        /* Level spec, see log_init() */
+  char trace_path[PATH_MAX];   /* Piece trace written on exit, empty if off */
+  in_port_t port;              /* TCP port the seeder listens on */
+  in_port_t discovery_port;    /* Seeders listen here, leechers one above */
+  char announce_ip[INET_ADDRSTRLEN]; /* Seeder address sent to leechers */
+  in_port_t announce_port;     /* Port sent to leechers, 0 to send port */
+  char scenario_path[PATH_MAX]; /* Disk latency rules, empty if off */
+  char config_path[PATH_MAX];   /* Options file, empty if none */
+  char control_addr[PATH_MAX];  /* Where the control socket is, empty if off */
+  char tls_cert_path[PATH_MAX]; /* Seeder certificate, empty for plaintext */
+  char tls_key_path[PATH_MAX];  /* Seeder key, empty if in the certificate */
+  char tls_ca_path[PATH_MAX];   /* CAs leechers trust, empty for plaintext */
+  uint64_t upload_rate;         /* Bytes/s per leecher, 0 for unlimited */
+  uint64_t write_queue;         /* Bytes waiting for the writer thread */
+  compress_mode_t compress;     /* When the seeder compresses pieces */
+  uint64_t compress_cache;      /* Bytes of compressed pieces kept */
+  uint32_t connect_timeout_ms;  /* Connect deadline of the leecher */
+  uint32_t request_timeout_ms;  /* Piece request deadline of the leecher */
+  Transport transport;          /* What peer connections run over */
+  char multicast_group[INET_ADDRSTRLEN]; /* Empty if off */
+  in_port_t multicast_port;
+  char local_socket[PATH_MAX]; /* Same-host peers, empty for the default */
   Mode mode;
 } Config;
 
@@ -17,8 +56,20 @@ typedef struct Config {
  */
 void print_client_config(const Config* cfg);
 
+/**
+ * @brief Parse a size with an optional K, M or G suffix (powers of 1024)
+ * @param text Text to parse, e.g. `512K` or `1.5M`
+ * @param size Output parameter for the size in bytes
+ * @return 0 on success, -1 on error
+ */
+int config_parse_size(const char* text, uint64_t* size);
+
 /**
  * @brief Initialize config from command line arguments
+ *
+ * Options of the --config file are applied first, then the command line.
+ * Can be called again with the same arguments to reload the file.
+ *
  * @param cfg Config structure to initialize
  * @param argc Argument count
  * @param argv Argument values
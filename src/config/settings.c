@@ -0,0 +1,201 @@
+#include "settings.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/log.h"
+#include "../file/compress.h"
+#include "../file/file_assembler.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+#define SETTINGS_VALUE_MAX 256
+#define SETTINGS_COMMAND_MAX 1024
+
+typedef struct {
+  const char* name;
+  int (*set)(const char* value);
+  void (*get)(FILE* out);
+} setting_t;
+
+static int k_argc = 0;
+static char** k_argv = NULL;
+static char k_log_levels[SETTINGS_VALUE_MAX] = "";
+static uint64_t k_upload_rate = 0;
+static uint64_t k_write_queue = WRITEBACK_QUEUE_BYTES;
+static uint64_t k_compress_cache = COMPRESS_CACHE_BYTES;
+
+static int set_log_level(const char* value) {
+  if (strlen(value) >= sizeof(k_log_levels) || log_set_levels(value) != 0) {
+    return -1;
+  }
+  strcpy(k_log_levels, value);
+  return 0;
+}
+
+static void get_log_level(FILE* out) {
+  fputs(*k_log_levels ? k_log_levels : "info", out);
+}
+
+static int set_upload_rate(const char* value) {
+  return config_parse_size(value, &k_upload_rate);
+}
+
+static void get_upload_rate(FILE* out) {
+  fprintf(out, "%" PRIu64, k_upload_rate);
+}
+
+static int set_write_queue(const char* value) {
+  uint64_t size;
+  if (config_parse_size(value, &size) != 0 || size == 0 || size > SIZE_MAX) {
+    return -1;
+  }
+  k_write_queue = size;
+  file_assembler_set_queue_limit((size_t)size);
+  return 0;
+}
+
+static void get_write_queue(FILE* out) {
+  fprintf(out, "%" PRIu64, k_write_queue);
+}
+
+static int set_compress_cache(const char* value) {
+  return config_parse_size(value, &k_compress_cache);
+}
+
+static void get_compress_cache(FILE* out) {
+  fprintf(out, "%" PRIu64, k_compress_cache);
+}
+
+/* Named like the command line options that set them */
+static const setting_t k_settings[] = {
+    {"log-level", set_log_level, get_log_level},
+    {"upload-rate", set_upload_rate, get_upload_rate},
+    {"write-queue", set_write_queue, get_write_queue},
+    {"compress-cache", set_compress_cache, get_compress_cache},
+};
+
+#define SETTINGS_COUNT (sizeof(k_settings) / sizeof(k_settings[0]))
+
+static const setting_t* find_setting(const char* name) {
+  for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+    if (strcmp(k_settings[i].name, name) == 0) {
+      return &k_settings[i];
+    }
+  }
+  return NULL;
+}
+
+static void print_setting(const setting_t* setting, FILE* out) {
+  fprintf(out, "%s ", setting->name);
+  setting->get(out);
+  fputc('\n', out);
+}
+
+/**
+ * @brief Applies the runtime settings of a configuration.
+ */
+static int apply_config(const Config* cfg) {
+  char write_queue[32];
+  char upload_rate[32];
+  char compress_cache[32];
+  snprintf(write_queue, sizeof(write_queue), "%" PRIu64, cfg->write_queue);
+  snprintf(upload_rate, sizeof(upload_rate), "%" PRIu64, cfg->upload_rate);
+  snprintf(compress_cache, sizeof(compress_cache), "%" PRIu64,
+           cfg->compress_cache);
+
+  const char* values[SETTINGS_COUNT] = {cfg->log_levels, upload_rate,
+                                        write_queue, compress_cache};
+  int result = 0;
+  for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+    if (k_settings[i].set(values[i]) != 0) {
+      LOG_WARN("Invalid %s: %s", k_settings[i].name, values[i]);
+      result = -1;
+    }
+  }
+  return result;
+}
+
+void settings_init(const Config* cfg, int argc, char** argv) {
+  k_argc = argc;
+  k_argv = argv;
+  apply_config(cfg);
+}
+
+int settings_reload(void) {
+  if (!k_argv) {
+    return -1;
+  }
+
+  Config cfg;
+  if (init_config(&cfg, k_argc, k_argv) != 0) {
+    LOG_WARN("Invalid configuration, settings unchanged");
+    return -1;
+  }
+  if (apply_config(&cfg) != 0) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+    char* value = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&value, &length);
+    if (out) {
+      k_settings[i].get(out);
+      fclose(out);
+      LOG_INFO("%s: %s", k_settings[i].name, value);
+    }
+    free(value);
+  }
+  return 0;
+}
+
+void settings_command(const char* command, FILE* reply) {
+  char line[SETTINGS_COMMAND_MAX];
+  if (strlen(command) >= sizeof(line)) {
+    fputs("error: command too long\n", reply);
+    return;
+  }
+  strcpy(line, command);
+
+  char* saveptr;
+  char* verb = strtok_r(line, " \t", &saveptr);
+  char* key = strtok_r(NULL, " \t", &saveptr);
+  char* value = strtok_r(NULL, "", &saveptr);
+  const setting_t* setting = key ? find_setting(key) : NULL;
+
+  if (verb && strcmp(verb, "get") == 0 && !key) {
+    for (size_t i = 0; i < SETTINGS_COUNT; i++) {
+      print_setting(&k_settings[i], reply);
+    }
+  } else if (verb && strcmp(verb, "get") == 0 && setting && !value) {
+    print_setting(setting, reply);
+  } else if (verb && strcmp(verb, "set") == 0 && setting && value) {
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+    if (setting->set(value) != 0) {
+      fprintf(reply, "error: invalid %s '%s'\n", key, value);
+      return;
+    }
+    LOG_INFO("%s set to %s", key, value);
+  } else if (verb && strcmp(verb, "reload") == 0 && !key) {
+    if (settings_reload() != 0) {
+      fputs("error: invalid configuration\n", reply);
+      return;
+    }
+  } else if (key && !setting && verb &&
+             (strcmp(verb, "get") == 0 || strcmp(verb, "set") == 0)) {
+    fprintf(reply, "error: unknown setting '%s'\n", key);
+    return;
+  } else {
+    fputs("error: use get [<key>], set <key> <value> or reload\n", reply);
+    return;
+  }
+  fputs("ok\n", reply);
+}
+
+uint64_t settings_upload_rate(void) { return k_upload_rate; }
+
+uint64_t settings_compress_cache(void) { return k_compress_cache; }
@@ -0,0 +1,59 @@
+/**
+ * @file settings.h
+ * @brief Settings that can change while the client runs.
+ *
+ * The log levels, the upload rate, the write queue size and the size of the
+ * compressed piece cache start from the configuration and can then be read
+ * and changed through the control socket or by editing the --config file and
+ * sending SIGHUP. Everything here runs on the thread of the main epoll loop.
+ *
+ * Control commands, one per line, each answered with `ok` or `error: ...`:
+ *   get [<key>]          - Print `<key> <value>` lines
+ *   set <key> <value>    - Change a setting
+ *   reload               - Read the config file again, as SIGHUP does
+ */
+
+#ifndef CONFIG_SETTINGS_H_
+#define CONFIG_SETTINGS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+
+/**
+ * @brief Take the runtime settings from the configuration and apply them
+ * @param cfg Configuration parsed from argc and argv
+ * @param argc Argument count, kept to reload the config file
+ * @param argv Argument values, must stay valid while running
+ */
+void settings_init(const Config* cfg, int argc, char** argv);
+
+/**
+ * @brief Run one control command
+ * @param command Command line without the newline
+ * @param reply Stream the answer is written to
+ */
+void settings_command(const char* command, FILE* reply);
+
+/**
+ * @brief Parse the config file and command line again and apply the runtime
+ * settings, the others need a restart
+ * @return `0` on success or `-1` if the configuration is invalid, nothing
+ * changes then
+ */
+int settings_reload(void);
+
+/**
+ * @brief Upload limit per leecher
+ * @return Bytes per second, `0` if unlimited
+ */
+uint64_t settings_upload_rate(void);
+
+/**
+ * @brief Bytes of compressed pieces a seeder keeps
+ * @return Capacity of the cache
+ */
+uint64_t settings_compress_cache(void);
+
+#endif  // CONFIG_SETTINGS_H_
@@ -0,0 +1,181 @@
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../common/log.h"
+#include "../thirdparty/uthash.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_FILE);
+
+#define COMPRESS_LEVEL 1
+/* Raw deflate, the frame already carries the size and the piece a hash */
+#define COMPRESS_WINDOW_BITS (-15)
+
+typedef struct {
+  uint64_t index;
+  uint32_t size; /* 0 if the piece does not shrink */
+  UT_hash_handle hh;
+  uint8_t data[];
+} cache_entry_t;
+
+struct piece_cache {
+  cache_entry_t* entries; /* In order of use, least recent first */
+  uint64_t capacity;
+  uint64_t bytes;
+};
+
+static const char* const k_mode_names[] = {"off", "auto", "always"};
+
+int compress_mode_parse(const char* name, compress_mode_t* mode) {
+  for (int i = COMPRESS_OFF; i <= COMPRESS_ALWAYS; i++) {
+    if (strcmp(name, k_mode_names[i]) == 0) {
+      *mode = (compress_mode_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char* compress_mode_name(compress_mode_t mode) {
+  return mode <= COMPRESS_ALWAYS ? k_mode_names[mode] : "unknown";
+}
+
+size_t compress_bound(size_t size) { return compressBound((uLong)size); }
+
+int64_t compress_piece(const uint8_t* data, size_t size, uint8_t* output) {
+  z_stream stream = {0};
+  if (deflateInit2(&stream, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_WINDOW_BITS,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    LOG_ERROR("deflateInit2 failed");
+    return -1;
+  }
+
+  stream.next_in = (Bytef*)data;
+  stream.avail_in = (uInt)size;
+  stream.next_out = output;
+  stream.avail_out = (uInt)compress_bound(size);
+  int result = deflate(&stream, Z_FINISH);
+  int64_t compressed = (int64_t)stream.total_out;
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    LOG_ERROR("deflate failed: %d", result);
+    return -1;
+  }
+  return compressed;
+}
+
+int decompress_piece(const uint8_t* data, size_t size, uint8_t* output,
+                     size_t output_size) {
+  z_stream stream = {0};
+  if (inflateInit2(&stream, COMPRESS_WINDOW_BITS) != Z_OK) {
+    LOG_ERROR("inflateInit2 failed");
+    return -1;
+  }
+
+  stream.next_in = (Bytef*)data;
+  stream.avail_in = (uInt)size;
+  stream.next_out = output;
+  stream.avail_out = (uInt)output_size;
+  int result = inflate(&stream, Z_FINISH);
+  int complete = result == Z_STREAM_END && stream.total_out == output_size &&
+                 stream.avail_in == 0;
+  inflateEnd(&stream);
+  return complete ? 0 : -1;
+}
+
+piece_cache_t* piece_cache_create(uint64_t capacity) {
+  piece_cache_t* cache = calloc(1, sizeof(piece_cache_t));
+  if (!cache) {
+    LOG_ERROR("calloc failed: %s", strerror(errno));
+    return NULL;
+  }
+  cache->capacity = capacity;
+  return cache;
+}
+
+static uint64_t entry_bytes(const cache_entry_t* entry) {
+  return sizeof(cache_entry_t) + entry->size;
+}
+
+static void remove_entry(piece_cache_t* cache, cache_entry_t* entry) {
+  HASH_DEL(cache->entries, entry);
+  cache->bytes -= entry_bytes(entry);
+  free(entry);
+}
+
+int piece_cache_get(piece_cache_t* cache, uint64_t index,
+                    const uint8_t** data, uint32_t* size) {
+  cache_entry_t* entry;
+  HASH_FIND(hh, cache->entries, &index, sizeof(index), entry);
+  if (!entry) {
+    return 0;
+  }
+
+  // Added again, uthash iterates in insertion order
+  HASH_DEL(cache->entries, entry);
+  HASH_ADD(hh, cache->entries, index, sizeof(entry->index), entry);
+  *data = entry->data;
+  *size = entry->size;
+  return 1;
+}
+
+int piece_cache_put(piece_cache_t* cache, uint64_t index, const uint8_t* data,
+                    uint32_t size) {
+  cache_entry_t* entry;
+  HASH_FIND(hh, cache->entries, &index, sizeof(index), entry);
+  if (entry) {
+    remove_entry(cache, entry);
+  }
+
+  entry = malloc(sizeof(cache_entry_t) + size);
+  if (!entry) {
+    LOG_ERROR("malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  entry->index = index;
+  entry->size = data ? size : 0;
+  if (data) {
+    memcpy(entry->data, data, size);
+  }
+  if (entry_bytes(entry) > cache->capacity) {
+    free(entry);
+    return 0;
+  }
+
+  cache_entry_t* oldest;
+  cache_entry_t* tmp;
+  HASH_ITER(hh, cache->entries, oldest, tmp) {
+    if (cache->bytes + entry_bytes(entry) <= cache->capacity) {
+      break;
+    }
+    remove_entry(cache, oldest);
+  }
+  HASH_ADD(hh, cache->entries, index, sizeof(entry->index), entry);
+  cache->bytes += entry_bytes(entry);
+  return 0;
+}
+
+void piece_cache_set_capacity(piece_cache_t* cache, uint64_t capacity) {
+  cache->capacity = capacity;
+  cache_entry_t* oldest;
+  cache_entry_t* tmp;
+  HASH_ITER(hh, cache->entries, oldest, tmp) {
+    if (cache->bytes <= cache->capacity) {
+      break;
+    }
+    remove_entry(cache, oldest);
+  }
+}
+
+void piece_cache_destroy(piece_cache_t* cache) {
+  if (!cache) {
+    return;
+  }
+  cache_entry_t* entry;
+  cache_entry_t* tmp;
+  HASH_ITER(hh, cache->entries, entry, tmp) { remove_entry(cache, entry); }
+  free(cache);
+}
@@ -0,0 +1,116 @@
+/**
+ * @file compress.h
+ * @brief Compression of pieces on the wire and a cache of compressed pieces.
+ *
+ * Pieces are compressed with raw deflate at level 1, which trades ratio for
+ * speed: compressing is only worth it when the link is slower than the CPU.
+ * The cache keeps compressed pieces, and marks the ones that did not shrink,
+ * so a piece served to several leechers is compressed at most once. It is
+ * bounded in bytes and drops the least recently used pieces first.
+ */
+
+#ifndef FILE_COMPRESS_H_
+#define FILE_COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes of compressed pieces kept by default */
+#define COMPRESS_CACHE_BYTES (64 * 1024 * 1024)
+
+typedef enum {
+  COMPRESS_OFF = 0, /* Pieces always go raw */
+  COMPRESS_AUTO,    /* When it saves more link time than it costs */
+  COMPRESS_ALWAYS   /* Every piece that shrinks */
+} compress_mode_t;
+
+typedef struct piece_cache piece_cache_t;
+
+/**
+ * @brief Parse a compression mode name
+ * @param name `off`, `auto` or `always`
+ * @param mode Output parameter for the mode
+ * @return `0` on success or `-1` if the name is unknown
+ */
+int compress_mode_parse(const char* name, compress_mode_t* mode);
+
+/**
+ * @brief Name of a compression mode
+ * @param mode Mode
+ * @return Static string
+ */
+const char* compress_mode_name(compress_mode_t mode);
+
+/**
+ * @brief Largest compressed size of a piece
+ * @param size Size of the piece
+ * @return Size of the buffer compress_piece() needs
+ */
+size_t compress_bound(size_t size);
+
+/**
+ * @brief Compress a piece
+ * @param data Piece
+ * @param size Size of the piece
+ * @param output Buffer of at least compress_bound(size) bytes
+ * @return Compressed size or `-1` on error
+ */
+int64_t compress_piece(const uint8_t* data, size_t size, uint8_t* output);
+
+/**
+ * @brief Decompress a piece whose size is known
+ * @param data Compressed piece
+ * @param size Compressed size
+ * @param output Buffer for the piece
+ * @param output_size Size of the piece, anything else is an error
+ * @return `0` on success or `-1` if the data is corrupted or of another size
+ */
+int decompress_piece(const uint8_t* data, size_t size, uint8_t* output,
+                     size_t output_size);
+
+/**
+ * @brief Create a cache of compressed pieces
+ * @param capacity Bytes the cache may hold
+ * @return Cache on success or NULL on error
+ */
+piece_cache_t* piece_cache_create(uint64_t capacity);
+
+/**
+ * @brief Look a piece up, making it the most recently used
+ * @param cache Cache
+ * @param index Piece index
+ * @param data Output parameter for the compressed piece, valid until the
+ * next piece_cache_put()
+ * @param size Output parameter for the compressed size, `0` if the piece
+ * does not shrink
+ * @return `1` if cached, `0` otherwise
+ */
+int piece_cache_get(piece_cache_t* cache, uint64_t index,
+                    const uint8_t** data, uint32_t* size);
+
+/**
+ * @brief Store a copy of a compressed piece, evicting older pieces
+ * @param cache Cache
+ * @param index Piece index, replaced if already cached
+ * @param data Compressed piece, NULL to mark a piece that does not shrink
+ * @param size Compressed size, `0` with NULL data
+ * @return `0` on success or `-1` on error
+ */
+int piece_cache_put(piece_cache_t* cache, uint64_t index, const uint8_t* data,
+                    uint32_t size);
+
+/**
+ * @brief Change the bytes the cache may hold, evicting the least recently
+ * used pieces that no longer fit
+ * @param cache Cache
+ * @param capacity Bytes the cache may hold
+ */
+void piece_cache_set_capacity(piece_cache_t* cache, uint64_t capacity);
+
+/**
+ * @brief Free the cache and its pieces
+ * @param cache Cache, may be NULL
+ */
+void piece_cache_destroy(piece_cache_t* cache);
+
+#endif  // FILE_COMPRESS_H_
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "delta.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../common/log.h"
+#include "../common/worker_pool.h"
+#include "../hash/hash.h"
+#include "file_assembler.h"
+#include "torrent_parser.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_FILE);
+
+/* Pieces claimed by a worker at once, so each thread reads sequentially */
+#define DELTA_BATCH_BYTES (8 * 1024 * 1024)
+
+typedef struct {
+  const eltextorrent_file_t* torrent;
+  const eltextorrent_file_t* base_torrent;
+  const uint8_t* data;
+  uint64_t data_size;
+  int data_fd;
+  uint64_t batch_pieces;
+  int copy;
+  uint8_t* reused;
+  atomic_uint_fast64_t next_piece;
+  atomic_uint_fast64_t reused_count;
+  atomic_uint_fast64_t cloned_count;
+  atomic_int failed;
+} delta_job_t;
+
+/**
+ * @brief Checks whether the old torrent can rule pieces out without reading
+ * them.
+ */
+static int base_torrent_usable(const eltextorrent_file_t* torrent,
+                               const eltextorrent_file_t* base_torrent,
+                               uint64_t base_size) {
+  if (!base_torrent) {
+    return 0;
+  }
+
+  // Content-defined pieces with the same index may start anywhere
+  if (torrent->pieces_offsets || base_torrent->pieces_offsets) {
+    return 0;
+  }
+  if (base_torrent->digest != torrent->digest ||
+      base_torrent->piece_size != torrent->piece_size ||
+      piece_hash_from_leaves(base_torrent) !=
+          piece_hash_from_leaves(torrent) ||
+      (piece_hash_from_leaves(torrent) &&
+       base_torrent->block_size != torrent->block_size) ||
+      base_torrent->file_size != base_size) {
+    LOG_ERROR("Base torrent does not describe the base file with the same "
+              "pieces, hashing every piece");
+    return 0;
+  }
+  return 1;
+}
+
+static int is_candidate(const delta_job_t* job, uint64_t index) {
+  const eltextorrent_file_t* torrent = job->torrent;
+  const eltextorrent_file_t* base = job->base_torrent;
+  uint64_t offset = torrent_piece_offset(torrent, index);
+  uint64_t length = torrent_piece_length(torrent, index);
+
+  if (offset + length > job->data_size) {
+    return 0;
+  }
+
+  // Same hash in both torrents is the only way the piece can match
+  return !base ||
+         (index < base->pieces_count &&
+          memcmp(&base->pieces_hashes[index * base->hash_size],
+                 &torrent->pieces_hashes[index * torrent->hash_size],
+                 torrent->hash_size) == 0);
+}
+
+static void* delta_worker(void* arg) {
+  delta_job_t* job = arg;
+  const eltextorrent_file_t* torrent = job->torrent;
+
+  while (!atomic_load(&job->failed)) {
+    uint64_t first = atomic_fetch_add(&job->next_piece, job->batch_pieces);
+    if (first >= torrent->pieces_count) {
+      break;
+    }
+
+    uint64_t last = first + job->batch_pieces;
+    if (last > torrent->pieces_count) {
+      last = torrent->pieces_count;
+    }
+
+    for (uint64_t i = first; i < last; i++) {
+      if (!is_candidate(job, i)) {
+        continue;
+      }
+
+      uint64_t offset = torrent_piece_offset(torrent, i);
+      uint32_t length = torrent_piece_length(torrent, i);
+      const uint8_t* piece = job->data + offset;
+
+      // Every core already hashes its own pieces
+      if (!verify_piece_hash((eltextorrent_file_t*)torrent, piece, length,
+                             (int)i, 1)) {
+        continue;
+      }
+      // The kernel moves the data when it can, the writer queue otherwise
+      if (job->copy) {
+        int cloned = clone_range_to_file(offset, job->data_fd, offset, length);
+        if (cloned < 0 && write_range_to_file(offset, piece, length) != 0) {
+          atomic_store(&job->failed, 1);
+          break;
+        }
+        if (cloned >= 0) {
+          atomic_fetch_add(&job->cloned_count, 1);
+        }
+      }
+
+      job->reused[i] = 1;
+      atomic_fetch_add(&job->reused_count, 1);
+    }
+
+    uint64_t batch_start = torrent_piece_offset(torrent, first);
+    uint64_t batch_end = torrent_piece_offset(torrent, last);
+    if (batch_start < job->data_size) {
+      if (batch_end > job->data_size) {
+        batch_end = job->data_size;
+      }
+      madvise((void*)(job->data + batch_start), batch_end - batch_start,
+              MADV_DONTNEED);
+    }
+  }
+
+  return NULL;
+}
+
+int64_t delta_reuse_pieces(const eltextorrent_file_t* torrent,
+                           const char* base_path,
+                           const eltextorrent_file_t* base_torrent, int copy,
+                           uint8_t* reused) {
+  if (!torrent || !base_path || !reused) {
+    return -1;
+  }
+
+  int fd = open(base_path, O_RDONLY);
+  if (fd == -1) {
+    LOG_ERROR("Failed to open base file: %s", strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    LOG_ERROR("fstat failed: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0 || torrent->pieces_count == 0) {
+    close(fd);
+    return 0;
+  }
+
+  // The descriptor stays open for clone_range_to_file()
+  uint8_t* data =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    LOG_ERROR("mmap failed: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  delta_job_t job = {
+      .torrent = torrent,
+      .base_torrent = base_torrent_usable(torrent, base_torrent,
+                                          (uint64_t)st.st_size)
+                          ? base_torrent
+                          : NULL,
+      .data = data,
+      .data_size = (uint64_t)st.st_size,
+      .data_fd = fd,
+      .batch_pieces = torrent->piece_size >= DELTA_BATCH_BYTES
+                          ? 1
+                          : DELTA_BATCH_BYTES / torrent->piece_size,
+      .copy = copy,
+      .reused = reused,
+  };
+  atomic_init(&job.next_piece, 0);
+  atomic_init(&job.reused_count, 0);
+  atomic_init(&job.cloned_count, 0);
+  atomic_init(&job.failed, 0);
+
+  worker_pool_run(delta_worker, &job);
+  munmap(data, (size_t)st.st_size);
+  close(fd);
+
+  if (atomic_load(&job.failed)) {
+    return -1;
+  }
+  if (copy) {
+    LOG_DEBUG("Copied %lu reused pieces in the kernel",
+              (uint64_t)atomic_load(&job.cloned_count));
+  }
+  return (int64_t)atomic_load(&job.reused_count);
+}
@@ -0,0 +1,39 @@
+/**
+ * @file delta.h
+ * @brief Reuse of pieces from a previous version of the shared file.
+ *
+ * The previous version is hashed piece by piece on all cores. Every piece
+ * whose hash matches the new torrent at the same index is taken from disk
+ * instead of the network, so an incremental release only transfers the
+ * pieces that changed.
+ */
+
+#ifndef FILE_DELTA_H_
+#define FILE_DELTA_H_
+
+#include <stdint.h>
+
+#include "../bit_torrent.h"
+
+/**
+ * @brief Find and copy the pieces of the new file already present in the old
+ *
+ * @param torrent Torrent of the new version
+ * @param base_path Path to the previous version of the file
+ * @param base_torrent Torrent of the previous version, or NULL. With the same
+ * digest and piece size only pieces whose hash did not change are read.
+ * @param copy `1` to copy matching pieces with clone_range_to_file(), or
+ * through the writer queue where the kernel can not, `0` when base_path is
+ * the output file itself and they are already in place
+ * @param reused Output array of pieces_count bytes, set to `1` for every
+ * reused piece
+ * @return Number of reused pieces or `-1` on error
+ *
+ * @note The file assembler must be initialized before this call.
+ */
+int64_t delta_reuse_pieces(const eltextorrent_file_t* torrent,
+                           const char* base_path,
+                           const eltextorrent_file_t* base_torrent, int copy,
+                           uint8_t* reused);
+
+#endif  // FILE_DELTA_H_
@@ -0,0 +1,54 @@
+#include "disk_latency.h"
+
+#include <errno.h>
+#include <time.h>
+
+static int k_enabled = 0;
+static scenario_rule_t k_rules[2];
+static uint64_t k_started_us = 0;
+
+static _Thread_local unsigned k_seed = 0;
+
+static uint64_t now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static int rule_is_set(const scenario_rule_t* rule) {
+  return rule->delay_us || rule->jitter_us || rule->rate ||
+         rule->stall_every_us;
+}
+
+void disk_latency_set(const scenario_t* scenario) {
+  k_rules[DISK_READ] = scenario->rules[SCENARIO_READ];
+  k_rules[DISK_WRITE] = scenario->rules[SCENARIO_WRITE];
+  k_enabled = rule_is_set(&k_rules[DISK_READ]) ||
+              rule_is_set(&k_rules[DISK_WRITE]);
+  k_started_us = now_us();
+}
+
+void disk_latency_inject(disk_op_t op, uint64_t bytes) {
+  if (!k_enabled) {
+    return;
+  }
+
+  const scenario_rule_t* rule = &k_rules[op];
+  if (k_seed == 0) {
+    k_seed = (unsigned)now_us() | 1;
+  }
+
+  uint64_t started = now_us() - k_started_us;
+  uint64_t done = scenario_after_stall(rule, started) +
+                  scenario_delay(rule, &k_seed);
+  if (rule->rate > 0) {
+    done += bytes * 1000000 / rule->rate;
+  }
+
+  uint64_t wait = done - started;
+  struct timespec duration = {(time_t)(wait / 1000000),
+                              (long)(wait % 1000000) * 1000};
+  while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+    continue;
+  }
+}
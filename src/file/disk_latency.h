@@ -0,0 +1,35 @@
+/**
+ * @file disk_latency.h
+ * @brief Injected disk latency for experiments on a fast local disk.
+ *
+ * The file reader, the assembler and the seeder call disk_latency_inject()
+ * before each disk operation. It does nothing until disk_latency_set() gets
+ * a scenario with `read` or `write` rules, then sleeps the calling thread
+ * for the rule's delay, jitter and transfer time at its rate, and until the
+ * end of a stall the operation runs into.
+ */
+
+#ifndef FILE_DISK_LATENCY_H_
+#define FILE_DISK_LATENCY_H_
+
+#include <stdint.h>
+
+#include "../common/scenario.h"
+
+typedef enum { DISK_READ = 0, DISK_WRITE } disk_op_t;
+
+/**
+ * @brief Apply the disk rules of a scenario
+ * @param scenario Scenario with the `read` and `write` rules
+ * @note Call before the threads doing disk operations start.
+ */
+void disk_latency_set(const scenario_t* scenario);
+
+/**
+ * @brief Sleep as long as the scenario says an operation takes
+ * @param op Kind of operation
+ * @param bytes Bytes it reads or writes
+ */
+void disk_latency_inject(disk_op_t op, uint64_t bytes);
+
+#endif  // FILE_DISK_LATENCY_H_
@@ -1,33 +1,44 @@
+#define _GNU_SOURCE
 #include "file_assembler.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-static FILE* k_output_file = NULL;
+#include "../common/log.h"
+#include "../common/metrics.h"
+#include "disk_latency.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_FILE);
+
+static int k_output_fd = -1;
 static char* k_current_filename = NULL;
+/* The file held data before assembly started, abort must not remove it */
+static int k_keep_on_abort = 0;
+/* Set by file_assembler_writeback(), writes go through its queue */
+static file_writer_t* k_writer = NULL;
+static durability_t k_durability = DURABILITY_NONE;
+static size_t k_queue_bytes = WRITEBACK_QUEUE_BYTES;
+/* Writer statistics, kept after the file is closed */
+static uint64_t k_writer_calls = 0;
+static uint64_t k_writer_bytes = 0;
 
-/**
- * @brief Initializes file assembly for a new file.
- *
- * @param output_filename Path to the output file to create/overwrite.
- * @param total_file_size Total expected size of the final file in bytes.
- *
- * @return If successful, returns 0.  It returns -1 on failure.
- *
- * @note Must be called first before any other functions in this module.
- * @note If the file exists, it will be truncated and overwritten.
- */
-int file_assembler_init(const char* output_filename, uint64_t total_file_size) {
+static int assembler_open(const char* output_filename,
+                          uint64_t total_file_size, int keep_existing) {
   if (!output_filename) {
-    fprintf(stderr, "Error: Invalid filename\n");
+    LOG_ERROR("Invalid filename");
     return -1;
   }
 
   k_current_filename = malloc(strlen(output_filename) + 1);
   if (!k_current_filename) {
-    perror("malloc failed");
+    LOG_ERROR("malloc failed: %s", strerror(errno));
     return -1;
   }
 
@@ -38,26 +49,195 @@ int file_assembler_init(const char* output_filename, uint64_t total_file_size) {
   }
   k_current_filename[i] = '\0';
 
-  k_output_file = fopen(output_filename, "wb");
-  if (!k_output_file) {
-    perror("fopen failed");
+  k_output_fd = keep_existing ? open(output_filename, O_RDWR) : -1;
+  k_keep_on_abort = k_output_fd != -1;
+  if (k_output_fd == -1) {
+    k_output_fd =
+        open(output_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+  if (k_output_fd == -1) {
+    LOG_ERROR("open failed: %s", strerror(errno));
     free(k_current_filename);
     k_current_filename = NULL;
     return -1;
   }
 
-  if (ftruncate(fileno(k_output_file), total_file_size) != 0) {
-    perror("ftruncate failed");
-    fclose(k_output_file);
+  if (ftruncate(k_output_fd, (off_t)total_file_size) != 0) {
+    LOG_ERROR("ftruncate failed: %s", strerror(errno));
+    close(k_output_fd);
     free(k_current_filename);
     k_current_filename = NULL;
-    k_output_file = NULL;
+    k_output_fd = -1;
     return -1;
   }
 
+  k_durability = DURABILITY_NONE;
+  k_writer_calls = 0;
+  k_writer_bytes = 0;
   return 0;
 }
 
+/**
+ * @brief Initializes file assembly for a new file.
+ *
+ * @param output_filename Path to the output file to create/overwrite.
+ * @param total_file_size Total expected size of the final file in bytes.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ *
+ * @note Must be called first before any other functions in this module.
+ * @note If the file exists, it will be truncated and overwritten.
+ */
+int file_assembler_init(const char* output_filename, uint64_t total_file_size) {
+  return assembler_open(output_filename, total_file_size, 0);
+}
+
+/**
+ * @brief Initializes file assembly on top of an existing file.
+ *
+ * @param output_filename Path to the output file to update or create.
+ * @param total_file_size Total expected size of the final file in bytes.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ *
+ * @note Used instead of file_assembler_init() when pieces already in the file
+ * are reused. The file is only resized, so data that stays in place survives.
+ * @note file_assembler_abort() keeps a file that existed before this call.
+ */
+int file_assembler_resume(const char* output_filename,
+                          uint64_t total_file_size) {
+  return assembler_open(output_filename, total_file_size, 1);
+}
+
+/**
+ * @brief Moves writes to a dedicated thread.
+ *
+ * @param durability When written data is forced to disk.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ *
+ * @note Call right after file_assembler_init() or file_assembler_resume().
+ * write_range_to_file() and write_piece_to_file() then only queue a copy of
+ * the data; write errors are reported by file_assembler().
+ */
+int file_assembler_writeback(durability_t durability) {
+  if (k_output_fd == -1 || k_writer) {
+    return -1;
+  }
+
+  k_writer = file_writer_create(k_output_fd, durability, k_queue_bytes);
+  if (!k_writer) {
+    LOG_ERROR("Failed to start the writer thread");
+    return -1;
+  }
+  k_durability = durability;
+  return 0;
+}
+
+/**
+ * @brief Sets how many bytes may wait for the writer thread.
+ *
+ * @param queue_bytes Queue limit, applies to the running writer and to the
+ * next one started by file_assembler_writeback().
+ *
+ * @note Call from the thread that writes pieces.
+ */
+void file_assembler_set_queue_limit(size_t queue_bytes) {
+  k_queue_bytes = queue_bytes;
+  file_writer_set_queue_limit(k_writer, queue_bytes);
+}
+
+/**
+ * @brief Number of write system calls and bytes written by the writer thread.
+ *
+ * @param writes Output parameter for the number of calls.
+ * @param bytes Output parameter for the number of bytes.
+ *
+ * @note Still valid after file_assembler() for the file just assembled.
+ */
+void file_assembler_stats(uint64_t* writes, uint64_t* bytes) {
+  if (k_writer) {
+    file_writer_stats(k_writer, &k_writer_calls, &k_writer_bytes);
+  }
+  *writes = k_writer_calls;
+  *bytes = k_writer_bytes;
+}
+
+/**
+ * @brief Writes data to a position in the file, or queues it for the writer
+ * thread and waits for space in the queue only if asked to.
+ */
+static int assembler_write(uint64_t offset, const uint8_t* data, uint32_t size,
+                           int wait) {
+  if (k_output_fd == -1) {
+    LOG_ERROR("File assembler not initialized");
+    return -1;
+  }
+
+  if (!data) {
+    LOG_ERROR("Invalid piece parameters");
+    return -1;
+  }
+
+  if (k_writer) {
+    return wait ? file_writer_submit(k_writer, offset, data, size)
+                : file_writer_queue(k_writer, offset, data, size);
+  }
+
+  // Positional writes, so pieces of any size land without seeking or copying
+  for (uint32_t total = 0; total < size;) {
+    uint64_t started = metrics_now_ns();
+    disk_latency_inject(DISK_WRITE, size - total);
+    ssize_t written = pwrite(k_output_fd, data + total, size - total,
+                             (off_t)(offset + total));
+    metrics_observe(METRIC_DISK_WRITE_DURATION, metrics_now_ns() - started);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      LOG_ERROR("pwrite failed: %s", strerror(errno));
+      return -1;
+    }
+    total += (uint32_t)written;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Writes data to a position in the file.
+ *
+ * @param offset Offset of the first byte in the file.
+ * @param data Pointer to the binary data.
+ * @param size Size of the data in bytes.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ *
+ * @note Must be called after file_assembler_init() and before
+ * file_assembler().
+ */
+int write_range_to_file(uint64_t offset, const uint8_t* data, uint32_t size) {
+  return assembler_write(offset, data, size, 1);
+}
+
+/**
+ * @brief Writes data to a position in the file without waiting for the
+ * writer thread.
+ *
+ * @param offset Offset of the first byte in the file.
+ * @param data Pointer to the binary data.
+ * @param size Size of the data in bytes.
+ *
+ * @return If successful, returns 0 or FILE_WRITER_FULL once the queue is
+ * full.  It returns -1 on failure.
+ *
+ * @note For an event loop: after FILE_WRITER_FULL, wait for
+ * file_assembler_space_fd() before producing more data.
+ */
+int queue_range_to_file(uint64_t offset, const uint8_t* data, uint32_t size) {
+  return assembler_write(offset, data, size, 0);
+}
+
 /**
  * @brief Writes a single piece to its correct position in the file.
  *
@@ -70,42 +250,115 @@ int file_assembler_init(const char* output_filename, uint64_t total_file_size) {
  *
  * @return If successful, returns 0.  It returns -1 on failure.
  *
- * @note Must be called after file_assembler_init() and before
- * file_assembler().
+ * @note Pieces of chunked torrents have no standard length, use
+ * write_range_to_file() with torrent_piece_offset() for them.
  */
-int write_piece_to_file(int piece_index, const uint8_t* piece_data,
+int write_piece_to_file(uint64_t piece_index, const uint8_t* piece_data,
                         uint32_t piece_size, uint32_t piece_length) {
-  if (!k_output_file) {
-    fprintf(stderr, "Error: File assembler not initialized\n");
-    return -1;
-  }
+  return write_range_to_file(piece_index * (uint64_t)piece_length, piece_data,
+                             piece_size);
+}
 
-  if (!piece_data || piece_index < 0) {
-    fprintf(stderr, "Error: Invalid piece parameters\n");
-    return -1;
-  }
+/**
+ * @brief Writes a single piece like write_piece_to_file(), without waiting
+ * for the writer thread like queue_range_to_file().
+ *
+ * @return If successful, returns 0 or FILE_WRITER_FULL once the queue is
+ * full.  It returns -1 on failure.
+ */
+int queue_piece_to_file(uint64_t piece_index, const uint8_t* piece_data,
+                        uint32_t piece_size, uint32_t piece_length) {
+  return queue_range_to_file(piece_index * (uint64_t)piece_length, piece_data,
+                             piece_size);
+}
 
-  uint64_t offset = (uint64_t)piece_index * (uint64_t)piece_length;
+/**
+ * @brief Descriptor that becomes readable once the queue reported full by
+ * queue_range_to_file() drains, or a write fails.
+ *
+ * @return Eventfd to read when readable, or -1 without a writer thread.
+ */
+int file_assembler_space_fd() {
+  return file_writer_space_fd(k_writer);
+}
 
-  if (fseek(k_output_file, offset, SEEK_SET) != 0) {
-    perror("fseek failed");
+/**
+ * @brief Fills a range of the file from a range of another local file.
+ *
+ * Tries a reflink first, so the data shares extents with the source and
+ * takes no extra space, then an in-kernel copy_file_range().
+ *
+ * @param offset Offset of the first byte in the file.
+ * @param src_fd Descriptor of the source file.
+ * @param src_offset Offset of the data in the source file.
+ * @param size Size of the data in bytes.
+ *
+ * @return `1` if reflinked, `0` if copied or `-1` if neither works between
+ * these files and the caller has to write the data itself.
+ */
+int clone_range_to_file(uint64_t offset, int src_fd, uint64_t src_offset,
+                        uint32_t size) {
+  if (k_output_fd == -1 || src_fd < 0) {
     return -1;
   }
 
-  size_t written = fwrite(piece_data, 1, piece_size, k_output_file);
-  if (written != piece_size) {
-    perror("fwrite failed");
-    return -1;
+  int fd = k_output_fd;
+  struct file_clone_range range = {
+      .src_fd = src_fd,
+      .src_offset = src_offset,
+      .src_length = size,
+      .dest_offset = offset,
+  };
+  if (ioctl(fd, FICLONERANGE, &range) == 0) {
+    return 1;
   }
 
-  if (fflush(k_output_file) != 0) {
-    perror("fflush failed");
-    return -1;
+  disk_latency_inject(DISK_WRITE, size);
+  loff_t src_position = (loff_t)src_offset;
+  loff_t dst_position = (loff_t)offset;
+  for (uint32_t total = 0; total < size;) {
+    ssize_t copied = copy_file_range(src_fd, &src_position, fd, &dst_position,
+                                     size - total, 0);
+    if (copied == -1 && errno == EINTR) {
+      continue;
+    }
+    if (copied <= 0) {
+      return -1;
+    }
+    total += (uint32_t)copied;
   }
 
   return 0;
 }
 
+/**
+ * @brief Waits until queued pieces are written.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ *
+ * @note Lets an interrupted download keep every piece received so far.
+ */
+int file_assembler_flush() {
+  return k_writer ? file_writer_flush(k_writer) : 0;
+}
+
+/**
+ * @brief Closes the output file and forgets it.
+ */
+static void assembler_close(int discard) {
+  if (k_writer) {
+    file_writer_stats(k_writer, &k_writer_calls, &k_writer_bytes);
+    file_writer_destroy(k_writer, discard);
+    k_writer = NULL;
+  }
+  if (k_output_fd != -1) {
+    close(k_output_fd);
+    k_output_fd = -1;
+  }
+  free(k_current_filename);
+  k_current_filename = NULL;
+}
+
 /**
  * @brief Finalizes file assembly and verifies completeness.
  *
@@ -115,53 +368,43 @@ int write_piece_to_file(int piece_index, const uint8_t* piece_data,
  *
  * @note Must be called after all pieces have been written via
  * write_piece_to_file().
+ * @note Waits for queued writes and, with DURABILITY_COMPLETE, for the data
+ * to reach the disk.
  * @note After this call, no more pieces can be written to the file.
  */
 int file_assembler(uint64_t expected_size) {
-  if (!k_output_file) {
-    fprintf(stderr, "Error: File assembler not initialized\n");
+  if (k_output_fd == -1) {
+    LOG_ERROR("File assembler not initialized");
     return -1;
   }
 
-  if (fseek(k_output_file, 0, SEEK_END) != 0) {
-    perror("fseek failed");
+  if (k_writer && file_writer_flush(k_writer) != 0) {
+    LOG_ERROR("Failed to write pieces to %s", k_current_filename);
+    assembler_close(1);
     return -1;
   }
 
-  long actual_size = ftell(k_output_file);
-  if (actual_size == -1) {
-    perror("ftell failed");
-    fclose(k_output_file);
-    k_output_file = NULL;
-    free(k_current_filename);
-    k_current_filename = NULL;
+  struct stat st;
+  if (fstat(k_output_fd, &st) != 0) {
+    LOG_ERROR("fstat failed: %s", strerror(errno));
+    assembler_close(1);
     return -1;
   }
 
-  if ((uint64_t)actual_size != expected_size) {
-    fprintf(stderr, "File size mismatch: expected %lu, got %ld\n",
-            expected_size, actual_size);
-    fclose(k_output_file);
-    k_output_file = NULL;
-    free(k_current_filename);
-    k_current_filename = NULL;
+  if ((uint64_t)st.st_size != expected_size) {
+    LOG_ERROR("File size mismatch: expected %lu, got %ld", expected_size,
+              (long)st.st_size);
+    assembler_close(1);
     return -1;
   }
 
-  if (fflush(k_output_file) != 0) {
-    perror("fflush failed");
-    fclose(k_output_file);
-    k_output_file = NULL;
-    free(k_current_filename);
-    k_current_filename = NULL;
+  if (k_durability == DURABILITY_COMPLETE && fdatasync(k_output_fd) != 0) {
+    LOG_ERROR("fdatasync failed: %s", strerror(errno));
+    assembler_close(1);
     return -1;
   }
 
-  fclose(k_output_file);
-  k_output_file = NULL;
-
-  free(k_current_filename);
-  k_current_filename = NULL;
+  assembler_close(0);
   return 0;
 }
 
@@ -172,24 +415,17 @@ int file_assembler(uint64_t expected_size) {
  *
  * @note Can be called at any time after file_assembler_init() to cancel
  * assembly.
- * @note Closes the file and removes the partially assembled file from disk.
+ * @note Drops queued writes, closes the file and removes the partially
+ * assembled file from disk.
  */
 int file_assembler_abort() {
-  if (k_output_file) {
-    fclose(k_output_file);
-    k_output_file = NULL;
-  }
+  int result = 0;
 
-  if (k_current_filename) {
-    if (remove(k_current_filename) != 0) {
-      perror("remove failed");
-      free(k_current_filename);
-      k_current_filename = NULL;
-      return -1;
-    }
-    free(k_current_filename);
-    k_current_filename = NULL;
+  if (k_current_filename && !k_keep_on_abort &&
+      remove(k_current_filename) != 0) {
+    LOG_ERROR("remove failed: %s", strerror(errno));
+    result = -1;
   }
-
-  return 0;
+  assembler_close(1);
+  return result;
 }
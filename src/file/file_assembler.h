@@ -4,8 +4,14 @@
  *
  * @usage
  * The functions in this module must be called in the following sequence:
- * 1. file_assembler_init() - Initialize the output file
- * 2. write_piece_to_file() - Write pieces (0 or more times, in any order)
+ * 1. file_assembler_init() - Initialize the output file, or
+ *    file_assembler_resume() - Reuse the data already in it
+ *    file_assembler_writeback() - Optionally write on a dedicated thread
+ * 2. write_piece_to_file() - Write pieces (0 or more times, in any order),
+ *    write_range_to_file() - Or pieces at an explicit offset,
+ *    queue_piece_to_file(), queue_range_to_file() - Or without waiting for
+ *    the writer thread, from an event loop,
+ *    clone_range_to_file() - Or take them from another local file
  * 3. file_assembler() - Finalize and verify the complete file
  *
  * If any error occurs during steps 1-2, call file_assembler_abort() to cleanup.
@@ -14,11 +20,27 @@
 #ifndef FILE_ASSEMBLER_H_
 #define FILE_ASSEMBLER_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "file_writer.h"
+
 int file_assembler_init(const char* output_filename, uint64_t total_file_size);
-int write_piece_to_file(int piece_index, const uint8_t* piece_data,
+int file_assembler_resume(const char* output_filename,
+                          uint64_t total_file_size);
+int file_assembler_writeback(durability_t durability);
+void file_assembler_set_queue_limit(size_t queue_bytes);
+void file_assembler_stats(uint64_t* writes, uint64_t* bytes);
+int write_range_to_file(uint64_t offset, const uint8_t* data, uint32_t size);
+int write_piece_to_file(uint64_t piece_index, const uint8_t* piece_data,
+                        uint32_t piece_size, uint32_t piece_length);
+int queue_range_to_file(uint64_t offset, const uint8_t* data, uint32_t size);
+int queue_piece_to_file(uint64_t piece_index, const uint8_t* piece_data,
                         uint32_t piece_size, uint32_t piece_length);
+int file_assembler_space_fd();
+int clone_range_to_file(uint64_t offset, int src_fd, uint64_t src_offset,
+                        uint32_t size);
+int file_assembler_flush();
 int file_assembler(uint64_t expected_size);
 int file_assembler_abort();
 
@@ -4,8 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
-int read_file_piece(const char* filename, int piece_index, uint32_t piece_size,
-                    uint8_t* output_buffer, size_t buffer_size,
-                    uint32_t* actual_size);
+int read_file_range(int fd, uint64_t offset, uint32_t size,
+                    uint8_t* output_buffer);
 
-#endif  // FILE_READER_H_
\ No newline at end of file
+#endif  // FILE_READER_H_
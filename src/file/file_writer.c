@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include "file_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../bit_torrent.h"
+#include "../common/log.h"
+#include "../common/metrics.h"
+#include "../common/trace.h"
+#include "disk_latency.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_FILE);
+
+struct file_writer {
+  int fd;
+  durability_t durability;
+  size_t queue_limit;
+  queue_t queue;
+  size_t pending_bytes; /* Queued or being written */
+  int stop;
+  int discard;
+  int failed;
+  int full;     /* file_writer_queue() reported a full queue */
+  int space_fd; /* Signaled once a full queue drains */
+  uint64_t writes;
+  uint64_t bytes;
+  /* Periodic policy: range written since the last sync and the one before */
+  uint64_t dirty_start;
+  uint64_t dirty_end;
+  uint64_t dirty_bytes;
+  uint64_t flushing_start;
+  uint64_t flushing_end;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;  /* Queue not empty or stop requested */
+  pthread_cond_t space; /* pending_bytes went down */
+};
+
+static const char* const k_durability_names[] = {"none", "periodic",
+                                                 "complete"};
+
+int durability_parse(const char* name, durability_t* durability) {
+  for (int i = DURABILITY_NONE; i <= DURABILITY_COMPLETE; i++) {
+    if (strcmp(name, k_durability_names[i]) == 0) {
+      *durability = (durability_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char* durability_name(durability_t durability) {
+  return durability <= DURABILITY_COMPLETE ? k_durability_names[durability]
+                                           : "unknown";
+}
+
+static int compare_offsets(const void* a, const void* b) {
+  uint64_t left = (*(queue_node_t* const*)a)->data.offset;
+  uint64_t right = (*(queue_node_t* const*)b)->data.offset;
+  return left < right ? -1 : left > right;
+}
+
+/**
+ * @brief Writes adjacent buffers, resuming after short writes.
+ *
+ * @return Number of write calls or `-1` on error
+ */
+static int64_t write_run(int fd, struct iovec* iov, int count,
+                         uint64_t offset) {
+  int64_t calls = 0;
+
+  while (count > 0) {
+    uint64_t started = metrics_now_ns();
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+      bytes += iov[i].iov_len;
+    }
+    disk_latency_inject(DISK_WRITE, bytes);
+    ssize_t written = pwritev(fd, iov, count, (off_t)offset);
+    metrics_observe(METRIC_DISK_WRITE_DURATION, metrics_now_ns() - started);
+    TRACE_SPAN("pwritev", offset, written > 0 ? (uint64_t)written : 0,
+               started);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      LOG_ERROR("pwritev failed: %s", strerror(errno));
+      return -1;
+    }
+    calls++;
+    offset += (uint64_t)written;
+
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (uint8_t*)iov->iov_base + written;
+      iov->iov_len -= (size_t)written;
+    }
+  }
+  return calls;
+}
+
+/**
+ * @brief Starts write-back of the range written since the last call and
+ * waits for the previous one, so dirty pages stay bounded without stalling
+ * on the range just written.
+ */
+static int sync_written_range(file_writer_t* writer) {
+  if (writer->flushing_end > writer->flushing_start &&
+      sync_file_range(writer->fd, (off_t)writer->flushing_start,
+                      (off_t)(writer->flushing_end - writer->flushing_start),
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+    LOG_ERROR("sync_file_range failed: %s", strerror(errno));
+    return -1;
+  }
+  if (sync_file_range(writer->fd, (off_t)writer->dirty_start,
+                      (off_t)(writer->dirty_end - writer->dirty_start),
+                      SYNC_FILE_RANGE_WRITE) != 0) {
+    LOG_ERROR("sync_file_range failed: %s", strerror(errno));
+    return -1;
+  }
+
+  writer->flushing_start = writer->dirty_start;
+  writer->flushing_end = writer->dirty_end;
+  writer->dirty_bytes = 0;
+  return 0;
+}
+
+static void track_dirty(file_writer_t* writer, uint64_t offset,
+                        uint64_t length) {
+  if (writer->dirty_bytes == 0 || offset < writer->dirty_start) {
+    writer->dirty_start = offset;
+  }
+  if (writer->dirty_bytes == 0 || offset + length > writer->dirty_end) {
+    writer->dirty_end = offset + length;
+  }
+  writer->dirty_bytes += length;
+}
+
+/**
+ * @brief Writes a batch sorted by offset, one pwritev() per run of adjacent
+ * pieces.
+ *
+ * @return Number of write calls or `-1` on error
+ */
+static int64_t write_batch(file_writer_t* writer, queue_node_t** nodes,
+                           size_t count) {
+  struct iovec iov[IOV_MAX];
+  int64_t calls = 0;
+
+  qsort(nodes, count, sizeof(queue_node_t*), compare_offsets);
+
+  for (size_t i = 0; i < count;) {
+    uint64_t offset = nodes[i]->data.offset;
+    uint64_t end = offset;
+    int used = 0;
+
+    while (i < count && used < IOV_MAX && nodes[i]->data.offset == end) {
+      iov[used].iov_base = nodes[i]->data.pieces;
+      iov[used].iov_len = nodes[i]->data.piece_size;
+      end += nodes[i]->data.piece_size;
+      used++;
+      i++;
+    }
+
+    int64_t run_calls = write_run(writer->fd, iov, used, offset);
+    if (run_calls < 0) {
+      return -1;
+    }
+    calls += run_calls;
+
+    if (writer->durability == DURABILITY_PERIODIC) {
+      track_dirty(writer, offset, end - offset);
+      if (writer->dirty_bytes >= WRITEBACK_SYNC_BYTES &&
+          sync_written_range(writer) != 0) {
+        return -1;
+      }
+    }
+  }
+  return calls;
+}
+
+/**
+ * @brief Tells a caller of file_writer_queue() waiting for a full queue that
+ * it may queue again, or that it has to learn the writer failed. Called with
+ * the lock held.
+ */
+static void signal_space(file_writer_t* writer) {
+  uint64_t one = 1;
+  if (!writer->full ||
+      (!writer->failed && writer->pending_bytes >= writer->queue_limit)) {
+    return;
+  }
+  writer->full = 0;
+  if (write(writer->space_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("eventfd write failed: %s", strerror(errno));
+  }
+}
+
+static void* writer_thread(void* arg) {
+  file_writer_t* writer = arg;
+  queue_node_t** nodes = NULL;
+  size_t nodes_capacity = 0;
+
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (!writer->queue.head && !writer->stop) {
+      pthread_cond_wait(&writer->work, &writer->lock);
+    }
+    if (!writer->queue.head) {
+      break;
+    }
+
+    queue_node_t* head = writer->queue.head;
+    size_t count = writer->queue.size;
+    int skip = writer->discard || writer->failed;
+    writer->queue.head = NULL;
+    writer->queue.tail = NULL;
+    writer->queue.size = 0;
+    pthread_mutex_unlock(&writer->lock);
+
+    if (count > nodes_capacity) {
+      queue_node_t** grown = realloc(nodes, count * sizeof(queue_node_t*));
+      if (grown) {
+        nodes = grown;
+        nodes_capacity = count;
+      } else {
+        skip = 1;
+      }
+    }
+
+    size_t batch_bytes = 0;
+    queue_node_t* node = head;
+    for (size_t i = 0; node; i++, node = node->next) {
+      if (i < nodes_capacity) {
+        nodes[i] = node;
+      }
+      batch_bytes += node->data.piece_size;
+      TRACE_SPAN("write queue", node->data.offset, node->data.piece_size,
+                 node->queued_ns);
+    }
+
+    int64_t calls = skip ? 0 : write_batch(writer, nodes, count);
+
+    while (head) {
+      queue_node_t* next = head->next;
+      free(head);
+      head = next;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    if (calls < 0 || (skip && !writer->discard)) {
+      writer->failed = 1;
+    } else if (!skip) {
+      writer->writes += (uint64_t)calls;
+      writer->bytes += batch_bytes;
+    }
+    writer->pending_bytes -= batch_bytes;
+    metrics_set(METRIC_WRITE_QUEUE_BYTES, (int64_t)writer->pending_bytes);
+    pthread_cond_broadcast(&writer->space);
+    signal_space(writer);
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  free(nodes);
+  return NULL;
+}
+
+file_writer_t* file_writer_create(int fd, durability_t durability,
+                                  size_t queue_bytes) {
+  if (fd < 0) {
+    return NULL;
+  }
+
+  file_writer_t* writer = calloc(1, sizeof(file_writer_t));
+  if (!writer) {
+    return NULL;
+  }
+  writer->fd = fd;
+  writer->durability = durability;
+  writer->queue_limit = queue_bytes;
+  writer->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (writer->space_fd < 0) {
+    LOG_ERROR("eventfd failed: %s", strerror(errno));
+    free(writer);
+    return NULL;
+  }
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->work, NULL);
+  pthread_cond_init(&writer->space, NULL);
+
+  if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+    pthread_cond_destroy(&writer->space);
+    pthread_cond_destroy(&writer->work);
+    pthread_mutex_destroy(&writer->lock);
+    close(writer->space_fd);
+    free(writer);
+    return NULL;
+  }
+  pthread_setname_np(writer->thread, "writer");
+  return writer;
+}
+
+/**
+ * @brief Copies data into the queue, waiting for space first if asked to.
+ *
+ * @return `0` on success, FILE_WRITER_FULL if queued without waiting past the
+ * limit or `-1` on error
+ */
+static int enqueue(file_writer_t* writer, uint64_t offset, const uint8_t* data,
+                   uint32_t size, int wait) {
+  if (!writer || !data) {
+    return -1;
+  }
+
+  // One allocation holds the node and its copy of the data
+  uint64_t queued_ns = TRACE_NOW();
+  queue_node_t* node = malloc(sizeof(queue_node_t) + size);
+  if (!node) {
+    LOG_ERROR("malloc failed: %s", strerror(errno));
+    return -1;
+  }
+  node->data.offset = offset;
+  node->data.piece_size = size;
+  node->data.pieces = (uint8_t*)(node + 1);
+  node->queued_ns = queued_ns;
+  node->next = NULL;
+  memcpy(node->data.pieces, data, size);
+
+  pthread_mutex_lock(&writer->lock);
+  while (wait && !writer->failed && writer->pending_bytes > 0 &&
+         writer->pending_bytes + size > writer->queue_limit) {
+    pthread_cond_wait(&writer->space, &writer->lock);
+  }
+  if (writer->failed) {
+    pthread_mutex_unlock(&writer->lock);
+    free(node);
+    return -1;
+  }
+
+  if (writer->queue.tail) {
+    writer->queue.tail->next = node;
+  } else {
+    writer->queue.head = node;
+  }
+  writer->queue.tail = node;
+  writer->queue.size++;
+  writer->pending_bytes += size;
+  metrics_set(METRIC_WRITE_QUEUE_BYTES, (int64_t)writer->pending_bytes);
+  int result = 0;
+  if (!wait && writer->pending_bytes >= writer->queue_limit) {
+    writer->full = 1;
+    result = FILE_WRITER_FULL;
+  }
+  pthread_cond_signal(&writer->work);
+  pthread_mutex_unlock(&writer->lock);
+  // The node may already be written and freed
+  TRACE_SPAN("submit", offset, size, queued_ns);
+  return result;
+}
+
+int file_writer_submit(file_writer_t* writer, uint64_t offset,
+                       const uint8_t* data, uint32_t size) {
+  return enqueue(writer, offset, data, size, 1);
+}
+
+int file_writer_queue(file_writer_t* writer, uint64_t offset,
+                      const uint8_t* data, uint32_t size) {
+  return enqueue(writer, offset, data, size, 0);
+}
+
+int file_writer_space_fd(file_writer_t* writer) {
+  return writer ? writer->space_fd : -1;
+}
+
+void file_writer_set_queue_limit(file_writer_t* writer, size_t queue_bytes) {
+  if (!writer) {
+    return;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  writer->queue_limit = queue_bytes;
+  pthread_cond_broadcast(&writer->space);
+  signal_space(writer);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+int file_writer_flush(file_writer_t* writer) {
+  if (!writer) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  while (!writer->failed && writer->pending_bytes > 0) {
+    pthread_cond_wait(&writer->space, &writer->lock);
+  }
+  int result = writer->failed ? -1 : 0;
+  pthread_mutex_unlock(&writer->lock);
+  return result;
+}
+
+void file_writer_stats(file_writer_t* writer, uint64_t* writes,
+                       uint64_t* bytes) {
+  pthread_mutex_lock(&writer->lock);
+  *writes = writer->writes;
+  *bytes = writer->bytes;
+  pthread_mutex_unlock(&writer->lock);
+}
+
+void file_writer_destroy(file_writer_t* writer, int discard) {
+  if (!writer) {
+    return;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  writer->stop = 1;
+  writer->discard = discard;
+  pthread_cond_signal(&writer->work);
+  pthread_mutex_unlock(&writer->lock);
+
+  pthread_join(writer->thread, NULL);
+
+  pthread_cond_destroy(&writer->space);
+  pthread_cond_destroy(&writer->work);
+  pthread_mutex_destroy(&writer->lock);
+  close(writer->space_fd);
+  free(writer);
+}
@@ -0,0 +1,136 @@
+/**
+ * @file file_writer.h
+ * @brief Write-back of received pieces on a dedicated thread.
+ *
+ * Pieces are copied into a bounded queue and written by a separate thread,
+ * so the network loop never waits for the disk. The thread takes everything
+ * queued at once, sorts it by offset and merges adjacent pieces into one
+ * pwritev() call. Submitting only blocks when the queue is full, which is
+ * the back pressure of a disk slower than the network. An event loop that
+ * must not block queues instead: the data is always taken, a full queue is
+ * reported and an eventfd signals once it drains.
+ */
+
+#ifndef FILE_WRITER_H_
+#define FILE_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes queued before submitting blocks, at least one piece is accepted */
+#define WRITEBACK_QUEUE_BYTES (64 * 1024 * 1024)
+/* Returned by file_writer_queue() once the queue reached its limit */
+#define FILE_WRITER_FULL 1
+/* Written bytes between two sync_file_range() calls of the periodic policy */
+#define WRITEBACK_SYNC_BYTES (32 * 1024 * 1024)
+
+typedef enum {
+  DURABILITY_NONE = 0, /* Leave write-back to the kernel */
+  DURABILITY_PERIODIC, /* Push dirty ranges out as the download goes */
+  DURABILITY_COMPLETE  /* fdatasync() once the file is complete */
+} durability_t;
+
+typedef struct file_writer file_writer_t;
+
+/**
+ * @brief Parse a durability policy name
+ * @param name `none`, `periodic` or `complete`
+ * @param durability Output parameter for the policy
+ * @return `0` on success or `-1` if the name is unknown
+ */
+int durability_parse(const char* name, durability_t* durability);
+
+/**
+ * @brief Name of a durability policy
+ * @param durability Policy
+ * @return Static string
+ */
+const char* durability_name(durability_t durability);
+
+/**
+ * @brief Start the writer thread for a file
+ * @param fd Descriptor of the file opened for writing, stays owned by the
+ * caller
+ * @param durability Sync policy applied while writing
+ * @param queue_bytes Bytes that may wait in the queue
+ * @return Writer on success or NULL on error
+ */
+file_writer_t* file_writer_create(int fd, durability_t durability,
+                                  size_t queue_bytes);
+
+/**
+ * @brief Queue a copy of data to be written at an offset
+ *
+ * Safe to call from several threads.
+ *
+ * @param writer Writer
+ * @param offset Offset in the file
+ * @param data Data to write, copied before the call returns
+ * @param size Size of the data in bytes
+ * @return `0` on success or `-1` if an earlier write failed
+ */
+int file_writer_submit(file_writer_t* writer, uint64_t offset,
+                       const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Queue a copy of data to be written at an offset without waiting
+ *
+ * The data is queued even past the limit. Once FILE_WRITER_FULL is returned,
+ * the caller should stop producing data until the descriptor of
+ * file_writer_space_fd() becomes readable.
+ *
+ * @param writer Writer
+ * @param offset Offset in the file
+ * @param data Data to write, copied before the call returns
+ * @param size Size of the data in bytes
+ * @return `0` on success, FILE_WRITER_FULL if the queue is full or `-1` if an
+ * earlier write failed
+ */
+int file_writer_queue(file_writer_t* writer, uint64_t offset,
+                      const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Eventfd that becomes readable once a queue reported full drains
+ * below its limit or a write fails
+ *
+ * Read it to rearm it. Closed by file_writer_destroy().
+ *
+ * @param writer Writer
+ * @return Descriptor or `-1` if there is no writer
+ */
+int file_writer_space_fd(file_writer_t* writer);
+
+/**
+ * @brief Change how many bytes may wait in the queue
+ *
+ * Submitters blocked on the old limit are woken up to check the new one.
+ *
+ * @param writer Writer
+ * @param queue_bytes Bytes that may wait in the queue
+ */
+void file_writer_set_queue_limit(file_writer_t* writer, size_t queue_bytes);
+
+/**
+ * @brief Wait until everything queued is written
+ * @param writer Writer
+ * @return `0` on success or `-1` if any write failed
+ */
+int file_writer_flush(file_writer_t* writer);
+
+/**
+ * @brief Number of write system calls and bytes written so far
+ * @param writer Writer
+ * @param writes Output parameter for the number of calls
+ * @param bytes Output parameter for the number of bytes
+ */
+void file_writer_stats(file_writer_t* writer, uint64_t* writes,
+                       uint64_t* bytes);
+
+/**
+ * @brief Stop the writer thread and free the writer
+ * @param writer Writer, may be NULL
+ * @param discard `1` to drop queued data instead of writing it
+ */
+void file_writer_destroy(file_writer_t* writer, int discard);
+
+#endif  // FILE_WRITER_H_
@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+#include "local_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../common/bitfield.h"
+#include "../common/log.h"
+#include "../common/worker_pool.h"
+#include "../hash/chunker.h"
+#include "../hash/digest.h"
+#include "../hash/hash.h"
+#include "../thirdparty/uthash.h"
+#include "file_assembler.h"
+#include "torrent_parser.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_FILE);
+
+#define INDEX_CACHE_MAGIC "ELTIDX3"
+#define INDEX_CACHE_MAGIC_SIZE 8
+#define WALK_MAX_FDS 16
+
+typedef struct {
+  char* path;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t pieces_count;
+  uint8_t* hashes; /* pieces_count * hash_size, NULL until hashed */
+  uint64_t* offsets; /* pieces_count + 1 boundaries, only when chunked */
+  UT_hash_handle hh;
+} local_file_t;
+
+typedef struct {
+  const uint8_t* hash;
+  uint32_t file;
+  uint32_t piece;
+  UT_hash_handle hh;
+} local_piece_t;
+
+struct local_index {
+  digest_algo_t digest;
+  uint32_t piece_size;
+  uint32_t hash_size;
+  uint32_t block_size; /* pieces are hashed from their leaves unless 0 */
+  chunker_params_t chunking; /* avg_size is 0 for fixed pieces */
+  local_file_t** files;
+  size_t files_count;
+  size_t files_capacity;
+  local_file_t* paths; /* files by path */
+  local_piece_t* entries;
+  local_piece_t* pieces; /* entries by hash */
+};
+
+typedef struct {
+  local_index_t* index;
+  atomic_size_t next_file;
+} hash_job_t;
+
+/* nftw() has no user argument, the walk state lives here */
+static local_index_t* k_walk_index = NULL;
+static struct stat k_walk_exclude;
+static int k_walk_has_exclude = 0;
+static int k_walk_failed = 0;
+
+/**
+ * @brief Range of a piece within an indexed file.
+ */
+static void piece_range(const local_index_t* index, const local_file_t* file,
+                        uint32_t piece, uint64_t* offset, uint64_t* length) {
+  if (file->offsets) {
+    *offset = file->offsets[piece];
+    *length = file->offsets[piece + 1] - file->offsets[piece];
+    return;
+  }
+
+  *offset = (uint64_t)piece * index->piece_size;
+  *length = file->size - *offset < index->piece_size ? file->size - *offset
+                                                      : index->piece_size;
+}
+
+static local_file_t* add_file(local_index_t* index, const char* path,
+                              const struct stat* st) {
+  if (index->files_count == index->files_capacity) {
+    size_t capacity = index->files_capacity ? index->files_capacity * 2 : 64;
+    local_file_t** files =
+        realloc(index->files, capacity * sizeof(local_file_t*));
+    if (!files) {
+      return NULL;
+    }
+    index->files = files;
+    index->files_capacity = capacity;
+  }
+
+  local_file_t* file = calloc(1, sizeof(local_file_t));
+  if (!file || !(file->path = strdup(path))) {
+    free(file);
+    return NULL;
+  }
+  file->size = (uint64_t)st->st_size;
+  file->mtime_sec = st->st_mtim.tv_sec;
+  file->mtime_nsec = st->st_mtim.tv_nsec;
+  // Content-defined pieces are only counted once the file is split
+  if (index->chunking.avg_size == 0) {
+    file->pieces_count =
+        (uint32_t)((file->size + index->piece_size - 1) / index->piece_size);
+  }
+
+  index->files[index->files_count++] = file;
+  HASH_ADD_KEYPTR(hh, index->paths, file->path, strlen(file->path), file);
+  return file;
+}
+
+static int walk_entry(const char* path, const struct stat* st, int type,
+                      struct FTW* ftw) {
+  (void)ftw;
+  local_file_t* known = NULL;
+
+  if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) {
+    return 0;
+  }
+  if (k_walk_has_exclude && st->st_dev == k_walk_exclude.st_dev &&
+      st->st_ino == k_walk_exclude.st_ino) {
+    return 0;
+  }
+  uint32_t smallest_piece = k_walk_index->chunking.avg_size
+                                ? k_walk_index->chunking.min_size
+                                : k_walk_index->piece_size;
+  if ((uint64_t)st->st_size / smallest_piece >= UINT32_MAX) {
+    return 0;
+  }
+
+  HASH_FIND_STR(k_walk_index->paths, path, known);
+  if (known) {
+    return 0;  // Loaded from the cache or reached through another directory
+  }
+
+  if (!add_file(k_walk_index, path, st)) {
+    k_walk_failed = 1;
+    return 1;
+  }
+  return 0;
+}
+
+static int hash_file(const local_index_t* index, local_file_t* file) {
+  int fd = open(file->path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  uint8_t* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise(data, file->size, MADV_SEQUENTIAL);
+
+  if (index->chunking.avg_size) {
+    int64_t count =
+        chunker_split(&index->chunking, data, file->size, &file->offsets);
+    if (count < 0) {
+      munmap(data, file->size);
+      return -1;
+    }
+    file->pieces_count = (uint32_t)count;
+  }
+
+  uint8_t* hashes = malloc((size_t)file->pieces_count * index->hash_size);
+  uint8_t* leaves = NULL;
+  if (index->block_size) {
+    leaves = malloc((size_t)(index->piece_size / index->block_size) *
+                    index->hash_size);
+  }
+  int result = hashes && (leaves || !index->block_size) ? 0 : -1;
+
+  // Every core already hashes its own file
+  for (uint32_t i = 0; result == 0 && i < file->pieces_count; i++) {
+    uint64_t offset, length;
+    uint8_t* hash = &hashes[(size_t)i * index->hash_size];
+    piece_range(index, file, i, &offset, &length);
+    result = index->block_size
+                 ? calculate_piece_hash_from_leaves(
+                       index->digest, index->block_size, data + offset,
+                       length, leaves, hash)
+                 : calculate_piece_hash(index->digest, data + offset, length,
+                                        1, hash);
+  }
+
+  munmap(data, file->size);
+  free(leaves);
+  if (result != 0) {
+    free(hashes);
+    free(file->offsets);
+    file->offsets = NULL;
+    return -1;
+  }
+  file->hashes = hashes;
+  return 0;
+}
+
+static void* hash_worker(void* arg) {
+  hash_job_t* job = arg;
+  local_index_t* index = job->index;
+
+  for (;;) {
+    size_t i = atomic_fetch_add(&job->next_file, 1);
+    if (i >= index->files_count) {
+      break;
+    }
+    if (!index->files[i]->hashes && hash_file(index, index->files[i]) != 0) {
+      LOG_ERROR("Failed to index %s", index->files[i]->path);
+    }
+  }
+  return NULL;
+}
+
+static void hash_files(local_index_t* index) {
+  hash_job_t job = {.index = index};
+  atomic_init(&job.next_file, 0);
+  worker_pool_run(hash_worker, &job);
+}
+
+/**
+ * @brief Reads the pieces of one cached file, with their boundaries when
+ * chunked.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int load_cached_pieces(const local_index_t* index, local_file_t* entry,
+                              FILE* file) {
+  size_t hashes_size = (size_t)entry->pieces_count * index->hash_size;
+
+  if (index->chunking.avg_size) {
+    size_t offsets_count = (size_t)entry->pieces_count + 1;
+    entry->offsets = malloc(offsets_count * sizeof(uint64_t));
+    if (!entry->offsets ||
+        fread(entry->offsets, sizeof(uint64_t), offsets_count, file) !=
+            offsets_count ||
+        entry->offsets[0] != 0 ||
+        entry->offsets[entry->pieces_count] != entry->size) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < entry->pieces_count; i++) {
+      if (entry->offsets[i + 1] <= entry->offsets[i] ||
+          entry->offsets[i + 1] - entry->offsets[i] > index->piece_size) {
+        return -1;
+      }
+    }
+  }
+
+  entry->hashes = malloc(hashes_size);
+  if (!entry->hashes ||
+      fread(entry->hashes, 1, hashes_size, file) != hashes_size) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Loads hashes of files that did not change since the cache was saved.
+ */
+static void load_cache(local_index_t* index, const char* cache_path) {
+  FILE* file = fopen(cache_path, "rb");
+  if (!file) {
+    return;
+  }
+
+  char magic[INDEX_CACHE_MAGIC_SIZE];
+  uint32_t digest, piece_size, hash_size, block_size, chunk_min_size,
+      chunk_avg_size;
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, INDEX_CACHE_MAGIC, sizeof(magic)) != 0 ||
+      fread(&digest, sizeof(digest), 1, file) != 1 ||
+      fread(&piece_size, sizeof(piece_size), 1, file) != 1 ||
+      fread(&hash_size, sizeof(hash_size), 1, file) != 1 ||
+      fread(&block_size, sizeof(block_size), 1, file) != 1 ||
+      fread(&chunk_min_size, sizeof(chunk_min_size), 1, file) != 1 ||
+      fread(&chunk_avg_size, sizeof(chunk_avg_size), 1, file) != 1 ||
+      digest != index->digest || piece_size != index->piece_size ||
+      hash_size != index->hash_size || block_size != index->block_size ||
+      chunk_min_size != index->chunking.min_size ||
+      chunk_avg_size != index->chunking.avg_size) {
+    fclose(file);
+    return;
+  }
+
+  for (;;) {
+    uint32_t path_length, pieces;
+    char path[PATH_MAX];
+    struct stat st;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t size;
+
+    if (fread(&path_length, sizeof(path_length), 1, file) != 1 ||
+        path_length == 0 || path_length >= PATH_MAX ||
+        fread(path, 1, path_length, file) != path_length ||
+        fread(&size, sizeof(size), 1, file) != 1 ||
+        fread(&mtime_sec, sizeof(mtime_sec), 1, file) != 1 ||
+        fread(&mtime_nsec, sizeof(mtime_nsec), 1, file) != 1 ||
+        fread(&pieces, sizeof(pieces), 1, file) != 1) {
+      break;
+    }
+    path[path_length] = '\0';
+
+    // Every content-defined piece holds at least one byte
+    if (chunk_avg_size ? pieces > size
+                       : pieces != (size + piece_size - 1) / piece_size) {
+      break;
+    }
+
+    uint64_t record_size = (uint64_t)pieces * hash_size;
+    if (chunk_avg_size) {
+      record_size += ((uint64_t)pieces + 1) * sizeof(uint64_t);
+    }
+    local_file_t* known = NULL;
+    HASH_FIND_STR(index->paths, path, known);
+
+    if (known || stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != size || st.st_mtim.tv_sec != mtime_sec ||
+        st.st_mtim.tv_nsec != mtime_nsec) {
+      if (fseek(file, (long)record_size, SEEK_CUR) != 0) {
+        break;
+      }
+      continue;
+    }
+
+    local_file_t* entry = add_file(index, path, &st);
+    if (!entry) {
+      break;
+    }
+    entry->pieces_count = pieces;
+    if (load_cached_pieces(index, entry, file) != 0) {
+      // Hashed again from the file
+      free(entry->hashes);
+      entry->hashes = NULL;
+      free(entry->offsets);
+      entry->offsets = NULL;
+      break;
+    }
+  }
+
+  fclose(file);
+}
+
+static void save_cache(const local_index_t* index, const char* cache_path) {
+  char tmp_path[PATH_MAX + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+
+  FILE* file = fopen(tmp_path, "wb");
+  if (!file) {
+    LOG_ERROR("Failed to save index cache: %s", strerror(errno));
+    return;
+  }
+
+  uint32_t digest = index->digest;
+  fwrite(INDEX_CACHE_MAGIC, 1, INDEX_CACHE_MAGIC_SIZE, file);
+  fwrite(&digest, sizeof(digest), 1, file);
+  fwrite(&index->piece_size, sizeof(index->piece_size), 1, file);
+  fwrite(&index->hash_size, sizeof(index->hash_size), 1, file);
+  fwrite(&index->block_size, sizeof(index->block_size), 1, file);
+  fwrite(&index->chunking.min_size, sizeof(index->chunking.min_size), 1,
+         file);
+  fwrite(&index->chunking.avg_size, sizeof(index->chunking.avg_size), 1,
+         file);
+
+  for (size_t i = 0; i < index->files_count; i++) {
+    const local_file_t* entry = index->files[i];
+    uint32_t path_length = (uint32_t)strlen(entry->path);
+    if (!entry->hashes) {
+      continue;
+    }
+
+    fwrite(&path_length, sizeof(path_length), 1, file);
+    fwrite(entry->path, 1, path_length, file);
+    fwrite(&entry->size, sizeof(entry->size), 1, file);
+    fwrite(&entry->mtime_sec, sizeof(entry->mtime_sec), 1, file);
+    fwrite(&entry->mtime_nsec, sizeof(entry->mtime_nsec), 1, file);
+    fwrite(&entry->pieces_count, sizeof(entry->pieces_count), 1, file);
+    if (entry->offsets) {
+      fwrite(entry->offsets, sizeof(uint64_t), entry->pieces_count + 1, file);
+    }
+    fwrite(entry->hashes, index->hash_size, entry->pieces_count, file);
+  }
+
+  if (fclose(file) != 0 || rename(tmp_path, cache_path) != 0) {
+    LOG_ERROR("Failed to save index cache: %s", strerror(errno));
+    remove(tmp_path);
+  }
+}
+
+static int index_pieces(local_index_t* index) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < index->files_count; i++) {
+    if (index->files[i]->hashes) {
+      total += index->files[i]->pieces_count;
+    }
+  }
+
+  index->entries = calloc(total + 1, sizeof(local_piece_t));
+  if (!index->entries) {
+    return -1;
+  }
+
+  local_piece_t* entry = index->entries;
+  for (size_t i = 0; i < index->files_count; i++) {
+    const local_file_t* file = index->files[i];
+    for (uint32_t p = 0; file->hashes && p < file->pieces_count; p++) {
+      local_piece_t* known = NULL;
+      const uint8_t* hash = &file->hashes[(size_t)p * index->hash_size];
+
+      HASH_FIND(hh, index->pieces, hash, index->hash_size, known);
+      if (known) {
+        continue;
+      }
+      entry->hash = hash;
+      entry->file = (uint32_t)i;
+      entry->piece = p;
+      HASH_ADD_KEYPTR(hh, index->pieces, entry->hash, index->hash_size,
+                      entry);
+      entry++;
+    }
+  }
+  return 0;
+}
+
+local_index_t* local_index_build(const eltextorrent_file_t* torrent,
+                                 const char (*dirs)[PATH_MAX], int dirs_count,
+                                 const char* cache_path,
+                                 const char* exclude_path) {
+  if (!torrent || !dirs) {
+    return NULL;
+  }
+
+  local_index_t* index = calloc(1, sizeof(local_index_t));
+  if (!index) {
+    return NULL;
+  }
+  index->digest = torrent->digest;
+  index->piece_size = torrent->piece_size;
+  index->hash_size = torrent->hash_size;
+  if (piece_hash_from_leaves(torrent)) {
+    index->block_size = torrent->block_size;
+  }
+  if (torrent->pieces_offsets) {
+    index->chunking.min_size = torrent->chunk_min_size;
+    index->chunking.avg_size = torrent->chunk_avg_size;
+    index->chunking.max_size = torrent->piece_size;
+  }
+
+  if (cache_path) {
+    load_cache(index, cache_path);
+  }
+
+  k_walk_index = index;
+  k_walk_failed = 0;
+  k_walk_has_exclude = exclude_path && stat(exclude_path, &k_walk_exclude) == 0;
+  for (int i = 0; i < dirs_count && !k_walk_failed; i++) {
+    if (nftw(dirs[i], walk_entry, WALK_MAX_FDS, FTW_PHYS) == -1) {
+      LOG_ERROR("Failed to scan %s", dirs[i]);
+    }
+  }
+  k_walk_index = NULL;
+
+  if (k_walk_failed) {
+    local_index_free(index);
+    return NULL;
+  }
+
+  hash_files(index);
+
+  if (cache_path) {
+    save_cache(index, cache_path);
+  }
+  if (index_pieces(index) != 0) {
+    local_index_free(index);
+    return NULL;
+  }
+  return index;
+}
+
+int64_t local_index_fill(const local_index_t* index,
+                         const eltextorrent_file_t* torrent,
+                         const uint8_t* needed_pieces, uint8_t* filled,
+                         uint64_t* reflinked) {
+  if (!index || !torrent || !needed_pieces || !filled ||
+      index->digest != torrent->digest ||
+      index->piece_size != torrent->piece_size ||
+      index->block_size !=
+          (piece_hash_from_leaves(torrent) ? torrent->block_size : 0) ||
+      index->chunking.avg_size != torrent->chunk_avg_size) {
+    return -1;
+  }
+
+  uint8_t* buffer = malloc(torrent->piece_size);
+  if (!buffer) {
+    return -1;
+  }
+
+  int64_t count = 0;
+  int src_fd = -1;
+  uint32_t src_file = UINT32_MAX;
+  if (reflinked) {
+    *reflinked = 0;
+  }
+
+  for (uint64_t i = 0; i < torrent->pieces_count; i++) {
+    local_piece_t* found = NULL;
+    if (!get_bit(needed_pieces, i)) {
+      continue;
+    }
+
+    HASH_FIND(hh, index->pieces, &torrent->pieces_hashes[i * index->hash_size],
+              index->hash_size, found);
+    if (!found) {
+      continue;
+    }
+
+    const local_file_t* file = index->files[found->file];
+    uint64_t src_offset, src_length;
+    piece_range(index, file, found->piece, &src_offset, &src_length);
+    uint32_t length = torrent_piece_length(torrent, i);
+    if (src_length != length) {
+      continue;
+    }
+
+    if (found->file != src_file) {
+      if (src_fd != -1) {
+        close(src_fd);
+      }
+      src_file = found->file;
+      src_fd = open(file->path, O_RDONLY);
+    }
+
+    // The file may have changed since it was indexed
+    if (src_fd == -1 ||
+        pread(src_fd, buffer, length, (off_t)src_offset) != (ssize_t)length ||
+        !verify_piece_hash((eltextorrent_file_t*)torrent, buffer, length,
+                           (int)i, 0)) {
+      continue;
+    }
+
+    uint64_t offset = torrent_piece_offset(torrent, i);
+    int cloned = clone_range_to_file(offset, src_fd, src_offset, length);
+    if (cloned < 0 && write_range_to_file(offset, buffer, length) != 0) {
+      continue;
+    }
+
+    if (cloned == 1 && reflinked) {
+      (*reflinked)++;
+    }
+    filled[i] = 1;
+    count++;
+  }
+
+  if (src_fd != -1) {
+    close(src_fd);
+  }
+  free(buffer);
+  return count;
+}
+
+void local_index_free(local_index_t* index) {
+  if (!index) {
+    return;
+  }
+
+  HASH_CLEAR(hh, index->pieces);
+  HASH_CLEAR(hh, index->paths);
+  for (size_t i = 0; i < index->files_count; i++) {
+    free(index->files[i]->path);
+    free(index->files[i]->hashes);
+    free(index->files[i]->offsets);
+    free(index->files[i]);
+  }
+  free(index->files);
+  free(index->entries);
+  free(index);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file local_index.h
+ * @brief Index of piece hashes over local directories.
+ *
+ * Every regular file under the configured directories is split into pieces
+ * the way the torrent is, at fixed offsets or at content-defined boundaries,
+ * and hashed with its digest. Needed pieces found in
+ * the index are filled from disk with a reflink or copy_file_range() instead
+ * of the network, so content shared between torrents is downloaded once and,
+ * where the filesystem supports reflinks, stored once.
+ *
+ * The hashes can be kept in a cache file. Files whose size and modification
+ * time did not change since are not read again.
+ */
+
+#ifndef FILE_LOCAL_INDEX_H_
+#define FILE_LOCAL_INDEX_H_
+
+#include <linux/limits.h>
+#include <stdint.h>
+
+#include "../bit_torrent.h"
+
+typedef struct local_index local_index_t;
+
+/**
+ * @brief Build the index for the pieces of a torrent
+ *
+ * @param torrent Torrent whose digest and piece size are indexed
+ * @param dirs Directories to scan recursively
+ * @param dirs_count Number of directories
+ * @param cache_path Cache file to load and update, or NULL
+ * @param exclude_path File to leave out, usually the download target
+ * @return Index on success or NULL on error
+ */
+local_index_t* local_index_build(const eltextorrent_file_t* torrent,
+                                 const char (*dirs)[PATH_MAX], int dirs_count,
+                                 const char* cache_path,
+                                 const char* exclude_path);
+
+/**
+ * @brief Fill needed pieces from indexed files
+ *
+ * Data is checked against the piece hash before it is used, so a file that
+ * changed after indexing is never trusted.
+ *
+ * @param index Index built for this torrent
+ * @param torrent Torrent being downloaded
+ * @param needed_pieces Bitfield of pieces still needed
+ * @param filled Output array of pieces_count bytes, set to `1` for every
+ * filled piece
+ * @param reflinked Output parameter for pieces that share extents
+ * @return Number of filled pieces or `-1` on error
+ *
+ * @note The file assembler must be initialized before this call.
+ */
+int64_t local_index_fill(const local_index_t* index,
+                         const eltextorrent_file_t* torrent,
+                         const uint8_t* needed_pieces, uint8_t* filled,
+                         uint64_t* reflinked);
+
+/**
+ * @brief Free the index
+ * @param index Index to free, may be NULL
+ */
+void local_index_free(local_index_t* index);
+
+#endif  // FILE_LOCAL_INDEX_H_
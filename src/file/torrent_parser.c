@@ -1,8 +1,16 @@
 #include "torrent_parser.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "../common/log.h"
+#include "../hash/digest.h"
+#include "../hash/hash.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_FILE);
 
 void torrent_free(eltextorrent_file_t* torrent) {
   if (torrent) {
@@ -18,22 +26,291 @@ void torrent_free(eltextorrent_file_t* torrent) {
     torrent->piece_size = 0;
     torrent->pieces_count = 0;
     torrent->pieces_hashes = NULL;
+
+    free(torrent->blocks_hashes);
+    torrent->blocks_hashes = NULL;
+    torrent->block_size = 0;
+    torrent->blocks_count = 0;
+    memset(torrent->merkle_root, 0, DIGEST_MAX_SIZE);
+    torrent->digest = DIGEST_SHA1;
+    torrent->hash_size = 0;
+
+    free(torrent->pieces_offsets);
+    torrent->pieces_offsets = NULL;
+    torrent->chunk_min_size = 0;
+    torrent->chunk_avg_size = 0;
+  }
+}
+
+uint64_t torrent_piece_offset(const eltextorrent_file_t* torrent,
+                              uint64_t piece_index) {
+  if (torrent->pieces_offsets) {
+    return piece_index < torrent->pieces_count
+               ? torrent->pieces_offsets[piece_index]
+               : torrent->file_size;
+  }
+  return piece_index * torrent->piece_size;
+}
+
+uint32_t torrent_piece_length(const eltextorrent_file_t* torrent,
+                              uint64_t piece_index) {
+  if (piece_index >= torrent->pieces_count) {
+    return 0;
+  }
+  if (torrent->pieces_offsets) {
+    return (uint32_t)(torrent->pieces_offsets[piece_index + 1] -
+                      torrent->pieces_offsets[piece_index]);
+  }
+
+  uint64_t remaining =
+      torrent->file_size - torrent_piece_offset(torrent, piece_index);
+  return remaining < torrent->piece_size ? (uint32_t)remaining
+                                         : torrent->piece_size;
+}
+
+uint32_t torrent_block_length(const eltextorrent_file_t* torrent,
+                              uint64_t block_index) {
+  if (block_index >= torrent->blocks_count) {
+    return 0;
+  }
+
+  uint64_t remaining = torrent->file_size - block_index * torrent->block_size;
+  return remaining < torrent->block_size ? (uint32_t)remaining
+                                         : torrent->block_size;
+}
+
+/**
+ * @brief Checks that the piece size and count describe the file.
+ *
+ * Chunked torrents only bound the count here, their pieces are checked when
+ * the chunks section is loaded.
+ *
+ * @return If valid, returns 0.  It returns -1 otherwise.
+ */
+static int check_pieces(const eltextorrent_file_t* torrent, int chunked) {
+  uint32_t size = torrent->piece_size;
+  uint64_t min_count = (torrent->file_size + size - 1) / size;
+
+  if (size < PIECE_SIZE_MIN || size > PIECE_SIZE_MAX ||
+      (size & (size - 1)) != 0 ||
+      (!chunked && torrent->pieces_count != min_count) ||
+      (chunked && (torrent->pieces_count < min_count ||
+                   torrent->pieces_count > torrent->file_size))) {
+    LOG_ERROR("Invalid piece size %u or count %u", size, torrent->pieces_count);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads the optional versioned header.
+ *
+ * Torrents without the magic prefix use the original layout hashed with SHA1.
+ *
+ * @param torrent Torrent structure to fill in.
+ * @param file Torrent file positioned at its start.
+ * @param version Output parameter for the format version.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int load_header(eltextorrent_file_t* torrent, FILE* file,
+                       uint32_t* version) {
+  char magic[TORRENT_MAGIC_SIZE];
+
+  if (fread(magic, 1, TORRENT_MAGIC_SIZE, file) != TORRENT_MAGIC_SIZE) {
+    return -1;
+  }
+
+  if (memcmp(magic, TORRENT_MAGIC, TORRENT_MAGIC_SIZE) != 0) {
+    rewind(file);
+    torrent->digest = DIGEST_SHA1;
+    *version = TORRENT_VERSION_LEGACY;
+  } else if (fread(version, 1, sizeof(*version), file) != sizeof(*version) ||
+             fread(&torrent->digest, 1, sizeof(torrent->digest), file) !=
+                 sizeof(torrent->digest)) {
+    return -1;
+  } else if (*version > TORRENT_VERSION_LEAVES) {
+    LOG_ERROR("Unsupported torrent version %u", *version);
+    return -1;
+  }
+
+  torrent->hash_size = digest_size(torrent->digest);
+  if (torrent->hash_size == 0) {
+    LOG_ERROR("Unknown digest algorithm %u", torrent->digest);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Loads the Merkle section and checks its leaves against the root.
+ *
+ * @param torrent Torrent structure with the base fields already loaded.
+ * @param file Torrent file positioned at the section payload.
+ * @param length Payload length in bytes.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int load_merkle(eltextorrent_file_t* torrent, FILE* file,
+                       uint64_t length) {
+  if (fread(&torrent->block_size, 1, sizeof(torrent->block_size), file) !=
+          sizeof(torrent->block_size) ||
+      fread(&torrent->blocks_count, 1, sizeof(torrent->blocks_count), file) !=
+          sizeof(torrent->blocks_count) ||
+      fread(torrent->merkle_root, 1, torrent->hash_size, file) !=
+          torrent->hash_size) {
+    return -1;
+  }
+
+  uint64_t leaves_size = (uint64_t)torrent->blocks_count * torrent->hash_size;
+  if (torrent->block_size == 0 ||
+      torrent->piece_size % torrent->block_size != 0 ||
+      torrent->blocks_count != (torrent->file_size + torrent->block_size - 1) /
+                                   torrent->block_size ||
+      length != sizeof(uint32_t) * 2 + torrent->hash_size + leaves_size) {
+    LOG_ERROR("Malformed Merkle section");
+    return -1;
   }
+
+  torrent->blocks_hashes = malloc(leaves_size);
+  if (!torrent->blocks_hashes) {
+    LOG_ERROR("Malloc failed in load_merkle: %s", strerror(errno));
+    return -1;
+  }
+  if (fread(torrent->blocks_hashes, 1, leaves_size, file) != leaves_size) {
+    return -1;
+  }
+
+  if (!verify_merkle_root(torrent)) {
+    LOG_ERROR("Block hashes do not match the Merkle root");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Loads the boundaries of content-defined pieces.
+ *
+ * The payload is {min_size, avg_size} followed by an {offset, length} pair
+ * per piece. Pieces must follow each other without gaps, fit in piece_size
+ * and cover the whole file.
+ *
+ * @param torrent Torrent structure with the base fields already loaded.
+ * @param file Torrent file positioned at the section payload.
+ * @param length Payload length in bytes.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int load_chunks(eltextorrent_file_t* torrent, FILE* file,
+                       uint64_t length) {
+  uint64_t entry_size = sizeof(uint64_t) + sizeof(uint32_t);
+
+  if (torrent->pieces_offsets ||
+      length != sizeof(uint32_t) * 2 + torrent->pieces_count * entry_size ||
+      fread(&torrent->chunk_min_size, 1, sizeof(torrent->chunk_min_size),
+            file) != sizeof(torrent->chunk_min_size) ||
+      fread(&torrent->chunk_avg_size, 1, sizeof(torrent->chunk_avg_size),
+            file) != sizeof(torrent->chunk_avg_size) ||
+      torrent->chunk_min_size == 0 ||
+      torrent->chunk_min_size > torrent->chunk_avg_size ||
+      torrent->chunk_avg_size > torrent->piece_size) {
+    LOG_ERROR("Malformed chunks section");
+    return -1;
+  }
+
+  torrent->pieces_offsets =
+      malloc(((size_t)torrent->pieces_count + 1) * sizeof(uint64_t));
+  if (!torrent->pieces_offsets) {
+    LOG_ERROR("Malloc failed in load_chunks: %s", strerror(errno));
+    return -1;
+  }
+
+  uint64_t expected = 0;
+  for (uint32_t i = 0; i < torrent->pieces_count; i++) {
+    uint64_t offset;
+    uint32_t piece_length;
+
+    if (fread(&offset, 1, sizeof(offset), file) != sizeof(offset) ||
+        fread(&piece_length, 1, sizeof(piece_length), file) !=
+            sizeof(piece_length)) {
+      return -1;
+    }
+    if (offset != expected || piece_length == 0 ||
+        piece_length > torrent->piece_size) {
+      LOG_ERROR("Invalid piece %u at offset %lu", i, offset);
+      return -1;
+    }
+    torrent->pieces_offsets[i] = offset;
+    expected = offset + piece_length;
+  }
+  torrent->pieces_offsets[torrent->pieces_count] = expected;
+
+  if (expected != torrent->file_size) {
+    LOG_ERROR("Pieces do not cover the file");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Loads the optional sections that follow the piece hashes.
+ *
+ * Each section is a {uint32_t type, uint64_t length, payload} record. Unknown
+ * types are skipped so older clients can read newer torrents.
+ *
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int load_extensions(eltextorrent_file_t* torrent, FILE* file) {
+  uint32_t type;
+  uint64_t length;
+
+  while (fread(&type, 1, sizeof(type), file) == sizeof(type)) {
+    if (fread(&length, 1, sizeof(length), file) != sizeof(length)) {
+      return -1;
+    }
+
+    switch (type) {
+      case TORRENT_EXT_MERKLE:
+        if (load_merkle(torrent, file, length) < 0) {
+          return -1;
+        }
+        break;
+      case TORRENT_EXT_CHUNKS:
+        if (load_chunks(torrent, file, length) < 0) {
+          return -1;
+        }
+        break;
+      default:
+        if (fseek(file, (long)length, SEEK_CUR) != 0) {
+          return -1;
+        }
+        break;
+    }
+  }
+
+  return feof(file) ? 0 : -1;
 }
 
 int torrent_loader(eltextorrent_file_t* torrent, const char* torrent_filename) {
   if (!torrent || !torrent_filename) {
-    fprintf(stderr, "Error: Invalid parameters\n");
+    LOG_ERROR("Invalid parameters");
     return -1;
   }
   FILE* file = NULL;
+  uint32_t version;
   file = fopen(torrent_filename, "rb");
   if (!file) {
-    perror("fopen failed in torrent_load");
+    LOG_ERROR("fopen failed in torrent_load: %s", strerror(errno));
     return -1;
   }
   torrent_free(torrent);
 
+  if (load_header(torrent, file, &version) < 0) {
+    goto fread_error;
+  }
+  torrent->version = version;
   if (fread(torrent->infohash, 1, HASH_SIZE, file) != HASH_SIZE) {
     goto fread_error;
   }
@@ -52,15 +329,31 @@ int torrent_loader(eltextorrent_file_t* torrent, const char* torrent_filename) {
       sizeof(torrent->pieces_count)) {
     goto fread_error;
   }
+  int chunked = version == TORRENT_VERSION_CHUNKED;
+  if (check_pieces(torrent, chunked) < 0) {
+    goto fread_error;
+  }
 
-  torrent->pieces_hashes = malloc(torrent->pieces_count * HASH_SIZE);
+  size_t hashes_size = (size_t)torrent->pieces_count * torrent->hash_size;
+  torrent->pieces_hashes = malloc(hashes_size);
   if (!torrent->pieces_hashes) {
-    perror("Malloc failed in torrent_loader.");
+    LOG_ERROR("Malloc failed in torrent_loader: %s", strerror(errno));
     fclose(file);
     return -1;
   }
-  if (fread(torrent->pieces_hashes, 1, torrent->pieces_count * HASH_SIZE,
-            file) != torrent->pieces_count * HASH_SIZE) {
+  if (fread(torrent->pieces_hashes, 1, hashes_size, file) != hashes_size) {
+    goto fread_error;
+  }
+  if (load_extensions(torrent, file) < 0) {
+    goto fread_error;
+  }
+  // Merkle blocks assume pieces made of whole blocks, and pieces hashed
+  // from their leaves need the leaves
+  if (chunked != (torrent->pieces_offsets != NULL) ||
+      (chunked && torrent->blocks_hashes) ||
+      (version == TORRENT_VERSION_LEAVES && torrent->pieces_count > 0 &&
+       !torrent->blocks_hashes)) {
+    LOG_ERROR("Invalid sections for torrent version %u", version);
     goto fread_error;
   }
 
@@ -68,7 +361,7 @@ int torrent_loader(eltextorrent_file_t* torrent, const char* torrent_filename) {
   return 0;
 
 fread_error:
-  perror("fread failed in torrent_loader");
+  LOG_ERROR("fread failed in torrent_loader: %s", strerror(errno));
   torrent_free(torrent);
   fclose(file);
   return -1;
@@ -3,8 +3,6 @@
 
 #include "../bit_torrent.h"
 
-#define PIECE_SIZE_64KB (64 * 1024)
-
 /**
  * @brief Frees and resets torrent structure resources.
  *
@@ -20,11 +18,48 @@ void torrent_free(eltextorrent_file_t* torrent);
  *
  * @return If successful, returns 0.  It returns -1 on failure.
  *
- * @note This function allocates memory for torrent->pieces_hashes.
+ * @note This function allocates memory for torrent->pieces_hashes and, for
+ * chunked torrents, torrent->pieces_offsets.
  * @warning Caller must call torrent_free() to avoid memory leaks.
  *
  * @note This function cleans the torrent structure before loading.
  */
 int torrent_loader(eltextorrent_file_t* torrent, const char* torrent_filename);
 
+/**
+ * @brief Offset of a piece within the shared file.
+ *
+ * @param torrent Pointer to the loaded torrent structure.
+ * @param piece_index Zero-based index of the piece.
+ *
+ * @return Offset of the first byte of the piece.
+ */
+uint64_t torrent_piece_offset(const eltextorrent_file_t* torrent,
+                              uint64_t piece_index);
+
+/**
+ * @brief Length of a piece.
+ *
+ * Fixed pieces are shorter than piece_size only for the last one, pieces of
+ * chunked torrents have any length up to piece_size.
+ *
+ * @param torrent Pointer to the loaded torrent structure.
+ * @param piece_index Zero-based index of the piece.
+ *
+ * @return Length of the piece in bytes, 0 if the index is out of range.
+ */
+uint32_t torrent_piece_length(const eltextorrent_file_t* torrent,
+                              uint64_t piece_index);
+
+/**
+ * @brief Length of a Merkle block, shorter than block_size only for the last.
+ *
+ * @param torrent Pointer to the loaded torrent structure.
+ * @param block_index Zero-based index of the block.
+ *
+ * @return Length of the block in bytes, 0 if the index is out of range.
+ */
+uint32_t torrent_block_length(const eltextorrent_file_t* torrent,
+                              uint64_t block_index);
+
 #endif  // TORRENT_PARSER_H_
\ No newline at end of file
@@ -0,0 +1,735 @@
+#include "blake3.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLAKE3_X86
+#endif
+
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+/* Subtrees smaller than this are not worth a thread of their own */
+#define PARALLEL_MIN_SUBTREE (64 * BLAKE3_CHUNK_LEN)
+/* Chunks hashed side by side by the widest SIMD path */
+#define SIMD_MAX_CHUNKS 8
+#define CHUNK_BLOCKS (BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN)
+
+static const uint32_t k_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                                 0xA54FF53A, 0x510E527F, 0x9B05688C,
+                                 0x1F83D9AB, 0x5BE0CD19};
+
+static const uint8_t k_msg_permutation[16] = {2, 6,  3,  10, 7, 0,  4,  13,
+                                              1, 11, 12, 5,  9, 14, 15, 8};
+
+/* Message words of each round, k_msg_permutation applied round after round */
+static const uint8_t k_msg_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+/**
+ * @brief Input of a compression whose result is not needed yet.
+ *
+ * Kept unevaluated until it is known whether the node is the root, which
+ * has to be compressed with the ROOT flag.
+ */
+typedef struct {
+  uint32_t input_cv[8];
+  uint32_t block_words[16];
+  uint64_t counter;
+  uint32_t block_len;
+  uint32_t flags;
+} output_t;
+
+static inline uint32_t rotr32(uint32_t w, uint32_t c) {
+  return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t load32(const uint8_t* src) {
+  return (uint32_t)src[0] | ((uint32_t)src[1] << 8) |
+         ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static inline void store32(uint8_t* dst, uint32_t w) {
+  dst[0] = (uint8_t)w;
+  dst[1] = (uint8_t)(w >> 8);
+  dst[2] = (uint8_t)(w >> 16);
+  dst[3] = (uint8_t)(w >> 24);
+}
+
+static void words_from_bytes(const uint8_t* bytes, uint32_t* words,
+                             size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    words[i] = load32(&bytes[i * 4]);
+  }
+}
+
+static inline void g(uint32_t* state, int a, int b, int c, int d, uint32_t mx,
+                     uint32_t my) {
+  state[a] = state[a] + state[b] + mx;
+  state[d] = rotr32(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = rotr32(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + my;
+  state[d] = rotr32(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+static void round_fn(uint32_t* state, const uint32_t* m) {
+  g(state, 0, 4, 8, 12, m[0], m[1]);
+  g(state, 1, 5, 9, 13, m[2], m[3]);
+  g(state, 2, 6, 10, 14, m[4], m[5]);
+  g(state, 3, 7, 11, 15, m[6], m[7]);
+  g(state, 0, 5, 10, 15, m[8], m[9]);
+  g(state, 1, 6, 11, 12, m[10], m[11]);
+  g(state, 2, 7, 8, 13, m[12], m[13]);
+  g(state, 3, 4, 9, 14, m[14], m[15]);
+}
+
+static void permute(uint32_t* m) {
+  uint32_t permuted[16];
+  for (int i = 0; i < 16; i++) {
+    permuted[i] = m[k_msg_permutation[i]];
+  }
+  memcpy(m, permuted, sizeof(permuted));
+}
+
+static void compress(const uint32_t* cv, const uint32_t* block_words,
+                     uint64_t counter, uint32_t block_len, uint32_t flags,
+                     uint32_t* out) {
+  uint32_t state[16] = {cv[0],
+                        cv[1],
+                        cv[2],
+                        cv[3],
+                        cv[4],
+                        cv[5],
+                        cv[6],
+                        cv[7],
+                        k_iv[0],
+                        k_iv[1],
+                        k_iv[2],
+                        k_iv[3],
+                        (uint32_t)counter,
+                        (uint32_t)(counter >> 32),
+                        block_len,
+                        flags};
+  uint32_t block[16];
+  memcpy(block, block_words, sizeof(block));
+
+  for (int r = 0; r < 7; r++) {
+    round_fn(state, block);
+    if (r < 6) {
+      permute(block);
+    }
+  }
+
+  for (int i = 0; i < 8; i++) {
+    state[i] ^= state[i + 8];
+    state[i + 8] ^= cv[i];
+  }
+  memcpy(out, state, sizeof(state));
+}
+
+static void output_chaining_value(const output_t* output, uint32_t* cv) {
+  uint32_t out[16];
+  compress(output->input_cv, output->block_words, output->counter,
+           output->block_len, output->flags, out);
+  memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void output_root_bytes(const output_t* output, uint8_t* output_hash) {
+  uint32_t out[16];
+  compress(output->input_cv, output->block_words, 0, output->block_len,
+           output->flags | ROOT, out);
+  for (int i = 0; i < BLAKE3_OUT_LEN / 4; i++) {
+    store32(&output_hash[i * 4], out[i]);
+  }
+}
+
+static void parent_output(const uint32_t* left_cv, const uint32_t* right_cv,
+                          output_t* output) {
+  memcpy(output->input_cv, k_iv, sizeof(k_iv));
+  memcpy(output->block_words, left_cv, 8 * sizeof(uint32_t));
+  memcpy(&output->block_words[8], right_cv, 8 * sizeof(uint32_t));
+  output->counter = 0;
+  output->block_len = BLAKE3_BLOCK_LEN;
+  output->flags = PARENT;
+}
+
+static void chunk_state_init(blake3_chunk_state_t* chunk,
+                             uint64_t chunk_counter) {
+  memcpy(chunk->cv, k_iv, sizeof(k_iv));
+  chunk->chunk_counter = chunk_counter;
+  memset(chunk->block, 0, sizeof(chunk->block));
+  chunk->block_len = 0;
+  chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_state_len(const blake3_chunk_state_t* chunk) {
+  return (size_t)BLAKE3_BLOCK_LEN * chunk->blocks_compressed + chunk->block_len;
+}
+
+static uint32_t chunk_start_flag(const blake3_chunk_state_t* chunk) {
+  return chunk->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_state_update(blake3_chunk_state_t* chunk,
+                               const uint8_t* input, size_t length) {
+  while (length > 0) {
+    if (chunk->block_len == BLAKE3_BLOCK_LEN) {
+      uint32_t block_words[16];
+      uint32_t out[16];
+      words_from_bytes(chunk->block, block_words, 16);
+      compress(chunk->cv, block_words, chunk->chunk_counter, BLAKE3_BLOCK_LEN,
+               chunk_start_flag(chunk), out);
+      memcpy(chunk->cv, out, sizeof(chunk->cv));
+      chunk->blocks_compressed++;
+      memset(chunk->block, 0, sizeof(chunk->block));
+      chunk->block_len = 0;
+    }
+
+    size_t take = BLAKE3_BLOCK_LEN - chunk->block_len;
+    if (take > length) {
+      take = length;
+    }
+    memcpy(&chunk->block[chunk->block_len], input, take);
+    chunk->block_len += (uint8_t)take;
+    input += take;
+    length -= take;
+  }
+}
+
+static void chunk_state_output(const blake3_chunk_state_t* chunk,
+                               output_t* output) {
+  memcpy(output->input_cv, chunk->cv, sizeof(chunk->cv));
+  words_from_bytes(chunk->block, output->block_words, 16);
+  output->counter = chunk->chunk_counter;
+  output->block_len = chunk->block_len;
+  output->flags = chunk_start_flag(chunk) | CHUNK_END;
+}
+
+/**
+ * @brief Chaining value of a whole chunk that is not the root.
+ */
+static void hash_chunk(const uint8_t* input, uint64_t counter, uint32_t* cv) {
+  blake3_chunk_state_t chunk;
+  output_t output;
+  chunk_state_init(&chunk, counter);
+  chunk_state_update(&chunk, input, BLAKE3_CHUNK_LEN);
+  chunk_state_output(&chunk, &output);
+  output_chaining_value(&output, cv);
+}
+
+#ifdef BLAKE3_X86
+/*
+ * The SIMD paths hash several whole chunks at once, one per lane: vector i
+ * holds word i of the state of every chunk. Message blocks are loaded a row
+ * per chunk and transposed into that layout, the chaining values transposed
+ * back at the end. They are compiled for their instruction set whatever the
+ * target of the build, and only run when the CPU has it.
+ */
+#define AVX2_FN static inline __attribute__((target("avx2"), always_inline))
+#define SSE41_FN static inline __attribute__((target("sse4.1"), always_inline))
+
+AVX2_FN __m256i rotr16_avx2(__m256i x) {
+  return _mm256_shuffle_epi8(
+      x, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                         13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+AVX2_FN __m256i rotr12_avx2(__m256i x) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(x, 20));
+}
+
+AVX2_FN __m256i rotr8_avx2(__m256i x) {
+  return _mm256_shuffle_epi8(
+      x, _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+                         12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+AVX2_FN __m256i rotr7_avx2(__m256i x) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, 7), _mm256_slli_epi32(x, 25));
+}
+
+AVX2_FN void g_avx2(__m256i* v, int a, int b, int c, int d, __m256i mx,
+                    __m256i my) {
+  v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), mx);
+  v[d] = rotr16_avx2(_mm256_xor_si256(v[d], v[a]));
+  v[c] = _mm256_add_epi32(v[c], v[d]);
+  v[b] = rotr12_avx2(_mm256_xor_si256(v[b], v[c]));
+  v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), my);
+  v[d] = rotr8_avx2(_mm256_xor_si256(v[d], v[a]));
+  v[c] = _mm256_add_epi32(v[c], v[d]);
+  v[b] = rotr7_avx2(_mm256_xor_si256(v[b], v[c]));
+}
+
+AVX2_FN void round_avx2(__m256i* v, const __m256i* m, int r) {
+  const uint8_t* s = k_msg_schedule[r];
+  g_avx2(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+  g_avx2(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+  g_avx2(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+  g_avx2(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+  g_avx2(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+  g_avx2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+  g_avx2(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+  g_avx2(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+}
+
+AVX2_FN void transpose_avx2(__m256i* vecs) {
+  __m256i ab_0145 = _mm256_unpacklo_epi32(vecs[0], vecs[1]);
+  __m256i ab_2367 = _mm256_unpackhi_epi32(vecs[0], vecs[1]);
+  __m256i cd_0145 = _mm256_unpacklo_epi32(vecs[2], vecs[3]);
+  __m256i cd_2367 = _mm256_unpackhi_epi32(vecs[2], vecs[3]);
+  __m256i ef_0145 = _mm256_unpacklo_epi32(vecs[4], vecs[5]);
+  __m256i ef_2367 = _mm256_unpackhi_epi32(vecs[4], vecs[5]);
+  __m256i gh_0145 = _mm256_unpacklo_epi32(vecs[6], vecs[7]);
+  __m256i gh_2367 = _mm256_unpackhi_epi32(vecs[6], vecs[7]);
+
+  __m256i abcd_04 = _mm256_unpacklo_epi64(ab_0145, cd_0145);
+  __m256i abcd_15 = _mm256_unpackhi_epi64(ab_0145, cd_0145);
+  __m256i abcd_26 = _mm256_unpacklo_epi64(ab_2367, cd_2367);
+  __m256i abcd_37 = _mm256_unpackhi_epi64(ab_2367, cd_2367);
+  __m256i efgh_04 = _mm256_unpacklo_epi64(ef_0145, gh_0145);
+  __m256i efgh_15 = _mm256_unpackhi_epi64(ef_0145, gh_0145);
+  __m256i efgh_26 = _mm256_unpacklo_epi64(ef_2367, gh_2367);
+  __m256i efgh_37 = _mm256_unpackhi_epi64(ef_2367, gh_2367);
+
+  vecs[0] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x20);
+  vecs[1] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x20);
+  vecs[2] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x20);
+  vecs[3] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x20);
+  vecs[4] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x31);
+  vecs[5] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x31);
+  vecs[6] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x31);
+  vecs[7] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x31);
+}
+
+/**
+ * @brief Chaining values of 8 consecutive whole chunks.
+ */
+__attribute__((target("avx2"))) static void hash8_avx2(const uint8_t* input,
+                                                       uint64_t counter,
+                                                       uint32_t (*cvs)[8]) {
+  uint32_t counter_low[8], counter_high[8];
+  for (int i = 0; i < 8; i++) {
+    counter_low[i] = (uint32_t)(counter + i);
+    counter_high[i] = (uint32_t)((counter + i) >> 32);
+  }
+
+  __m256i h[8];
+  for (int i = 0; i < 8; i++) {
+    h[i] = _mm256_set1_epi32((int)k_iv[i]);
+  }
+
+  for (int b = 0; b < CHUNK_BLOCKS; b++) {
+    __m256i m[16];
+    for (int i = 0; i < 8; i++) {
+      const uint8_t* block =
+          input + i * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN;
+      m[i] = _mm256_loadu_si256((const __m256i*)block);
+      m[i + 8] = _mm256_loadu_si256((const __m256i*)(block + 32));
+    }
+    transpose_avx2(m);
+    transpose_avx2(m + 8);
+
+    uint32_t flags =
+        (b == 0 ? CHUNK_START : 0) | (b == CHUNK_BLOCKS - 1 ? CHUNK_END : 0);
+    __m256i v[16] = {
+        h[0],
+        h[1],
+        h[2],
+        h[3],
+        h[4],
+        h[5],
+        h[6],
+        h[7],
+        _mm256_set1_epi32((int)k_iv[0]),
+        _mm256_set1_epi32((int)k_iv[1]),
+        _mm256_set1_epi32((int)k_iv[2]),
+        _mm256_set1_epi32((int)k_iv[3]),
+        _mm256_loadu_si256((const __m256i*)counter_low),
+        _mm256_loadu_si256((const __m256i*)counter_high),
+        _mm256_set1_epi32(BLAKE3_BLOCK_LEN),
+        _mm256_set1_epi32((int)flags),
+    };
+    for (int r = 0; r < 7; r++) {
+      round_avx2(v, m, r);
+    }
+    for (int i = 0; i < 8; i++) {
+      h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+  }
+
+  transpose_avx2(h);
+  for (int i = 0; i < 8; i++) {
+    _mm256_storeu_si256((__m256i*)cvs[i], h[i]);
+  }
+}
+
+SSE41_FN __m128i rotr16_sse41(__m128i x) {
+  return _mm_shuffle_epi8(
+      x, _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+SSE41_FN __m128i rotr12_sse41(__m128i x) {
+  return _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 20));
+}
+
+SSE41_FN __m128i rotr8_sse41(__m128i x) {
+  return _mm_shuffle_epi8(
+      x, _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+SSE41_FN __m128i rotr7_sse41(__m128i x) {
+  return _mm_or_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 25));
+}
+
+SSE41_FN void g_sse41(__m128i* v, int a, int b, int c, int d, __m128i mx,
+                      __m128i my) {
+  v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), mx);
+  v[d] = rotr16_sse41(_mm_xor_si128(v[d], v[a]));
+  v[c] = _mm_add_epi32(v[c], v[d]);
+  v[b] = rotr12_sse41(_mm_xor_si128(v[b], v[c]));
+  v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), my);
+  v[d] = rotr8_sse41(_mm_xor_si128(v[d], v[a]));
+  v[c] = _mm_add_epi32(v[c], v[d]);
+  v[b] = rotr7_sse41(_mm_xor_si128(v[b], v[c]));
+}
+
+SSE41_FN void round_sse41(__m128i* v, const __m128i* m, int r) {
+  const uint8_t* s = k_msg_schedule[r];
+  g_sse41(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+  g_sse41(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+  g_sse41(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+  g_sse41(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+  g_sse41(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+  g_sse41(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+  g_sse41(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+  g_sse41(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+}
+
+SSE41_FN void transpose_sse41(__m128i* vecs) {
+  __m128i ab_01 = _mm_unpacklo_epi32(vecs[0], vecs[1]);
+  __m128i ab_23 = _mm_unpackhi_epi32(vecs[0], vecs[1]);
+  __m128i cd_01 = _mm_unpacklo_epi32(vecs[2], vecs[3]);
+  __m128i cd_23 = _mm_unpackhi_epi32(vecs[2], vecs[3]);
+  vecs[0] = _mm_unpacklo_epi64(ab_01, cd_01);
+  vecs[1] = _mm_unpackhi_epi64(ab_01, cd_01);
+  vecs[2] = _mm_unpacklo_epi64(ab_23, cd_23);
+  vecs[3] = _mm_unpackhi_epi64(ab_23, cd_23);
+}
+
+/**
+ * @brief Chaining values of 4 consecutive whole chunks.
+ */
+__attribute__((target("sse4.1"))) static void hash4_sse41(
+    const uint8_t* input, uint64_t counter, uint32_t (*cvs)[8]) {
+  uint32_t counter_low[4], counter_high[4];
+  for (int i = 0; i < 4; i++) {
+    counter_low[i] = (uint32_t)(counter + i);
+    counter_high[i] = (uint32_t)((counter + i) >> 32);
+  }
+
+  __m128i h[8];
+  for (int i = 0; i < 8; i++) {
+    h[i] = _mm_set1_epi32((int)k_iv[i]);
+  }
+
+  for (int b = 0; b < CHUNK_BLOCKS; b++) {
+    __m128i m[16];
+    for (int q = 0; q < 4; q++) {
+      for (int i = 0; i < 4; i++) {
+        const uint8_t* block =
+            input + i * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN;
+        m[q * 4 + i] = _mm_loadu_si128((const __m128i*)(block + q * 16));
+      }
+      transpose_sse41(m + q * 4);
+    }
+
+    uint32_t flags =
+        (b == 0 ? CHUNK_START : 0) | (b == CHUNK_BLOCKS - 1 ? CHUNK_END : 0);
+    __m128i v[16] = {
+        h[0],
+        h[1],
+        h[2],
+        h[3],
+        h[4],
+        h[5],
+        h[6],
+        h[7],
+        _mm_set1_epi32((int)k_iv[0]),
+        _mm_set1_epi32((int)k_iv[1]),
+        _mm_set1_epi32((int)k_iv[2]),
+        _mm_set1_epi32((int)k_iv[3]),
+        _mm_loadu_si128((const __m128i*)counter_low),
+        _mm_loadu_si128((const __m128i*)counter_high),
+        _mm_set1_epi32(BLAKE3_BLOCK_LEN),
+        _mm_set1_epi32((int)flags),
+    };
+    for (int r = 0; r < 7; r++) {
+      round_sse41(v, m, r);
+    }
+    for (int i = 0; i < 8; i++) {
+      h[i] = _mm_xor_si128(v[i], v[i + 8]);
+    }
+  }
+
+  transpose_sse41(h);
+  transpose_sse41(h + 4);
+  for (int i = 0; i < 4; i++) {
+    _mm_storeu_si128((__m128i*)cvs[i], h[i]);
+    _mm_storeu_si128((__m128i*)&cvs[i][4], h[i + 4]);
+  }
+}
+#endif  // BLAKE3_X86
+
+/**
+ * @brief Chaining values of consecutive whole chunks, none of them the root.
+ *
+ * Groups of chunks are hashed side by side with the widest SIMD instructions
+ * the CPU has, the rest one by one.
+ */
+static void hash_chunks(const uint8_t* input, size_t chunks, uint64_t counter,
+                        uint32_t (*cvs)[8]) {
+#ifdef BLAKE3_X86
+  if (__builtin_cpu_supports("avx2")) {
+    for (; chunks >= 8; chunks -= 8, counter += 8, cvs += 8) {
+      hash8_avx2(input, counter, cvs);
+      input += 8 * BLAKE3_CHUNK_LEN;
+    }
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    for (; chunks >= 4; chunks -= 4, counter += 4, cvs += 4) {
+      hash4_sse41(input, counter, cvs);
+      input += 4 * BLAKE3_CHUNK_LEN;
+    }
+  }
+#endif
+  for (; chunks > 0; chunks--, counter++, cvs++) {
+    hash_chunk(input, counter, *cvs);
+    input += BLAKE3_CHUNK_LEN;
+  }
+}
+
+void blake3_hasher_init(blake3_hasher_t* hasher) {
+  chunk_state_init(&hasher->chunk, 0);
+  hasher->cv_stack_len = 0;
+}
+
+static void hasher_add_chunk_cv(blake3_hasher_t* hasher, uint32_t* new_cv,
+                                uint64_t total_chunks) {
+  output_t parent;
+
+  // Merge every completed subtree, one per trailing zero bit of the count
+  while ((total_chunks & 1) == 0) {
+    hasher->cv_stack_len--;
+    parent_output(hasher->cv_stack[hasher->cv_stack_len], new_cv, &parent);
+    output_chaining_value(&parent, new_cv);
+    total_chunks >>= 1;
+  }
+
+  memcpy(hasher->cv_stack[hasher->cv_stack_len], new_cv, 8 * sizeof(uint32_t));
+  hasher->cv_stack_len++;
+}
+
+void blake3_hasher_update(blake3_hasher_t* hasher, const void* data,
+                          size_t length) {
+  const uint8_t* input = data;
+
+  while (length > 0) {
+    if (chunk_state_len(&hasher->chunk) == BLAKE3_CHUNK_LEN) {
+      output_t output;
+      uint32_t chunk_cv[8];
+      chunk_state_output(&hasher->chunk, &output);
+      output_chaining_value(&output, chunk_cv);
+
+      uint64_t total_chunks = hasher->chunk.chunk_counter + 1;
+      hasher_add_chunk_cv(hasher, chunk_cv, total_chunks);
+      chunk_state_init(&hasher->chunk, total_chunks);
+    }
+
+    // Whole chunks that more input follows are not the root, they are
+    // hashed side by side. The last one waits in the chunk state.
+    if (chunk_state_len(&hasher->chunk) == 0 && length > BLAKE3_CHUNK_LEN) {
+      uint32_t cvs[SIMD_MAX_CHUNKS][8];
+      size_t chunks = (length - 1) / BLAKE3_CHUNK_LEN;
+      if (chunks > SIMD_MAX_CHUNKS) {
+        chunks = SIMD_MAX_CHUNKS;
+      }
+      uint64_t counter = hasher->chunk.chunk_counter;
+      hash_chunks(input, chunks, counter, cvs);
+      for (size_t i = 0; i < chunks; i++) {
+        hasher_add_chunk_cv(hasher, cvs[i], counter + i + 1);
+      }
+      chunk_state_init(&hasher->chunk, counter + chunks);
+      input += chunks * BLAKE3_CHUNK_LEN;
+      length -= chunks * BLAKE3_CHUNK_LEN;
+      continue;
+    }
+
+    size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&hasher->chunk);
+    if (take > length) {
+      take = length;
+    }
+    chunk_state_update(&hasher->chunk, input, take);
+    input += take;
+    length -= take;
+  }
+}
+
+void blake3_hasher_finalize(const blake3_hasher_t* hasher,
+                            uint8_t* output_hash) {
+  output_t output;
+  chunk_state_output(&hasher->chunk, &output);
+
+  for (size_t i = hasher->cv_stack_len; i > 0; i--) {
+    uint32_t cv[8];
+    output_chaining_value(&output, cv);
+    parent_output(hasher->cv_stack[i - 1], cv, &output);
+  }
+
+  output_root_bytes(&output, output_hash);
+}
+
+/**
+ * @brief Size of the left subtree of a node covering `length` bytes.
+ *
+ * The left subtree always holds the largest power of two number of chunks
+ * that leaves at least one byte for the right subtree.
+ */
+static size_t left_subtree_len(size_t length) {
+  size_t full_chunks = (length - 1) / BLAKE3_CHUNK_LEN;
+  size_t chunks = 1;
+  while (chunks * 2 <= full_chunks) {
+    chunks *= 2;
+  }
+  return chunks * BLAKE3_CHUNK_LEN;
+}
+
+typedef struct {
+  const uint8_t* input;
+  size_t length;
+  uint64_t chunk_counter;
+  unsigned threads;
+  output_t output;
+} subtree_job_t;
+
+/**
+ * @brief Merges the chaining values of `count` chunks, at least two, into
+ * the output of their parent along the BLAKE3 tree.
+ */
+static void merge_cvs(uint32_t (*cvs)[8], size_t count, output_t* output) {
+  size_t left = 1;
+  while (left * 2 < count) {
+    left *= 2;
+  }
+
+  uint32_t left_cv[8], right_cv[8];
+  output_t child;
+  if (left == 1) {
+    memcpy(left_cv, cvs[0], sizeof(left_cv));
+  } else {
+    merge_cvs(cvs, left, &child);
+    output_chaining_value(&child, left_cv);
+  }
+  if (count - left == 1) {
+    memcpy(right_cv, cvs[left], sizeof(right_cv));
+  } else {
+    merge_cvs(cvs + left, count - left, &child);
+    output_chaining_value(&child, right_cv);
+  }
+  parent_output(left_cv, right_cv, output);
+}
+
+/**
+ * @brief Output of a subtree of 2 to SIMD_MAX_CHUNKS chunks, whose whole
+ * chunks are hashed side by side.
+ */
+static void small_subtree_output(subtree_job_t* job) {
+  uint32_t cvs[SIMD_MAX_CHUNKS][8];
+  size_t chunks = job->length / BLAKE3_CHUNK_LEN;
+  size_t tail = job->length % BLAKE3_CHUNK_LEN;
+  hash_chunks(job->input, chunks, job->chunk_counter, cvs);
+
+  if (tail > 0) {
+    blake3_chunk_state_t chunk;
+    output_t output;
+    chunk_state_init(&chunk, job->chunk_counter + chunks);
+    chunk_state_update(&chunk, job->input + chunks * BLAKE3_CHUNK_LEN, tail);
+    chunk_state_output(&chunk, &output);
+    output_chaining_value(&output, cvs[chunks]);
+    chunks++;
+  }
+  merge_cvs(cvs, chunks, &job->output);
+}
+
+static void* subtree_output(void* arg) {
+  subtree_job_t* job = arg;
+
+  if (job->length <= BLAKE3_CHUNK_LEN) {
+    blake3_chunk_state_t chunk;
+    chunk_state_init(&chunk, job->chunk_counter);
+    chunk_state_update(&chunk, job->input, job->length);
+    chunk_state_output(&chunk, &job->output);
+    return NULL;
+  }
+  if (job->length <= SIMD_MAX_CHUNKS * BLAKE3_CHUNK_LEN) {
+    small_subtree_output(job);
+    return NULL;
+  }
+
+  size_t left_len = left_subtree_len(job->length);
+  unsigned left_threads = job->threads / 2;
+  subtree_job_t left = {
+      .input = job->input,
+      .length = left_len,
+      .chunk_counter = job->chunk_counter,
+      .threads = left_threads > 0 ? left_threads : 1,
+  };
+  subtree_job_t right = {
+      .input = job->input + left_len,
+      .length = job->length - left_len,
+      .chunk_counter = job->chunk_counter + left_len / BLAKE3_CHUNK_LEN,
+      .threads = job->threads - left_threads,
+  };
+
+  pthread_t worker;
+  int spawned = job->threads > 1 && left_len >= PARALLEL_MIN_SUBTREE &&
+                pthread_create(&worker, NULL, subtree_output, &left) == 0;
+
+  subtree_output(&right);
+  if (spawned) {
+    pthread_join(worker, NULL);
+  } else {
+    subtree_output(&left);
+  }
+
+  uint32_t left_cv[8], right_cv[8];
+  output_chaining_value(&left.output, left_cv);
+  output_chaining_value(&right.output, right_cv);
+  parent_output(left_cv, right_cv, &job->output);
+  return NULL;
+}
+
+void blake3_hash_parallel(const void* data, size_t length, uint8_t* output_hash,
+                          unsigned threads) {
+  subtree_job_t root = {
+      .input = data,
+      .length = length,
+      .chunk_counter = 0,
+      .threads = threads > 0 ? threads : 1,
+  };
+  subtree_output(&root);
+  output_root_bytes(&root.output, output_hash);
+}
@@ -0,0 +1,72 @@
+/**
+ * @file blake3.h
+ * @brief BLAKE3 hash function.
+ *
+ * C implementation of unkeyed BLAKE3 with a 32-byte output. On x86 whole
+ * 1 KiB chunks are hashed 8 at a time with AVX2 or 4 at a time with SSE4.1,
+ * picked at run time, and one by one in plain C elsewhere. Besides the
+ * incremental hasher it offers a one-shot function that splits the input along
+ * the BLAKE3 tree and hashes the subtrees on several threads, so a single large
+ * piece or a whole memory-mapped file can use every core.
+ */
+
+#ifndef HASH_BLAKE3_H_
+#define HASH_BLAKE3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct {
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint8_t block_len;
+  uint8_t blocks_compressed;
+} blake3_chunk_state_t;
+
+typedef struct {
+  blake3_chunk_state_t chunk;
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+  uint8_t cv_stack_len;
+} blake3_hasher_t;
+
+/**
+ * @brief Initialize an incremental hasher
+ * @param hasher Hasher to initialize
+ */
+void blake3_hasher_init(blake3_hasher_t* hasher);
+
+/**
+ * @brief Add input to the hasher
+ * @param hasher Initialized hasher
+ * @param data Input data
+ * @param length Input length in bytes
+ */
+void blake3_hasher_update(blake3_hasher_t* hasher, const void* data,
+                          size_t length);
+
+/**
+ * @brief Write the hash of all input so far
+ * @param hasher Initialized hasher, can be updated further afterwards
+ * @param output_hash Output buffer of BLAKE3_OUT_LEN bytes
+ */
+void blake3_hasher_finalize(const blake3_hasher_t* hasher,
+                            uint8_t* output_hash);
+
+/**
+ * @brief Hash a buffer, splitting the tree across threads
+ * @param data Input data
+ * @param length Input length in bytes
+ * @param output_hash Output buffer of BLAKE3_OUT_LEN bytes
+ * @param threads Maximum number of threads to use, `1` hashes serially
+ * @note Subtrees whose worker thread can not be started are hashed inline.
+ */
+void blake3_hash_parallel(const void* data, size_t length, uint8_t* output_hash,
+                          unsigned threads);
+
+#endif  // HASH_BLAKE3_H_
@@ -0,0 +1,103 @@
+#include "chunker.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Fixed seed, so every build cuts the same data at the same boundaries */
+#define GEAR_SEED UINT64_C(0x454c54434443)
+
+static uint64_t k_gear[256];
+static pthread_once_t k_gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void) {
+  uint64_t state = GEAR_SEED;
+
+  // splitmix64
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    k_gear[i] = z ^ (z >> 31);
+  }
+}
+
+/**
+ * @brief Mask of the top bits of the hash, the ones covering the whole
+ * 64-byte window.
+ */
+static uint64_t top_bits_mask(unsigned bits) {
+  return bits == 0 ? 0 : ~UINT64_C(0) << (64 - bits);
+}
+
+void chunker_params_init(chunker_params_t* params, uint32_t avg_size) {
+  params->avg_size = avg_size;
+  params->min_size = avg_size / CHUNK_MIN_DIVISOR;
+  params->max_size = avg_size * CHUNK_MAX_MULTIPLIER;
+}
+
+uint32_t chunker_next(const chunker_params_t* params, const uint8_t* data,
+                      uint64_t length) {
+  if (length <= params->min_size) {
+    return (uint32_t)length;
+  }
+
+  pthread_once(&k_gear_once, gear_init);
+
+  unsigned bits = 0;
+  while ((UINT32_C(1) << (bits + 1)) <= params->avg_size) {
+    bits++;
+  }
+  uint64_t mask_small = top_bits_mask(bits + 1);
+  uint64_t mask_large = top_bits_mask(bits > 1 ? bits - 1 : 1);
+
+  uint32_t end = length < params->max_size ? (uint32_t)length
+                                           : params->max_size;
+  uint32_t normal = end < params->avg_size ? end : params->avg_size;
+  uint32_t i = params->min_size;
+  uint64_t hash = 0;
+
+  for (; i < normal; i++) {
+    hash = (hash << 1) + k_gear[data[i]];
+    if ((hash & mask_small) == 0) {
+      return i + 1;
+    }
+  }
+  for (; i < end; i++) {
+    hash = (hash << 1) + k_gear[data[i]];
+    if ((hash & mask_large) == 0) {
+      return i + 1;
+    }
+  }
+  return end;
+}
+
+int64_t chunker_split(const chunker_params_t* params, const uint8_t* data,
+                      uint64_t length, uint64_t** offsets) {
+  size_t capacity = length / params->avg_size + 2;
+  uint64_t* bounds = malloc(capacity * sizeof(uint64_t));
+  int64_t count = 0;
+  uint64_t offset = 0;
+
+  if (!bounds) {
+    return -1;
+  }
+
+  bounds[0] = 0;
+  while (offset < length) {
+    if ((size_t)count + 2 > capacity) {
+      capacity *= 2;
+      uint64_t* grown = realloc(bounds, capacity * sizeof(uint64_t));
+      if (!grown) {
+        free(bounds);
+        return -1;
+      }
+      bounds = grown;
+    }
+
+    offset += chunker_next(params, data + offset, length - offset);
+    bounds[++count] = offset;
+  }
+
+  *offsets = bounds;
+  return count;
+}
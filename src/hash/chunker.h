@@ -0,0 +1,60 @@
+/**
+ * @file chunker.h
+ * @brief Content-defined chunking with a FastCDC-style gear hash.
+ *
+ * A rolling hash over the last 64 bytes picks the piece boundaries, so they
+ * depend on the data around them rather than on the offset in the file. An
+ * insertion or deletion only changes the pieces it touches, later pieces are
+ * cut at the same content and keep their hashes.
+ *
+ * Boundaries are never placed before min_size. Up to avg_size a stricter
+ * mask is used and past it a looser one, which keeps most pieces close to
+ * the average. A piece is cut at max_size if no boundary was found.
+ */
+
+#ifndef HASH_CHUNKER_H_
+#define HASH_CHUNKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Piece size limits derived from the average one */
+#define CHUNK_MIN_DIVISOR 4
+#define CHUNK_MAX_MULTIPLIER 4
+
+typedef struct {
+  uint32_t min_size;
+  uint32_t avg_size; /* Power of two */
+  uint32_t max_size;
+} chunker_params_t;
+
+/**
+ * @brief Set up the limits around an average piece size
+ * @param params Parameters to fill
+ * @param avg_size Average piece size, a power of two
+ */
+void chunker_params_init(chunker_params_t* params, uint32_t avg_size);
+
+/**
+ * @brief Find the length of the piece starting at data
+ * @param params Chunking parameters
+ * @param data Data left to split
+ * @param length Length of the data in bytes
+ * @return Length of the next piece, `0` only if length is `0`
+ */
+uint32_t chunker_next(const chunker_params_t* params, const uint8_t* data,
+                      uint64_t length);
+
+/**
+ * @brief Split a buffer into pieces
+ * @param params Chunking parameters
+ * @param data Data to split
+ * @param length Length of the data in bytes
+ * @param offsets Output array of count + 1 piece boundaries, the last one
+ * equals length. Caller must free it.
+ * @return Number of pieces or `-1` on error
+ */
+int64_t chunker_split(const chunker_params_t* params, const uint8_t* data,
+                      uint64_t length, uint64_t** offsets);
+
+#endif  // HASH_CHUNKER_H_
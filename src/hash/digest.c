@@ -0,0 +1,134 @@
+#include "digest.h"
+
+#include <string.h>
+#include <unistd.h>
+
+static const char* const k_digest_names[DIGEST_COUNT] = {"sha1", "sha256",
+                                                         "blake3"};
+
+static const EVP_MD* digest_evp(digest_algo_t algo) {
+  switch (algo) {
+    case DIGEST_SHA1:
+      return EVP_sha1();
+    case DIGEST_SHA256:
+      return EVP_sha256();
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * @brief Thread limit with `0` replaced by the number of online CPUs.
+ */
+static unsigned digest_threads(unsigned threads) {
+  if (threads > 0) {
+    return threads;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (unsigned)cpus : 1;
+}
+
+size_t digest_size(digest_algo_t algo) {
+  switch (algo) {
+    case DIGEST_SHA1:
+      return 20;
+    case DIGEST_SHA256:
+      return 32;
+    case DIGEST_BLAKE3:
+      return BLAKE3_OUT_LEN;
+    default:
+      return 0;
+  }
+}
+
+const char* digest_name(digest_algo_t algo) {
+  if (algo >= DIGEST_COUNT) {
+    return "unknown";
+  }
+  return k_digest_names[algo];
+}
+
+int digest_parse(const char* name, digest_algo_t* algo) {
+  if (!name || !algo) {
+    return -1;
+  }
+
+  for (int i = 0; i < DIGEST_COUNT; i++) {
+    if (strcmp(name, k_digest_names[i]) == 0) {
+      *algo = (digest_algo_t)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int digest_init(digest_ctx_t* ctx, digest_algo_t algo) {
+  if (!ctx || digest_size(algo) == 0) {
+    return -1;
+  }
+  ctx->algo = algo;
+
+  if (algo == DIGEST_BLAKE3) {
+    blake3_hasher_init(&ctx->blake3);
+    return 0;
+  }
+
+  if (!ctx->evp) {
+    ctx->evp = EVP_MD_CTX_new();
+    if (!ctx->evp) {
+      return -1;
+    }
+  }
+  return EVP_DigestInit_ex(ctx->evp, digest_evp(algo), NULL) == 1 ? 0 : -1;
+}
+
+int digest_update(digest_ctx_t* ctx, const void* data, size_t length) {
+  if (!ctx) {
+    return -1;
+  }
+
+  if (ctx->algo == DIGEST_BLAKE3) {
+    blake3_hasher_update(&ctx->blake3, data, length);
+    return 0;
+  }
+  return EVP_DigestUpdate(ctx->evp, data, length) == 1 ? 0 : -1;
+}
+
+int digest_final(digest_ctx_t* ctx, uint8_t* output_hash) {
+  if (!ctx || !output_hash) {
+    return -1;
+  }
+
+  if (ctx->algo == DIGEST_BLAKE3) {
+    blake3_hasher_finalize(&ctx->blake3, output_hash);
+    return 0;
+  }
+  return EVP_DigestFinal_ex(ctx->evp, output_hash, NULL) == 1 ? 0 : -1;
+}
+
+void digest_free(digest_ctx_t* ctx) {
+  if (ctx) {
+    EVP_MD_CTX_free(ctx->evp);
+    ctx->evp = NULL;
+  }
+}
+
+int digest_calculate(digest_algo_t algo, const uint8_t* data, size_t length,
+                     unsigned threads, uint8_t* output_hash) {
+  if (!data || !output_hash) {
+    return -1;
+  }
+
+  if (algo == DIGEST_BLAKE3) {
+    blake3_hash_parallel(
+        data, length, output_hash,
+        length >= DIGEST_PARALLEL_MIN_SIZE ? digest_threads(threads) : 1);
+    return 0;
+  }
+
+  const EVP_MD* md = digest_evp(algo);
+  if (!md) {
+    return -1;
+  }
+  return EVP_Digest(data, length, output_hash, NULL, md, NULL) == 1 ? 0 : -1;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file digest.h
+ * @brief Digest algorithms used for piece and block hashes.
+ *
+ * Every torrent records the algorithm its piece and Merkle hashes were made
+ * with, and all hashing goes through this module so the creator, the parser
+ * and the verifier dispatch on that value instead of calling OpenSSL directly.
+ * SHA1 and SHA-256 come from OpenSSL EVP, BLAKE3 is bundled in-tree and hashes
+ * large inputs across all cores.
+ */
+
+#ifndef HASH_DIGEST_H_
+#define HASH_DIGEST_H_
+
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../bit_torrent.h"
+#include "blake3.h"
+
+/* Inputs at least this large are hashed on all cores when the algorithm can */
+#define DIGEST_PARALLEL_MIN_SIZE (1024 * 1024)
+
+typedef enum {
+  DIGEST_SHA1 = 0,
+  DIGEST_SHA256 = 1,
+  DIGEST_BLAKE3 = 2,
+  DIGEST_COUNT
+} digest_algo_t;
+
+/**
+ * @brief Incremental digest state
+ * @note Zero-initialize before the first digest_init() and release with
+ * digest_free(). The same context can be initialized again for a new digest.
+ */
+typedef struct {
+  digest_algo_t algo;
+  EVP_MD_CTX* evp;
+  blake3_hasher_t blake3;
+} digest_ctx_t;
+
+/**
+ * @brief Get digest size in bytes
+ * @param algo Digest algorithm
+ * @return Digest size, `0` for an unknown algorithm
+ */
+size_t digest_size(digest_algo_t algo);
+
+/**
+ * @brief Get digest name as used on the command line
+ * @param algo Digest algorithm
+ * @return Digest name, "unknown" for an unknown algorithm
+ */
+const char* digest_name(digest_algo_t algo);
+
+/**
+ * @brief Parse digest name
+ * @param name Digest name ("sha1", "sha256" or "blake3")
+ * @param algo Output digest algorithm
+ * @return `0` on success or `-1` for an unknown name
+ */
+int digest_parse(const char* name, digest_algo_t* algo);
+
+/**
+ * @brief Start a new digest
+ * @param ctx Zero-initialized or previously used context
+ * @param algo Digest algorithm
+ * @return `0` on success or `-1` on error
+ */
+int digest_init(digest_ctx_t* ctx, digest_algo_t algo);
+
+/**
+ * @brief Add data to the digest
+ * @param ctx Initialized context
+ * @param data self explanatory
+ * @param length self explanatory
+ * @return `0` on success or `-1` on error
+ */
+int digest_update(digest_ctx_t* ctx, const void* data, size_t length);
+
+/**
+ * @brief Write the digest of all data added since digest_init()
+ * @param ctx Initialized context
+ * @param output_hash Output buffer of digest_size() bytes
+ * @return `0` on success or `-1` on error
+ */
+int digest_final(digest_ctx_t* ctx, uint8_t* output_hash);
+
+/**
+ * @brief Free context resources
+ * @param ctx Context to free
+ */
+void digest_free(digest_ctx_t* ctx);
+
+/**
+ * @brief Calculate the digest of a buffer in one call
+ *
+ * BLAKE3 inputs of at least DIGEST_PARALLEL_MIN_SIZE bytes are split along
+ * the hash tree and hashed on up to `threads` threads. Callers that already
+ * hash on several threads pass `1` so the machine is not oversubscribed.
+ *
+ * @param algo Digest algorithm
+ * @param data self explanatory
+ * @param length self explanatory
+ * @param threads Thread limit, `0` for every online CPU
+ * @param output_hash Output buffer of digest_size() bytes
+ * @return `0` on success or `-1` on error
+ */
+int digest_calculate(digest_algo_t algo, const uint8_t* data, size_t length,
+                     unsigned threads, uint8_t* output_hash);
+
+#endif  // HASH_DIGEST_H_
@@ -6,42 +6,86 @@
 #include <stdlib.h>
 #include <string.h>
 
-static void calculate_sha1_hash(const uint8_t* data, size_t length,
-                                uint8_t* output_hash) {
+#include "../common/log.h"
+#include "digest.h"
+#include "merkle.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_HASH);
+
+int calculate_piece_hash(digest_algo_t algo, const uint8_t* data, size_t length,
+                         unsigned threads, uint8_t* output_hash) {
   if (!data || !output_hash) {
-    return;
+    return -1;
   }
 
   if (length == 0) {
-    return;
+    return -1;
   }
 
-  EVP_MD_CTX* sha1_ctx = EVP_MD_CTX_new();
-  if (!sha1_ctx) {
-    return;
+  if (digest_calculate(algo, data, length, threads, output_hash) != 0) {
+    return -1;
   }
 
-  if (1 != EVP_DigestInit_ex(sha1_ctx, EVP_sha1(), NULL)) {
-    EVP_MD_CTX_free(sha1_ctx);
-    return;
+  // SHA1 piece hashes keep their original base64 form for compatibility
+  if (algo == DIGEST_SHA1) {
+    unsigned char base64[28];
+    EVP_EncodeBlock(base64, output_hash, HASH_SIZE);
+    base64[27] = '\0';
+    memcpy(output_hash, base64, HASH_SIZE);
   }
 
-  if (1 != EVP_DigestUpdate(sha1_ctx, data, length)) {
-    EVP_MD_CTX_free(sha1_ctx);
-    return;
+  return 0;
+}
+
+int calculate_piece_hash_from_leaves(digest_algo_t algo, uint32_t block_size,
+                                     const uint8_t* data, size_t length,
+                                     uint8_t* leaves, uint8_t* output_hash) {
+  size_t hash_size = digest_size(algo);
+  if (!data || !leaves || !output_hash || length == 0 || block_size == 0 ||
+      hash_size == 0) {
+    return -1;
   }
 
-  if (1 != EVP_DigestFinal_ex(sha1_ctx, output_hash, NULL)) {
-    EVP_MD_CTX_free(sha1_ctx);
-    return;
+  size_t count = 0;
+  for (size_t offset = 0; offset < length; offset += block_size, count++) {
+    size_t block_length =
+        length - offset < block_size ? length - offset : block_size;
+    if (merkle_leaf_hash(algo, data + offset, block_length,
+                         &leaves[count * hash_size]) != 0) {
+      return -1;
+    }
   }
 
-  EVP_MD_CTX_free(sha1_ctx);
+  return calculate_piece_hash(algo, leaves, count * hash_size, 1,
+                              output_hash);
+}
+
+int piece_hash_from_leaves(const eltextorrent_file_t* torrent) {
+  return torrent && torrent->blocks_hashes &&
+         torrent->version == TORRENT_VERSION_LEAVES;
+}
 
-  unsigned char base64[28];
-  EVP_EncodeBlock(base64, output_hash, HASH_SIZE);
-  base64[27] = '\0';
-  memcpy(output_hash, base64, HASH_SIZE);
+/**
+ * @brief Checks every block of a piece against its stored leaf.
+ */
+static int verify_piece_leaves(const eltextorrent_file_t* torrent,
+                               const uint8_t* data, size_t length,
+                               uint32_t piece_index) {
+  uint64_t block = (uint64_t)piece_index *
+                   (torrent->piece_size / torrent->block_size);
+
+  for (size_t offset = 0; offset < length;
+       offset += torrent->block_size, block++) {
+    size_t block_length = length - offset < torrent->block_size
+                              ? length - offset
+                              : torrent->block_size;
+    if (block >= torrent->blocks_count ||
+        !verify_block_hash(torrent, data + offset, block_length,
+                           (uint32_t)block)) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 static const uint8_t* get_piece_hash(eltextorrent_file_t* torrent, int index) {
@@ -54,39 +98,83 @@ static const uint8_t* get_piece_hash(eltextorrent_file_t* torrent, int index) {
     return NULL;
   }
 
-  return &torrent->pieces_hashes[index * HASH_SIZE];
+  return &torrent->pieces_hashes[(size_t)index * torrent->hash_size];
 }
 
-int compare_hashes(const uint8_t* hash1, const uint8_t* hash2) {
+int compare_hashes(const uint8_t* hash1, const uint8_t* hash2,
+                   size_t hash_size) {
   if (hash1 == NULL || hash2 == NULL) {
     return 0;
   }
 
-  return memcmp(hash1, hash2, HASH_SIZE) == 0;
+  return memcmp(hash1, hash2, hash_size) == 0;
 }
 
 int verify_piece_hash(eltextorrent_file_t* torrent, const uint8_t* data,
-                      size_t length, int piece_index) {
+                      size_t length, int piece_index, unsigned threads) {
   if (piece_index < 0) {
-    fprintf(stderr, "[verify_piece_hash] Bad piece index\n");
+    LOG_ERROR("[verify_piece_hash] Bad piece index");
     return 0;
   }
 
   if (!torrent || !data || length == 0 ||
       (uint32_t)piece_index >= torrent->pieces_count) {
-    fprintf(stderr, "[verify_piece_hash] Bad args\n");
+    LOG_ERROR("[verify_piece_hash] Bad args");
     return 0;
   }
 
-  uint8_t calculated_hash[HASH_SIZE + 1];
+  if (torrent->blocks_hashes) {
+    return verify_piece_leaves(torrent, data, length, (uint32_t)piece_index);
+  }
 
-  calculate_sha1_hash(data, length, calculated_hash);
+  uint8_t calculated_hash[DIGEST_MAX_SIZE];
+
+  if (calculate_piece_hash(torrent->digest, data, length, threads,
+                           calculated_hash) != 0) {
+    LOG_ERROR("[verify_piece_hash] hashing failed");
+    return 0;
+  }
 
   const uint8_t* piece_hash = get_piece_hash(torrent, piece_index);
   if (!piece_hash) {
-    fprintf(stderr, "[verify_piece_hash] no piece_hash\n");
+    LOG_ERROR("[verify_piece_hash] no piece_hash");
+    return 0;
+  }
+
+  return compare_hashes(calculated_hash, piece_hash, torrent->hash_size);
+}
+
+int verify_block_hash(const eltextorrent_file_t* torrent, const uint8_t* data,
+                      size_t length, uint32_t block_index) {
+  if (!torrent || !torrent->blocks_hashes || !data || length == 0 ||
+      block_index >= torrent->blocks_count) {
+    LOG_ERROR("[verify_block_hash] Bad args");
+    return 0;
+  }
+
+  uint8_t calculated_hash[DIGEST_MAX_SIZE];
+  if (merkle_leaf_hash(torrent->digest, data, length, calculated_hash) != 0) {
+    LOG_ERROR("[verify_block_hash] hashing failed");
+    return 0;
+  }
+
+  return compare_hashes(
+      calculated_hash,
+      &torrent->blocks_hashes[(size_t)block_index * torrent->hash_size],
+      torrent->hash_size);
+}
+
+int verify_merkle_root(const eltextorrent_file_t* torrent) {
+  if (!torrent || !torrent->blocks_hashes) {
+    return 0;
+  }
+
+  uint8_t root[DIGEST_MAX_SIZE];
+  if (merkle_root(torrent->digest, torrent->blocks_hashes,
+                  torrent->blocks_count, root) != 0) {
+    LOG_ERROR("[verify_merkle_root] hashing failed");
     return 0;
   }
 
-  return compare_hashes(calculated_hash, piece_hash);
+  return compare_hashes(root, torrent->merkle_root, torrent->hash_size);
 }
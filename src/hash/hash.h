@@ -5,6 +5,44 @@
 #include <stdint.h>
 
 #include "../bit_torrent.h"
+#include "digest.h"
+
+/**
+ * @brief Calculate a piece hash in the form stored in torrent files
+ * @param algo Digest algorithm of the torrent
+ * @param data Piece data
+ * @param length Data length
+ * @param threads Thread limit of digest_calculate(), `0` for every online CPU
+ * @param output_hash Output buffer of digest_size() bytes
+ * @return `0` on success or `-1` on error
+ *
+ * @note SHA1 hashes are stored as the first HASH_SIZE base64 characters.
+ */
+int calculate_piece_hash(digest_algo_t algo, const uint8_t* data, size_t length,
+                         unsigned threads, uint8_t* output_hash);
+
+/**
+ * @brief Calculate a piece hash from the Merkle leaves of the piece, in the
+ * form stored in torrent files of version TORRENT_VERSION_LEAVES
+ * @param algo Digest algorithm of the torrent
+ * @param block_size Merkle block size of the torrent
+ * @param data Piece data
+ * @param length Data length
+ * @param leaves Output buffer for one digest_size() leaf per block
+ * @param output_hash Output buffer of digest_size() bytes
+ * @return `0` on success or `-1` on error
+ */
+int calculate_piece_hash_from_leaves(digest_algo_t algo, uint32_t block_size,
+                                     const uint8_t* data, size_t length,
+                                     uint8_t* leaves, uint8_t* output_hash);
+
+/**
+ * @brief Check whether the piece hashes of a torrent are digests of its
+ * Merkle leaves rather than of the piece data
+ * @param torrent Torrent file structure
+ * @return 1 if they are, 0 otherwise
+ */
+int piece_hash_from_leaves(const eltextorrent_file_t* torrent);
 
 /**
  * @brief Verify piece data against stored hash
@@ -12,17 +50,41 @@
  * @param data Piece data to verify
  * @param length Data length
  * @param index Piece index
+ * @param threads Thread limit of digest_calculate(), `0` for every online CPU
  * @return 1 if hashes match, 0 otherwise
+ *
+ * @note Pieces of torrents with a Merkle section are checked against their
+ * leaves, which hashes the data once whatever the piece hashes are made of.
  */
 int verify_piece_hash(eltextorrent_file_t* torrent, const uint8_t* data,
-                      size_t length, int index);
+                      size_t length, int index, unsigned threads);
+
+/**
+ * @brief Verify one Merkle block against its leaf hash
+ * @param torrent Torrent file structure with a Merkle section
+ * @param data Block data to verify
+ * @param length Data length
+ * @param block_index Global block index
+ * @return 1 if hashes match, 0 otherwise
+ */
+int verify_block_hash(const eltextorrent_file_t* torrent, const uint8_t* data,
+                      size_t length, uint32_t block_index);
+
+/**
+ * @brief Check that the stored leaves hash up to the stored Merkle root
+ * @param torrent Torrent file structure with a Merkle section
+ * @return 1 if the root matches, 0 otherwise
+ */
+int verify_merkle_root(const eltextorrent_file_t* torrent);
 
 /**
  * @brief Compare two hashes for equality
  * @param hash1 First hash to compare
  * @param hash2 Second hash to compare
+ * @param hash_size Size of both hashes in bytes
  * @return 1 if hashes are equal, 0 otherwise
  */
-int compare_hashes(const uint8_t* hash1, const uint8_t* hash2);
+int compare_hashes(const uint8_t* hash1, const uint8_t* hash2,
+                   size_t hash_size);
 
 #endif  // HASH_HASH_H_
@@ -0,0 +1,76 @@
+#include "merkle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+
+static int merkle_digest(digest_ctx_t* ctx, digest_algo_t algo, uint8_t prefix,
+                         const uint8_t* data, size_t length,
+                         uint8_t* output_hash) {
+  if (digest_init(ctx, algo) != 0 ||
+      digest_update(ctx, &prefix, sizeof(prefix)) != 0 ||
+      digest_update(ctx, data, length) != 0 ||
+      digest_final(ctx, output_hash) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int merkle_leaf_hash(digest_algo_t algo, const uint8_t* data, size_t length,
+                     uint8_t* output_hash) {
+  if (!data || !output_hash) {
+    return -1;
+  }
+
+  digest_ctx_t ctx = {0};
+  int result =
+      merkle_digest(&ctx, algo, MERKLE_LEAF_PREFIX, data, length, output_hash);
+
+  digest_free(&ctx);
+  return result;
+}
+
+int merkle_root(digest_algo_t algo, const uint8_t* leaves,
+                uint32_t leaves_count, uint8_t* root) {
+  size_t hash_size = digest_size(algo);
+  if (!leaves || !root || leaves_count == 0 || hash_size == 0) {
+    return -1;
+  }
+
+  uint8_t* level = malloc((size_t)leaves_count * hash_size);
+  if (!level) {
+    return -1;
+  }
+  memcpy(level, leaves, (size_t)leaves_count * hash_size);
+
+  digest_ctx_t ctx = {0};
+  int result = 0;
+  uint32_t count = leaves_count;
+  while (count > 1 && result == 0) {
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < count; i += 2, next++) {
+      uint8_t* dst = &level[(size_t)next * hash_size];
+      const uint8_t* left = &level[(size_t)i * hash_size];
+
+      if (i + 1 == count) {
+        memmove(dst, left, hash_size);
+      } else if (merkle_digest(&ctx, algo, MERKLE_NODE_PREFIX, left,
+                               2 * hash_size, dst) != 0) {
+        result = -1;
+        break;
+      }
+    }
+    count = next;
+  }
+
+  if (result == 0) {
+    memcpy(root, level, hash_size);
+  }
+
+  digest_free(&ctx);
+  free(level);
+  return result;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file merkle.h
+ * @brief Merkle tree over fixed-size blocks of the shared file.
+ *
+ * Leaves are digests of consecutive blocks of the file, inner nodes are
+ * digests of their two children concatenated. Leaf and inner node inputs are
+ * prefixed with different bytes so one can never be passed off as the other.
+ * An unpaired node at the end of a level is promoted unchanged, so the tree
+ * needs no padding.
+ */
+
+#ifndef HASH_MERKLE_H_
+#define HASH_MERKLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "digest.h"
+
+/**
+ * @brief Calculate the leaf hash of one block
+ * @param algo Digest algorithm of the tree
+ * @param data Block data
+ * @param length Block length in bytes
+ * @param output_hash Output buffer of digest_size() bytes
+ * @return `0` on success or `-1` on error
+ */
+int merkle_leaf_hash(digest_algo_t algo, const uint8_t* data, size_t length,
+                     uint8_t* output_hash);
+
+/**
+ * @brief Calculate the tree root from its leaves
+ * @param algo Digest algorithm of the tree
+ * @param leaves Array of leaves_count * digest_size() leaf hashes
+ * @param leaves_count Number of leaves
+ * @param root Output buffer of digest_size() bytes
+ * @return `0` on success or `-1` on error
+ */
+int merkle_root(digest_algo_t algo, const uint8_t* leaves,
+                uint32_t leaves_count, uint8_t* root);
+
+#endif  // HASH_MERKLE_H_
@@ -2,23 +2,211 @@
 #define _GNU_SOURCE
 #include "leecher.h"
 
-static int create_timerfd(long interval) {
-  int tfd = timerfd_create(CLOCK_REALTIME, 0);
-  if (tfd < 0) {
-    return -1;
+LOG_DEFINE_MODULE(LOG_MODULE_LEECHER);
+
+typedef struct {
+  uint8_t* needed_pieces;   /* Pieces not received yet */
+  uint8_t* repair_blocks;   /* Blocks that failed verification */
+  uint8_t* verified_blocks; /* Blocks matched against their Merkle leaf */
+  uint64_t have_pieces;
+  uint64_t have_bytes;
+  int failed; /* A write to the output file failed, the download stops */
+  int paused; /* The write queue is full, nothing is asked until it drains */
+  char* piece_buffer; /* Piece read or decompressed, used right away */
+} download_t;
+
+/* Answer of a seeder, received in parts as the data arrives */
+typedef struct answer_state {
+  uint8_t header[ANSWER_HEADER_SIZE];
+  uint32_t header_received;
+  uint64_t index; /* Of the piece or block */
+  int block;      /* A block asked for repair, not a piece */
+  int compressed;
+  int shared;           /* Read from the file a local seeder shared */
+  uint32_t size;        /* Of the piece or block */
+  uint32_t packet_size; /* Announced by the header */
+  uint32_t data_size;   /* Bytes that follow the header */
+  uint32_t received;    /* Of data_size */
+  uint64_t started;
+  uint8_t data[]; /* compress_bound() of the piece size */
+} answer_state_t;
+
+/* Peer whose last connection attempt failed */
+typedef struct {
+  char ip[INET_ADDRSTRLEN];
+  in_port_t port; /* 0 if the slot is free */
+  uint32_t failures;
+  uint64_t retry_ns; /* Its discovery answers are ignored until then */
+} connect_backoff_t;
+
+/* Seeders of the download and the deadlines that keep it moving */
+typedef struct {
+  ClientNode* clients;
+  ClientNode* current; /* Last client asked for a piece */
+  ClientNode* dropped; /* Freed once the current batch of events is done */
+  const eltextorrent_file_t* torrent;
+  download_t* dl;
+  reactor_t* reactor;
+  timer_wheel_t* wheel;
+  udp_broadcast_t* discovery;
+  udp_broadcast_receiver_t* answers;
+  reactor_source_t answers_source;
+  reactor_source_t space_source; /* Write queue drained */
+  reactor_task_t free_dropped;
+  tls_context_t* tls; /* NULL for plaintext */
+  int udp;            /* Connect over UDP streams instead of TCP */
+  char host_id[LOCAL_PEER_HOST_ID_SIZE]; /* Empty if local sockets are off */
+  multicast_receiver_t* multicast; /* NULL if off */
+  reactor_source_t multicast_source;
+  wheel_timer_t multicast_naks;
+  uint32_t connect_timeout_ms;
+  uint32_t request_timeout_ms;
+  connect_backoff_t backoff[CONNECT_BACKOFF_PEERS];
+} peers_t;
+
+static connect_backoff_t* find_backoff(peers_t* peers, const char* ip,
+                                       in_port_t port) {
+  for (int i = 0; i < CONNECT_BACKOFF_PEERS; i++) {
+    connect_backoff_t* peer = &peers->backoff[i];
+    if (peer->port == port && strcmp(peer->ip, ip) == 0) {
+      return peer;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Remembers a failed peer, the delay before the next attempt doubles
+ * with every failure in a row.
+ */
+static void backoff_peer(peers_t* peers, const TCPClient_t* client) {
+  uint64_t now = metrics_now_ns();
+  connect_backoff_t* peer = find_backoff(peers, client->ip, client->port);
+  if (!peer) {
+    // Take a free slot or forget the peer that is retried first
+    peer = &peers->backoff[0];
+    for (int i = 0; i < CONNECT_BACKOFF_PEERS && peer->port != 0; i++) {
+      connect_backoff_t* slot = &peers->backoff[i];
+      if (slot->port == 0 || slot->retry_ns < peer->retry_ns) {
+        peer = slot;
+      }
+    }
+    memset(peer, 0, sizeof(*peer));
+    memcpy(peer->ip, client->ip, sizeof(peer->ip));
+    peer->port = client->port;
+  }
+
+  uint64_t delay_ms = CONNECT_BACKOFF_MAX_MS;
+  if (peer->failures < 16) {
+    delay_ms = (uint64_t)CONNECT_BACKOFF_MIN_MS << peer->failures;
+    delay_ms = delay_ms < CONNECT_BACKOFF_MAX_MS ? delay_ms
+                                                 : CONNECT_BACKOFF_MAX_MS;
+  }
+  peer->failures++;
+  peer->retry_ns = now + delay_ms * 1000000;
+  LOG_INFO("Retrying %s:%d in %" PRIu64 " ms", peer->ip, peer->port,
+           delay_ms);
+}
+
+static void connect_failed(peers_t* peers, const TCPClient_t* client) {
+  metrics_add(METRIC_CONNECT_FAILURES, client->ip, 1);
+  backoff_peer(peers, client);
+}
+
+/**
+ * @brief Forgets the failures of a peer once it answers, a seeder that
+ * accepts connections but stalls keeps backing off.
+ */
+static void peer_answered(peers_t* peers, const TCPClient_t* client) {
+  connect_backoff_t* peer = find_backoff(peers, client->ip, client->port);
+  if (peer) {
+    memset(peer, 0, sizeof(*peer));
   }
-  struct itimerspec spec = {
-      .it_value.tv_sec = interval,
-      .it_interval.tv_sec = interval,
-  };
-  timerfd_settime(tfd, 0, &spec, NULL);
+}
+
+/**
+ * @brief Checks whether a client is still connecting, the TLS handshake is
+ * part of the connect and shares its deadline.
+ */
+static int client_connecting(const TCPClient_t* client) {
+  return client->connect_started_ns || tls_handshaking(client);
+}
+
+/**
+ * @brief Next client after node in round-robin order, skipping the ones
+ * still connecting.
+ *
+ * @return The client or NULL if none is connected.
+ */
+static ClientNode* next_connected(ClientNode* head, ClientNode* node) {
+  ClientNode* next = node;
+  // One step per client bounds the search to a full turn
+  for (ClientNode* step = head; step; step = step->next) {
+    next = next && next->next ? next->next : head;
+    if (next->client->connected && !client_connecting(next->client)) {
+      return next;
+    }
+  }
+  return NULL;
+}
+
+static void keep_requesting(peers_t* peers);
+
+/**
+ * @brief Frees clients with the answers they were receiving.
+ */
+static void destroy_clients(ClientNode* clients) {
+  for (ClientNode* node = clients; node; node = node->next) {
+    free(node->client->answer);
+    node->client->answer = NULL;
+  }
+  client_list_destroy(clients);
+}
+
+static void free_dropped(reactor_task_t* task, void* arg) {
+  (void)task;
+  peers_t* peers = arg;
+  destroy_clients(peers->dropped);
+  peers->dropped = NULL;
+}
+
+/**
+ * @brief Closes a client at once, its handler may still be running so the
+ * memory is freed after the current batch of events.
+ */
+static void drop_client(peers_t* peers, TCPClient_t* client) {
+  timer_wheel_cancel(peers->wheel, &client->deadline);
+  reactor_remove(peers->reactor, &client->source);
+  if (client->connected && !client_connecting(client)) {
+    metrics_add(METRIC_CONNECTIONS, NULL, -1);
+  }
+
+  if (peers->current && peers->current->client == client) {
+    peers->current = peers->current->next;
+  }
+
+  // Remove from list
+  peers->clients = client_list_remove(peers->clients, client);
+  // The seeder of a UDP stream learns it is over from the FIN
+  udp_stream_close(client);
+  close(client->socket_fd);
+  client->socket_fd = -1;
+  client->connected = 0;
+  peers->dropped = client_list_add(peers->dropped, client);
+  reactor_defer(peers->reactor, &peers->free_dropped);
 
-  return tfd;
+  // The pieces it was asked for are asked from another seeder
+  keep_requesting(peers);
 }
 
 static uint64_t find_next_piece(const uint8_t* needed_pieces,
                                 uint64_t pieces_count) {
   for (uint64_t i = 0; i < pieces_count; i++) {
+    // Skip whole bytes of received pieces, large torrents have millions
+    if (i % 8 == 0 && needed_pieces[i / 8] == 0) {
+      i += 7;
+      continue;
+    }
     if (get_bit(needed_pieces, i)) {
       return i;
     }
@@ -26,213 +214,1089 @@ static uint64_t find_next_piece(const uint8_t* needed_pieces,
   return pieces_count;  // none found
 }
 
-static const char* format_piece_index(uint64_t piece_index) {
-  static char piece_index_buf[PIECE_INDEX_BUF_SIZE];
-  int len =
-      snprintf(piece_index_buf, PIECE_INDEX_BUF_SIZE, "%" PRIu64, piece_index);
-  if (len < 0 || (size_t)len >= PIECE_INDEX_BUF_SIZE) {
-    return NULL;
+/**
+ * @brief Sends the next request to a seeder.
+ *
+ * Pieces still needed go first so a peer serving a corrupted block can not
+ * stall the download, then blocks waiting for repair. Pieces are left to
+ * the multicast group while it makes progress.
+ *
+ * @return `1` if a request was sent, `0` if nothing is left or `-1` on
+ * error.
+ */
+static int request_next(TCPClient_t* client, const eltextorrent_file_t* torrent,
+                        const download_t* dl, int skip_pieces) {
+  char request[PIECE_INDEX_BUF_SIZE] = {0};
+  int len;
+
+  uint64_t next_piece =
+      skip_pieces ? torrent->pieces_count
+                  : find_next_piece(dl->needed_pieces, torrent->pieces_count);
+  uint64_t next_block =
+      find_next_piece(dl->repair_blocks, torrent->blocks_count);
+  if (next_piece < torrent->pieces_count) {
+    len = snprintf(request, sizeof(request), "%" PRIu64 "%c", next_piece,
+                   COMPRESS_REQUEST_SUFFIX);
+  } else if (next_block < torrent->blocks_count) {
+    len = snprintf(request, sizeof(request), "%c%" PRIu64,
+                   BLOCK_REQUEST_PREFIX, next_block);
+  } else {
+    return 0;
+  }
+
+  if (len < 0 || (size_t)len >= sizeof(request)) {
+    LOG_ERROR("Failed to format piece index");
+    return -1;
+  }
+
+  if (tcp_client_send(client, request, PIECE_INDEX_BUF_SIZE) < 0) {
+    return -1;
+  }
+
+  metrics_add(next_piece < torrent->pieces_count ? METRIC_PIECES_REQUESTED
+                                                 : METRIC_BLOCKS_REQUESTED,
+              NULL, 1);
+  client->request_sent_ns = metrics_now_ns();
+  if (next_piece < torrent->pieces_count) {
+    TRACE_BEGIN("piece request", next_piece);
+  } else {
+    TRACE_BEGIN("block request", next_block);
+  }
+  return 1;
+}
+
+/**
+ * @brief Sends the next request to a seeder, the deadline runs from its
+ * oldest unanswered request. Nothing is asked once a write failed or while
+ * the write queue is full.
+ */
+static void send_request(peers_t* peers, TCPClient_t* client) {
+  if (peers->dl->failed || peers->dl->paused) {
+    return;
+  }
+  int sent = request_next(
+      client, peers->torrent, peers->dl,
+      peers->multicast && !multicast_receiver_stalled(peers->multicast));
+  if (sent < 0) {
+    drop_client(peers, client);
+  } else if (sent > 0 && client->requests_pending++ == 0) {
+    timer_wheel_schedule(peers->wheel, &client->deadline,
+                         peers->request_timeout_ms);
+  }
+}
+
+/**
+ * @brief Asks the next seeder for a piece unless an answer or a connect is
+ * still awaited, so losing a seeder never stalls the download.
+ */
+static void keep_requesting(peers_t* peers) {
+  for (ClientNode* node = peers->clients; node; node = node->next) {
+    if (node->client->requests_pending > 0 ||
+        client_connecting(node->client)) {
+      return;
+    }
+  }
+
+  peers->current = next_connected(peers->clients, peers->current);
+  if (peers->current) {
+    send_request(peers, peers->current->client);
+  }
+}
+
+/**
+ * @brief Drops a seeder that did not accept the connection or answer a
+ * request in time, its pieces are asked from the next one right away.
+ */
+static void client_deadline(wheel_timer_t* timer, void* arg) {
+  peers_t* peers = arg;
+  TCPClient_t* client = TIMER_CONTAINER(timer, TCPClient_t, deadline);
+
+  if (client_connecting(client)) {
+    LOG_WARN("Connect to %s:%d timed out", client->ip, client->port);
+    connect_failed(peers, client);
+  } else {
+    LOG_WARN("%s:%d did not answer in %u ms", client->ip, client->port,
+             peers->request_timeout_ms);
+    metrics_add(METRIC_REQUEST_TIMEOUTS, client->ip, 1);
+    backoff_peer(peers, client);
+  }
+  drop_client(peers, client);
+}
+
+/**
+ * @brief Sends the discovery broadcast, seeders answer with their address.
+ */
+static void announce(wheel_timer_t* timer, void* arg) {
+  peers_t* peers = arg;
+  udp_broadcast_send(peers->discovery, (const char*)&peers->torrent->infohash,
+                     HASH_SIZE);
+  TRACE_INSTANT("discovery broadcast", 0, HASH_SIZE);
+  timer_wheel_schedule(peers->wheel, timer, TIMER_INTERVAL_SEC * 1000);
+}
+
+/**
+ * @brief Checks a write queued for a piece. A full queue pauses the requests,
+ * a failed write stops the download and the piece stays needed.
+ *
+ * @return `0` if the data was queued or `-1` on error
+ */
+static int piece_queued(download_t* dl, uint64_t piece_index, int result) {
+  if (result == FILE_WRITER_FULL) {
+    if (!dl->paused) {
+      LOG_DEBUG("Write queue full, requests wait for the disk");
+    }
+    dl->paused = 1;
+    return 0;
+  }
+  if (result != 0) {
+    LOG_ERROR("Failed to write piece %lu", piece_index);
+    dl->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static void complete_piece(const eltextorrent_file_t* torrent,
+                           download_t* dl, uint64_t piece_index) {
+  dl->have_pieces++;
+  dl->have_bytes += torrent_piece_length(torrent, piece_index);
+  metrics_add(METRIC_PIECES_VERIFIED, NULL, 1);
+  TRACE_INSTANT("piece verified", piece_index,
+                torrent_piece_length(torrent, piece_index));
+  progress_bar_set_done(dl->have_bytes);
+}
+
+/**
+ * @brief Verifies a received piece or block and records how long hashing
+ * took.
+ *
+ * @return `1` if the data matches its hash, `0` otherwise
+ */
+static int verify_received(const eltextorrent_file_t* torrent,
+                           const uint8_t* data, uint32_t size, int is_block,
+                           uint64_t index) {
+  uint64_t started = metrics_now_ns();
+  int valid = is_block ? verify_block_hash(torrent, data, size, index)
+                       : verify_piece_hash((eltextorrent_file_t*)torrent, data,
+                                           size, index, 0);
+  metrics_observe(METRIC_HASH_DURATION, metrics_now_ns() - started);
+  TRACE_SPAN(is_block ? "block hash" : "piece hash", index, size, started);
+
+  if (!valid) {
+    metrics_add(METRIC_PIECES_FAILED, NULL, 1);
+  }
+  return valid;
+}
+
+/**
+ * @brief Reads a range of the file a seeder on the same host shared, in
+ * place of receiving it.
+ *
+ * @return Amount of read bytes or `-1` on error
+ */
+static int read_shared(const TCPClient_t* client, uint64_t offset,
+                       uint8_t* buffer, uint32_t size) {
+  uint64_t started = metrics_now_ns();
+  if (read_file_range(client->shared_fd, offset, size, buffer) < 0) {
+    LOG_ERROR("Failed to read the file shared by %s:%d", client->ip,
+              client->port);
+    return -1;
+  }
+  metrics_add(METRIC_SHARED_READ_BYTES, NULL, size);
+  TRACE_SPAN("shared read", offset, size, started);
+  return (int)size;
+}
+
+/**
+ * @brief Records the verified blocks of a needed piece and writes them. The
+ * piece is complete unless some block failed and waits for repair.
+ */
+static void finish_piece(const eltextorrent_file_t* torrent, download_t* dl,
+                         uint64_t piece_index, const uint8_t* buffer,
+                         uint32_t piece_size, uint32_t bad_blocks) {
+  uint64_t first_block =
+      piece_index * (torrent->piece_size / torrent->block_size);
+
+  if (bad_blocks == 0 &&
+      piece_queued(dl, piece_index,
+                   queue_piece_to_file(piece_index, buffer, piece_size,
+                                       torrent->piece_size)) != 0) {
+    return;
+  }
+
+  for (uint32_t offset = 0; offset < piece_size;
+       offset += torrent->block_size) {
+    uint64_t block = first_block + offset / torrent->block_size;
+    if (get_bit(dl->repair_blocks, block)) {
+      continue;
+    }
+
+    if (bad_blocks > 0 &&
+        piece_queued(dl, piece_index,
+                     queue_piece_to_file(block, buffer + offset,
+                                         torrent_block_length(torrent, block),
+                                         torrent->block_size)) != 0) {
+      return;
+    }
+    set_bit(dl->verified_blocks, block);
+  }
+
+  clear_bit(dl->needed_pieces, piece_index);
+  if (bad_blocks == 0) {
+    complete_piece(torrent, dl, piece_index);
+  }
+}
+
+/**
+ * @brief Verifies a whole needed piece held in memory and writes it, with
+ * the piece hash or block by block when the torrent has a Merkle section.
+ */
+static void store_piece(const eltextorrent_file_t* torrent, download_t* dl,
+                        uint64_t piece_index, const uint8_t* buffer,
+                        uint32_t piece_size) {
+  if (!torrent->blocks_hashes) {
+    if (!verify_received(torrent, buffer, piece_size, 0, piece_index)) {
+      LOG_WARN("Hash verification failed for piece %lu", piece_index);
+      return;
+    }
+
+    if (piece_queued(dl, piece_index,
+                     queue_range_to_file(
+                         torrent_piece_offset(torrent, piece_index), buffer,
+                         piece_size)) != 0) {
+      return;
+    }
+    clear_bit(dl->needed_pieces, piece_index);
+    complete_piece(torrent, dl, piece_index);
+    return;
+  }
+
+  uint64_t first_block =
+      piece_index * (torrent->piece_size / torrent->block_size);
+  uint32_t bad_blocks = 0;
+  for (uint32_t offset = 0; offset < piece_size;
+       offset += torrent->block_size) {
+    uint64_t block = first_block + offset / torrent->block_size;
+    if (!verify_received(torrent, buffer + offset,
+                         torrent_block_length(torrent, block), 1, block)) {
+      LOG_WARN("Hash verification failed for block %lu of piece %lu",
+               block - first_block, piece_index);
+      set_bit(dl->repair_blocks, block);
+      bad_blocks++;
+    }
+  }
+  finish_piece(torrent, dl, piece_index, buffer, piece_size, bad_blocks);
+}
+
+/**
+ * @brief Verifies a block received for repair and writes it, its piece is
+ * complete once every block of it is verified.
+ */
+static void store_block(const eltextorrent_file_t* torrent, download_t* dl,
+                        uint64_t block_index, const uint8_t* buffer,
+                        uint32_t size) {
+  if (!verify_received(torrent, buffer, size, 1, block_index)) {
+    LOG_WARN("Hash verification failed for block %lu", block_index);
+    return;
+  }
+
+  uint64_t blocks_per_piece = torrent->piece_size / torrent->block_size;
+  if (piece_queued(dl, block_index / blocks_per_piece,
+                   queue_piece_to_file(block_index, buffer, size,
+                                       torrent->block_size)) != 0) {
+    return;
+  }
+  clear_bit(dl->repair_blocks, block_index);
+  set_bit(dl->verified_blocks, block_index);
+
+  uint64_t first_block = block_index - block_index % blocks_per_piece;
+  uint64_t last_block = first_block + blocks_per_piece;
+  if (last_block > torrent->blocks_count) {
+    last_block = torrent->blocks_count;
+  }
+
+  for (uint64_t b = first_block; b < last_block; b++) {
+    if (!get_bit(dl->verified_blocks, b)) {
+      return;
+    }
+  }
+
+  complete_piece(torrent, dl, block_index / blocks_per_piece);
+}
+
+/**
+ * @brief Reads what already arrived of a part of an answer. The deadline of
+ * the seeder restarts whenever data comes in, so only a stalled seeder
+ * misses it.
+ *
+ * @return `1` once the part is complete, `0` if more is to come or `-1` if
+ * the connection failed or closed
+ */
+static int receive_into(peers_t* peers, TCPClient_t* client, uint8_t* buffer,
+                        uint32_t size, uint32_t* received) {
+  uint32_t before = *received;
+  int result = 1;
+  while (*received < size) {
+    int count = tcp_client_receive_some(client, (char*)buffer + *received,
+                                        size - *received);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      result = 0;
+      break;
+    }
+    if (count <= 0) {
+      return -1;
+    }
+    *received += (uint32_t)count;
+  }
+
+  if (*received > before) {
+    timer_wheel_schedule(peers->wheel, &client->deadline,
+                         peers->request_timeout_ms);
+  }
+  return result;
+}
+
+/**
+ * @brief Checks the header of an answer and sets up receiving what follows
+ * it. Only a seeder on the same host answers without the data, the
+ * leecher reads it from the file the seeder shared.
+ *
+ * @return `0` on success or `-1` if the answer is unexpected
+ */
+static int start_answer(const eltextorrent_file_t* torrent,
+                        const TCPClient_t* client, answer_state_t* answer) {
+  uint64_t header;
+  memcpy(&header, answer->header, sizeof(header));
+  memcpy(&answer->packet_size, answer->header + sizeof(header),
+         sizeof(answer->packet_size));
+  answer->shared = (header & SHARED_RESPONSE_FLAG) != 0;
+  answer->block = (header & BLOCK_RESPONSE_FLAG) != 0;
+  answer->compressed = (header & COMPRESSED_RESPONSE_FLAG) != 0;
+  answer->index = header & ~(SHARED_RESPONSE_FLAG | BLOCK_RESPONSE_FLAG |
+                             COMPRESSED_RESPONSE_FLAG);
+  answer->received = 0;
+  answer->started = TRACE_NOW();
+
+  if (answer->shared && (!client->local || client->shared_fd < 0)) {
+    LOG_ERROR("%s:%d shared no file", client->ip, client->port);
+    return -1;
+  }
+
+  if (answer->block) {
+    TRACE_END("block request", answer->index);
+    if (!torrent->blocks_hashes || answer->compressed ||
+        answer->index >= torrent->blocks_count ||
+        answer->packet_size != torrent_block_length(torrent, answer->index)) {
+      LOG_ERROR("Unexpected block %lu of size %u", answer->index,
+                answer->packet_size);
+      return -1;
+    }
+    answer->size = answer->packet_size;
+  } else {
+    TRACE_END("piece request", answer->index);
+    answer->size = answer->index < torrent->pieces_count
+                       ? torrent_piece_length(torrent, answer->index)
+                       : 0;
+    if (answer->size == 0 ||
+        (answer->compressed ? answer->packet_size > compress_bound(answer->size)
+                            : answer->packet_size != answer->size)) {
+      LOG_ERROR("Unexpected piece %lu of size %u", answer->index,
+                answer->packet_size);
+      return -1;
+    }
+  }
+
+  answer->data_size = answer->shared ? 0 : answer->packet_size;
+  return 0;
+}
+
+/**
+ * @brief Stores a complete answer and asks the next seeder for a piece.
+ *
+ * A compressed piece is decompressed whole, then verified like a raw one,
+ * with the piece hash or block by block when the torrent has a Merkle
+ * section, and so is a piece read from the file a seeder on the same host
+ * shared. Corrupted blocks are marked for repair and fetched again one by
+ * one, so a bad block never costs a full piece. Data no longer needed is
+ * dropped unchecked.
+ *
+ * @return `0` on success or `-1` if the answer is invalid
+ */
+static int finish_answer(peers_t* peers, TCPClient_t* client,
+                         answer_state_t* answer) {
+  const eltextorrent_file_t* torrent = peers->torrent;
+  download_t* dl = peers->dl;
+  uint8_t* data = answer->data;
+  int needed = get_bit(answer->block ? dl->repair_blocks : dl->needed_pieces,
+                       answer->index);
+
+  if (needed && answer->shared) {
+    // The verified copy in memory is what gets written: the file of the
+    // seeder may change after it was read
+    uint64_t offset = answer->block
+                          ? answer->index * torrent->block_size
+                          : torrent_piece_offset(torrent, answer->index);
+    if (read_shared(client, offset, data, answer->size) < 0) {
+      return -1;
+    }
+  } else if (needed && answer->compressed) {
+    uint64_t started = TRACE_NOW();
+    if (decompress_piece(answer->data, answer->packet_size,
+                         (uint8_t*)dl->piece_buffer, answer->size) != 0) {
+      LOG_WARN("Piece %lu from %s does not decompress", answer->index,
+               client->ip);
+      return -1;
+    }
+    TRACE_SPAN("decompress", answer->index, answer->size, started);
+    data = (uint8_t*)dl->piece_buffer;
+  }
+
+  if (needed && answer->block) {
+    store_block(torrent, dl, answer->index, data, answer->size);
+  } else if (needed) {
+    store_piece(torrent, dl, answer->index, data, answer->size);
+  }
+  TRACE_SPAN(answer->block ? "block transfer" : "piece transfer",
+             answer->index, answer->packet_size, answer->started);
+  if (!answer->block) {
+    metrics_add(METRIC_PIECES_RECEIVED, NULL, 1);
+  }
+  progress_bar_add_peer(client->ip, answer->packet_size);
+  peer_answered(peers, client);
+  answer->header_received = 0;
+
+  // The next answer is due one timeout after this one
+  if (client->requests_pending > 0) {
+    client->requests_pending--;
+  }
+  if (client->requests_pending > 0) {
+    timer_wheel_schedule(peers->wheel, &client->deadline,
+                         peers->request_timeout_ms);
+  } else {
+    timer_wheel_cancel(peers->wheel, &client->deadline);
+  }
+
+  if (dl->have_pieces < torrent->pieces_count) {
+    // Cycle to next client
+    peers->current = next_connected(peers->clients, peers->current);
+    if (peers->current) {
+      send_request(peers, peers->current->client);
+    }
   }
-  return piece_index_buf;
+  return 0;
 }
 
 static void init_leecher(eltextorrent_file_t* torrent, char* full_file_path,
                          const Config* cfg) {
   if (torrent_loader(torrent, cfg->torrent_path) < 0) {
-    fprintf(stderr, "torrent_loader failed\n");
+    LOG_ERROR("torrent_loader failed");
     exit(EXIT_FAILURE);
   }
   if (build_full_path(full_file_path, PATH_MAX, cfg->data_path,
                       torrent->name) != 0) {
-    fprintf(stderr, "Failed to build full path\n");
+    LOG_ERROR("Failed to build full path");
     exit(EXIT_FAILURE);
   }
-  printf("Loaded Torrent file with INFOHASH [%s]\n", torrent->infohash);
-  printf("Piece count [%u]\n", torrent->pieces_count);
+  LOG_INFO("Loaded Torrent file with INFOHASH [%s]", torrent->infohash);
+  LOG_INFO("Piece count [%u]", torrent->pieces_count);
 }
 
-static ClientNode* event_client_connect(udp_broadcast_receiver_t* udprec,
-                                        char* buffer,
-                                        const uint8_t* needed_pieces,
-                                        const eltextorrent_file_t* torrent,
-                                        ClientNode** current_client,
-                                        ClientNode* clients, int epoll_fd) {
-  char sender_ip[INET_ADDRSTRLEN + 6];
-  int received = udp_broadcast_receiver_receive(
-      udprec, buffer, NETWORK_BUFFER_SIZE, sender_ip, sizeof(sender_ip));
-  if (received > 0) {
-    printf("received UDP broadcast: [%s] from [%s]\n", buffer, sender_ip);
-
-    int port;
-    if (split_ip_port(buffer, &port) == 0) {
-      printf("IP: %s\nPort: %d\n", buffer, port);
-      TCPClient_t* new_client = tcp_client_create();
-      if (tcp_client_connect(new_client, buffer, port) == 0) {
-        clients = client_list_add(clients, new_client);
-
-        if (!*current_client) {
-          *current_client = clients;  // Разыменовываем указатель
-        }
-
-        uint64_t next_piece =
-            find_next_piece(needed_pieces, torrent->pieces_count);
-        const char* piece_i_str = format_piece_index(next_piece);
-        if (!piece_i_str) {
-          fprintf(stderr, "Failed to format piece index\n");
-          return clients;
-        }
-
-        tcp_client_send(new_client, piece_i_str, PIECE_INDEX_BUF_SIZE);
-        add_to_epoll(epoll_fd, new_client->socket_fd);
-      } else {
-        tcp_client_destroy(new_client);
-      }
-    } else {
-      fprintf(stderr, "Failed to split or max clients reached\n");
+/**
+ * @brief Marks pieces already written to the output file as received.
+ *
+ * @param received Array of pieces_count bytes, `1` for every written piece
+ * @return Number of bytes in the marked pieces
+ */
+static uint64_t mark_pieces_received(const eltextorrent_file_t* torrent,
+                                     const uint8_t* received, download_t* dl) {
+  uint64_t bytes = 0;
+  uint64_t blocks_per_piece =
+      torrent->blocks_hashes ? torrent->piece_size / torrent->block_size : 0;
+  for (uint64_t i = 0; i < torrent->pieces_count; i++) {
+    if (!received[i]) {
+      continue;
     }
+
+    clear_bit(dl->needed_pieces, i);
+    for (uint64_t b = i * blocks_per_piece;
+         b < (i + 1) * blocks_per_piece && b < torrent->blocks_count; b++) {
+      set_bit(dl->verified_blocks, b);
+    }
+    bytes += torrent_piece_length(torrent, i);
+    dl->have_pieces++;
   }
-  return clients;
+  dl->have_bytes += bytes;
+  return bytes;
 }
 
-static void handle_tcp_client(ClientNode** clients, ClientNode** current_client,
-                              eltextorrent_file_t* torrent,
-                              uint8_t* needed_pieces, uint64_t* have_pieces,
-                              int epoll_fd, char* piece_buffer, int client_fd) {
-  TCPClient_t* client = client_list_find(*clients, client_fd);
-  if (!client) {
+/**
+ * @brief Marks pieces found in the previous version of the file as received.
+ *
+ * @return `0` on success or `-1` on error
+ */
+static int reuse_base_pieces(const eltextorrent_file_t* torrent,
+                             const Config* cfg, int in_place, download_t* dl) {
+  eltextorrent_file_t base_torrent = {0};
+  int has_base_torrent = strlen(cfg->base_torrent_path) > 0;
+
+  if (has_base_torrent &&
+      torrent_loader(&base_torrent, cfg->base_torrent_path) < 0) {
+    LOG_ERROR("Failed to load base torrent: %s", cfg->base_torrent_path);
+    return -1;
+  }
+
+  uint8_t* reused = calloc(torrent->pieces_count + 1, 1);
+  if (!reused) {
+    torrent_free(&base_torrent);
+    return -1;
+  }
+
+  int64_t count =
+      delta_reuse_pieces(torrent, cfg->base_path,
+                         has_base_torrent ? &base_torrent : NULL, !in_place,
+                         reused);
+  torrent_free(&base_torrent);
+  if (count < 0) {
+    free(reused);
+    return -1;
+  }
+
+  uint64_t reused_bytes = mark_pieces_received(torrent, reused, dl);
+  free(reused);
+
+  LOG_INFO("Reused %" PRId64 " of %u pieces (%" PRIu64
+           " bytes) from the base file", count, torrent->pieces_count,
+           reused_bytes);
+  return 0;
+}
+
+/**
+ * @brief Fills still needed pieces from files in the local directories.
+ *
+ * @return `0` on success or `-1` on error
+ */
+static int fill_from_local_data(const eltextorrent_file_t* torrent,
+                                const char* full_file_path, const Config* cfg,
+                                download_t* dl) {
+  local_index_t* index = local_index_build(
+      torrent, cfg->local_dirs, cfg->local_dirs_count,
+      strlen(cfg->index_path) > 0 ? cfg->index_path : NULL, full_file_path);
+  if (!index) {
+    LOG_ERROR("Failed to index local data");
+    return -1;
+  }
+
+  uint8_t* filled = calloc(torrent->pieces_count + 1, 1);
+  if (!filled) {
+    local_index_free(index);
+    return -1;
+  }
+
+  uint64_t reflinked = 0;
+  int64_t count = local_index_fill(index, torrent, dl->needed_pieces, filled,
+                                   &reflinked);
+  local_index_free(index);
+  if (count < 0) {
+    free(filled);
+    return -1;
+  }
+
+  uint64_t filled_bytes = mark_pieces_received(torrent, filled, dl);
+  free(filled);
+
+  LOG_INFO("Filled %" PRId64 " of %u pieces (%" PRIu64
+           " bytes) from local data, %" PRIu64 " reflinked", count,
+           torrent->pieces_count, filled_bytes, reflinked);
+  return 0;
+}
+
+/**
+ * @brief Opens the output file, reusing the previous version when given.
+ *
+ * When the base file is the output file itself, it is resized instead of
+ * truncated and matching pieces stay where they are. Pieces still missing
+ * are then looked up in the local directories.
+ *
+ * @return `0` on success or `-1` on error
+ */
+static int init_output(const eltextorrent_file_t* torrent,
+                       const char* full_file_path, const Config* cfg,
+                       download_t* dl) {
+  struct stat base_st, output_st;
+  int has_base = strlen(cfg->base_path) > 0;
+  int in_place = 0;
+
+  if (has_base) {
+    if (stat(cfg->base_path, &base_st) != 0) {
+      LOG_ERROR("Base file not found: %s", strerror(errno));
+      return -1;
+    }
+    in_place = stat(full_file_path, &output_st) == 0 &&
+               base_st.st_dev == output_st.st_dev &&
+               base_st.st_ino == output_st.st_ino;
+  }
+
+  int result = in_place
+                   ? file_assembler_resume(full_file_path, torrent->file_size)
+                   : file_assembler_init(full_file_path, torrent->file_size);
+  if (result != 0) {
+    return -1;
+  }
+  // Pieces are copied into the writer queue, the epoll loop never waits on
+  // the disk
+  if (file_assembler_writeback(cfg->durability) != 0) {
+    file_assembler_abort();
+    return -1;
+  }
+
+  if (has_base && reuse_base_pieces(torrent, cfg, in_place, dl) != 0) {
+    file_assembler_abort();
+    return -1;
+  }
+  if (cfg->local_dirs_count > 0 && dl->have_pieces < torrent->pieces_count &&
+      fill_from_local_data(torrent, full_file_path, cfg, dl) != 0) {
+    file_assembler_abort();
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Starts reading from a client once it is connected and asks it for a
+ * piece.
+ */
+static void client_ready(peers_t* peers, TCPClient_t* client) {
+  timer_wheel_cancel(peers->wheel, &client->deadline);
+  metrics_add(METRIC_CONNECTIONS, NULL, 1);
+
+  // Answers are read as they arrive and resumed on the next edge, a
+  // seeder stalling mid-piece only misses its deadline
+  client->answer = calloc(1, sizeof(answer_state_t) +
+                                 compress_bound(peers->torrent->piece_size));
+  if (!client->answer || tcp_set_non_blocking(client, 1) < 0 ||
+      reactor_modify(peers->reactor, &client->source, EPOLLIN | EPOLLET) <
+          0) {
+    drop_client(peers, client);
     return;
   }
+  send_request(peers, client);
 
-  uint64_t piece_index = 0;
-  tcp_client_receive(client, (char*)&piece_index, sizeof(piece_index));
-  uint32_t packet_size = 0;
-  tcp_client_receive(client, (char*)&packet_size, sizeof(packet_size));
+  if (!peers->current) {
+    peers->current = next_connected(peers->clients, NULL);
+  }
+}
 
-  int received = tcp_client_receive(client, piece_buffer, packet_size);
-  if (received > 0) {
-    if (get_bit(needed_pieces, piece_index)) {
-      clear_bit(needed_pieces, piece_index);
+/**
+ * @brief Continues the TLS handshake of a client, the client is ready once it
+ * is done.
+ */
+static void continue_handshake(peers_t* peers, TCPClient_t* client) {
+  int wanted = tls_handshake(client);
+  if (wanted < 0 ||
+      (wanted > 0 &&
+       reactor_modify(peers->reactor, &client->source, wanted) != 0)) {
+    connect_failed(peers, client);
+    drop_client(peers, client);
+  } else if (wanted == 0) {
+    client_ready(peers, client);
+  }
+}
 
-      int hash_correct = verify_piece_hash(torrent, (uint8_t*)piece_buffer,
-                                           received, piece_index);
-      if (hash_correct == 0) {
-        printf("ERROR: Hash verification failed for piece %lu\n", piece_index);
-      }
+/**
+ * @brief Starts the TLS handshake of a client that just connected, a
+ * plaintext client is ready right away.
+ */
+static void client_connected(peers_t* peers, TCPClient_t* client) {
+  // Nothing leaves the host on a local connection, it needs no TLS
+  if (!peers->tls || client->local) {
+    client_ready(peers, client);
+    return;
+  }
 
-      write_piece_to_file(piece_index, (uint8_t*)piece_buffer, received,
-                          torrent->piece_size);
-      (*have_pieces)++;
-      update_progress_bar(torrent->file_size,
-                          torrent->piece_size * (*have_pieces));
-
-      if (*have_pieces < torrent->pieces_count) {
-        // Cycle to next client
-        if (*current_client) {
-          *current_client = (*current_client)->next;
-          if (!*current_client) {
-            *current_client = *clients;
-          }
-        }
-
-        if (*current_client) {
-          TCPClient_t* next_client = (*current_client)->client;
-          uint64_t next_piece =
-              find_next_piece(needed_pieces, torrent->pieces_count);
-          const char* piece_i_str = format_piece_index(next_piece);
-          if (!piece_i_str) {
-            fprintf(stderr, "Failed to format piece index\n");
-            return;
-          }
-          tcp_client_send(next_client, piece_i_str, PIECE_INDEX_BUF_SIZE);
-        }
-      }
+  if (tls_start(peers->tls, client) != 0) {
+    connect_failed(peers, client);
+    drop_client(peers, client);
+    return;
+  }
+  if (!timer_pending(&client->deadline)) {
+    timer_wheel_schedule(peers->wheel, &client->deadline,
+                         peers->connect_timeout_ms);
+  }
+  continue_handshake(peers, client);
+}
+
+/**
+ * @brief Receives what arrived of the answer a seeder is sending, its header
+ * then its data, and stores the answer once it is complete.
+ *
+ * @return `1` if an answer was complete, `0` if more data is to come or `-1`
+ * if the client was dropped
+ */
+static int receive_answer(peers_t* peers, TCPClient_t* client) {
+  answer_state_t* answer = client->answer;
+  int result = 1;
+  if (answer->header_received < ANSWER_HEADER_SIZE) {
+    result = receive_into(peers, client, answer->header, ANSWER_HEADER_SIZE,
+                          &answer->header_received);
+    if (result > 0 && client->request_sent_ns) {
+      metrics_observe(METRIC_REQUEST_RTT,
+                      metrics_now_ns() - client->request_sent_ns);
+      client->request_sent_ns = 0;
     }
-  } else {
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
-    tcp_client_destroy(client);
+    if (result > 0 && start_answer(peers->torrent, client, answer) != 0) {
+      result = -1;
+    }
+  }
+  if (result > 0) {
+    result = receive_into(peers, client, answer->data, answer->data_size,
+                          &answer->received);
+  }
+  if (result > 0 && finish_answer(peers, client, answer) != 0) {
+    result = -1;
+  }
 
-    // Remove from list
-    *clients = client_list_remove(*clients, client);
+  if (result < 0) {
+    drop_client(peers, client);
+  }
+  return result;
+}
 
-    if (*current_client && (*current_client)->client == client) {
-      *current_client = (*current_client)->next;
+/**
+ * @brief Resumes the requests once the write queue that paused them drained.
+ */
+static void handle_write_space(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  peers_t* peers = source->ctx;
+  uint64_t count;
+  if (read(source->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("eventfd read failed: %s", strerror(errno));
+  }
+  peers->dl->paused = 0;
+  keep_requesting(peers);
+}
+
+static void handle_client(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  peers_t* peers = source->ctx;
+  TCPClient_t* client = REACTOR_CONTAINER(source, TCPClient_t, source);
+
+  if (client->connect_started_ns) {
+    uint64_t started = client->connect_started_ns;
+    int result = tcp_client_connect_finish(client);
+    if (result > 0) {
+      // Not the answer of the seeder yet
+      return;
+    }
+    if (result < 0) {
+      connect_failed(peers, client);
+      drop_client(peers, client);
+      return;
+    }
+    TRACE_SPAN("connect", client->port, 0, started);
+    client_connected(peers, client);
+    return;
+  }
+  if (tls_handshaking(client)) {
+    continue_handshake(peers, client);
+    return;
+  }
+
+  // Edge-triggered, so everything already received is read now. A dropped
+  // client has no socket left, which ends the loop
+  while (client->socket_fd >= 0) {
+    if (receive_answer(peers, client) <= 0) {
+      return;
     }
   }
 }
 
-void run_leecher_mode(int epoll_fd, int signal_fd, const Config* cfg) {
+/**
+ * @brief Finds the local socket of a seeder on the same host. Past the
+ * address and a NUL byte, its discovery answer has the boot id of its host
+ * and the socket name.
+ *
+ * @return `1` if the seeder runs on this host and has a socket, `0`
+ * otherwise
+ */
+static int same_host_socket(const peers_t* peers, const char* answer,
+                            int size, char* name) {
+  char host_id[LOCAL_PEER_HOST_ID_SIZE];
+  size_t length = strnlen(answer, (size_t)size);
+  if (strlen(peers->host_id) == 0 || (int)length + 1 >= size ||
+      size >= NETWORK_BUFFER_SIZE) {
+    return 0;
+  }
+  return sscanf(answer + length + 1, "%36s %107s", host_id, name) == 2 &&
+         strcmp(host_id, peers->host_id) == 0;
+}
+
+/**
+ * @brief Connects to the local socket of a seeder on the same host, under
+ * its TCP address so that both count as the same peer.
+ *
+ * @return The client, or NULL if the socket can not be reached from here
+ * and TCP is used instead
+ */
+static TCPClient_t* connect_local(const char* ip, in_port_t port,
+                                  const char* name) {
+  TCPClient_t* client = local_peer_client_create();
+  if (!client) {
+    return NULL;
+  }
+
+  snprintf(client->ip, sizeof(client->ip), "%s", ip);
+  client->port = port;
+  if (local_peer_connect(client, name) < 0) {
+    tcp_client_destroy(client);
+    return NULL;
+  }
+  return client;
+}
+
+static void handle_discovery_answer(reactor_source_t* source,
+                                    uint32_t events) {
+  (void)events;
+  peers_t* peers = source->ctx;
   char buffer[NETWORK_BUFFER_SIZE];
-  char full_file_path[PATH_MAX];
-  int shutdown_requested = 0;
-  struct epoll_event events[MAX_EPOLL_EVENTS];
+  char sender_ip[INET_ADDRSTRLEN + 6];
+  int received = udp_broadcast_receiver_receive(
+      peers->answers, buffer, sizeof(buffer), sender_ip, sizeof(sender_ip));
+  if (received <= 0) {
+    return;
+  }
+  LOG_DEBUG("received UDP broadcast: [%s] from [%s]", buffer, sender_ip);
+  char local_name[LOCAL_PEER_NAME_SIZE];
+  int local = same_host_socket(peers, buffer, received, local_name);
+
+  int port;
+  if (split_ip_port(buffer, &port) != 0) {
+    LOG_ERROR("Failed to split or max clients reached");
+    return;
+  }
+
+  // Seeders answer every broadcast, including those of other leechers, so
+  // an answer is also how a peer that failed gets retried
+  if (client_list_find_peer(peers->clients, buffer, (in_port_t)port)) {
+    return;
+  }
+  connect_backoff_t* backoff = find_backoff(peers, buffer, (in_port_t)port);
+  if (backoff && metrics_now_ns() < backoff->retry_ns) {
+    return;
+  }
+
+  LOG_DEBUG("Discovered seeder %s:%d", buffer, port);
+  uint64_t started = TRACE_NOW();
+  int result = 1;
+  TCPClient_t* new_client =
+      local ? connect_local(buffer, (in_port_t)port, local_name) : NULL;
+  if (!new_client) {
+    new_client = peers->udp ? udp_stream_client_create(peers->wheel)
+                            : tcp_client_create();
+    if (!new_client) {
+      return;
+    }
+    result = tcp_client_connect_start(new_client, buffer, (in_port_t)port);
+  }
+  timer_init(&new_client->deadline, client_deadline, peers);
+  if (result < 0) {
+    connect_failed(peers, new_client);
+    tcp_client_destroy(new_client);
+    return;
+  }
+
+  // Connects run in parallel, each completes when its socket is writable,
+  // or for a UDP stream when the answer of the seeder arrives, and for a
+  // local socket the shared file
+  if (reactor_add(peers->reactor, &new_client->source, new_client->socket_fd,
+                  new_client->udp || new_client->local ? EPOLLIN : EPOLLOUT,
+                  handle_client, peers) < 0) {
+    tcp_client_destroy(new_client);
+    return;
+  }
+  peers->clients = client_list_add(peers->clients, new_client);
 
-  ClientNode* clients = client_list_create();
-  ClientNode* current_client = NULL;  // Теперь это указатель
+  if (result == 0) {
+    TRACE_SPAN("connect", (uint64_t)port, 0, started);
+    client_connected(peers, new_client);
+  } else {
+    timer_wheel_schedule(peers->wheel, &new_client->deadline,
+                         peers->connect_timeout_ms);
+  }
+}
 
-  udp_broadcast_t* udpbr = udp_broadcast_create(UDP_RECEIVE_PORT);
-  udp_broadcast_receiver_t* udprec =
-      udp_broadcast_receiver_create(UDP_BROADCAST_PORT);
-  add_to_epoll(epoll_fd, udprec->socket_fd);
+/**
+ * @brief Takes the pieces the multicast group completed.
+ */
+static void handle_multicast(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  peers_t* peers = source->ctx;
+  const eltextorrent_file_t* torrent = peers->torrent;
+  uint32_t piece;
+  const uint8_t* data;
 
-  int tfd = create_timerfd(TIMER_INTERVAL_SEC);
-  add_to_epoll(epoll_fd, tfd);
+  while (multicast_receiver_receive(peers->multicast, &piece, &data) > 0) {
+    uint32_t size = torrent_piece_length(torrent, piece);
+    metrics_add(METRIC_PIECES_RECEIVED, NULL, 1);
+    TRACE_INSTANT("multicast piece", piece, size);
+    store_piece(torrent, peers->dl, piece, data, size);
+  }
+}
+
+/**
+ * @brief Sends the NAKs of the fragments found missing. Seeders are asked
+ * over TCP for blocks that failed verification, and for pieces while the
+ * group brings nothing.
+ */
+static void multicast_tick(wheel_timer_t* timer, void* arg) {
+  peers_t* peers = arg;
+  multicast_receiver_send_naks(peers->multicast);
+  keep_requesting(peers);
+  timer_wheel_schedule(peers->wheel, timer, MULTICAST_NAK_MS);
+}
+
+/**
+ * @brief Joins the multicast group, once the pieces found locally are
+ * known so they are never NAKed.
+ */
+static int init_multicast(peers_t* peers, const Config* cfg) {
+  peers->multicast = multicast_receiver_create(
+      cfg->multicast_group, cfg->multicast_port, peers->torrent,
+      peers->dl->needed_pieces);
+  if (!peers->multicast ||
+      reactor_add(peers->reactor, &peers->multicast_source,
+                  multicast_receiver_fd(peers->multicast), EPOLLIN,
+                  handle_multicast, peers) < 0) {
+    return -1;
+  }
+  timer_init(&peers->multicast_naks, multicast_tick, peers);
+  timer_wheel_schedule(peers->wheel, &peers->multicast_naks,
+                       MULTICAST_NAK_MS);
+  return 0;
+}
+
+int run_leecher_mode(reactor_t* reactor, const Config* cfg) {
+  char full_file_path[PATH_MAX];
 
   eltextorrent_file_t torrent = {0};
+  download_t dl = {0};
+  peers_t peers = {0};
+  peers.clients = client_list_create();
+  peers.torrent = &torrent;
+  peers.dl = &dl;
+  peers.reactor = reactor;
+  peers.wheel = reactor_wheel(reactor);
+  peers.connect_timeout_ms = cfg->connect_timeout_ms;
+  peers.request_timeout_ms = cfg->request_timeout_ms;
+  peers.udp = cfg->transport == TRANSPORT_UDP;
+  peers.multicast_source.fd = -1;
+  peers.space_source.fd = -1;
+  if (strcmp(cfg->local_socket, LOCAL_PEER_OFF) != 0 &&
+      local_peer_host_id(peers.host_id) != 0) {
+    LOG_WARN("Host id unknown, seeders on this host are reached over TCP");
+  }
+  reactor_task_init(&peers.free_dropped, free_dropped, &peers);
+  if (strlen(cfg->tls_ca_path) > 0) {
+    peers.tls = tls_client_create(cfg->tls_ca_path);
+    if (!peers.tls) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  peers.discovery = udp_broadcast_create(cfg->discovery_port);
+  peers.answers = udp_broadcast_receiver_create(cfg->discovery_port + 1);
+  if (!peers.discovery || !peers.answers ||
+      reactor_add(reactor, &peers.answers_source, peers.answers->socket_fd,
+                  EPOLLIN, handle_discovery_answer, &peers) < 0) {
+    exit(EXIT_FAILURE);
+  }
+
   init_leecher(&torrent, full_file_path, cfg);
 
-  uint8_t* needed_pieces = calloc((torrent.pieces_count + 7) / 8, 1);
-  if (!needed_pieces) {
-    fprintf(stderr, "Failed to allocate needed_pieces\n");
+  dl.needed_pieces = calloc((torrent.pieces_count + 7) / 8, 1);
+  dl.repair_blocks = calloc((torrent.blocks_count + 7) / 8, 1);
+  dl.verified_blocks = calloc((torrent.blocks_count + 7) / 8, 1);
+  if (!dl.needed_pieces || !dl.repair_blocks || !dl.verified_blocks) {
+    LOG_ERROR("Failed to allocate needed_pieces");
     exit(EXIT_FAILURE);
   }
   for (uint64_t i = 0; i < torrent.pieces_count; i++) {
-    set_bit(needed_pieces, i);
+    set_bit(dl.needed_pieces, i);
   }
 
-  file_assembler_init(full_file_path, torrent.file_size);
-  char* piece_buffer = malloc(torrent.piece_size);
-  if (!piece_buffer) {
-    fprintf(stderr, "Failed to allocate piece_buffer\n");
+  if (init_output(&torrent, full_file_path, cfg, &dl) != 0) {
+    LOG_ERROR("Failed to prepare output file");
+    exit(EXIT_FAILURE);
+  }
+  int space_fd = file_assembler_space_fd();
+  if (space_fd >= 0 && reactor_add(reactor, &peers.space_source, space_fd,
+                                   EPOLLIN, handle_write_space, &peers) < 0) {
+    LOG_ERROR("Failed to watch the write queue");
     exit(EXIT_FAILURE);
   }
+  dl.piece_buffer = malloc(torrent.piece_size);
+  if (!dl.piece_buffer) {
+    LOG_ERROR("Failed to allocate piece_buffer");
+    exit(EXIT_FAILURE);
+  }
+  if (strlen(cfg->multicast_group) > 0 && init_multicast(&peers, cfg) != 0) {
+    LOG_ERROR("Failed to join the multicast group");
+    exit(EXIT_FAILURE);
+  }
+  progress_bar_start(torrent.file_size, dl.have_bytes);
 
-  uint64_t have_pieces = 0;
-  while (!shutdown_requested && have_pieces < torrent.pieces_count) {
-    int nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, EPOLL_TIMEOUT_MS);
+  wheel_timer_t discovery;
+  timer_init(&discovery, announce, &peers);
+  timer_wheel_schedule(peers.wheel, &discovery, 0);
 
-    if (nfds == -1) {
-      perror("epoll_wait");
+  while (!reactor_stopped(reactor) && !dl.failed &&
+         dl.have_pieces < torrent.pieces_count) {
+    if (reactor_run_once(reactor, EPOLL_TIMEOUT_MS) < 0) {
       break;
     }
+    progress_bar_tick();
+  }
+  progress_bar_finish();
+  // The writer and its eventfd go away with the output file
+  reactor_remove(reactor, &peers.space_source);
 
-    for (int i = 0; i < nfds; i++) {
-      if (events[i].data.fd == signal_fd) {
-        if (handle_signalfd_event(signal_fd, &shutdown_requested) != 0) {
-          shutdown_requested = 1;
-          break;
-        }
-      } else if (events[i].data.fd == tfd) {
-        uint64_t numExp;
-        ssize_t rs = read(tfd, &numExp, sizeof(uint64_t));
-        if (rs == -1) {
-          fprintf(stderr, "Failed to read in numExp\n");
-        }
-        udp_broadcast_send(udpbr, (const char*)&torrent.infohash, HASH_SIZE);
-      } else if (events[i].data.fd == udprec->socket_fd) {
-        clients = event_client_connect(udprec, buffer, needed_pieces, &torrent,
-                                       &current_client, clients, epoll_fd);
-      } else {
-        handle_tcp_client(&clients, &current_client, &torrent, needed_pieces,
-                          &have_pieces, epoll_fd, piece_buffer,
-                          events[i].data.fd);
-      }
+  if (dl.have_pieces < torrent.pieces_count &&
+      file_assembler_flush() != 0) {
+    LOG_ERROR("Failed to write received pieces");
+    dl.failed = 1;
+  }
+  if (dl.have_pieces == torrent.pieces_count &&
+      file_assembler(torrent.file_size) != 0) {
+    dl.failed = 1;
+  } else if (dl.have_pieces == torrent.pieces_count) {
+    uint64_t writes, written;
+    file_assembler_stats(&writes, &written);
+    LOG_INFO("Wrote %" PRIu64 " bytes in %" PRIu64 " write calls (%s)", written,
+             writes, durability_name(cfg->durability));
+    if (torrent.blocks_hashes) {
+      LOG_INFO("All %u blocks verified against the Merkle root",
+               torrent.blocks_count);
     }
   }
 
-  free(piece_buffer);
-  client_list_destroy(clients);
-  free(needed_pieces);
-  udp_broadcast_destroy(udpbr);
-  udp_broadcast_receiver_destroy(udprec);
+  free(dl.piece_buffer);
+  // The reactor outlives the clients, their timers must not stay linked
+  timer_wheel_cancel(peers.wheel, &discovery);
+  for (ClientNode* node = peers.clients; node; node = node->next) {
+    timer_wheel_cancel(peers.wheel, &node->client->deadline);
+    reactor_remove(reactor, &node->client->source);
+  }
+  reactor_remove(reactor, &peers.answers_source);
+  reactor_remove(reactor, &peers.multicast_source);
+  timer_wheel_cancel(peers.wheel, &peers.multicast_naks);
+  destroy_clients(peers.clients);
+  destroy_clients(peers.dropped);
+  free(dl.needed_pieces);
+  free(dl.repair_blocks);
+  free(dl.verified_blocks);
+  udp_broadcast_destroy(peers.discovery);
+  udp_broadcast_receiver_destroy(peers.answers);
+  tls_context_destroy(peers.tls);
+  multicast_receiver_destroy(peers.multicast);
   torrent_free(&torrent);
+  return dl.failed ? -1 : 0;
 }
@@ -10,26 +10,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
-#include <sys/timerfd.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "bit_torrent.h"
 #include "common/bitfield.h"
 #include "common/client_list.h"
-#include "common/epoll_utils.h"
+#include "common/log.h"
+#include "common/metrics.h"
 #include "common/network_utils.h"
 #include "common/path_utils.h"
+#include "common/reactor.h"
+#include "common/trace.h"
 #include "config/config.h"
+#include "file/compress.h"
+#include "file/delta.h"
 #include "file/file_assembler.h"
+#include "file/file_reader.h"
+#include "file/local_index.h"
 #include "file/torrent_parser.h"
 #include "hash/hash.h"
+#include "network/local_peer.h"
+#include "network/multicast.h"
 #include "network/tcp_client.h"
+#include "network/tls.h"
+#include "network/udp_stream.h"
 #include "network/udp_broadcast.h"
 #include "network/udp_broadcast_receiver.h"
 #include "signals/signals.h"
 #include "ui/progress_bar.h"
 
-void run_leecher_mode(int epoll_fd, int signal_fd, const Config* cfg);
+int run_leecher_mode(reactor_t* reactor, const Config* cfg);
 
 #endif  // LEECHER_H_
\ No newline at end of file
@@ -9,22 +9,31 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "common/bitfield.h"
 #include "common/client_list.h"
-#include "common/epoll_utils.h"
+#include "common/log.h"
+#include "common/metrics.h"
 #include "common/network_utils.h"
 #include "common/path_utils.h"
+#include "common/reactor.h"
+#include "common/scenario.h"
+#include "common/trace.h"
 #include "config/config.h"
+#include "config/settings.h"
+#include "file/disk_latency.h"
 #include "file/file_assembler.h"
 #include "file/file_reader.h"
 #include "file/torrent_parser.h"
 #include "hash/hash.h"
 #include "hash/table.h"
 #include "leecher.h"
+#include "network/control_server.h"
+#include "network/metrics_server.h"
 #include "network/tcp_client.h"
 #include "network/tcp_server.h"
 #include "network/udp_broadcast.h"
@@ -33,37 +42,88 @@
 #include "signals/signals.h"
 #include "ui/progress_bar.h"
 
-#define NO_SUCH_FILE_MSG "%s: No such file or directory\n"
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+#define NO_SUCH_FILE_MSG "%s: No such file or directory"
 
 static int is_path_exist(const char* path) { return access(path, F_OK) == 0; }
 
-static int run_application(const Config* cfg, int epoll_fd, int signal_fd) {
+static void reload_settings(void) { settings_reload(); }
+
+static void handle_signals(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  int shutdown_requested = 0;
+  if (handle_signalfd_event(source->fd, &shutdown_requested) != 0 ||
+      shutdown_requested) {
+    reactor_stop(source->ctx);
+  }
+}
+
+static int run_application(const Config* cfg, reactor_t* reactor) {
+  metrics_server_t* metrics = NULL;
+  control_server_t* control = NULL;
+
   print_client_config(cfg);
 
+  if (strlen(cfg->metrics_addr) > 0) {
+    metrics = metrics_server_create(cfg->metrics_addr, reactor);
+    if (!metrics) {
+      return -1;
+    }
+  }
+
+  if (strlen(cfg->control_addr) > 0) {
+    control = control_server_create(cfg->control_addr, reactor,
+                                    settings_command);
+    if (!control) {
+      metrics_server_destroy(metrics);
+      return -1;
+    }
+  }
+  signals_set_reload_handler(reload_settings);
+
+  int result = 0;
   if (cfg->mode == SEED) {
-    run_seeder_mode(epoll_fd, signal_fd, cfg);
+    run_seeder_mode(reactor, cfg);
   } else {
-    run_leecher_mode(epoll_fd, signal_fd, cfg);
+    result = run_leecher_mode(reactor, cfg);
   }
 
-  return 0;
+  control_server_destroy(control);
+  metrics_server_destroy(metrics);
+  return result;
 }
 
-static void cleanup_resources(int epoll_fd, int signal_fd) {
-  printf("Cleaning up resources...\n");
-
-  if (epoll_fd >= 0) {
-    close(epoll_fd);
+static void log_resource_usage(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return;
   }
+  LOG_INFO("Resource usage: user=%ld.%06ld system=%ld.%06ld max_rss_kb=%ld",
+           (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec,
+           (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec,
+           usage.ru_maxrss);
+}
+
+static void cleanup_resources(reactor_t* reactor, int signal_fd) {
+  LOG_INFO("Cleaning up resources...");
+  log_resource_usage();
+
+  reactor_destroy(reactor);
 
   if (signal_fd >= 0) {
     close(signal_fd);
   }
+
+  trace_shutdown();
+  metrics_free();
+  log_shutdown();
 }
 
 int main(int argc, char* argv[]) {
   int signal_fd = -1;
-  int epoll_fd = -1;
+  reactor_t* reactor = NULL;
+  reactor_source_t signals;
 
   Config config = {0};
   int result = init_config(&config, argc, argv);
@@ -71,38 +131,52 @@ int main(int argc, char* argv[]) {
     return result;
   }
 
+  if (log_init(config.log_path, config.log_levels) != 0) {
+    return -1;
+  }
+  settings_init(&config, argc, argv);
+
+  if (strlen(config.scenario_path) > 0) {
+    scenario_t scenario;
+    if (scenario_load(config.scenario_path, &scenario) != 0) {
+      return -1;
+    }
+    disk_latency_set(&scenario);
+  }
+
+  if (strlen(config.trace_path) > 0 &&
+      trace_init(config.trace_path,
+                 config.mode == SEED ? "seeder" : "leecher") != 0) {
+    return -1;
+  }
+
   if (!is_path_exist(config.torrent_path)) {
-    printf(NO_SUCH_FILE_MSG, config.torrent_path);
+    LOG_ERROR(NO_SUCH_FILE_MSG, config.torrent_path);
     return -1;
   }
 
   if (!is_path_exist(config.data_path)) {
-    printf(NO_SUCH_FILE_MSG, config.data_path);
+    LOG_ERROR(NO_SUCH_FILE_MSG, config.data_path);
     return -1;
   }
 
   signal_fd = setup_signal_handlers();
   if (signal_fd < 0) {
-    fprintf(stderr, "Failed to setup signal handlers\n");
-    return -1;
-  }
-
-  epoll_fd = epoll_create1(0);
-  if (epoll_fd < 0) {
-    perror("epoll_create1");
-    cleanup_resources(epoll_fd, signal_fd);
+    LOG_ERROR("Failed to setup signal handlers");
     return -1;
   }
 
-  if (add_to_epoll(epoll_fd, signal_fd) < 0) {
-    perror("add_to_epoll");
-    cleanup_resources(epoll_fd, signal_fd);
+  reactor = reactor_create();
+  if (!reactor || reactor_add(reactor, &signals, signal_fd, EPOLLIN,
+                              handle_signals, reactor) < 0) {
+    LOG_ERROR("Failed to create the event loop");
+    cleanup_resources(reactor, signal_fd);
     return -1;
   }
 
-  run_application(&config, epoll_fd, signal_fd);
+  result = run_application(&config, reactor);
 
-  cleanup_resources(epoll_fd, signal_fd);
+  cleanup_resources(reactor, signal_fd);
 
-  return 0;
+  return result;
 }
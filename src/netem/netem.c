@@ -0,0 +1,589 @@
+/*
+ * netem: a TCP proxy between leechers and a seeder that impairs the link.
+ *
+ * Every accepted connection gets its own connection to the seeder. Bytes
+ * read from either side are queued as chunks with a release time computed
+ * from the scenario: chunks leave one after another at the rate of the
+ * direction, wait out stalls, and arrive after the delay plus jitter, never
+ * overtaking each other as TCP would not. A direction stops reading once
+ * NETEM_QUEUE_BYTES are in flight, so a slow link pushes back on the sender
+ * like a router buffer would. Past reset_after bytes both ends are reset.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/epoll_utils.h"
+#include "../common/log.h"
+#include "../common/scenario.h"
+#include "../network/tcp_client.h"
+#include "../network/tcp_server.h"
+#include "../signals/signals.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+/* Largest chunk read at once, the granularity of the rate limit */
+#define NETEM_CHUNK_SIZE (16 * 1024)
+/* Bytes in flight per direction before reading stops */
+#define NETEM_QUEUE_BYTES (1024 * 1024)
+#define NETEM_EPOLL_EVENTS 64
+
+typedef struct chunk {
+  uint64_t release_us; /* When it reaches the other end */
+  size_t length;
+  size_t sent;
+  int reset; /* Reset the link instead of sending anything */
+  struct chunk* next;
+  uint8_t data[];
+} chunk_t;
+
+typedef struct {
+  const scenario_rule_t* rule;
+  int from_fd;
+  int to_fd;
+  chunk_t* head;
+  chunk_t* tail;
+  size_t queued;
+  uint64_t forwarded;       /* Bytes read from the source */
+  uint64_t departure_us;    /* When the rate lets the next chunk leave */
+  uint64_t last_release_us; /* Release time of the tail */
+  int eof;                  /* Source closed, or the reset is queued */
+  int shut;                 /* Sink got the end of the stream */
+  int blocked;              /* Sink socket buffer is full */
+} pipe_t;
+
+typedef struct link {
+  TCPClient_t* leecher; /* Accepted connection */
+  TCPClient_t* seeder;  /* Connection to the target */
+  pipe_t up;
+  pipe_t down;
+  uint32_t leecher_events;
+  uint32_t seeder_events;
+  struct link* next;
+} link_t;
+
+typedef struct {
+  in_port_t listen_port;
+  char target_ip[INET_ADDRSTRLEN];
+  in_port_t target_port;
+  const char* scenario_path;
+  const char* log_levels;
+  unsigned seed;
+} netem_options_t;
+
+static scenario_t k_scenario;
+static uint64_t k_started_us = 0;
+static unsigned k_seed = 1;
+
+static uint64_t now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000 -
+         k_started_us;
+}
+
+static void pipe_init(pipe_t* pipe, const scenario_rule_t* rule, int from_fd,
+                      int to_fd) {
+  memset(pipe, 0, sizeof(*pipe));
+  pipe->rule = rule;
+  pipe->from_fd = from_fd;
+  pipe->to_fd = to_fd;
+}
+
+static void pipe_free(pipe_t* pipe) {
+  while (pipe->head) {
+    chunk_t* next = pipe->head->next;
+    free(pipe->head);
+    pipe->head = next;
+  }
+}
+
+/**
+ * @brief Queues a chunk to arrive when the scenario says it would.
+ */
+static void pipe_schedule(pipe_t* pipe, chunk_t* chunk, uint64_t now) {
+  const scenario_rule_t* rule = pipe->rule;
+
+  uint64_t departure = now > pipe->departure_us ? now : pipe->departure_us;
+  departure = scenario_after_stall(rule, departure);
+  if (rule->rate > 0) {
+    departure += chunk->length * 1000000 / rule->rate;
+  }
+  pipe->departure_us = departure;
+
+  chunk->release_us = departure + scenario_delay(rule, &k_seed);
+  if (chunk->release_us < pipe->last_release_us) {
+    chunk->release_us = pipe->last_release_us;
+  }
+  pipe->last_release_us = chunk->release_us;
+
+  if (pipe->tail) {
+    pipe->tail->next = chunk;
+  } else {
+    pipe->head = chunk;
+  }
+  pipe->tail = chunk;
+  pipe->queued += chunk->length;
+}
+
+/**
+ * @brief Reads what the source has while there is room in the queue.
+ *
+ * @return `0` on success or `-1` on error.
+ */
+static int pipe_read(pipe_t* pipe, uint64_t now) {
+  while (!pipe->eof && pipe->queued < NETEM_QUEUE_BYTES) {
+    size_t room = NETEM_CHUNK_SIZE;
+    uint64_t reset_after = pipe->rule->reset_after;
+    if (reset_after > 0 && reset_after - pipe->forwarded < room) {
+      room = reset_after - pipe->forwarded;
+    }
+
+    chunk_t* chunk = malloc(sizeof(chunk_t) + room);
+    if (!chunk) {
+      LOG_ERROR("malloc failed");
+      return -1;
+    }
+
+    ssize_t received = recv(pipe->from_fd, chunk->data, room, 0);
+    if (received <= 0) {
+      free(chunk);
+      if (received == 0) {
+        pipe->eof = 1;
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    chunk->length = (size_t)received;
+    chunk->sent = 0;
+    chunk->reset = 0;
+    chunk->next = NULL;
+    pipe->forwarded += (uint64_t)received;
+    pipe_schedule(pipe, chunk, now);
+
+    // The reset arrives right after the last byte let through
+    if (reset_after > 0 && pipe->forwarded >= reset_after) {
+      chunk_t* reset = calloc(1, sizeof(chunk_t));
+      if (!reset) {
+        LOG_ERROR("calloc failed");
+        return -1;
+      }
+      reset->reset = 1;
+      pipe_schedule(pipe, reset, now);
+      pipe->eof = 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Sends every chunk that has arrived.
+ *
+ * @return `0` on success, `1` if the link has to be reset or `-1` on error.
+ */
+static int pipe_write(pipe_t* pipe, uint64_t now) {
+  pipe->blocked = 0;
+
+  while (pipe->head && pipe->head->release_us <= now) {
+    chunk_t* chunk = pipe->head;
+    if (chunk->reset) {
+      return 1;
+    }
+
+    ssize_t sent = send(pipe->to_fd, chunk->data + chunk->sent,
+                        chunk->length - chunk->sent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        pipe->blocked = 1;
+        return 0;
+      }
+      return -1;
+    }
+
+    chunk->sent += (size_t)sent;
+    if (chunk->sent == chunk->length) {
+      pipe->head = chunk->next;
+      if (!pipe->head) {
+        pipe->tail = NULL;
+      }
+      pipe->queued -= chunk->length;
+      free(chunk);
+    }
+  }
+
+  if (!pipe->head && pipe->eof && !pipe->shut) {
+    shutdown(pipe->to_fd, SHUT_WR);
+    pipe->shut = 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Interest in a socket given the pipes reading from and writing to it.
+ */
+static uint32_t socket_events(const pipe_t* reading, const pipe_t* writing) {
+  uint32_t events = 0;
+  if (!reading->eof && reading->queued < NETEM_QUEUE_BYTES) {
+    events |= EPOLLIN;
+  }
+  if (writing->blocked) {
+    events |= EPOLLOUT;
+  }
+  return events;
+}
+
+static void update_events(int epoll_fd, int fd, uint32_t* current,
+                          uint32_t events, link_t* link) {
+  if (*current == events) {
+    return;
+  }
+
+  struct epoll_event event = {0};
+  event.events = events;
+  event.data.ptr = link;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+    *current = events;
+  }
+}
+
+/**
+ * @brief Moves data both ways.
+ *
+ * @return `0` while the link is open, `1` if it has to be reset, `-1` once
+ * it is done or failed.
+ */
+static int link_pump(link_t* link, int epoll_fd, uint64_t now) {
+  if (pipe_read(&link->up, now) != 0 || pipe_read(&link->down, now) != 0) {
+    return -1;
+  }
+
+  int up = pipe_write(&link->up, now);
+  int down = pipe_write(&link->down, now);
+  if (up < 0 || down < 0) {
+    return -1;
+  }
+  if (up > 0 || down > 0) {
+    return 1;
+  }
+  if (link->up.shut && link->down.shut) {
+    return -1;
+  }
+
+  update_events(epoll_fd, link->leecher->socket_fd, &link->leecher_events,
+                socket_events(&link->up, &link->down), link);
+  update_events(epoll_fd, link->seeder->socket_fd, &link->seeder_events,
+                socket_events(&link->down, &link->up), link);
+  return 0;
+}
+
+/**
+ * @brief Closes both ends, with a RST instead of a FIN if reset is set.
+ */
+static void link_close(link_t* link, TCPServer_t* server, int reset) {
+  LOG_INFO("Link %s:%d %s after %llu bytes up, %llu down", link->leecher->ip,
+           link->leecher->port, reset ? "reset" : "closed",
+           (unsigned long long)link->up.forwarded,
+           (unsigned long long)link->down.forwarded);
+
+  if (reset) {
+    struct linger linger = {1, 0};
+    setsockopt(link->leecher->socket_fd, SOL_SOCKET, SO_LINGER, &linger,
+               sizeof(linger));
+    setsockopt(link->seeder->socket_fd, SOL_SOCKET, SO_LINGER, &linger,
+               sizeof(linger));
+  }
+
+  tcp_server_disclient(server, link->leecher);
+  tcp_client_destroy(link->seeder);
+  pipe_free(&link->up);
+  pipe_free(&link->down);
+  free(link);
+}
+
+/**
+ * @brief Turns Nagle's algorithm off, the proxy forwards what it reads at
+ * once and a small write held back for an ACK would add latency no rule
+ * asked for.
+ */
+static void set_no_delay(int socket_fd) {
+  int on = 1;
+  if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+    ERRNO_MSG("setsockopt failed");
+  }
+}
+
+static link_t* link_open(TCPClient_t* leecher, const netem_options_t* options,
+                         int epoll_fd) {
+  link_t* link = calloc(1, sizeof(link_t));
+  TCPClient_t* seeder = tcp_client_create();
+  if (!link || !seeder ||
+      tcp_client_connect(seeder, options->target_ip, options->target_port) !=
+          0 ||
+      tcp_client_set_non_blocking(seeder, 1) != 0 ||
+      socket_set_non_blocking(leecher->socket_fd, 1) != 0) {
+    free(link);
+    tcp_client_destroy(seeder);
+    return NULL;
+  }
+
+  set_no_delay(leecher->socket_fd);
+  set_no_delay(seeder->socket_fd);
+  link->leecher = leecher;
+  link->seeder = seeder;
+  pipe_init(&link->up, &k_scenario.rules[SCENARIO_UP], leecher->socket_fd,
+            seeder->socket_fd);
+  pipe_init(&link->down, &k_scenario.rules[SCENARIO_DOWN], seeder->socket_fd,
+            leecher->socket_fd);
+  link->leecher_events = EPOLLIN;
+  link->seeder_events = EPOLLIN;
+
+  if (add_to_epoll_ptr(epoll_fd, leecher->socket_fd, link) != 0 ||
+      add_to_epoll_ptr(epoll_fd, seeder->socket_fd, link) != 0) {
+    tcp_client_destroy(seeder);
+    free(link);
+    return NULL;
+  }
+
+  LOG_INFO("Link %s:%d <-> %s:%d", leecher->ip, leecher->port,
+           options->target_ip, options->target_port);
+  return link;
+}
+
+static void accept_links(TCPServer_t* server, const netem_options_t* options,
+                         int epoll_fd, link_t** links) {
+  TCPClient_t* leecher;
+  while ((leecher = tcp_server_accept(server))) {
+    link_t* link = link_open(leecher, options, epoll_fd);
+    if (!link) {
+      tcp_server_disclient(server, leecher);
+      continue;
+    }
+    link->next = *links;
+    *links = link;
+  }
+}
+
+/**
+ * @brief Milliseconds until the first chunk that can be sent arrives.
+ */
+static int next_timeout(const link_t* links, uint64_t now) {
+  uint64_t next = UINT64_MAX;
+
+  for (const link_t* link = links; link; link = link->next) {
+    const pipe_t* pipes[] = {&link->up, &link->down};
+    for (int i = 0; i < 2; i++) {
+      if (pipes[i]->head && !pipes[i]->blocked &&
+          pipes[i]->head->release_us < next) {
+        next = pipes[i]->head->release_us;
+      }
+    }
+  }
+
+  if (next == UINT64_MAX) {
+    return -1;
+  }
+  return next <= now ? 0 : (int)((next - now + 999) / 1000);
+}
+
+static int run_proxy(const netem_options_t* options) {
+  int result = -1;
+  int epoll_fd = -1;
+  int signal_fd = -1;
+  int shutdown = 0;
+  link_t* links = NULL;
+  struct epoll_event events[NETEM_EPOLL_EVENTS];
+
+  TCPServer_t* server = tcp_server_create(options->listen_port);
+  if (!server || tcp_server_listen(server, TCP_MAX_CLIENTS) != 0 ||
+      tcp_server_set_non_blocking(server, 1) != 0) {
+    goto cleanup;
+  }
+
+  signal_fd = setup_signal_handlers();
+  epoll_fd = epoll_create1(0);
+  if (signal_fd < 0 || epoll_fd < 0 ||
+      add_to_epoll_ptr(epoll_fd, server->socket_fd, server) != 0 ||
+      add_to_epoll_ptr(epoll_fd, signal_fd, &signal_fd) != 0) {
+    LOG_ERROR("Failed to set up the event loop: %s", strerror(errno));
+    goto cleanup;
+  }
+
+  LOG_INFO("Forwarding port %d to %s:%d", options->listen_port,
+           options->target_ip, options->target_port);
+
+  while (!shutdown) {
+    int nfds = epoll_wait(epoll_fd, events, NETEM_EPOLL_EVENTS,
+                          next_timeout(links, now_us()));
+    if (nfds < 0 && errno != EINTR) {
+      LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+      goto cleanup;
+    }
+
+    for (int i = 0; i < nfds; i++) {
+      if (events[i].data.ptr == &signal_fd) {
+        handle_signalfd_event(signal_fd, &shutdown);
+      } else if (events[i].data.ptr == server) {
+        accept_links(server, options, epoll_fd, &links);
+      }
+    }
+
+    // Few links, so all of them are pumped on every wake-up
+    uint64_t now = now_us();
+    for (link_t** link = &links; *link;) {
+      int state = link_pump(*link, epoll_fd, now);
+      if (state == 0) {
+        link = &(*link)->next;
+        continue;
+      }
+      link_t* done = *link;
+      *link = done->next;
+      link_close(done, server, state > 0);
+    }
+  }
+  result = 0;
+
+cleanup:
+  while (links) {
+    link_t* next = links->next;
+    link_close(links, server, 0);
+    links = next;
+  }
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+  }
+  if (signal_fd >= 0) {
+    close(signal_fd);
+  }
+  if (server) {
+    tcp_server_destroy(server);
+  }
+  return result;
+}
+
+static void print_help(const char* program_name) {
+  printf(
+      "Usage: %s --listen <port> --target <ip:port> [--scenario <file>]\n\n"
+      "TCP proxy with the delay, jitter, rate, stalls and resets of a\n"
+      "scenario file, to put between leechers and a seeder. Start the seeder\n"
+      "with --announce <ip>:<listen port> so leechers connect through it.\n"
+      "OPTIONS:\n"
+      "  -l, --listen <PORT>      Port leechers connect to\n"
+      "  -t, --target <IP:PORT>   Address of the seeder\n"
+      "  -s, --scenario <FILE>    Rules of the up and down links (default: "
+      "none)\n"
+      "  -r, --seed <N>           Seed of the jitter (default: 1)\n"
+      "  -v, --log-level <SPEC>   Log level, e.g. debug\n"
+      "  -h, --help               Show this help message and exit\n\n",
+      program_name);
+}
+
+static int parse_port(const char* text, in_port_t* port) {
+  char* end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || value == 0 || value > 65535) {
+    return -1;
+  }
+  *port = (in_port_t)value;
+  return 0;
+}
+
+static int parse_target(const char* text, netem_options_t* options) {
+  const char* port = strrchr(text, ':');
+  if (!port || (size_t)(port - text) >= sizeof(options->target_ip)) {
+    return -1;
+  }
+
+  memcpy(options->target_ip, text, (size_t)(port - text));
+  options->target_ip[port - text] = '\0';
+
+  struct in_addr addr;
+  if (inet_pton(AF_INET, options->target_ip, &addr) != 1) {
+    return -1;
+  }
+  return parse_port(port + 1, &options->target_port);
+}
+
+int main(int argc, char* argv[]) {
+  static struct option long_options[] = {
+      {"listen", required_argument, 0, 'l'},
+      {"target", required_argument, 0, 't'},
+      {"scenario", required_argument, 0, 's'},
+      {"seed", required_argument, 0, 'r'},
+      {"log-level", required_argument, 0, 'v'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  netem_options_t options = {0};
+  options.seed = 1;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "l:t:s:r:v:h", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'l':
+        if (parse_port(optarg, &options.listen_port) != 0) {
+          fprintf(stderr, "Error: Invalid port '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        if (parse_target(optarg, &options) != 0) {
+          fprintf(stderr, "Error: Invalid target '%s', use IP:PORT\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        options.scenario_path = optarg;
+        break;
+      case 'r':
+        options.seed = (unsigned)strtoul(optarg, NULL, 10);
+        break;
+      case 'v':
+        options.log_levels = optarg;
+        break;
+      case 'h':
+        print_help(argv[0]);
+        return 0;
+      default:
+        print_help(argv[0]);
+        return 1;
+    }
+  }
+
+  if (options.listen_port == 0 || options.target_port == 0) {
+    fprintf(stderr, "Error: --listen and --target are required\n");
+    return 1;
+  }
+
+  if (log_init(NULL, options.log_levels) != 0) {
+    return 1;
+  }
+
+  int result = 1;
+  if (!options.scenario_path ||
+      scenario_load(options.scenario_path, &k_scenario) == 0) {
+    k_seed = options.seed;
+    k_started_us = now_us();
+    result = run_proxy(&options) == 0 ? 0 : 1;
+  }
+
+  log_shutdown();
+  return result;
+}
@@ -1,5 +1,21 @@
 #include "common.h"
 
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+#include "tls.h"
+#include "udp_stream.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+#define LOCAL_DEFAULT_HOST "127.0.0.1"
+#define LOCAL_UNIX_PREFIX "unix:"
+
 int socket_set_non_blocking(int socket_fd, int on) {
   int flags = fcntl(socket_fd, F_GETFL, 0);
   if (flags < 0) {
@@ -21,7 +37,106 @@ int socket_set_non_blocking(int socket_fd, int on) {
   return 0;
 }
 
-int tcp_send(TCPClient_t* client, const char* data, size_t data_size) {
+int socket_has_input(int socket_fd) {
+  if (socket_fd < 0) {
+    return 0;
+  }
+  char byte;
+  ssize_t peeked = recv(socket_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return peeked >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+int tcp_has_input(const TCPClient_t* client) {
+  if (client->udp) {
+    return udp_stream_has_input(client);
+  }
+  return tls_pending(client) > 0 || socket_has_input(client->socket_fd);
+}
+
+int tcp_set_non_blocking(TCPClient_t* client, int on) {
+  if (client->udp) {
+    udp_stream_set_non_blocking(client, on);
+    return 0;
+  }
+  return socket_set_non_blocking(client->socket_fd, on);
+}
+
+ssize_t tcp_recv(TCPClient_t* client, char* buffer, size_t size) {
+  if (client->udp) {
+    return udp_stream_recv(client, buffer, size);
+  }
+  // With kTLS RX the kernel hands out decrypted data, unless OpenSSL read
+  // some of it before the keys moved there
+  if (client->tls &&
+      (!tls_kernel_receive(client) || tls_pending(client) > 0)) {
+    return tls_read(client, buffer, size);
+  }
+  return recv(client->socket_fd, buffer, size, 0);
+}
+
+uint64_t tcp_delivery_rate(const TCPClient_t* client) {
+  if (client->udp) {
+    return udp_stream_delivery_rate(client);
+  }
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(client->socket_fd, IPPROTO_TCP, TCP_INFO, &info, &length) !=
+      0) {
+    return 0;
+  }
+  // Kernels before 4.9 fill in less
+  if (length < offsetof(struct tcp_info, tcpi_delivery_rate) +
+                   sizeof(info.tcpi_delivery_rate)) {
+    return 0;
+  }
+  // Samples taken right after an idle period overshoot a paced socket
+  uint64_t rate = info.tcpi_delivery_rate;
+  if (info.tcpi_max_pacing_rate > 0 && info.tcpi_max_pacing_rate < rate) {
+    rate = info.tcpi_max_pacing_rate;
+  }
+  return rate;
+}
+
+void tcp_count_received(TCPClient_t* client, int64_t bytes) {
+  if (!client->received_bytes) {
+    client->received_bytes =
+        metrics_series(METRIC_PEER_RECEIVED_BYTES, client->ip);
+  }
+  metrics_series_add(client->received_bytes, bytes);
+}
+
+static void count_sent(TCPClient_t* client, int64_t bytes) {
+  if (!client->sent_bytes) {
+    client->sent_bytes = metrics_series(METRIC_PEER_SENT_BYTES, client->ip);
+  }
+  metrics_series_add(client->sent_bytes, bytes);
+}
+
+/**
+ * @brief Sends data with one call, passing flags to send() on plain sockets.
+ *
+ * @return Amount of sent bytes or `-1` on error.
+ */
+static ssize_t send_once(TCPClient_t* client, const char* data, size_t size,
+                         int flags) {
+  if (client->udp) {
+    return udp_stream_send(client, data, size);
+  }
+  // With kTLS TX the kernel encrypts what is sent on the socket
+  if (client->tls && !tls_kernel_send(client)) {
+    return tls_write(client, data, size);
+  }
+  return send(client->socket_fd, data, size, flags);
+}
+
+/**
+ * @brief Sends all the data, passing flags to send() on plain sockets.
+ *
+ * @return Amount of sent bytes or `-1` on error.
+ */
+static int send_all(TCPClient_t* client, const char* data, size_t data_size,
+                    int flags) {
   if (!client || !data || data_size == 0) {
     STDERR_MSG("Wrong parameters");
     return -1;
@@ -34,8 +149,8 @@ int tcp_send(TCPClient_t* client, const char* data, size_t data_size) {
 
   size_t total_sent = 0;
   while (total_sent < data_size) {
-    ssize_t sent =
-        send(client->socket_fd, data + total_sent, data_size - total_sent, 0);
+    ssize_t sent = send_once(client, data + total_sent,
+                             data_size - total_sent, flags);
     if (sent < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         // Wait for socket to be writable, but for simplicity, retry
@@ -53,5 +168,184 @@ int tcp_send(TCPClient_t* client, const char* data, size_t data_size) {
     total_sent += sent;
   }
 
+  count_sent(client, (int64_t)total_sent);
+  return total_sent;
+}
+
+int tcp_send(TCPClient_t* client, const char* data, size_t data_size) {
+  return send_all(client, data, data_size, 0);
+}
+
+int tcp_send_more(TCPClient_t* client, const char* data, size_t data_size) {
+  // kTLS keeps the record open as well
+  return send_all(client, data, data_size, MSG_MORE);
+}
+
+ssize_t tcp_send_some(TCPClient_t* client, const char* data, size_t size,
+                      int more) {
+  if (!client || !data || size == 0) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  if (!client->connected) {
+    STDERR_MSG("trying to send data while not connected");
+    return -1;
+  }
+
+  ssize_t sent = send_once(client, data, size, more ? MSG_MORE : 0);
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return -1;
+  }
+  if (sent <= 0) {
+    ERRNO_MSG("send failed");
+    client->connected = 0;
+    return -1;
+  }
+
+  count_sent(client, (int64_t)sent);
+  return sent;
+}
+
+ssize_t tcp_sendfile(TCPClient_t* client, int fd, uint64_t offset,
+                     size_t size) {
+  if (!client || fd < 0) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  if (!client->connected) {
+    STDERR_MSG("trying to send data while not connected");
+    return -1;
+  }
+  if ((client->tls && !tls_kernel_send(client)) || client->udp) {
+    // The records would have to be encrypted in user space, or the segments
+    // built there
+    errno = ENOSYS;
+    return -1;
+  }
+
+  off_t position = (off_t)offset;
+  size_t total_sent = 0;
+  while (total_sent < size) {
+    ssize_t sent =
+        sendfile(client->socket_fd, fd, &position, size - total_sent);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // A non-blocking socket is full, the caller sends the rest later
+        if (total_sent == 0) {
+          return -1;
+        }
+        break;
+      }
+      if (total_sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+        return -1;
+      }
+      ERRNO_MSG("sendfile failed");
+      client->connected = 0;
+      return -1;
+    }
+    if (sent == 0) {
+      // File is shorter than expected, the peer would wait forever
+      STDERR_MSG("unexpected end of file");
+      client->connected = 0;
+      return -1;
+    }
+    total_sent += sent;
+  }
+
+  count_sent(client, (int64_t)total_sent);
   return total_sent;
-}
\ No newline at end of file
+}
+
+static int listen_unix(const char* path, char* unix_path,
+                       size_t unix_path_size) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path) ||
+      strlen(path) >= unix_path_size) {
+    STDERR_MSG("Unix socket path is too long");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    ERRNO_MSG("socket failed");
+    return -1;
+  }
+
+  // A socket left by a previous run would make bind() fail
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ERRNO_MSG("bind failed");
+    close(fd);
+    return -1;
+  }
+  strcpy(unix_path, path);
+  return fd;
+}
+
+static int listen_tcp(const char* address) {
+  char host[INET_ADDRSTRLEN] = LOCAL_DEFAULT_HOST;
+  const char* port = strrchr(address, ':');
+
+  if (port) {
+    size_t host_length = (size_t)(port - address);
+    if (host_length == 0 || host_length >= sizeof(host)) {
+      STDERR_MSG("Invalid host");
+      return -1;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    port++;
+  } else {
+    port = address;
+  }
+
+  char* end;
+  unsigned long port_number = strtoul(port, &end, 10);
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((in_port_t)port_number);
+  if (*port == '\0' || *end != '\0' || port_number == 0 ||
+      port_number > UINT16_MAX ||
+      inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    STDERR_MSG("Invalid address");
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    ERRNO_MSG("socket failed");
+    return -1;
+  }
+
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ERRNO_MSG("bind failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int socket_listen_local(const char* address, int backlog, char* unix_path,
+                        size_t unix_path_size) {
+  size_t prefix_length = strlen(LOCAL_UNIX_PREFIX);
+  int fd = strncmp(address, LOCAL_UNIX_PREFIX, prefix_length) == 0
+               ? listen_unix(address + prefix_length, unix_path,
+                             unix_path_size)
+               : listen_tcp(address);
+
+  if (fd >= 0 && listen(fd, backlog) < 0) {
+    ERRNO_MSG("listen failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -5,19 +5,38 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#define ERRNO_MSG(msg) printf("[%s] <%s> %s\n", __func__, strerror(errno), msg)
-#define STDERR_MSG(msg) fprintf(stderr, "[%s] %s\n", __func__, msg)
+#include "../common/log.h"
+#include "../common/metrics.h"
+#include "../common/reactor.h"
+#include "../common/timer_wheel.h"
+
+#define ERRNO_MSG(msg) LOG_ERROR("[%s] <%s> %s", __func__, strerror(errno), msg)
+#define STDERR_MSG(msg) LOG_ERROR("[%s] %s", __func__, msg)
 
 typedef struct TCPClient {
   int socket_fd;
   char ip[INET_ADDRSTRLEN];
   in_port_t port;
   int connected;
+  uint64_t request_sent_ns; /* Outstanding request, 0 if none */
+  uint64_t connect_started_ns; /* Connect in progress, 0 if none */
+  uint32_t requests_pending;   /* Requests sent and not answered yet */
+  wheel_timer_t deadline;      /* Connect, request or idle timeout */
+  reactor_source_t source;     /* Registration in the event loop */
+  struct ssl_st* tls;          /* TLS session, NULL for plaintext */
+  struct udp_stream* udp;      /* UDP stream, NULL for TCP */
+  int local;                   /* Unix socket to a peer on the same host */
+  int shared_fd;               /* File a local seeder shared, -1 if none */
+  struct answer_state* answer; /* Answer in transit, NULL if none */
+  /* Traffic counters of ip, looked up on first use and reset with ip */
+  metrics_series_t* sent_bytes;
+  metrics_series_t* received_bytes;
 } TCPClient_t;
 
 /**
@@ -28,6 +47,49 @@ typedef struct TCPClient {
  */
 int socket_set_non_blocking(int socket_fd, int on);
 
+/**
+ * @brief Check without blocking whether a read would return at once, for
+ * handlers of edge-triggered sockets that read until EAGAIN
+ * @param socket_fd File descriptor of the socket, may be `-1`
+ * @return `1` if data, end of stream or an error is pending, `0` otherwise
+ */
+int socket_has_input(int socket_fd);
+
+/**
+ * @brief Like socket_has_input(), also counting data TLS already decrypted
+ * and the data a UDP stream holds
+ * @param client pointer to Client struct
+ * @return `1` if a receive would return at once, `0` otherwise
+ */
+int tcp_has_input(const TCPClient_t* client);
+
+/**
+ * @brief Rate at which the kernel saw the peer acknowledge data, its
+ * estimate of the link capacity, at most the pacing limit of the socket
+ * @param client pointer to Client struct
+ * @return Bytes per second or `0` if unknown
+ */
+uint64_t tcp_delivery_rate(const TCPClient_t* client);
+
+/**
+ * @brief Listen for local control or monitoring connections
+ * @param address `unix:<path>`, `<host>:<port>` or `<port>` on 127.0.0.1
+ * @param backlog Pending connections
+ * @param unix_path Output parameter for the path to unlink on exit, left
+ * untouched for TCP
+ * @param unix_path_size Size of unix_path
+ * @return Non-blocking listening socket or `-1` on error
+ */
+int socket_listen_local(const char* address, int backlog, char* unix_path,
+                        size_t unix_path_size);
+
+/**
+ * @brief Count bytes received from the peer in the series of its address
+ * @param client pointer to Client struct
+ * @param bytes Amount of received bytes
+ */
+void tcp_count_received(TCPClient_t* client, int64_t bytes);
+
 /**
  * @brief Send data to connected server
  * @param client pointer to Client struct
@@ -37,4 +99,64 @@ int socket_set_non_blocking(int socket_fd, int on);
  */
 int tcp_send(TCPClient_t* client, const char* data, size_t data_size);
 
+/**
+ * @brief Send data with a single call, for non-blocking sockets: what the
+ * socket does not take now is left to the caller
+ * @param client pointer to Client struct
+ * @param data self explanatory
+ * @param size self explanatory
+ * @param more `1` if the next send completes the data, see tcp_send_more()
+ * @return Amount of sent bytes or `-1` on error, with errno `EAGAIN` if the
+ * socket is full
+ */
+ssize_t tcp_send_some(TCPClient_t* client, const char* data, size_t size,
+                      int more);
+
+/**
+ * @brief Make receives and sends return at once instead of waiting, UDP
+ * streams included
+ * @param client pointer to Client struct
+ * @param on `1` - enable, `0` - disable
+ * @return `0` on success or `-1` on error
+ */
+int tcp_set_non_blocking(TCPClient_t* client, int on);
+
+/**
+ * @brief Send data that the next send completes, like the header of an
+ * answer: the kernel holds it back and sends it in the same segment as the
+ * data that follows. A TLS session in user space or a UDP stream sends it at
+ * once
+ * @param client pointer to Client struct
+ * @param data self explanatory
+ * @param data_size self explanatory
+ * @return Amount of sent bytes or `-1` on error
+ */
+int tcp_send_more(TCPClient_t* client, const char* data, size_t data_size);
+
+/**
+ * @brief Receive data once from connected peer, like recv(), decrypting it
+ * in user space only if the kernel does not
+ * @param client pointer to Client struct
+ * @param buffer Buffer
+ * @param size Size of buffer
+ * @return Amount of received bytes, `0` if closed or `-1` on error
+ */
+ssize_t tcp_recv(TCPClient_t* client, char* buffer, size_t size);
+
+/**
+ * @brief Send a range of a file to connected peer without copying it to user
+ * space
+ * @param client pointer to Client struct
+ * @param fd File descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param size Amount of bytes to send
+ * @return Amount of sent bytes, less than size once a non-blocking socket
+ * is full, or `-1` on error. If nothing was sent and errno is `EAGAIN`, the
+ * socket is full. If it is `EINVAL` or `ENOSYS`, the file, a TLS session
+ * without kernel offload or a UDP stream does not support sendfile() and the
+ * caller may fall back to tcp_send()
+ */
+ssize_t tcp_sendfile(TCPClient_t* client, int fd, uint64_t offset,
+                     size_t size);
+
 #endif  // NETWORK_COMMON_H_
\ No newline at end of file
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "control_server.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+typedef struct {
+  int fd; /* -1 if the slot is free */
+  reactor_source_t source;
+  char line[CONTROL_LINE_MAX];
+  size_t line_length;
+  char* reply; /* Replies not yet sent, NULL if none */
+  size_t reply_length;
+  size_t reply_sent;
+  int closing; /* Peer is done sending, close once the reply is out */
+} control_connection_t;
+
+struct control_server {
+  int socket_fd;
+  reactor_t* reactor;
+  reactor_source_t source;
+  control_handler_t handler;
+  char unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  control_connection_t connections[CONTROL_MAX_CONNECTIONS];
+};
+
+static void close_connection(control_server_t* server,
+                             control_connection_t* connection) {
+  reactor_remove(server->reactor, &connection->source);
+  close(connection->fd);
+  free(connection->reply);
+  memset(connection, 0, sizeof(control_connection_t));
+  connection->fd = -1;
+  connection->source.fd = -1;
+}
+
+static int watch(control_server_t* server, control_connection_t* connection,
+                 uint32_t events) {
+  return reactor_modify(server->reactor, &connection->source, events);
+}
+
+/**
+ * @brief Runs every complete line in the buffer, appending the replies to
+ * the ones still waiting to be sent.
+ *
+ * @return `0` on success or `-1` if the reply could not be built
+ */
+static int run_commands(control_server_t* server,
+                        control_connection_t* connection) {
+  char* start = connection->line;
+  char* end = connection->line + connection->line_length;
+  char* newline;
+
+  while ((newline = memchr(start, '\n', (size_t)(end - start))) != NULL) {
+    *newline = '\0';
+    if (newline > start && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+
+    char* unsent = connection->reply + connection->reply_sent;
+    size_t unsent_length = connection->reply_length - connection->reply_sent;
+    char* reply = NULL;
+    size_t reply_length = 0;
+    FILE* out = open_memstream(&reply, &reply_length);
+    if (!out) {
+      return -1;
+    }
+    fwrite(unsent, 1, unsent_length, out);
+    if (*start) {
+      server->handler(start, out);
+    }
+    if (fclose(out) != 0) {
+      free(reply);
+      return -1;
+    }
+
+    free(connection->reply);
+    connection->reply = reply;
+    connection->reply_length = reply_length;
+    connection->reply_sent = 0;
+    start = newline + 1;
+  }
+
+  connection->line_length = (size_t)(end - start);
+  memmove(connection->line, start, connection->line_length);
+  return 0;
+}
+
+/**
+ * @brief Sends as much of the replies as the socket takes, waiting for
+ * EPOLLOUT for the rest.
+ *
+ * @return `1` when everything is sent, `0` if more is left or `-1` on error
+ */
+static int send_reply(control_server_t* server,
+                      control_connection_t* connection) {
+  while (connection->reply_sent < connection->reply_length) {
+    ssize_t sent = send(connection->fd,
+                        connection->reply + connection->reply_sent,
+                        connection->reply_length - connection->reply_sent,
+                        MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return watch(server, connection, EPOLLOUT) == 0 ? 0 : -1;
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    connection->reply_sent += (size_t)sent;
+  }
+
+  free(connection->reply);
+  connection->reply = NULL;
+  connection->reply_length = 0;
+  connection->reply_sent = 0;
+  return 1;
+}
+
+static void handle_connection(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  control_server_t* server = source->ctx;
+  control_connection_t* connection =
+      REACTOR_CONTAINER(source, control_connection_t, source);
+  // Stop reading while a reply is stuck so a client that never reads
+  // cannot grow it without bound
+  int writing = connection->reply != NULL;
+  if (!writing && !connection->closing) {
+    ssize_t received =
+        recv(connection->fd, connection->line + connection->line_length,
+             CONTROL_LINE_MAX - connection->line_length, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (received < 0) {
+      close_connection(server, connection);
+      return;
+    }
+    if (received == 0) {
+      // Run the last command even without its newline
+      if (connection->line_length == CONTROL_LINE_MAX) {
+        close_connection(server, connection);
+        return;
+      }
+      connection->line[connection->line_length++] = '\n';
+      connection->closing = 1;
+    } else {
+      connection->line_length += (size_t)received;
+    }
+
+    if (run_commands(server, connection) < 0 ||
+        connection->line_length == CONTROL_LINE_MAX) {
+      close_connection(server, connection);
+      return;
+    }
+  }
+
+  int sent = send_reply(server, connection);
+  if (sent < 0 || (sent == 1 && connection->closing)) {
+    close_connection(server, connection);
+    return;
+  }
+  if (sent == 1 && writing && watch(server, connection, EPOLLIN) < 0) {
+    close_connection(server, connection);
+  }
+}
+
+static void accept_connection(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  control_server_t* server = source->ctx;
+  int fd = accept4(server->socket_fd, NULL, NULL, SOCK_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+
+  for (int i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+    control_connection_t* connection = &server->connections[i];
+    if (connection->fd == -1) {
+      if (reactor_add(server->reactor, &connection->source, fd, EPOLLIN,
+                      handle_connection, server) == 0) {
+        connection->fd = fd;
+        return;
+      }
+      break;
+    }
+  }
+
+  close(fd);
+}
+
+control_server_t* control_server_create(const char* address,
+                                        reactor_t* reactor,
+                                        control_handler_t handler) {
+  if (!address || !*address || !handler) {
+    return NULL;
+  }
+
+  control_server_t* server = calloc(1, sizeof(control_server_t));
+  if (!server) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  server->socket_fd = -1;
+  server->reactor = reactor;
+  server->source.fd = -1;
+  server->handler = handler;
+  for (int i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+    server->connections[i].fd = -1;
+    server->connections[i].source.fd = -1;
+  }
+
+  server->socket_fd =
+      socket_listen_local(address, CONTROL_MAX_CONNECTIONS, server->unix_path,
+                          sizeof(server->unix_path));
+  if (server->socket_fd < 0 ||
+      reactor_add(reactor, &server->source, server->socket_fd, EPOLLIN,
+                  accept_connection, server) < 0) {
+    ERRNO_MSG("Failed to start control server");
+    control_server_destroy(server);
+    return NULL;
+  }
+
+  LOG_INFO("Control on: %s", address);
+  return server;
+}
+
+void control_server_destroy(control_server_t* server) {
+  if (!server) {
+    return;
+  }
+
+  for (int i = 0; i < CONTROL_MAX_CONNECTIONS; i++) {
+    if (server->connections[i].fd != -1) {
+      close_connection(server, &server->connections[i]);
+    }
+  }
+  if (server->socket_fd >= 0) {
+    reactor_remove(server->reactor, &server->source);
+    close(server->socket_fd);
+  }
+  if (server->unix_path[0]) {
+    unlink(server->unix_path);
+  }
+  free(server);
+}
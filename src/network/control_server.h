@@ -0,0 +1,47 @@
+/**
+ * @file control_server.h
+ * @brief Line based control socket served from the main event loop.
+ *
+ * Each line received is one command, passed to the handler with its reply
+ * stream. Connections stay open for any number of commands, so an operator
+ * can keep one open with `socat - UNIX-CONNECT:<path>`. Like the metrics
+ * server, reading and writing never block the transfer.
+ */
+
+#ifndef CONTROL_SERVER_H_
+#define CONTROL_SERVER_H_
+
+#include <stdio.h>
+
+#include "../common/reactor.h"
+
+#define CONTROL_MAX_CONNECTIONS 4
+#define CONTROL_LINE_MAX 1024
+
+typedef struct control_server control_server_t;
+
+/**
+ * @brief Runs one command
+ * @param command Line without the newline
+ * @param reply Stream for the reply lines
+ */
+typedef void (*control_handler_t)(const char* command, FILE* reply);
+
+/**
+ * @brief Start listening and register the socket in the reactor
+ * @param address `unix:<path>`, `<host>:<port>` or `<port>` on 127.0.0.1
+ * @param reactor Event loop that serves the connections
+ * @param handler Called for every command
+ * @return Server on success or NULL on error
+ */
+control_server_t* control_server_create(const char* address,
+                                        reactor_t* reactor,
+                                        control_handler_t handler);
+
+/**
+ * @brief Close the socket and every open connection
+ * @param server Server, may be NULL
+ */
+void control_server_destroy(control_server_t* server);
+
+#endif  // CONTROL_SERVER_H_
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "local_peer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+int local_peer_host_id(char* id) {
+  FILE* file = fopen(BOOT_ID_PATH, "r");
+  if (!file) {
+    ERRNO_MSG("Failed to open " BOOT_ID_PATH);
+    return -1;
+  }
+
+  int result = fgets(id, LOCAL_PEER_HOST_ID_SIZE, file) ? 0 : -1;
+  fclose(file);
+  if (result == 0) {
+    id[strcspn(id, "\n")] = '\0';
+  }
+  return result == 0 && strlen(id) > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Fills the address of a socket name, an abstract name starts with a
+ * NUL byte and is not NUL-terminated.
+ *
+ * @return Length of the address or `0` if the name is too long.
+ */
+static socklen_t local_address(const char* name, struct sockaddr_un* addr) {
+  size_t length = strlen(name);
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (length == 0 || length >= sizeof(addr->sun_path)) {
+    STDERR_MSG("Invalid local socket name");
+    return 0;
+  }
+
+  memcpy(addr->sun_path, name, length);
+  if (name[0] == LOCAL_PEER_ABSTRACT_PREFIX) {
+    addr->sun_path[0] = '\0';
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+  }
+  return (socklen_t)sizeof(*addr);
+}
+
+int local_peer_listen(const char* name, char* unix_path,
+                      size_t unix_path_size) {
+  struct sockaddr_un addr;
+  socklen_t length = local_address(name, &addr);
+  int abstract = name[0] == LOCAL_PEER_ABSTRACT_PREFIX;
+  if (length == 0 || (!abstract && strlen(name) >= unix_path_size)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    ERRNO_MSG("socket failed");
+    return -1;
+  }
+
+  // A socket left by a previous run would make bind() fail
+  if (!abstract) {
+    unlink(name);
+  }
+  if (bind(fd, (struct sockaddr*)&addr, length) < 0 || listen(fd, 64) < 0) {
+    ERRNO_MSG("Failed to listen on the local socket");
+    close(fd);
+    return -1;
+  }
+
+  if (!abstract) {
+    strcpy(unix_path, name);
+  }
+  LOG_INFO("Same-host leechers connect to %s", name);
+  return fd;
+}
+
+int local_peer_send_file(TCPClient_t* client, int fd) {
+  // One byte carries the descriptor, it is the first byte of the stream
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (sendmsg(client->socket_fd, &msg, MSG_NOSIGNAL) != 1) {
+    ERRNO_MSG("Failed to pass the shared file");
+    return -1;
+  }
+  return 0;
+}
+
+TCPClient_t* local_peer_client_create(void) {
+  TCPClient_t* client = calloc(1, sizeof(TCPClient_t));
+  if (!client) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  client->source.fd = -1;
+  client->local = 1;
+  client->shared_fd = -1;
+
+  client->socket_fd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (client->socket_fd < 0) {
+    ERRNO_MSG("socket failed");
+    free(client);
+    return NULL;
+  }
+  return client;
+}
+
+int local_peer_connect(TCPClient_t* client, const char* name) {
+  struct sockaddr_un addr;
+  socklen_t length = local_address(name, &addr);
+  if (length == 0) {
+    return -1;
+  }
+
+  // Never blocks: a Unix socket connects at once, or fails with EAGAIN
+  // when the backlog of the seeder is full
+  if (connect(client->socket_fd, (struct sockaddr*)&addr, length) < 0) {
+    LOG_DEBUG("Local socket %s not reachable: %s", name, strerror(errno));
+    return -1;
+  }
+  client->connect_started_ns = metrics_now_ns();
+  return 1;
+}
+
+int local_peer_connect_finish(TCPClient_t* client) {
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+
+  ssize_t received =
+      recvmsg(client->socket_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 1;
+  }
+
+  client->connect_started_ns = 0;
+  struct cmsghdr* cmsg = received == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    LOG_WARN("Seeder %s:%d did not share its file", client->ip, client->port);
+    return -1;
+  }
+  memcpy(&client->shared_fd, CMSG_DATA(cmsg), sizeof(int));
+
+  struct stat st;
+  if (fstat(client->shared_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    LOG_WARN("Seeder %s:%d shared something else than a file", client->ip,
+             client->port);
+    return -1;
+  }
+  // Answers are read with blocking calls, like on TCP connections
+  if (socket_set_non_blocking(client->socket_fd, 0) != 0) {
+    return -1;
+  }
+
+  client->connected = 1;
+  LOG_INFO("Connected to %s:%d on the same host", client->ip, client->port);
+  return 0;
+}
+
+void local_peer_close(TCPClient_t* client) {
+  if (client->local && client->shared_fd >= 0) {
+    close(client->shared_fd);
+    client->shared_fd = -1;
+  }
+}
@@ -0,0 +1,89 @@
+/**
+ * @file local_peer.h
+ * @brief Connections between a seeder and a leecher on the same host.
+ *
+ * Besides its TCP port, a seeder listens on a Unix socket and puts its name
+ * in the discovery answer, next to the boot id of the host. A leecher that
+ * finds its own boot id there connects to that socket instead, when it can
+ * reach it: an abstract name in the same network namespace, or a path on a
+ * volume both sides mount.
+ *
+ * Right after accepting, the seeder passes the shared file itself over the
+ * socket (SCM_RIGHTS). Requests then go over the socket as usual, but the
+ * answers only carry the header: the leecher reads the range from the file
+ * at memory speed, verifies it and hands the verified copy to its writer
+ * thread, like a piece received over the network.
+ */
+
+#ifndef NETWORK_LOCAL_PEER_H_
+#define NETWORK_LOCAL_PEER_H_
+
+#include <stddef.h>
+
+#include "common.h"
+
+/* Boot id of the host, 36 characters */
+#define LOCAL_PEER_HOST_ID_SIZE 37
+/* Longest socket name and its NUL, the size of sun_path */
+#define LOCAL_PEER_NAME_SIZE 108
+/* Leading character of abstract socket names */
+#define LOCAL_PEER_ABSTRACT_PREFIX '@'
+/* Socket option value that turns same-host connections off */
+#define LOCAL_PEER_OFF "off"
+
+/**
+ * @brief Read the boot id of the host, shared by every container on it
+ * @param id Output buffer of LOCAL_PEER_HOST_ID_SIZE bytes
+ * @return `0` on success or `-1` on error
+ */
+int local_peer_host_id(char* id);
+
+/**
+ * @brief Create the socket same-host leechers connect to
+ * @param name Socket path, or an abstract name after a leading `@`
+ * @param unix_path Output parameter for the path to unlink on exit, left
+ * untouched for an abstract name
+ * @param unix_path_size Size of unix_path
+ * @return Non-blocking listening socket or `-1` on error
+ */
+int local_peer_listen(const char* name, char* unix_path,
+                      size_t unix_path_size);
+
+/**
+ * @brief Pass the shared file to an accepted leecher
+ * @param client Client accepted on the socket from local_peer_listen()
+ * @param fd Descriptor of the shared file
+ * @return `0` on success or `-1` on error
+ */
+int local_peer_send_file(TCPClient_t* client, int fd);
+
+/**
+ * @brief Create a client that connects to a seeder on the same host
+ * @return Client on success or NULL on error
+ */
+TCPClient_t* local_peer_client_create(void);
+
+/**
+ * @brief Connect to the socket of a seeder, the client is connected once
+ * local_peer_connect_finish() returns `0`
+ * @param client Client from local_peer_client_create()
+ * @param name Socket path, or an abstract name after a leading `@`
+ * @return `1` while waiting for the shared file or `-1` if the socket can
+ * not be reached
+ */
+int local_peer_connect(TCPClient_t* client, const char* name);
+
+/**
+ * @brief Take the shared file if it arrived
+ * @param client Connecting client
+ * @return `0` once connected, `1` while still waiting or `-1` on error
+ */
+int local_peer_connect_finish(TCPClient_t* client);
+
+/**
+ * @brief Close the shared file, the socket is left open
+ * @param client Client, does nothing unless it is local
+ */
+void local_peer_close(TCPClient_t* client);
+
+#endif  // NETWORK_LOCAL_PEER_H_
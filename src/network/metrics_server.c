@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "metrics_server.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+#include "common.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+typedef struct {
+  int fd; /* -1 if the slot is free */
+  reactor_source_t source;
+  char request[METRICS_REQUEST_MAX + 1];
+  size_t request_length;
+  char* reply; /* Set once the request is read */
+  size_t reply_length;
+  size_t reply_sent;
+} metrics_connection_t;
+
+struct metrics_server {
+  int socket_fd;
+  reactor_t* reactor;
+  reactor_source_t source;
+  char unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  metrics_connection_t connections[METRICS_MAX_CONNECTIONS];
+};
+
+static void close_connection(metrics_server_t* server,
+                             metrics_connection_t* connection) {
+  reactor_remove(server->reactor, &connection->source);
+  close(connection->fd);
+  free(connection->reply);
+  memset(connection, 0, sizeof(metrics_connection_t));
+  connection->fd = -1;
+  connection->source.fd = -1;
+}
+
+static int build_reply(metrics_connection_t* connection) {
+  size_t body_length;
+  char* body = metrics_render(&body_length);
+  if (!body) {
+    return -1;
+  }
+
+  FILE* out = open_memstream(&connection->reply, &connection->reply_length);
+  if (!out) {
+    free(body);
+    return -1;
+  }
+  fprintf(out,
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: %zu\r\n"
+          "Connection: close\r\n\r\n",
+          body_length);
+  fwrite(body, 1, body_length, out);
+  free(body);
+
+  if (fclose(out) != 0) {
+    free(connection->reply);
+    connection->reply = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Sends as much of the reply as the socket takes, waiting for
+ * EPOLLOUT for the rest.
+ *
+ * @return `1` when everything is sent, `0` if more is left or `-1` on error
+ */
+static int send_reply(metrics_server_t* server,
+                      metrics_connection_t* connection) {
+  while (connection->reply_sent < connection->reply_length) {
+    ssize_t sent = send(connection->fd,
+                        connection->reply + connection->reply_sent,
+                        connection->reply_length - connection->reply_sent,
+                        MSG_NOSIGNAL);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return reactor_modify(server->reactor, &connection->source, EPOLLOUT);
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    connection->reply_sent += (size_t)sent;
+  }
+  return 1;
+}
+
+static void handle_connection(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  metrics_server_t* server = source->ctx;
+  metrics_connection_t* connection =
+      REACTOR_CONTAINER(source, metrics_connection_t, source);
+  if (!connection->reply) {
+    ssize_t received =
+        recv(connection->fd, connection->request + connection->request_length,
+             METRICS_REQUEST_MAX - connection->request_length, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (received > 0) {
+      connection->request_length += (size_t)received;
+      connection->request[connection->request_length] = '\0';
+    }
+
+    // Wait for the end of the headers unless the peer is done sending
+    if (received > 0 && connection->request_length < METRICS_REQUEST_MAX &&
+        !strstr(connection->request, "\r\n\r\n")) {
+      return;
+    }
+    if (received < 0 || connection->request_length == 0 ||
+        build_reply(connection) < 0) {
+      close_connection(server, connection);
+      return;
+    }
+  }
+
+  if (send_reply(server, connection) != 0) {
+    close_connection(server, connection);
+  }
+}
+
+static void accept_connection(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  metrics_server_t* server = source->ctx;
+  int fd = accept4(server->socket_fd, NULL, NULL, SOCK_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+
+  for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+    metrics_connection_t* connection = &server->connections[i];
+    if (connection->fd == -1) {
+      if (reactor_add(server->reactor, &connection->source, fd, EPOLLIN,
+                      handle_connection, server) == 0) {
+        connection->fd = fd;
+        return;
+      }
+      break;
+    }
+  }
+
+  // Too many scrapers at once, they will retry
+  close(fd);
+}
+
+metrics_server_t* metrics_server_create(const char* address,
+                                        reactor_t* reactor) {
+  if (!address || !*address) {
+    return NULL;
+  }
+
+  metrics_server_t* server = calloc(1, sizeof(metrics_server_t));
+  if (!server) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  server->socket_fd = -1;
+  server->reactor = reactor;
+  server->source.fd = -1;
+  for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+    server->connections[i].fd = -1;
+    server->connections[i].source.fd = -1;
+  }
+
+  server->socket_fd =
+      socket_listen_local(address, METRICS_MAX_CONNECTIONS, server->unix_path,
+                          sizeof(server->unix_path));
+  if (server->socket_fd < 0 ||
+      reactor_add(reactor, &server->source, server->socket_fd, EPOLLIN,
+                  accept_connection, server) < 0) {
+    ERRNO_MSG("Failed to start metrics server");
+    metrics_server_destroy(server);
+    return NULL;
+  }
+
+  LOG_INFO("Metrics on: %s", address);
+  return server;
+}
+
+void metrics_server_destroy(metrics_server_t* server) {
+  if (!server) {
+    return;
+  }
+
+  for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+    if (server->connections[i].fd != -1) {
+      close_connection(server, &server->connections[i]);
+    }
+  }
+  if (server->socket_fd >= 0) {
+    reactor_remove(server->reactor, &server->source);
+    close(server->socket_fd);
+  }
+  if (server->unix_path[0]) {
+    unlink(server->unix_path);
+  }
+  free(server);
+}
@@ -0,0 +1,36 @@
+/**
+ * @file metrics_server.h
+ * @brief Serves the metrics registry over HTTP from the main event loop.
+ *
+ * Every request on the socket, whatever its path, is answered with the
+ * current metrics in the Prometheus text format and the connection is
+ * closed. Reading the request and writing the reply never block, so a slow
+ * scraper can not stall the transfer.
+ */
+
+#ifndef METRICS_SERVER_H_
+#define METRICS_SERVER_H_
+
+#include "../common/reactor.h"
+
+#define METRICS_MAX_CONNECTIONS 8
+#define METRICS_REQUEST_MAX 1024
+
+typedef struct metrics_server metrics_server_t;
+
+/**
+ * @brief Start listening and register the socket in the reactor
+ * @param address `unix:<path>`, `<host>:<port>` or `<port>` on 127.0.0.1
+ * @param reactor Event loop that serves the connections
+ * @return Server on success or NULL on error
+ */
+metrics_server_t* metrics_server_create(const char* address,
+                                        reactor_t* reactor);
+
+/**
+ * @brief Close the socket and every open connection
+ * @param server Server, may be NULL
+ */
+void metrics_server_destroy(metrics_server_t* server);
+
+#endif  // METRICS_SERVER_H_
@@ -0,0 +1,846 @@
+#define _GNU_SOURCE
+#include "multicast.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../common/bitfield.h"
+#include "../common/metrics.h"
+#include "../file/torrent_parser.h"
+#include "../thirdparty/uthash.h"
+#include "common.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+/* A 1500 byte MTU minus the IPv4 and UDP headers */
+#define MULTICAST_PACKET_SIZE 1472
+#define MULTICAST_FRAGMENT_SIZE \
+  (MULTICAST_PACKET_SIZE - sizeof(multicast_header_t))
+#define MULTICAST_NAK_RANGES \
+  ((MULTICAST_PACKET_SIZE - sizeof(multicast_header_t)) / sizeof(nak_range_t))
+/* Datagrams per sendmmsg() and recvmmsg() call */
+#define MULTICAST_BATCH 64
+/* Sending may catch up this long after a late timer */
+#define MULTICAST_BURST_MS 10
+/* Kernel buffers, leechers must ride out a slow hash or a busy loop */
+#define MULTICAST_SOCKET_BUFFER (8 * 1024 * 1024)
+/* Memory for partly received pieces, at least two are kept */
+#define MULTICAST_REASSEMBLY_BYTES (64 * 1024 * 1024)
+#define MULTICAST_MIN_SLOTS 2
+/* Runs of missed fragments remembered between two NAKs, beyond that the
+   leecher NAKs everything it needs */
+#define MULTICAST_GAPS 256
+/* Least time between two NAKs of everything needed */
+#define MULTICAST_NAK_ALL_MS 200
+
+enum { PACKET_DATA = 1, PACKET_STATUS, PACKET_NAK };
+
+/* Status: nothing is queued */
+#define PACKET_FLAG_IDLE 1
+
+/* Fields in network byte order */
+typedef struct {
+  uint8_t session[8]; /* First bytes of the infohash */
+  uint8_t type;
+  uint8_t flags;
+  uint16_t count;    /* NAK: ranges that follow */
+  uint32_t reserved;
+  uint64_t fragment; /* Data: this one, status: the last one sent */
+} multicast_header_t;
+
+/* Fragments [begin, end) */
+typedef struct {
+  uint64_t begin;
+  uint64_t end;
+} nak_range_t;
+
+/* Geometry shared by both ends, fragments are numbered piece by piece */
+typedef struct {
+  const eltextorrent_file_t* torrent;
+  uint64_t per_piece; /* Fragments of the largest piece */
+  uint64_t total;     /* per_piece for every piece, short ones have holes */
+  uint8_t session[8];
+} layout_t;
+
+struct multicast_sender {
+  int fd;
+  int data_fd;
+  struct sockaddr_in group;
+  layout_t layout;
+  uint8_t* queued; /* Bitmap of fragments to send */
+  uint64_t queued_count;
+  uint64_t cursor;    /* Next fragment looked at */
+  uint64_t last_sent; /* Reported in the status */
+  uint64_t sent_ns;   /* Sending was paced up to then */
+  int64_t credit;     /* Bytes that may be sent now */
+  uint8_t packets[MULTICAST_BATCH][MULTICAST_PACKET_SIZE];
+};
+
+typedef struct {
+  uint32_t piece;
+  int used;
+  uint32_t count;    /* Fragments of the piece */
+  uint32_t received;
+  uint8_t* bits;     /* Fragments received */
+  uint8_t* data;
+  UT_hash_handle hh;
+} slot_t;
+
+struct multicast_receiver {
+  int fd;
+  layout_t layout;
+  const uint8_t* needed_pieces;
+  struct sockaddr_in sender; /* Where NAKs go, port 0 until heard */
+  uint64_t position; /* Last fragment the sender went past */
+  int positioned;
+  slot_t* slots;
+  uint32_t slots_count;
+  slot_t* used_slots; /* By piece */
+  slot_t* handed; /* Given to the caller, freed on the next call */
+  nak_range_t gaps[MULTICAST_GAPS];
+  uint32_t gaps_count;
+  int nak_all;
+  uint64_t nak_all_ns;
+  uint64_t progress_ns; /* Last needed fragment or the join */
+  /* Datagrams read by recvmmsg() and not processed yet */
+  uint8_t packets[MULTICAST_BATCH][MULTICAST_PACKET_SIZE];
+  struct mmsghdr messages[MULTICAST_BATCH];
+  struct iovec iov[MULTICAST_BATCH];
+  struct sockaddr_in sources[MULTICAST_BATCH];
+  uint32_t batch_count;
+  uint32_t batch_next;
+};
+
+static void layout_init(layout_t* layout,
+                        const eltextorrent_file_t* torrent) {
+  layout->torrent = torrent;
+  layout->per_piece = (torrent->piece_size + MULTICAST_FRAGMENT_SIZE - 1) /
+                      MULTICAST_FRAGMENT_SIZE;
+  layout->total = layout->per_piece * torrent->pieces_count;
+  memcpy(layout->session, torrent->infohash, sizeof(layout->session));
+}
+
+static uint32_t piece_fragments(const layout_t* layout, uint64_t piece) {
+  uint32_t length = torrent_piece_length(layout->torrent, piece);
+  return (length + MULTICAST_FRAGMENT_SIZE - 1) / MULTICAST_FRAGMENT_SIZE;
+}
+
+/**
+ * @brief Size of a fragment, `0` for the holes past the end of short pieces.
+ */
+static uint32_t fragment_size(const layout_t* layout, uint64_t fragment) {
+  uint32_t length =
+      torrent_piece_length(layout->torrent, fragment / layout->per_piece);
+  uint64_t offset = fragment % layout->per_piece * MULTICAST_FRAGMENT_SIZE;
+  if (offset >= length) {
+    return 0;
+  }
+  return length - offset < MULTICAST_FRAGMENT_SIZE
+             ? (uint32_t)(length - offset)
+             : (uint32_t)MULTICAST_FRAGMENT_SIZE;
+}
+
+static void write_header(const layout_t* layout, uint8_t* packet,
+                         uint8_t type, uint8_t flags, uint16_t count,
+                         uint64_t fragment) {
+  multicast_header_t header = {
+      .type = type,
+      .flags = flags,
+      .count = htons(count),
+      .fragment = htobe64(fragment),
+  };
+  memcpy(header.session, layout->session, sizeof(header.session));
+  memcpy(packet, &header, sizeof(header));
+}
+
+/**
+ * @brief Checks that a datagram belongs to the torrent and reads its
+ * header.
+ */
+static int read_header(const layout_t* layout, const uint8_t* packet,
+                       size_t size, multicast_header_t* header) {
+  if (size < sizeof(*header)) {
+    return -1;
+  }
+  memcpy(header, packet, sizeof(*header));
+  if (memcmp(header->session, layout->session, sizeof(header->session)) !=
+      0) {
+    return -1;
+  }
+  header->count = ntohs(header->count);
+  header->fragment = be64toh(header->fragment);
+  return 0;
+}
+
+static int create_socket(void) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    ERRNO_MSG("socket failed");
+    return -1;
+  }
+  // Best effort, the kernel caps them at net.core.[rw]mem_max
+  int size = MULTICAST_SOCKET_BUFFER;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  return fd;
+}
+
+static int parse_group(const char* group, in_port_t port,
+                       struct sockaddr_in* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  if (inet_pton(AF_INET, group, &addr->sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(addr->sin_addr.s_addr))) {
+    LOG_ERROR("Not a multicast group: %s", group);
+    return -1;
+  }
+  return 0;
+}
+
+multicast_sender_t* multicast_sender_create(const char* group, in_port_t port,
+                                            const eltextorrent_file_t* torrent,
+                                            int data_fd) {
+  multicast_sender_t* sender = calloc(1, sizeof(multicast_sender_t));
+  if (!sender) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  sender->data_fd = data_fd;
+  layout_init(&sender->layout, torrent);
+  sender->queued = calloc((sender->layout.total + 7) / 8, 1);
+  if (!sender->queued || parse_group(group, port, &sender->group) != 0 ||
+      (sender->fd = create_socket()) < 0) {
+    free(sender->queued);
+    free(sender);
+    return NULL;
+  }
+
+  // The group stays on the LAN, leechers on this host get it too
+  int ttl = 1;
+  int loop = 1;
+  if (setsockopt(sender->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+                 sizeof(ttl)) < 0 ||
+      setsockopt(sender->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                 sizeof(loop)) < 0) {
+    ERRNO_MSG("setsockopt failed");
+    multicast_sender_destroy(sender);
+    return NULL;
+  }
+  sender->sent_ns = metrics_now_ns();
+  LOG_INFO("Multicasting to %s:%d", group, port);
+  return sender;
+}
+
+int multicast_sender_fd(const multicast_sender_t* sender) {
+  return sender->fd;
+}
+
+/**
+ * @brief Queues a range of fragments, whole bytes of the bitmap at once.
+ */
+static void queue_range(multicast_sender_t* sender, uint64_t begin,
+                        uint64_t end) {
+  uint64_t i = begin;
+  while (i < end) {
+    if (i % 8 == 0 && end - i >= 8) {
+      uint8_t* byte = &sender->queued[i / 8];
+      sender->queued_count += 8 - (uint64_t)__builtin_popcount(*byte);
+      *byte = 0xff;
+      i += 8;
+      continue;
+    }
+    if (!get_bit(sender->queued, i)) {
+      set_bit(sender->queued, i);
+      sender->queued_count++;
+    }
+    i++;
+  }
+}
+
+int multicast_sender_receive(multicast_sender_t* sender) {
+  uint8_t packet[MULTICAST_PACKET_SIZE];
+  multicast_header_t header;
+  int naks = 0;
+
+  ssize_t received;
+  while ((received = recv(sender->fd, packet, sizeof(packet), 0)) >= 0) {
+    if (read_header(&sender->layout, packet, (size_t)received, &header) !=
+            0 ||
+        header.type != PACKET_NAK ||
+        sizeof(header) + header.count * sizeof(nak_range_t) >
+            (size_t)received) {
+      continue;
+    }
+
+    for (uint16_t i = 0; i < header.count; i++) {
+      nak_range_t range;
+      memcpy(&range, packet + sizeof(header) + i * sizeof(range),
+             sizeof(range));
+      uint64_t begin = be64toh(range.begin);
+      uint64_t end = be64toh(range.end);
+      if (end > sender->layout.total) {
+        end = sender->layout.total;
+      }
+      if (begin < end) {
+        queue_range(sender, begin, end);
+      }
+    }
+    naks++;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    ERRNO_MSG("recv failed");
+  }
+  metrics_add(METRIC_MULTICAST_NAKS, NULL, naks);
+  return naks;
+}
+
+/**
+ * @brief Takes the next queued fragment from the cursor on, wrapping
+ * around. Some fragment must be queued.
+ */
+static uint64_t take_queued(multicast_sender_t* sender) {
+  uint64_t i = sender->cursor;
+  for (;;) {
+    if (i >= sender->layout.total) {
+      i = 0;
+    }
+    if (i % 8 == 0 && sender->queued[i / 8] == 0) {
+      i += 8;
+      continue;
+    }
+    if (get_bit(sender->queued, i)) {
+      break;
+    }
+    i++;
+  }
+  clear_bit(sender->queued, i);
+  sender->queued_count--;
+  sender->cursor = i + 1;
+  return i;
+}
+
+/**
+ * @brief Fills a datagram with a fragment read from the file.
+ *
+ * @return Size of the datagram, `0` for a hole or `-1` on error.
+ */
+static ssize_t build_fragment(multicast_sender_t* sender, uint8_t* packet,
+                              uint64_t fragment) {
+  const layout_t* layout = &sender->layout;
+  uint32_t size = fragment_size(layout, fragment);
+  if (size == 0) {
+    return 0;
+  }
+
+  uint64_t offset =
+      torrent_piece_offset(layout->torrent, fragment / layout->per_piece) +
+      fragment % layout->per_piece * MULTICAST_FRAGMENT_SIZE;
+  uint8_t* payload = packet + sizeof(multicast_header_t);
+  if (pread(sender->data_fd, payload, size, (off_t)offset) != size) {
+    ERRNO_MSG("pread failed");
+    return -1;
+  }
+  write_header(layout, packet, PACKET_DATA, 0, 0, fragment);
+  return (ssize_t)(sizeof(multicast_header_t) + size);
+}
+
+int multicast_sender_send(multicast_sender_t* sender, uint64_t rate) {
+  uint64_t now = metrics_now_ns();
+  int64_t burst = (int64_t)(rate * MULTICAST_BURST_MS / 1000);
+  sender->credit += (int64_t)((double)rate * (now - sender->sent_ns) / 1e9);
+  if (sender->credit > burst) {
+    sender->credit = burst;
+  }
+  sender->sent_ns = now;
+
+  struct mmsghdr messages[MULTICAST_BATCH];
+  struct iovec iov[MULTICAST_BATCH];
+  uint64_t fragments[MULTICAST_BATCH];
+  while (sender->credit > 0 && sender->queued_count > 0) {
+    unsigned int count = 0;
+    int64_t bytes = 0;
+    while (count < MULTICAST_BATCH && sender->queued_count > 0 &&
+           bytes < sender->credit) {
+      uint64_t fragment = take_queued(sender);
+      ssize_t size = build_fragment(sender, sender->packets[count], fragment);
+      if (size < 0) {
+        return -1;
+      }
+      if (size == 0) {
+        continue;
+      }
+      iov[count] = (struct iovec){sender->packets[count], (size_t)size};
+      messages[count] = (struct mmsghdr){
+          .msg_hdr = {.msg_name = &sender->group,
+                      .msg_namelen = sizeof(sender->group),
+                      .msg_iov = &iov[count],
+                      .msg_iovlen = 1},
+      };
+      fragments[count++] = fragment;
+      bytes += size;
+    }
+    if (count == 0) {
+      break;
+    }
+
+    int sent = sendmmsg(sender->fd, messages, count, 0);
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        ERRNO_MSG("sendmmsg failed");
+      }
+      sent = 0;
+    }
+    for (int i = 0; i < sent; i++) {
+      sender->credit -= (int64_t)iov[i].iov_len;
+      metrics_add(METRIC_MULTICAST_SENT_BYTES, NULL,
+                  (int64_t)(iov[i].iov_len - sizeof(multicast_header_t)));
+    }
+    if (sent > 0) {
+      sender->last_sent = fragments[sent - 1];
+    }
+    // Sent again on the next call, from where the kernel stopped
+    if ((unsigned int)sent < count) {
+      for (unsigned int i = (unsigned int)sent; i < count; i++) {
+        queue_range(sender, fragments[i], fragments[i] + 1);
+      }
+      sender->cursor = fragments[sent];
+      break;
+    }
+  }
+  return sender->queued_count > 0;
+}
+
+void multicast_sender_status(multicast_sender_t* sender) {
+  uint8_t packet[sizeof(multicast_header_t)];
+  write_header(&sender->layout, packet, PACKET_STATUS,
+               sender->queued_count == 0 ? PACKET_FLAG_IDLE : 0, 0,
+               sender->last_sent);
+  if (sendto(sender->fd, packet, sizeof(packet), 0,
+             (struct sockaddr*)&sender->group, sizeof(sender->group)) < 0 &&
+      errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+    ERRNO_MSG("sendto failed");
+  }
+}
+
+void multicast_sender_destroy(multicast_sender_t* sender) {
+  if (!sender) {
+    return;
+  }
+  if (sender->fd >= 0) {
+    close(sender->fd);
+  }
+  free(sender->queued);
+  free(sender);
+}
+
+multicast_receiver_t* multicast_receiver_create(
+    const char* group, in_port_t port, const eltextorrent_file_t* torrent,
+    const uint8_t* needed_pieces) {
+  multicast_receiver_t* receiver = calloc(1, sizeof(multicast_receiver_t));
+  if (!receiver) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  receiver->fd = -1;
+  receiver->needed_pieces = needed_pieces;
+  receiver->progress_ns = metrics_now_ns();
+  layout_init(&receiver->layout, torrent);
+
+  uint64_t slots = MULTICAST_REASSEMBLY_BYTES / torrent->piece_size;
+  slots = slots < MULTICAST_MIN_SLOTS ? MULTICAST_MIN_SLOTS : slots;
+  receiver->slots_count = (uint32_t)slots;
+  receiver->slots = calloc(slots, sizeof(slot_t));
+  if (!receiver->slots) {
+    ERRNO_MSG("calloc failed");
+    multicast_receiver_destroy(receiver);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < receiver->slots_count; i++) {
+    slot_t* slot = &receiver->slots[i];
+    slot->bits = malloc((receiver->layout.per_piece + 7) / 8);
+    slot->data = malloc(torrent->piece_size);
+    if (!slot->bits || !slot->data) {
+      ERRNO_MSG("malloc failed");
+      multicast_receiver_destroy(receiver);
+      return NULL;
+    }
+  }
+
+  struct sockaddr_in addr;
+  if (parse_group(group, port, &addr) != 0 ||
+      (receiver->fd = create_socket()) < 0) {
+    multicast_receiver_destroy(receiver);
+    return NULL;
+  }
+
+  // Bound to the group, so datagrams of other groups on the port stay out.
+  // Several leechers of one host share it
+  int reuse = 1;
+  struct ip_mreq membership = {.imr_multiaddr = addr.sin_addr,
+                               .imr_interface.s_addr = htonl(INADDR_ANY)};
+  if (setsockopt(receiver->fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) < 0 ||
+      bind(receiver->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      setsockopt(receiver->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) < 0) {
+    ERRNO_MSG("Failed to join the group");
+    multicast_receiver_destroy(receiver);
+    return NULL;
+  }
+
+  for (int i = 0; i < MULTICAST_BATCH; i++) {
+    receiver->iov[i] =
+        (struct iovec){receiver->packets[i], MULTICAST_PACKET_SIZE};
+  }
+  LOG_INFO("Joined %s:%d", group, port);
+  return receiver;
+}
+
+int multicast_receiver_fd(const multicast_receiver_t* receiver) {
+  return receiver->fd;
+}
+
+/**
+ * @brief Remembers fragments the sender went past, merged with the last
+ * run when they touch it.
+ */
+static void add_gap(multicast_receiver_t* receiver, uint64_t begin,
+                    uint64_t end) {
+  if (begin >= end || receiver->nak_all) {
+    return;
+  }
+  if (receiver->gaps_count > 0) {
+    nak_range_t* last = &receiver->gaps[receiver->gaps_count - 1];
+    if (begin <= last->end && end >= last->begin) {
+      last->begin = begin < last->begin ? begin : last->begin;
+      last->end = end > last->end ? end : last->end;
+      return;
+    }
+  }
+  if (receiver->gaps_count == MULTICAST_GAPS) {
+    receiver->nak_all = 1;
+    receiver->gaps_count = 0;
+    return;
+  }
+  receiver->gaps[receiver->gaps_count++] = (nak_range_t){begin, end};
+}
+
+/**
+ * @brief Records that the sender went past a fragment. Those between it and
+ * the previous one were either lost or not queued, both are worth a NAK.
+ */
+static void advance(multicast_receiver_t* receiver, uint64_t fragment) {
+  if (!receiver->positioned) {
+    // Joined now, whatever came before is missing
+    receiver->positioned = 1;
+    receiver->nak_all = 1;
+  } else if (fragment > receiver->position) {
+    add_gap(receiver, receiver->position + 1, fragment);
+  } else if (fragment < receiver->position) {
+    add_gap(receiver, receiver->position + 1, receiver->layout.total);
+    add_gap(receiver, 0, fragment);
+  }
+  receiver->position = fragment;
+}
+
+static slot_t* find_slot(multicast_receiver_t* receiver, uint32_t piece) {
+  slot_t* slot;
+  HASH_FIND(hh, receiver->used_slots, &piece, sizeof(piece), slot);
+  return slot;
+}
+
+static void release_slot(multicast_receiver_t* receiver, slot_t* slot) {
+  HASH_DEL(receiver->used_slots, slot);
+  slot->used = 0;
+}
+
+/**
+ * @brief Takes a free slot for a piece, or the one furthest from complete.
+ * The fragments it held are NAKed once the sender is idle.
+ */
+static slot_t* take_slot(multicast_receiver_t* receiver, uint32_t piece) {
+  slot_t* slot = NULL;
+  for (uint32_t i = 0; i < receiver->slots_count; i++) {
+    slot_t* candidate = &receiver->slots[i];
+    if (!candidate->used) {
+      slot = candidate;
+      break;
+    }
+    if (!slot || candidate->received < slot->received) {
+      slot = candidate;
+    }
+  }
+
+  if (slot->used) {
+    release_slot(receiver, slot);
+  }
+  slot->piece = piece;
+  slot->used = 1;
+  slot->count = piece_fragments(&receiver->layout, piece);
+  slot->received = 0;
+  memset(slot->bits, 0, (receiver->layout.per_piece + 7) / 8);
+  HASH_ADD(hh, receiver->used_slots, piece, sizeof(slot->piece), slot);
+  return slot;
+}
+
+/**
+ * @brief Stores a fragment of a needed piece.
+ *
+ * @return The slot if it completed the piece, NULL otherwise.
+ */
+static slot_t* store_fragment(multicast_receiver_t* receiver,
+                              uint64_t fragment, const uint8_t* payload,
+                              size_t size) {
+  const layout_t* layout = &receiver->layout;
+  if (fragment >= layout->total || size != fragment_size(layout, fragment)) {
+    return NULL;
+  }
+  uint32_t piece = (uint32_t)(fragment / layout->per_piece);
+  uint32_t index = (uint32_t)(fragment % layout->per_piece);
+  slot_t* slot = find_slot(receiver, piece);
+  if (!get_bit(receiver->needed_pieces, piece)) {
+    // Received over TCP meanwhile
+    if (slot) {
+      release_slot(receiver, slot);
+    }
+    return NULL;
+  }
+
+  if (!slot) {
+    slot = take_slot(receiver, piece);
+  }
+  if (get_bit(slot->bits, index)) {
+    return NULL;
+  }
+  set_bit(slot->bits, index);
+  memcpy(slot->data + (uint64_t)index * MULTICAST_FRAGMENT_SIZE, payload,
+         size);
+  receiver->progress_ns = metrics_now_ns();
+  metrics_add(METRIC_MULTICAST_RECEIVED_BYTES, NULL, (int64_t)size);
+  return ++slot->received == slot->count ? slot : NULL;
+}
+
+/**
+ * @brief Processes one datagram of the group.
+ *
+ * @return The slot of a piece it completed, NULL otherwise.
+ */
+static slot_t* process_packet(multicast_receiver_t* receiver,
+                              const uint8_t* packet, size_t size,
+                              const struct sockaddr_in* source) {
+  multicast_header_t header;
+  if (read_header(&receiver->layout, packet, size, &header) != 0) {
+    return NULL;
+  }
+
+  if (header.type == PACKET_STATUS) {
+    receiver->sender = *source;
+    if (header.flags & PACKET_FLAG_IDLE) {
+      // Nothing more is coming, everything still needed is missing
+      receiver->positioned = 1;
+      receiver->nak_all = 1;
+    } else if (receiver->positioned &&
+               header.fragment > receiver->position) {
+      add_gap(receiver, receiver->position + 1, header.fragment + 1);
+      receiver->position = header.fragment;
+    }
+    return NULL;
+  }
+  if (header.type != PACKET_DATA) {
+    return NULL;
+  }
+
+  receiver->sender = *source;
+  advance(receiver, header.fragment);
+  return store_fragment(receiver, header.fragment,
+                        packet + sizeof(header), size - sizeof(header));
+}
+
+int multicast_receiver_receive(multicast_receiver_t* receiver,
+                               uint32_t* piece, const uint8_t** data) {
+  if (receiver->handed) {
+    release_slot(receiver, receiver->handed);
+    receiver->handed = NULL;
+  }
+
+  for (;;) {
+    while (receiver->batch_next < receiver->batch_count) {
+      uint32_t i = receiver->batch_next++;
+      slot_t* slot = process_packet(receiver, receiver->packets[i],
+                                    receiver->messages[i].msg_len,
+                                    &receiver->sources[i]);
+      if (slot) {
+        receiver->handed = slot;
+        *piece = slot->piece;
+        *data = slot->data;
+        return 1;
+      }
+    }
+
+    for (int i = 0; i < MULTICAST_BATCH; i++) {
+      receiver->messages[i] = (struct mmsghdr){
+          .msg_hdr = {.msg_name = &receiver->sources[i],
+                      .msg_namelen = sizeof(receiver->sources[i]),
+                      .msg_iov = &receiver->iov[i],
+                      .msg_iovlen = 1},
+      };
+    }
+    int received = recvmmsg(receiver->fd, receiver->messages,
+                            MULTICAST_BATCH, 0, NULL);
+    if (received <= 0) {
+      if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        ERRNO_MSG("recvmmsg failed");
+      }
+      receiver->batch_count = 0;
+      receiver->batch_next = 0;
+      return 0;
+    }
+    receiver->batch_count = (uint32_t)received;
+    receiver->batch_next = 0;
+  }
+}
+
+typedef struct {
+  multicast_receiver_t* receiver;
+  uint8_t packet[MULTICAST_PACKET_SIZE];
+  uint16_t count;
+  int sent;
+} nak_builder_t;
+
+static int flush_nak(nak_builder_t* nak) {
+  multicast_receiver_t* receiver = nak->receiver;
+  if (nak->count == 0) {
+    return 0;
+  }
+  write_header(&receiver->layout, nak->packet, PACKET_NAK, 0, nak->count, 0);
+  size_t size = sizeof(multicast_header_t) + nak->count * sizeof(nak_range_t);
+  nak->count = 0;
+  if (sendto(receiver->fd, nak->packet, size, 0,
+             (struct sockaddr*)&receiver->sender,
+             sizeof(receiver->sender)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      return 0;
+    }
+    ERRNO_MSG("sendto failed");
+    return -1;
+  }
+  nak->sent++;
+  return 0;
+}
+
+/**
+ * @brief Adds fragments to the NAK, merged with the last range when they
+ * follow it.
+ */
+static int add_nak(nak_builder_t* nak, uint64_t begin, uint64_t end) {
+  uint8_t* ranges = nak->packet + sizeof(multicast_header_t);
+  if (nak->count > 0) {
+    nak_range_t last;
+    memcpy(&last, ranges + (nak->count - 1) * sizeof(last), sizeof(last));
+    if (be64toh(last.end) == begin) {
+      last.end = htobe64(end);
+      memcpy(ranges + (nak->count - 1) * sizeof(last), &last, sizeof(last));
+      return 0;
+    }
+  }
+  if (nak->count == MULTICAST_NAK_RANGES && flush_nak(nak) != 0) {
+    return -1;
+  }
+  nak_range_t range = {htobe64(begin), htobe64(end)};
+  memcpy(ranges + nak->count++ * sizeof(range), &range, sizeof(range));
+  return 0;
+}
+
+/**
+ * @brief NAKs the fragments of a range that are missing from needed pieces.
+ */
+static int nak_missing(nak_builder_t* nak, uint64_t begin, uint64_t end) {
+  multicast_receiver_t* receiver = nak->receiver;
+  const layout_t* layout = &receiver->layout;
+  uint64_t piece = begin / layout->per_piece;
+  for (; piece * layout->per_piece < end; piece++) {
+    if (piece % 8 == 0 && receiver->needed_pieces[piece / 8] == 0) {
+      piece += 7;
+      continue;
+    }
+    if (!get_bit(receiver->needed_pieces, piece)) {
+      continue;
+    }
+
+    uint64_t first = piece * layout->per_piece;
+    uint64_t last = first + piece_fragments(layout, piece);
+    uint64_t from = begin > first ? begin : first;
+    uint64_t to = end < last ? end : last;
+    slot_t* slot = find_slot(receiver, (uint32_t)piece);
+    if (!slot) {
+      if (from < to && add_nak(nak, from, to) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    for (uint64_t f = from; f < to; f++) {
+      if (!get_bit(slot->bits, f - first) && add_nak(nak, f, f + 1) != 0) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int multicast_receiver_send_naks(multicast_receiver_t* receiver) {
+  if (receiver->sender.sin_port == 0) {
+    return 0;
+  }
+
+  uint64_t now = metrics_now_ns();
+  if (receiver->nak_all &&
+      now - receiver->nak_all_ns < MULTICAST_NAK_ALL_MS * 1000000ULL) {
+    return 0;
+  }
+
+  nak_builder_t nak = {.receiver = receiver};
+  int result = 0;
+  if (receiver->nak_all) {
+    receiver->nak_all_ns = now;
+    result = nak_missing(&nak, 0, receiver->layout.total);
+  } else {
+    for (uint32_t i = 0; i < receiver->gaps_count && result == 0; i++) {
+      result =
+          nak_missing(&nak, receiver->gaps[i].begin, receiver->gaps[i].end);
+    }
+  }
+  receiver->nak_all = 0;
+  receiver->gaps_count = 0;
+  if (result != 0 || flush_nak(&nak) != 0) {
+    return -1;
+  }
+  metrics_add(METRIC_MULTICAST_NAKS, NULL, nak.sent);
+  return nak.sent;
+}
+
+int multicast_receiver_stalled(const multicast_receiver_t* receiver) {
+  return metrics_now_ns() - receiver->progress_ns >
+         MULTICAST_STALL_MS * 1000000ULL;
+}
+
+void multicast_receiver_destroy(multicast_receiver_t* receiver) {
+  if (!receiver) {
+    return;
+  }
+  if (receiver->fd >= 0) {
+    close(receiver->fd);
+  }
+  HASH_CLEAR(hh, receiver->used_slots);
+  for (uint32_t i = 0; receiver->slots && i < receiver->slots_count; i++) {
+    free(receiver->slots[i].bits);
+    free(receiver->slots[i].data);
+  }
+  free(receiver->slots);
+  free(receiver);
+}
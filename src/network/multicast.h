@@ -0,0 +1,145 @@
+/**
+ * @file multicast.h
+ * @brief Piece distribution to a LAN multicast group with NAK-based repair.
+ *
+ * A seeder sends each piece once to the group, however many leechers
+ * listen. Pieces travel in fragments that fit a 1500 byte MTU, numbered
+ * across the whole file. Nothing is acknowledged: a leecher that misses
+ * fragments names them in a NAK sent back to the seeder, which queues them
+ * again. The queue is a bitmap of fragments, so a fragment missed by a
+ * hundred leechers is still sent once (NAK aggregation), and a leecher that
+ * joins late simply NAKs what it lacks.
+ *
+ * The seeder sends the queued fragments in order, wrapping around, at a
+ * fixed rate: there is no congestion control on a multicast group. A
+ * leecher NAKs the fragments it needs that the seeder went past without it
+ * receiving them, and everything it still needs whenever the seeder reports
+ * an empty queue. The seeder sends its state to the group a few times a
+ * second, which is also how leechers learn where to send NAKs.
+ *
+ * Leechers reassemble a few pieces at a time and hand them over whole, for
+ * the caller to verify and write.
+ */
+
+#ifndef NETWORK_MULTICAST_H_
+#define NETWORK_MULTICAST_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "../bit_torrent.h"
+
+/* Group rate when no upload rate is set, bytes per second */
+#define MULTICAST_DEFAULT_RATE (64 * 1024 * 1024)
+/* How often the seeder sends its state and leechers send NAKs */
+#define MULTICAST_STATUS_MS 100
+#define MULTICAST_NAK_MS 10
+/* A leecher that received nothing it needs for this long asks seeders over
+   TCP, until the group makes progress again */
+#define MULTICAST_STALL_MS 2000
+
+typedef struct multicast_sender multicast_sender_t;
+typedef struct multicast_receiver multicast_receiver_t;
+
+/**
+ * @brief Create the socket that sends pieces to the group and takes NAKs
+ * @param group IPv4 multicast address
+ * @param port UDP port of the group
+ * @param torrent Torrent of the shared file
+ * @param data_fd Shared file, read with pread()
+ * @return Sender on success or NULL on error
+ */
+multicast_sender_t* multicast_sender_create(const char* group, in_port_t port,
+                                            const eltextorrent_file_t* torrent,
+                                            int data_fd);
+
+/**
+ * @brief Socket NAKs arrive on
+ * @param sender Sender
+ * @return Non-blocking socket
+ */
+int multicast_sender_fd(const multicast_sender_t* sender);
+
+/**
+ * @brief Queue the fragments named by the NAKs that arrived, without
+ * blocking
+ * @param sender Sender
+ * @return Number of NAKs processed
+ */
+int multicast_sender_receive(multicast_sender_t* sender);
+
+/**
+ * @brief Send queued fragments, as many as the rate allows since the last
+ * call
+ * @param sender Sender
+ * @param rate Bytes per second
+ * @return `1` if fragments are still queued, `0` otherwise
+ */
+int multicast_sender_send(multicast_sender_t* sender, uint64_t rate);
+
+/**
+ * @brief Tell the group where the seeder is and whether its queue is empty
+ * @param sender Sender
+ */
+void multicast_sender_status(multicast_sender_t* sender);
+
+/**
+ * @brief Close the socket and free the sender
+ * @param sender Sender, may be NULL
+ */
+void multicast_sender_destroy(multicast_sender_t* sender);
+
+/**
+ * @brief Join the group
+ * @param group IPv4 multicast address
+ * @param port UDP port of the group
+ * @param torrent Torrent of the download
+ * @param needed_pieces Bitfield of the pieces still needed, kept up to date
+ * by the caller
+ * @return Receiver on success or NULL on error
+ */
+multicast_receiver_t* multicast_receiver_create(
+    const char* group, in_port_t port, const eltextorrent_file_t* torrent,
+    const uint8_t* needed_pieces);
+
+/**
+ * @brief Socket the group's datagrams arrive on
+ * @param receiver Receiver
+ * @return Non-blocking socket
+ */
+int multicast_receiver_fd(const multicast_receiver_t* receiver);
+
+/**
+ * @brief Process what arrived without blocking, until a needed piece is
+ * complete
+ * @param receiver Receiver
+ * @param piece Output parameter for the index of the complete piece
+ * @param data Output parameter for the piece, valid until the next call
+ * @return `1` with a complete piece, `0` once nothing is left
+ */
+int multicast_receiver_receive(multicast_receiver_t* receiver,
+                               uint32_t* piece, const uint8_t** data);
+
+/**
+ * @brief Send the seeder NAKs for the needed fragments found missing since
+ * the last call
+ * @param receiver Receiver
+ * @return Number of NAKs sent or `-1` on error
+ */
+int multicast_receiver_send_naks(multicast_receiver_t* receiver);
+
+/**
+ * @brief Check whether the group brought nothing needed for
+ * MULTICAST_STALL_MS
+ * @param receiver Receiver
+ * @return `1` if stalled, `0` otherwise
+ */
+int multicast_receiver_stalled(const multicast_receiver_t* receiver);
+
+/**
+ * @brief Leave the group and free the receiver
+ * @param receiver Receiver, may be NULL
+ */
+void multicast_receiver_destroy(multicast_receiver_t* receiver);
+
+#endif  // NETWORK_MULTICAST_H_
@@ -10,7 +10,13 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "../common/metrics.h"
 #include "common.h"
+#include "local_peer.h"
+#include "tls.h"
+#include "udp_stream.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
 
 TCPClient_t* tcp_client_create(void) {
   TCPClient_t* client = malloc(sizeof(TCPClient_t));
@@ -19,6 +25,7 @@ TCPClient_t* tcp_client_create(void) {
     return NULL;
   }
   memset(client, 0, sizeof(TCPClient_t));
+  client->source.fd = -1;
 
   client->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (client->socket_fd < 0) {
@@ -55,8 +62,84 @@ int tcp_client_connect(TCPClient_t* client, const char* server_ip,
   client->connected = 1;
   strncpy(client->ip, server_ip, sizeof(client->ip) - 1);
   client->port = server_port;
+  client->sent_bytes = NULL;
+  client->received_bytes = NULL;
+
+  LOG_INFO("Connected to %s:%d", client->ip, client->port);
+  return 0;
+}
+
+int tcp_client_connect_start(TCPClient_t* client, const char* server_ip,
+                             in_port_t server_port) {
+  if (!client || !server_ip) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  struct sockaddr_in server_addr = {0};
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+
+  if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+    STDERR_MSG("Invalid server_ip");
+    return -1;
+  }
+
+  strncpy(client->ip, server_ip, sizeof(client->ip) - 1);
+  client->port = server_port;
+  client->sent_bytes = NULL;
+  client->received_bytes = NULL;
+  if (client->udp) {
+    return udp_stream_connect(client, &server_addr);
+  }
+
+  if (socket_set_non_blocking(client->socket_fd, 1) != 0) {
+    return -1;
+  }
+  if (connect(client->socket_fd, (struct sockaddr*)&server_addr,
+              sizeof(server_addr)) == 0) {
+    return tcp_client_connect_finish(client);
+  }
+  if (errno != EINPROGRESS) {
+    LOG_WARN("Failed to connect to %s:%d: %s", client->ip, client->port,
+             strerror(errno));
+    return -1;
+  }
+
+  client->connect_started_ns = metrics_now_ns();
+  return 1;
+}
 
-  printf("Connected to %s:%d\n", client->ip, client->port);
+int tcp_client_connect_finish(TCPClient_t* client) {
+  if (!client) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+  if (client->udp) {
+    return udp_stream_connect_finish(client);
+  }
+  if (client->local) {
+    return local_peer_connect_finish(client);
+  }
+
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(client->socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) <
+      0) {
+    error = errno;
+  }
+  client->connect_started_ns = 0;
+  if (error != 0) {
+    LOG_WARN("Failed to connect to %s:%d: %s", client->ip, client->port,
+             strerror(error));
+    return -1;
+  }
+  if (socket_set_non_blocking(client->socket_fd, 0) != 0) {
+    return -1;
+  }
+
+  client->connected = 1;
+  LOG_INFO("Connected to %s:%d", client->ip, client->port);
   return 0;
 }
 
@@ -77,8 +160,8 @@ int tcp_client_receive(TCPClient_t* client, char* buffer, size_t buffer_size) {
 
   size_t total_received = 0;
   while (total_received < buffer_size) {
-    ssize_t received = recv(client->socket_fd, buffer + total_received,
-                            buffer_size - total_received, 0);
+    ssize_t received = tcp_recv(client, buffer + total_received,
+                                buffer_size - total_received);
     if (received < 0) {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         ERRNO_MSG("recv failed");
@@ -86,16 +169,46 @@ int tcp_client_receive(TCPClient_t* client, char* buffer, size_t buffer_size) {
       return -1;
     }
     if (received == 0) {
-      printf("Server disconnected\n");
+      LOG_INFO("Server disconnected");
       client->connected = 0;
       return 0;
     }
     total_received += received;
   }
 
+  tcp_count_received(client, (int64_t)total_received);
   return total_received;
 }
 
+int tcp_client_receive_some(TCPClient_t* client, char* buffer,
+                            size_t buffer_size) {
+  if (!client || !buffer || buffer_size == 0) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  if (!client->connected) {
+    STDERR_MSG("trying to receive data while not connected");
+    return -1;
+  }
+
+  ssize_t received = tcp_recv(client, buffer, buffer_size);
+  if (received < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ERRNO_MSG("recv failed");
+    }
+    return -1;
+  }
+  if (received == 0) {
+    LOG_INFO("Server disconnected");
+    client->connected = 0;
+    return 0;
+  }
+
+  tcp_count_received(client, received);
+  return (int)received;
+}
+
 int tcp_client_set_non_blocking(const TCPClient_t* client, int on) {
   if (!client) {
     STDERR_MSG("Wrong parameters");
@@ -107,6 +220,9 @@ int tcp_client_set_non_blocking(const TCPClient_t* client, int on) {
 
 void tcp_client_destroy(TCPClient_t* client) {
   if (client) {
+    tls_close(client);
+    udp_stream_close(client);
+    local_peer_close(client);
     if (client->socket_fd >= 0) {
       close(client->socket_fd);
     }
@@ -22,6 +22,35 @@ TCPClient_t* tcp_client_create(void);
 int tcp_client_connect(TCPClient_t* client, const char* server_ip,
                        in_port_t server_port);
 
+/**
+ * @brief Start connecting to TCP server without waiting for the handshake
+ *
+ * The socket becomes writable once the attempt is over, then call
+ * tcp_client_connect_finish(). A UDP stream client waits for the answer of
+ * the seeder instead, its socket becomes readable. The address is set right
+ * away, so the client can be found by peer while connecting.
+ *
+ * @param client pointer to Client struct
+ * @param server_ip IP address of the server
+ * @param server_port port of the server
+ * @return `0` if already connected, `1` if in progress or `-1` on error
+ */
+int tcp_client_connect_start(TCPClient_t* client, const char* server_ip,
+                             in_port_t server_port);
+
+/**
+ * @brief Complete a connect started by tcp_client_connect_start() or
+ * local_peer_connect()
+ *
+ * The socket is switched back to blocking mode on success.
+ *
+ * @param client pointer to Client struct
+ * @return `0` on success, `1` while a UDP stream still waits for the answer
+ * or a local client for the shared file, `-1` if the connection was refused
+ * or failed
+ */
+int tcp_client_connect_finish(TCPClient_t* client);
+
 /**
  * @brief Send data to connected server
  * @param client pointer to Client struct
@@ -41,6 +70,18 @@ int tcp_client_send(TCPClient_t* client, const char* data, size_t data_size);
  */
 int tcp_client_receive(TCPClient_t* client, char* buffer, size_t buffer_size);
 
+/**
+ * @brief Receive the data that already arrived from connected server, up to
+ * buffer_size bytes, for non-blocking clients
+ * @param client pointer to Client struct
+ * @param buffer self explanatory
+ * @param buffer_size self explanatory
+ * @return Amount of received bytes, `0` if connection is closed or `-1` on
+ * error, with errno `EAGAIN` if nothing arrived
+ */
+int tcp_client_receive_some(TCPClient_t* client, char* buffer,
+                            size_t buffer_size);
+
 /**
  * @brief Enable non-blocking mode for the socket
  * @param client pointer to Client struct
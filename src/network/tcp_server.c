@@ -1,16 +1,24 @@
+#define _GNU_SOURCE
 #include "tcp_server.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "../common/metrics.h"
 #include "common.h"
+#include "local_peer.h"
+#include "tls.h"
+#include "udp_stream.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
 
 TCPServer_t* tcp_server_create(in_port_t port) {
   TCPServer_t* server = malloc(sizeof(TCPServer_t));
@@ -48,11 +56,18 @@ TCPServer_t* tcp_server_create(in_port_t port) {
     return NULL;
   }
 
+  server->udp_fd = -1;
+  server->local_fd = -1;
   server->port = port;
   server->client_count = 0;
+  server->max_rate = 0;
   memset(server->clients, 0, sizeof(server->clients));
+  for (uint16_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    server->clients[i].socket_fd = -1;
+    server->clients[i].source.fd = -1;
+  }
 
-  printf("TCP server created on port: %d\n", port);
+  LOG_INFO("TCP server created on port: %d", port);
   return server;
 }
 
@@ -67,10 +82,43 @@ int tcp_server_listen(TCPServer_t* server, int qsize) {
     return -1;
   }
 
-  printf("TCP server listening\n");
+  LOG_INFO("TCP server listening");
   return 0;
 }
 
+static int apply_max_rate(int socket_fd, uint64_t rate) {
+  // The option takes 32 bits, ~0U means unlimited
+  unsigned int pacing = rate == 0 || rate >= UINT32_MAX ? ~0U : (unsigned)rate;
+  return setsockopt(socket_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing,
+                    sizeof(pacing));
+}
+
+static TCPClient_t* add_client(TCPServer_t* server, int client_socket,
+                               const char* ip, in_port_t port) {
+  TCPClient_t* new_client = NULL;
+  for (uint16_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    if (server->clients[i].socket_fd < 0) {
+      new_client = &server->clients[i];
+      break;
+    }
+  }
+
+  if (!new_client) {
+    STDERR_MSG("Something really terrible happened");
+    close(client_socket);
+    return NULL;
+  }
+
+  new_client->socket_fd = client_socket;
+  new_client->connected = 1;
+  new_client->port = port;
+  strncpy(new_client->ip, ip, INET_ADDRSTRLEN - 1);
+  new_client->sent_bytes = NULL;
+  new_client->received_bytes = NULL;
+  server->client_count++;
+  return new_client;
+}
+
 TCPClient_t* tcp_server_accept(TCPServer_t* server) {
   if (!server || server->client_count >= TCP_MAX_CLIENTS) {
     STDERR_MSG("Cannot accept more clients");
@@ -89,26 +137,132 @@ TCPClient_t* tcp_server_accept(TCPServer_t* server) {
     return NULL;
   }
 
-  TCPClient_t* new_client = NULL;
+  if (server->max_rate > 0 &&
+      apply_max_rate(client_socket, server->max_rate) < 0) {
+    ERRNO_MSG("Failed to limit upload rate");
+  }
+  // Answers are sent whole, holding back their tail only adds a round trip
+  int nodelay = 1;
+  if (setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                 sizeof(nodelay)) < 0) {
+    ERRNO_MSG("setsockopt failed");
+  }
+
+  TCPClient_t* new_client =
+      add_client(server, client_socket, inet_ntoa(client_addr.sin_addr),
+                 ntohs(client_addr.sin_port));
+  if (new_client) {
+    LOG_INFO("New client from %s:%d", new_client->ip, new_client->port);
+  }
+  return new_client;
+}
+
+int tcp_server_listen_udp(TCPServer_t* server) {
+  if (!server) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  server->udp_fd = udp_stream_listen(server->port);
+  return server->udp_fd < 0 ? -1 : 0;
+}
+
+static int has_udp_client(const TCPServer_t* server,
+                          const struct sockaddr_in* addr) {
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
   for (uint16_t i = 0; i < TCP_MAX_CLIENTS; i++) {
-    if (server->clients[i].connected == 0) {
-      new_client = &server->clients[i];
-      break;
+    const TCPClient_t* client = &server->clients[i];
+    if (client->socket_fd >= 0 && client->udp &&
+        client->port == ntohs(addr->sin_port) && strcmp(client->ip, ip) == 0) {
+      return 1;
     }
   }
+  return 0;
+}
+
+TCPClient_t* tcp_server_accept_udp(TCPServer_t* server, timer_wheel_t* wheel) {
+  if (!server || server->udp_fd < 0 || !wheel) {
+    STDERR_MSG("Wrong parameters");
+    return NULL;
+  }
+
+  struct sockaddr_in client_addr;
+  uint32_t conn_id;
+  do {
+    if (udp_stream_accept(server->udp_fd, &client_addr, &conn_id) != 0) {
+      return NULL;
+    }
+  } while (has_udp_client(server, &client_addr));
 
+  if (server->client_count >= TCP_MAX_CLIENTS) {
+    STDERR_MSG("Cannot accept more clients");
+    return NULL;
+  }
+  int client_socket = udp_stream_open(server->port, &client_addr);
+  if (client_socket < 0) {
+    return NULL;
+  }
+  TCPClient_t* new_client =
+      add_client(server, client_socket, inet_ntoa(client_addr.sin_addr),
+                 ntohs(client_addr.sin_port));
   if (!new_client) {
-    STDERR_MSG("Something really terrible happened");
     return NULL;
   }
+  if (udp_stream_attach(new_client, wheel, conn_id) != 0) {
+    tcp_server_disclient(server, new_client);
+    return NULL;
+  }
+  udp_stream_set_max_rate(new_client, server->max_rate);
 
-  new_client->socket_fd = client_socket;
-  new_client->connected = 1;
-  new_client->port = ntohs(client_addr.sin_port);
-  strncpy(new_client->ip, inet_ntoa(client_addr.sin_addr), INET_ADDRSTRLEN);
+  LOG_INFO("New client from %s:%d over UDP", new_client->ip,
+           new_client->port);
+  return new_client;
+}
 
-  printf("New client from %s:%d\n", new_client->ip, new_client->port);
-  server->client_count++;
+int tcp_server_listen_local(TCPServer_t* server, const char* name,
+                            char* unix_path, size_t unix_path_size) {
+  if (!server || !name) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  server->local_fd = local_peer_listen(name, unix_path, unix_path_size);
+  return server->local_fd < 0 ? -1 : 0;
+}
+
+TCPClient_t* tcp_server_accept_local(TCPServer_t* server, int data_fd) {
+  if (!server || server->local_fd < 0) {
+    STDERR_MSG("Wrong parameters");
+    return NULL;
+  }
+
+  int client_socket = accept4(server->local_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client_socket < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ERRNO_MSG("accept failed");
+    }
+    return NULL;
+  }
+  if (server->client_count >= TCP_MAX_CLIENTS) {
+    STDERR_MSG("Cannot accept more clients");
+    close(client_socket);
+    return NULL;
+  }
+
+  // Named after the socket, the peer has no address
+  TCPClient_t* new_client = add_client(server, client_socket, "local", 0);
+  if (!new_client) {
+    return NULL;
+  }
+  new_client->local = 1;
+  new_client->shared_fd = -1;
+  if (local_peer_send_file(new_client, data_fd) != 0) {
+    tcp_server_disclient(server, new_client);
+    return NULL;
+  }
+
+  LOG_INFO("New client on the same host");
   return new_client;
 }
 
@@ -124,7 +278,7 @@ ssize_t tcp_server_receive(TCPClient_t* client, char* buffer,
     return -1;
   }
 
-  ssize_t received = recv(client->socket_fd, buffer, buffer_size, 0);
+  ssize_t received = tcp_recv(client, buffer, buffer_size);
   if (received < 0) {
     if (errno != EAGAIN && errno != EWOULDBLOCK) {
       ERRNO_MSG("recv failed");
@@ -132,12 +286,13 @@ ssize_t tcp_server_receive(TCPClient_t* client, char* buffer,
     return -1;
   }
   if (received == 0) {
-    printf("Client %s:%d disconnected\n", client->ip, client->port);
+    LOG_INFO("Client %s:%d disconnected", client->ip, client->port);
     client->connected = 0;
     return 0;
   }
 
   buffer[received] = '\0';
+  tcp_count_received(client, received);
   return received;
 }
 
@@ -145,18 +300,36 @@ int tcp_server_send(TCPClient_t* client, const char* data, size_t data_size) {
   return tcp_send(client, data, data_size);
 }
 
+int tcp_server_send_more(TCPClient_t* client, const char* data,
+                         size_t data_size) {
+  return tcp_send_more(client, data, data_size);
+}
+
+ssize_t tcp_server_send_some(TCPClient_t* client, const char* data,
+                             size_t data_size, int more) {
+  return tcp_send_some(client, data, data_size, more);
+}
+
+ssize_t tcp_server_sendfile(TCPClient_t* client, int fd, uint64_t offset,
+                            size_t size) {
+  return tcp_sendfile(client, fd, offset, size);
+}
+
 int tcp_server_disclient(TCPServer_t* server, TCPClient_t* client) {
-  if (!server || !client || !client->connected) {
+  // The peer may have closed first, the socket is still ours to close
+  if (!server || !client || client->socket_fd < 0) {
     STDERR_MSG("Wrong parameters");
     return -1;
   }
 
-  if (client->socket_fd >= 0) {
-    close(client->socket_fd);
-    printf("Client %s:%d disconnected\n", client->ip, client->port);
-  }
+  tls_close(client);
+  udp_stream_close(client);
+  close(client->socket_fd);
+  LOG_INFO("Client %s:%d disconnected", client->ip, client->port);
 
+  client->socket_fd = -1;
   client->connected = 0;
+  client->local = 0;
   server->client_count--;
   return 0;
 }
@@ -170,14 +343,48 @@ int tcp_server_set_non_blocking(const TCPServer_t* server, int on) {
   return socket_set_non_blocking(server->socket_fd, on);
 }
 
+int tcp_server_set_max_rate(TCPServer_t* server, uint64_t rate) {
+  if (!server) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+  if (server->max_rate == rate) {
+    return 0;
+  }
+
+  int result = 0;
+  for (uint16_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    TCPClient_t* client = &server->clients[i];
+    if (client->connected && client->udp) {
+      udp_stream_set_max_rate(client, rate);
+    } else if (client->connected && !client->local &&
+               apply_max_rate(client->socket_fd, rate) < 0) {
+      ERRNO_MSG("Failed to limit upload rate");
+      result = -1;
+    }
+  }
+  server->max_rate = rate;
+  return result;
+}
+
 void tcp_server_destroy(TCPServer_t* server) {
   if (server) {
     for (ssize_t i = 0; i < TCP_MAX_CLIENTS; i++) {
       if (server->clients[i].socket_fd >= 0) {
+        tls_close(&server->clients[i]);
+        udp_stream_close(&server->clients[i]);
         close(server->clients[i].socket_fd);
       }
     }
 
+    if (server->udp_fd >= 0) {
+      close(server->udp_fd);
+    }
+
+    if (server->local_fd >= 0) {
+      close(server->local_fd);
+    }
+
     if (server->socket_fd >= 0) {
       close(server->socket_fd);
     }
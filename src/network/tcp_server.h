@@ -4,15 +4,19 @@
 #include <netinet/in.h>
 #include <stddef.h>
 
+#include "../common/timer_wheel.h"
 #include "common.h"
 
 #define TCP_MAX_CLIENTS 64
 
 typedef struct TCPServer {
   int socket_fd;
+  int udp_fd; /* Socket UDP stream requests arrive on, -1 if off */
+  int local_fd; /* Unix socket same-host leechers connect to, -1 if off */
   in_port_t port;
   TCPClient_t clients[TCP_MAX_CLIENTS];
   uint16_t client_count;
+  uint64_t max_rate; /* Upload limit per client in bytes/s, 0 if off */
 } TCPServer_t;
 
 /**
@@ -37,6 +41,44 @@ int tcp_server_listen(TCPServer_t* server, int qsize);
  */
 TCPClient_t* tcp_server_accept(TCPServer_t* server);
 
+/**
+ * @brief Also accept connections over UDP, on the port of the TCP listener
+ * @param server pointer to Server struct
+ * @return `0` on success or `-1` on error
+ */
+int tcp_server_listen_udp(TCPServer_t* server);
+
+/**
+ * @brief Accept a connection request that arrived over UDP, skipping the
+ * requests of peers already connected
+ * @param server pointer to Server struct
+ * @param wheel Wheel of the event loop, for retransmissions
+ * @return pointer to Client struct or `NULL` once no request is left or on
+ * error
+ */
+TCPClient_t* tcp_server_accept_udp(TCPServer_t* server, timer_wheel_t* wheel);
+
+/**
+ * @brief Also accept connections of leechers on the same host
+ * @param server pointer to Server struct
+ * @param name Socket path, or an abstract name after a leading `@`
+ * @param unix_path Output parameter for the path to unlink on exit, left
+ * untouched for an abstract name
+ * @param unix_path_size Size of unix_path
+ * @return `0` on success or `-1` on error
+ */
+int tcp_server_listen_local(TCPServer_t* server, const char* name,
+                            char* unix_path, size_t unix_path_size);
+
+/**
+ * @brief Accept a connection of a leecher on the same host and pass it the
+ * shared file, its requests are answered without the data
+ * @param server pointer to Server struct
+ * @param data_fd Descriptor of the shared file
+ * @return pointer to Client struct or `NULL` once none is left or on error
+ */
+TCPClient_t* tcp_server_accept_local(TCPServer_t* server, int data_fd);
+
 /**
  * @brief Receive data from connected client
  * @param client pointer to Client struct
@@ -58,7 +100,44 @@ ssize_t tcp_server_receive(TCPClient_t* client, char* buffer,
 int tcp_server_send(TCPClient_t* client, const char* data, size_t data_size);
 
 /**
- * @brief Disconnect client
+ * @brief Send data to connected client that the next send completes, see
+ * tcp_send_more()
+ * @param client pointer to Client struct
+ * @param data self explanatory
+ * @param data_size self explanatory
+ * @return Amount of sent bytes or `-1` on error
+ */
+int tcp_server_send_more(TCPClient_t* client, const char* data,
+                         size_t data_size);
+
+/**
+ * @brief Send what a non-blocking socket takes now of data to connected
+ * client, see tcp_send_some()
+ * @param client pointer to Client struct
+ * @param data self explanatory
+ * @param data_size self explanatory
+ * @param more `1` if the next send completes the data
+ * @return Amount of sent bytes or `-1` on error, with errno `EAGAIN` if the
+ * socket is full
+ */
+ssize_t tcp_server_send_some(TCPClient_t* client, const char* data,
+                             size_t data_size, int more);
+
+/**
+ * @brief Send a range of a file to connected client with sendfile()
+ * @param client pointer to Client struct
+ * @param fd File descriptor of the file to send
+ * @param offset Offset of the first byte to send
+ * @param size Amount of bytes to send
+ * @return Amount of sent bytes, less than size once a non-blocking socket
+ * is full, or `-1` on error, see tcp_sendfile()
+ */
+ssize_t tcp_server_sendfile(TCPClient_t* client, int fd, uint64_t offset,
+                            size_t size);
+
+/**
+ * @brief Close the socket of a client and free its slot, also after the
+ * client disconnected itself
  * @param server pointer to Server struct
  * @param client pointer to Client struct
  * @return `0` on success or `-1` on error
@@ -73,6 +152,15 @@ int tcp_server_disclient(TCPServer_t* server, TCPClient_t* client);
  */
 int tcp_server_set_non_blocking(const TCPServer_t* server, int on);
 
+/**
+ * @brief Limit upload rate of every client, current and future ones, with
+ * kernel pacing or the window of UDP streams
+ * @param server pointer to Server struct
+ * @param rate Bytes per second per client, `0` to remove the limit
+ * @return `0` on success or `-1` if some client could not be limited
+ */
+int tcp_server_set_max_rate(TCPServer_t* server, uint64_t rate);
+
 /**
  * @brief Close socket and free memory resources
  * @param server pointer to Server struct
@@ -0,0 +1,263 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509_vfy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "common.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+/* Ciphers the kernel implements, ECDHE for forward secrecy */
+#define TLS_CIPHERS                                                   \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"        \
+  "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"        \
+  "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+
+struct tls_context {
+  SSL_CTX* ctx;
+  int server;
+};
+
+/**
+ * @brief Takes the oldest OpenSSL error of this thread and forgets the rest.
+ */
+static const char* take_ssl_error(char* message, size_t size) {
+  unsigned long error = ERR_get_error();
+  if (error != 0) {
+    ERR_error_string_n(error, message, size);
+  } else {
+    snprintf(message, size, "unknown error");
+  }
+  ERR_clear_error();
+  return message;
+}
+
+static void log_ssl_error(const char* what) {
+  char message[256];
+  LOG_ERROR("%s: %s", what, take_ssl_error(message, sizeof(message)));
+}
+
+static tls_context_t* create_context(const SSL_METHOD* method, int server) {
+  tls_context_t* ctx = calloc(1, sizeof(tls_context_t));
+  if (!ctx) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+
+  ctx->server = server;
+  ctx->ctx = SSL_CTX_new(method);
+  if (!ctx->ctx) {
+    log_ssl_error("SSL_CTX_new failed");
+    free(ctx);
+    return NULL;
+  }
+
+  // The framing and the piece hashes catch a truncated stream, and no
+  // session is resumed, so tickets would only be extra records to skip
+  SSL_CTX_set_options(ctx->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_TICKET |
+                                    SSL_OP_IGNORE_UNEXPECTED_EOF);
+  if (!SSL_CTX_set_min_proto_version(ctx->ctx, TLS1_2_VERSION) ||
+      !SSL_CTX_set_max_proto_version(ctx->ctx, TLS1_2_VERSION) ||
+      !SSL_CTX_set_cipher_list(ctx->ctx, TLS_CIPHERS)) {
+    log_ssl_error("Failed to set the TLS version or ciphers");
+    tls_context_destroy(ctx);
+    return NULL;
+  }
+  // Sockets stay non-blocking, a write the socket can not take whole is
+  // resumed later with the rest of the data
+  SSL_CTX_set_mode(ctx->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  return ctx;
+}
+
+tls_context_t* tls_server_create(const char* cert_path, const char* key_path) {
+  if (!cert_path) {
+    STDERR_MSG("Wrong parameters");
+    return NULL;
+  }
+
+  tls_context_t* ctx = create_context(TLS_server_method(), 1);
+  if (!ctx) {
+    return NULL;
+  }
+  if (SSL_CTX_use_certificate_chain_file(ctx->ctx, cert_path) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx->ctx, key_path ? key_path : cert_path,
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx->ctx) != 1) {
+    log_ssl_error("Failed to load the certificate or key");
+    tls_context_destroy(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+tls_context_t* tls_client_create(const char* ca_path) {
+  if (!ca_path) {
+    STDERR_MSG("Wrong parameters");
+    return NULL;
+  }
+
+  tls_context_t* ctx = create_context(TLS_client_method(), 0);
+  if (!ctx) {
+    return NULL;
+  }
+  if (SSL_CTX_load_verify_locations(ctx->ctx, ca_path, NULL) != 1) {
+    log_ssl_error("Failed to load the CA certificates");
+    tls_context_destroy(ctx);
+    return NULL;
+  }
+  SSL_CTX_set_verify(ctx->ctx, SSL_VERIFY_PEER, NULL);
+  return ctx;
+}
+
+int tls_start(tls_context_t* ctx, TCPClient_t* client) {
+  if (!ctx || !client || client->tls) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  SSL* ssl = SSL_new(ctx->ctx);
+  if (!ssl) {
+    log_ssl_error("SSL_new failed");
+    return -1;
+  }
+  if (SSL_set_fd(ssl, client->socket_fd) != 1) {
+    log_ssl_error("SSL_set_fd failed");
+    SSL_free(ssl);
+    return -1;
+  }
+
+  if (ctx->server) {
+    SSL_set_accept_state(ssl);
+  } else {
+    // Seeders are known by the address they announce, not by a name
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), client->ip) != 1) {
+      log_ssl_error("Invalid seeder address");
+      SSL_free(ssl);
+      return -1;
+    }
+    SSL_set_connect_state(ssl);
+  }
+
+  if (socket_set_non_blocking(client->socket_fd, 1) != 0) {
+    SSL_free(ssl);
+    return -1;
+  }
+  client->tls = ssl;
+  return 0;
+}
+
+int tls_handshake(TCPClient_t* client) {
+  SSL* ssl = client->tls;
+  int result = SSL_do_handshake(ssl);
+  if (result != 1) {
+    switch (SSL_get_error(ssl, result)) {
+      case SSL_ERROR_WANT_READ:
+        return EPOLLIN;
+      case SSL_ERROR_WANT_WRITE:
+        return EPOLLOUT;
+      default:
+        break;
+    }
+    // A peer with the wrong certificate is not an error of ours
+    char message[256];
+    long verify = SSL_get_verify_result(ssl);
+    LOG_WARN("TLS handshake with %s:%d failed: %s", client->ip, client->port,
+             verify != X509_V_OK ? X509_verify_cert_error_string(verify)
+                                 : take_ssl_error(message, sizeof(message)));
+    ERR_clear_error();
+    return -1;
+  }
+
+  LOG_INFO("TLS with %s:%d using %s, kernel offload: send %s, receive %s",
+           client->ip, client->port, SSL_get_cipher_name(ssl),
+           tls_kernel_send(client) ? "on" : "off",
+           tls_kernel_receive(client) ? "on" : "off");
+  return 0;
+}
+
+int tls_handshaking(const TCPClient_t* client) {
+  return client->tls && !SSL_is_init_finished(client->tls);
+}
+
+int tls_kernel_send(const TCPClient_t* client) {
+  return client->tls && BIO_get_ktls_send(SSL_get_wbio(client->tls));
+}
+
+int tls_kernel_receive(const TCPClient_t* client) {
+  return client->tls && BIO_get_ktls_recv(SSL_get_rbio(client->tls));
+}
+
+ssize_t tls_write(TCPClient_t* client, const void* data, size_t size) {
+  size_t written = 0;
+  int result = SSL_write_ex(client->tls, data, size, &written);
+  if (result == 1) {
+    return (ssize_t)written;
+  }
+
+  switch (SSL_get_error(client->tls, result)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      // The socket is full, call again with the same data
+      ERR_clear_error();
+      errno = EAGAIN;
+      return -1;
+    default:
+      log_ssl_error("SSL_write failed");
+      errno = EIO;
+      return -1;
+  }
+}
+
+ssize_t tls_read(TCPClient_t* client, void* buffer, size_t size) {
+  size_t received = 0;
+  int result = SSL_read_ex(client->tls, buffer, size, &received);
+  if (result == 1) {
+    return (ssize_t)received;
+  }
+
+  switch (SSL_get_error(client->tls, result)) {
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      // Nothing to read on a non-blocking socket
+      ERR_clear_error();
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_SYSCALL:
+      ERR_clear_error();
+      if (errno == 0) {
+        errno = EIO;
+      }
+      return -1;
+    default:
+      log_ssl_error("SSL_read failed");
+      errno = EIO;
+      return -1;
+  }
+}
+
+size_t tls_pending(const TCPClient_t* client) {
+  return client->tls ? (size_t)SSL_pending(client->tls) : 0;
+}
+
+void tls_close(TCPClient_t* client) {
+  if (client && client->tls) {
+    SSL_free(client->tls);
+    client->tls = NULL;
+  }
+}
+
+void tls_context_destroy(tls_context_t* ctx) {
+  if (!ctx) {
+    return;
+  }
+  SSL_CTX_free(ctx->ctx);
+  free(ctx);
+}
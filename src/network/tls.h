@@ -0,0 +1,120 @@
+/**
+ * @file tls.h
+ * @brief TLS for peer connections with the record layer in the kernel.
+ *
+ * The handshake runs in OpenSSL on a non-blocking socket, driven by the
+ * event loop. Once it is done, OpenSSL hands the session keys to the kernel
+ * (kTLS) if the tls module is loaded and the cipher is supported. The
+ * socket is then used with plain send(), sendfile() and recv(), and the
+ * kernel encrypts and decrypts the records. Without kTLS the records go
+ * through SSL_write() and SSL_read() and sendfile() is not available.
+ *
+ * OpenSSL only hands TLS 1.2 receive keys to the kernel, so sessions are
+ * limited to TLS 1.2 with ECDHE and an AEAD cipher the kernel implements.
+ */
+
+#ifndef NETWORK_TLS_H_
+#define NETWORK_TLS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+typedef struct tls_context tls_context_t;
+
+/**
+ * @brief Create the context of a seeder
+ * @param cert_path PEM certificate chain
+ * @param key_path PEM private key, NULL if it is in cert_path
+ * @return Context on success or NULL on error
+ */
+tls_context_t* tls_server_create(const char* cert_path, const char* key_path);
+
+/**
+ * @brief Create the context of a leecher, seeders must present a
+ * certificate signed by a CA of ca_path for the address they are reached at
+ * @param ca_path PEM CA certificates
+ * @return Context on success or NULL on error
+ */
+tls_context_t* tls_client_create(const char* ca_path);
+
+/**
+ * @brief Attach a session to a connected client and make its socket
+ * non-blocking for the handshake
+ * @param ctx Context
+ * @param client Connected client without a session
+ * @return `0` on success or `-1` on error
+ */
+int tls_start(tls_context_t* ctx, TCPClient_t* client);
+
+/**
+ * @brief Continue the handshake, call again when the socket is ready for
+ * the returned events. The socket stays non-blocking once done
+ * @param client Client with a session
+ * @return `0` when done, EPOLLIN or EPOLLOUT to wait for, or `-1` on error
+ */
+int tls_handshake(TCPClient_t* client);
+
+/**
+ * @brief Check whether the handshake of a client is still running
+ * @param client Client
+ * @return `1` if handshaking, `0` if done or plaintext
+ */
+int tls_handshaking(const TCPClient_t* client);
+
+/**
+ * @brief Check whether the kernel encrypts what is sent
+ * @param client Client
+ * @return `1` if kTLS TX is on, `0` otherwise
+ */
+int tls_kernel_send(const TCPClient_t* client);
+
+/**
+ * @brief Check whether the kernel decrypts what is received
+ * @param client Client
+ * @return `1` if kTLS RX is on, `0` otherwise
+ */
+int tls_kernel_receive(const TCPClient_t* client);
+
+/**
+ * @brief Send data through the session
+ * @param client Client with a completed handshake
+ * @param data Data
+ * @param size Size of data
+ * @return Amount of sent bytes or `-1` on error, with errno `EAGAIN` if the
+ * socket is full
+ */
+ssize_t tls_write(TCPClient_t* client, const void* data, size_t size);
+
+/**
+ * @brief Receive data through the session, like recv()
+ * @param client Client with a completed handshake
+ * @param buffer Buffer
+ * @param size Size of buffer
+ * @return Amount of received bytes, `0` if closed or `-1` on error, with
+ * errno `EAGAIN` if nothing arrived
+ */
+ssize_t tls_read(TCPClient_t* client, void* buffer, size_t size);
+
+/**
+ * @brief Decrypted bytes waiting in the session, the socket does not report
+ * them
+ * @param client Client
+ * @return Amount of bytes, `0` for plaintext
+ */
+size_t tls_pending(const TCPClient_t* client);
+
+/**
+ * @brief Free the session of a client, the socket is left open
+ * @param client Client, does nothing without a session
+ */
+void tls_close(TCPClient_t* client);
+
+/**
+ * @brief Free a context
+ * @param ctx Context, may be NULL
+ */
+void tls_context_destroy(tls_context_t* ctx);
+
+#endif  // NETWORK_TLS_H_
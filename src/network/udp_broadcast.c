@@ -1,21 +1,28 @@
 #include "udp_broadcast.h"
 
+#include <errno.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "../common/log.h"
+#include "../common/metrics.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
 udp_broadcast_t* udp_broadcast_create(int port) {
   udp_broadcast_t* broadcast = malloc(sizeof(udp_broadcast_t));
   if (!broadcast) {
-    perror("[udp_broadcast_create] malloc failed");
+    LOG_ERROR("[udp_broadcast_create] malloc failed: %s", strerror(errno));
     return NULL;
   }
 
   broadcast->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
   if (broadcast->socket_fd < 0) {
-    perror("[udp_broadcast_create] socket failed");
+    LOG_ERROR("[udp_broadcast_create] socket failed: %s", strerror(errno));
     free(broadcast);
     return NULL;
   }
@@ -23,7 +30,7 @@ udp_broadcast_t* udp_broadcast_create(int port) {
   int on = 1;
   if (setsockopt(broadcast->socket_fd, SOL_SOCKET, SO_BROADCAST, &on,
                  sizeof(on)) < 0) {
-    perror("[udp_broadcast_create] setsockopt failed");
+    LOG_ERROR("[udp_broadcast_create] setsockopt failed: %s", strerror(errno));
     close(broadcast->socket_fd);
     free(broadcast);
     return NULL;
@@ -36,7 +43,7 @@ udp_broadcast_t* udp_broadcast_create(int port) {
 int udp_broadcast_send(udp_broadcast_t* broadcast, const char* data,
                        size_t length) {
   if (!broadcast || !data) {
-    fprintf(stderr, "[udp_broadcast_send] Wrong parameters\n");
+    LOG_ERROR("[udp_broadcast_send] Wrong parameters");
     return -1;
   }
 
@@ -48,10 +55,11 @@ int udp_broadcast_send(udp_broadcast_t* broadcast, const char* data,
   int sent = sendto(broadcast->socket_fd, data, length, MSG_DONTWAIT,
                     (struct sockaddr*)&broadcast_addr, sizeof(broadcast_addr));
   if (sent < 0) {
-    perror("[udp_broadcast_send] sendto failed");
+    LOG_ERROR("[udp_broadcast_send] sendto failed: %s", strerror(errno));
     return -1;
   }
 
+  metrics_add(METRIC_DISCOVERY_SENT, NULL, 1);
   return sent;
 }
 
@@ -6,20 +6,28 @@
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "../common/log.h"
+#include "../common/metrics.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
 udp_broadcast_receiver_t* udp_broadcast_receiver_create(int port) {
   udp_broadcast_receiver_t* receiver = malloc(sizeof(udp_broadcast_receiver_t));
   if (!receiver) {
-    perror("[udp_broadcast_receiver_create] malloc failed");
+    LOG_ERROR("[udp_broadcast_receiver_create] malloc failed: %s",
+              strerror(errno));
     return NULL;
   }
 
   receiver->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
   if (receiver->socket_fd < 0) {
-    perror("[udp_broadcast_receiver_create] socket failed");
+    LOG_ERROR("[udp_broadcast_receiver_create] socket failed: %s",
+              strerror(errno));
     free(receiver);
     return NULL;
   }
@@ -27,7 +35,8 @@ udp_broadcast_receiver_t* udp_broadcast_receiver_create(int port) {
   int reuse_addr = 1;
   if (setsockopt(receiver->socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr,
                  sizeof(reuse_addr)) < 0) {
-    perror("[udp_broadcast_receiver_create] setsockopt failed");
+    LOG_ERROR("[udp_broadcast_receiver_create] setsockopt failed: %s",
+              strerror(errno));
     close(receiver->socket_fd);
     free(receiver);
     return NULL;
@@ -40,14 +49,15 @@ udp_broadcast_receiver_t* udp_broadcast_receiver_create(int port) {
 
   if (bind(receiver->socket_fd, (struct sockaddr*)&local_addr,
            sizeof(local_addr)) < 0) {
-    perror("[udp_broadcast_receiver_create] bind failed");
+    LOG_ERROR("[udp_broadcast_receiver_create] bind failed: %s",
+              strerror(errno));
     close(receiver->socket_fd);
     free(receiver);
     return NULL;
   }
 
   receiver->port = port;
-  printf("Listening on port: %d\n", port);
+  LOG_INFO("Listening on port: %d", port);
   return receiver;
 }
 
@@ -55,7 +65,7 @@ int udp_broadcast_receiver_receive(udp_broadcast_receiver_t* receiver,
                                    char* buffer, size_t buffer_size,
                                    char* sender_ip, size_t ip_buffer_size) {
   if (!receiver || !buffer || buffer_size == 0) {
-    fprintf(stderr, "[udp_broadcast_receiver_receive] Wrong parameters\n");
+    LOG_ERROR("[udp_broadcast_receiver_receive] Wrong parameters");
     return -1;
   }
 
@@ -66,11 +76,14 @@ int udp_broadcast_receiver_receive(udp_broadcast_receiver_t* receiver,
                           (struct sockaddr*)&sender_addr, &sender_addr_len);
   if (received < 0) {
     if (errno != EAGAIN && errno != EWOULDBLOCK) {
-      perror("[udp_broadcast_receiver_receive] recvfrom failed");
+      LOG_ERROR("[udp_broadcast_receiver_receive] recvfrom failed: %s",
+                strerror(errno));
     }
     return -1;
   }
 
+  metrics_add(METRIC_DISCOVERY_RECEIVED, NULL, 1);
+
   if (received < (int)buffer_size) {
     buffer[received] = '\0';
   }
@@ -92,7 +105,8 @@ int udp_broadcast_receiver_set_non_blocking(udp_broadcast_receiver_t* receiver,
 
   int flags = fcntl(receiver->socket_fd, F_GETFL, 0);
   if (flags < 0) {
-    perror("[udp_broadcast_receiver_set_non_blocking] fcntl failed");
+    LOG_ERROR("[udp_broadcast_receiver_set_non_blocking] fcntl failed: %s",
+              strerror(errno));
     return -1;
   }
 
@@ -103,7 +117,8 @@ int udp_broadcast_receiver_set_non_blocking(udp_broadcast_receiver_t* receiver,
   }
 
   if (fcntl(receiver->socket_fd, F_SETFL, flags) < 0) {
-    perror("[udp_broadcast_receiver_set_non_blocking] fcntl failed");
+    LOG_ERROR("[udp_broadcast_receiver_set_non_blocking] fcntl failed: %s",
+              strerror(errno));
     return -1;
   }
 
@@ -122,7 +137,8 @@ int udp_broadcast_receiver_set_timeout(udp_broadcast_receiver_t* receiver,
 
   if (setsockopt(receiver->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
                  sizeof(tv)) < 0) {
-    perror("[udp_broadcast_receiver_set_timeout] setsockopt failed");
+    LOG_ERROR("[udp_broadcast_receiver_set_timeout] setsockopt failed: %s",
+              strerror(errno));
     return -1;
   }
 
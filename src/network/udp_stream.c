@@ -0,0 +1,1280 @@
+#define _GNU_SOURCE
+#include "udp_stream.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../common/metrics.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_NETWORK);
+
+/* A 1500 byte MTU minus the IPv4 and UDP headers */
+#define UDP_PACKET_SIZE 1472
+#define UDP_SEGMENT_SIZE (UDP_PACKET_SIZE - sizeof(packet_header_t))
+/* ACKs report the 256 segments past the first gap */
+#define UDP_SACK_BYTES 32
+/* Datagrams per recvmmsg() and sendmmsg() call */
+#define UDP_BATCH 64
+/* Segments per GSO run, which must stay under 64 KiB */
+#define UDP_GSO_SEGMENTS 44
+/* Segments in flight and segments the receiver holds, ~6 MiB each */
+#define UDP_SEND_WINDOW 4096
+#define UDP_RECEIVE_WINDOW 4096
+/* Bytes queued by the application before udp_stream_send() blocks */
+#define UDP_SEND_BUFFER (8 * 1024 * 1024)
+/* Kernel buffers, bursts of a full window must not overflow them */
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+
+#define UDP_INITIAL_RTO_MS 1000
+#define UDP_MIN_RTO_MS 200
+/* Lower bound of the tail loss probe, sent after two round trips */
+#define UDP_MIN_PROBE_MS 10
+#define UDP_MAX_RTO_MS 10000
+/* Timeouts in a row before the peer is given up, ~25 s from the minimum */
+#define UDP_MAX_TIMEOUTS 7
+/* A segment is presumed lost once this many later transmissions, or one
+   sent a quarter round trip after it, were acknowledged */
+#define UDP_DUP_THRESH 3
+
+/* RFC 6817 parameters, the window is kept in bytes */
+#define UDP_LEDBAT_GAIN 1.0
+#define UDP_LEDBAT_MIN_CWND 2
+#define UDP_LEDBAT_ALLOWED_INCREASE 1
+#define UDP_LEDBAT_BASE_HISTORY 10 /* Minutes of lowest delays kept */
+#define UDP_LEDBAT_CURRENT_FILTER 4
+
+enum {
+  PACKET_SYN = 1,
+  PACKET_SYN_ACK,
+  PACKET_DATA,
+  PACKET_ACK,
+  PACKET_FIN,
+};
+
+/* echo_us and delay_us are set */
+#define PACKET_FLAG_ECHO 1
+
+/* Fields in network byte order, every packet acknowledges */
+typedef struct {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t window;       /* Segments the sender can still take */
+  uint32_t conn_id;      /* Chosen by the leecher */
+  uint32_t seq;          /* Data: this segment, otherwise the next one */
+  uint32_t ack;          /* Next segment expected */
+  uint32_t timestamp_us; /* Sender's clock */
+  uint32_t echo_us;      /* timestamp_us of the newest segment received */
+  uint32_t delay_us;     /* Its one-way delay, clocks offset included */
+} packet_header_t;
+
+typedef struct {
+  uint8_t* data;
+  size_t capacity;
+  size_t head; /* Index of the first byte */
+  size_t size;
+} byte_ring_t;
+
+typedef struct {
+  uint64_t offset;  /* Stream offset of its first byte */
+  uint32_t order;   /* Transmission it was last sent in */
+  uint32_t sent_us; /* When */
+  uint16_t size;
+  uint8_t sacked;
+  uint8_t lost; /* Waiting to be sent again */
+} segment_t;
+
+enum { STREAM_CONNECTING, STREAM_CONNECTED };
+
+struct udp_stream {
+  TCPClient_t* client;
+  timer_wheel_t* wheel;
+  wheel_timer_t timer;  /* Retransmission, armed while data is unacked */
+  uint64_t deadline_us; /* When the timer is due, 0 if not armed */
+  uint32_t conn_id;
+  int state;
+  int server;
+  int error; /* errno that broke the stream, 0 if none */
+  int gso;   /* 0 once the kernel refused UDP_SEGMENT */
+  int syn_ack_pending;
+  int non_blocking; /* Calls return EAGAIN instead of waiting */
+
+  /* Sending */
+  byte_ring_t unacked;    /* Bytes queued and not acknowledged */
+  uint64_t unacked_offset; /* Stream offset of the first byte of unacked */
+  uint64_t unsent_offset;  /* Stream offset of the first byte not sent */
+  segment_t* segments;     /* UDP_SEND_WINDOW, indexed by sequence */
+  uint32_t snd_una;        /* Oldest segment not acknowledged */
+  uint32_t snd_nxt;        /* Next new segment */
+  uint32_t sacked;         /* Segments acknowledged past snd_una */
+  uint32_t lost;           /* Segments waiting to be sent again */
+  uint32_t order;          /* Transmissions so far */
+  uint32_t acked_order;    /* Latest transmission the peer received */
+  uint32_t acked_sent_us;  /* When it was sent */
+  uint32_t recover;        /* Losses before it belong to the last episode */
+  uint64_t in_flight;      /* Bytes sent and neither acked nor lost */
+  double cwnd;
+  double ssthresh; /* Slow start ends there, half the window at the loss */
+  int slow_start;
+  uint32_t peer_window;
+  uint64_t max_rate;
+  uint32_t srtt_us;
+  uint32_t rttvar_us;
+  uint32_t rto_ms;
+  uint32_t timeouts; /* In a row */
+  int probing;       /* The timer is for a tail loss probe */
+  int probed;        /* Probe sent, nothing acknowledged since */
+
+  /* One-way delay, base is the lowest of each of the last minutes */
+  uint32_t base_delay[UDP_LEDBAT_BASE_HISTORY];
+  uint32_t current_delay[UDP_LEDBAT_CURRENT_FILTER];
+  uint64_t base_minute;
+  uint32_t delay_samples;
+
+  /* Receiving */
+  byte_ring_t ready;     /* Bytes in order, not read yet */
+  uint8_t* out_of_order; /* UDP_RECEIVE_WINDOW segments, allocated on the
+                            first gap */
+  uint16_t out_of_order_size[UDP_RECEIVE_WINDOW];
+  uint32_t rcv_nxt;
+  uint32_t fin_seq;
+  int peer_closed;
+  int ack_pending;
+  int has_echo;
+  uint32_t echo_us;
+  uint32_t delay_us;
+  uint16_t advertised_window;
+
+  uint8_t* rx; /* UDP_BATCH packets each way */
+  uint8_t* tx;
+  uint16_t tx_sizes[UDP_BATCH];
+  uint32_t tx_count;
+};
+
+static uint64_t now_us(void) { return metrics_now_ns() / 1000; }
+
+static int seq_before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+static int ring_reserve(byte_ring_t* ring, size_t size) {
+  if (size <= ring->capacity) {
+    return 0;
+  }
+  size_t capacity = ring->capacity ? ring->capacity : 64 * 1024;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  uint8_t* data = malloc(capacity);
+  if (!data) {
+    ERRNO_MSG("malloc failed");
+    return -1;
+  }
+
+  size_t first = ring->capacity - ring->head;
+  first = first < ring->size ? first : ring->size;
+  if (ring->size > 0) {
+    memcpy(data, ring->data + ring->head, first);
+    memcpy(data + first, ring->data, ring->size - first);
+  }
+  free(ring->data);
+  ring->data = data;
+  ring->capacity = capacity;
+  ring->head = 0;
+  return 0;
+}
+
+static void ring_write(byte_ring_t* ring, const uint8_t* data, size_t size) {
+  size_t tail = (ring->head + ring->size) % ring->capacity;
+  size_t first = ring->capacity - tail < size ? ring->capacity - tail : size;
+  memcpy(ring->data + tail, data, first);
+  memcpy(ring->data, data + first, size - first);
+  ring->size += size;
+}
+
+static void ring_read(const byte_ring_t* ring, size_t offset, uint8_t* out,
+                      size_t size) {
+  size_t start = (ring->head + offset) % ring->capacity;
+  size_t first =
+      ring->capacity - start < size ? ring->capacity - start : size;
+  memcpy(out, ring->data + start, first);
+  memcpy(out + first, ring->data, size - first);
+}
+
+static void ring_drop(byte_ring_t* ring, size_t size) {
+  ring->size -= size;
+  ring->head = ring->size > 0 ? (ring->head + size) % ring->capacity : 0;
+}
+
+static uint16_t receive_window(const udp_stream_t* stream) {
+  size_t held = (stream->ready.size + UDP_SEGMENT_SIZE - 1) / UDP_SEGMENT_SIZE;
+  return held >= UDP_RECEIVE_WINDOW ? 0
+                                    : (uint16_t)(UDP_RECEIVE_WINDOW - held);
+}
+
+static void write_header(udp_stream_t* stream, uint8_t type, uint32_t seq,
+                         uint8_t* packet) {
+  stream->advertised_window = receive_window(stream);
+  packet_header_t header = {
+      .type = type,
+      .flags = stream->has_echo ? PACKET_FLAG_ECHO : 0,
+      .window = htons(stream->advertised_window),
+      .conn_id = htonl(stream->conn_id),
+      .seq = htonl(seq),
+      .ack = htonl(stream->rcv_nxt),
+      .timestamp_us = htonl((uint32_t)now_us()),
+      .echo_us = htonl(stream->echo_us),
+      .delay_us = htonl(stream->delay_us),
+  };
+  memcpy(packet, &header, sizeof(header));
+}
+
+/**
+ * @brief Sends the queued packets, runs of full segments are handed to the
+ * kernel as one GSO datagram and all runs go in one sendmmsg() call.
+ */
+static void flush(udp_stream_t* stream) {
+  struct mmsghdr messages[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  char control[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  uint32_t first_packet[UDP_BATCH];
+  uint32_t next = 0;
+
+  while (next < stream->tx_count && !stream->error) {
+    uint32_t count = 0;
+    memset(messages, 0, sizeof(messages));
+    for (uint32_t i = next; i < stream->tx_count; count++) {
+      uint32_t run = 0;
+      size_t bytes = 0;
+      do {
+        bytes += stream->tx_sizes[i + run];
+        run++;
+      } while (stream->gso && run < UDP_GSO_SEGMENTS &&
+               i + run < stream->tx_count &&
+               stream->tx_sizes[i + run - 1] == UDP_PACKET_SIZE);
+
+      first_packet[count] = i;
+      iov[count].iov_base = stream->tx + (size_t)i * UDP_PACKET_SIZE;
+      iov[count].iov_len = bytes;
+      struct msghdr* header = &messages[count].msg_hdr;
+      header->msg_iov = &iov[count];
+      header->msg_iovlen = 1;
+      if (run > 1) {
+        header->msg_control = control[count];
+        header->msg_controllen = sizeof(control[count]);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(header);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment_size = UDP_PACKET_SIZE;
+        memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+      }
+      i += run;
+    }
+
+    int sent = sendmmsg(stream->client->socket_fd, messages, count, 0);
+    if (sent > 0) {
+      next = (uint32_t)sent < count ? first_packet[sent] : stream->tx_count;
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && stream->gso &&
+        (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+      // No segmentation offload on this route, one datagram per message
+      LOG_INFO("UDP GSO unavailable to %s:%d, sending datagrams one by one",
+               stream->client->ip, stream->client->port);
+      stream->gso = 0;
+      continue;
+    }
+    if (sent < 0 && errno == ECONNREFUSED) {
+      stream->error = errno;
+    } else {
+      // What was not sent is retransmitted like a loss
+      LOG_WARN("sendmmsg to %s:%d failed: %s", stream->client->ip,
+               stream->client->port, strerror(errno));
+    }
+    break;
+  }
+  stream->tx_count = 0;
+}
+
+static uint8_t* next_packet(udp_stream_t* stream) {
+  if (stream->tx_count == UDP_BATCH) {
+    flush(stream);
+  }
+  return stream->tx + (size_t)stream->tx_count * UDP_PACKET_SIZE;
+}
+
+static void queue_packet(udp_stream_t* stream, size_t size) {
+  stream->tx_sizes[stream->tx_count++] = (uint16_t)size;
+}
+
+static void queue_control(udp_stream_t* stream, uint8_t type) {
+  uint8_t* packet = next_packet(stream);
+  write_header(stream, type, stream->snd_nxt, packet);
+  queue_packet(stream, sizeof(packet_header_t));
+}
+
+static void queue_ack(udp_stream_t* stream) {
+  uint8_t* packet = next_packet(stream);
+  uint8_t* sack = packet + sizeof(packet_header_t);
+  write_header(stream, PACKET_ACK, stream->snd_nxt, packet);
+
+  memset(sack, 0, UDP_SACK_BYTES);
+  if (stream->out_of_order) {
+    for (uint32_t i = 0; i < UDP_SACK_BYTES * 8; i++) {
+      uint32_t seq = stream->rcv_nxt + 1 + i;
+      if (stream->out_of_order_size[seq % UDP_RECEIVE_WINDOW] > 0) {
+        sack[i / 8] |= (uint8_t)(1 << (i % 8));
+      }
+    }
+  }
+  queue_packet(stream, sizeof(packet_header_t) + UDP_SACK_BYTES);
+  stream->ack_pending = 0;
+}
+
+static void queue_segment(udp_stream_t* stream, uint32_t seq) {
+  segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+  uint8_t* packet = next_packet(stream);
+  write_header(stream, PACKET_DATA, seq, packet);
+  ring_read(&stream->unacked, segment->offset - stream->unacked_offset,
+            packet + sizeof(packet_header_t), segment->size);
+  queue_packet(stream, sizeof(packet_header_t) + segment->size);
+
+  segment->order = ++stream->order;
+  segment->sent_us = (uint32_t)now_us();
+  stream->in_flight += segment->size;
+  // The segment carries the acknowledgement
+  stream->ack_pending = 0;
+}
+
+/**
+ * @brief Sends a segment again, lost or still counted in flight.
+ */
+static void resend(udp_stream_t* stream, uint32_t seq) {
+  segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+  if (segment->lost) {
+    segment->lost = 0;
+    stream->lost--;
+  } else {
+    stream->in_flight -= segment->size;
+  }
+  queue_segment(stream, seq);
+  metrics_add(METRIC_UDP_RETRANSMITS, stream->client->ip, 1);
+}
+
+static void retransmit_timeout(wheel_timer_t* timer, void* arg);
+
+/**
+ * @brief Arms the retransmission timer while anything waits for the peer,
+ * a running timer is left as is unless restart is set. Data in flight is
+ * first probed for after two round trips, like TCP's tail loss probe: when
+ * the last segments or their ACKs are lost, no later ACK reveals it.
+ */
+static void arm_timer(udp_stream_t* stream, int restart) {
+  // Queued data the peer has no room for is probed for too
+  int waiting = stream->state == STREAM_CONNECTING ||
+                stream->snd_una != stream->snd_nxt ||
+                (stream->peer_window == 0 &&
+                 stream->unsent_offset <
+                     stream->unacked_offset + stream->unacked.size);
+  if (!waiting || stream->error) {
+    timer_wheel_cancel(stream->wheel, &stream->timer);
+    stream->deadline_us = 0;
+    return;
+  }
+  if (restart || !timer_pending(&stream->timer)) {
+    uint32_t delay_ms = stream->rto_ms;
+    stream->probing = stream->state == STREAM_CONNECTED &&
+                      stream->snd_una != stream->snd_nxt &&
+                      stream->srtt_us > 0 && !stream->probed &&
+                      stream->timeouts == 0;
+    if (stream->probing) {
+      uint32_t probe_ms = 2 * stream->srtt_us / 1000;
+      probe_ms = probe_ms > UDP_MIN_PROBE_MS ? probe_ms : UDP_MIN_PROBE_MS;
+      delay_ms = probe_ms < delay_ms ? probe_ms : delay_ms;
+    }
+    timer_wheel_schedule(stream->wheel, &stream->timer, delay_ms);
+    stream->deadline_us = now_us() + (uint64_t)delay_ms * 1000;
+  }
+}
+
+static uint64_t send_window(const udp_stream_t* stream) {
+  uint64_t window = (uint64_t)stream->cwnd;
+  uint64_t peer = (uint64_t)stream->peer_window * UDP_SEGMENT_SIZE;
+  return window < peer ? window : peer;
+}
+
+/**
+ * @brief Sends what the window allows, lost segments first, then the ACK
+ * if no segment carried it. With force, one segment goes out even if the
+ * window is full, to probe a peer that stopped answering.
+ */
+static void transmit(udp_stream_t* stream, int force) {
+  if (stream->error || stream->client->socket_fd < 0) {
+    return;
+  }
+  if (stream->state == STREAM_CONNECTED) {
+    uint64_t window = send_window(stream);
+    for (uint32_t seq = stream->snd_una;
+         stream->lost > 0 && seq != stream->snd_nxt; seq++) {
+      segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+      if (!segment->lost) {
+        continue;
+      }
+      if (stream->in_flight + segment->size > window && !force) {
+        break;
+      }
+      resend(stream, seq);
+      force = 0;
+    }
+
+    uint64_t end = stream->unacked_offset + stream->unacked.size;
+    while (stream->unsent_offset < end &&
+           stream->snd_nxt - stream->snd_una < UDP_SEND_WINDOW &&
+           (stream->snd_nxt - stream->snd_una < stream->peer_window ||
+            force)) {
+      uint64_t left = end - stream->unsent_offset;
+      uint16_t size = left < UDP_SEGMENT_SIZE ? (uint16_t)left
+                                              : (uint16_t)UDP_SEGMENT_SIZE;
+      if (stream->in_flight + size > window && !force) {
+        break;
+      }
+      segment_t* segment = &stream->segments[stream->snd_nxt % UDP_SEND_WINDOW];
+      memset(segment, 0, sizeof(*segment));
+      segment->offset = stream->unsent_offset;
+      segment->size = size;
+      queue_segment(stream, stream->snd_nxt++);
+      stream->unsent_offset += size;
+      force = 0;
+    }
+  }
+
+  if (stream->syn_ack_pending) {
+    queue_control(stream, PACKET_SYN_ACK);
+    stream->syn_ack_pending = 0;
+  }
+  if (stream->ack_pending) {
+    queue_ack(stream);
+  }
+  flush(stream);
+  arm_timer(stream, 0);
+}
+
+static void update_rtt(udp_stream_t* stream, uint32_t echo_us) {
+  uint32_t rtt = (uint32_t)now_us() - echo_us;
+  if (stream->srtt_us == 0) {
+    stream->srtt_us = rtt > 0 ? rtt : 1;
+    stream->rttvar_us = rtt / 2;
+  } else {
+    uint32_t deviation = stream->srtt_us > rtt ? stream->srtt_us - rtt
+                                               : rtt - stream->srtt_us;
+    stream->rttvar_us = (3 * stream->rttvar_us + deviation) / 4;
+    stream->srtt_us = (7 * stream->srtt_us + rtt) / 8;
+  }
+
+  uint32_t rto_ms = (stream->srtt_us + 4 * stream->rttvar_us) / 1000;
+  stream->rto_ms = rto_ms < UDP_MIN_RTO_MS   ? UDP_MIN_RTO_MS
+                   : rto_ms > UDP_MAX_RTO_MS ? UDP_MAX_RTO_MS
+                                             : rto_ms;
+}
+
+/**
+ * @brief Records a one-way delay sample. The clocks of the two hosts are
+ * not synchronized, their offset cancels out in the queuing delay.
+ */
+static void update_delay(udp_stream_t* stream, uint32_t delay_us) {
+  uint64_t minute = metrics_now_ns() / (60 * UINT64_C(1000000000));
+  uint32_t* base = stream->base_delay;
+
+  if (stream->delay_samples == 0 ||
+      minute - stream->base_minute >= UDP_LEDBAT_BASE_HISTORY) {
+    for (int i = 0; i < UDP_LEDBAT_BASE_HISTORY; i++) {
+      base[i] = delay_us;
+    }
+  } else {
+    // Minutes without samples start from this one
+    for (uint64_t m = stream->base_minute + 1; m <= minute; m++) {
+      base[m % UDP_LEDBAT_BASE_HISTORY] = delay_us;
+    }
+    uint32_t* slot = &base[minute % UDP_LEDBAT_BASE_HISTORY];
+    if ((int32_t)(delay_us - *slot) < 0) {
+      *slot = delay_us;
+    }
+  }
+  stream->base_minute = minute;
+  stream->current_delay[stream->delay_samples++ % UDP_LEDBAT_CURRENT_FILTER] =
+      delay_us;
+}
+
+static uint32_t queuing_delay(const udp_stream_t* stream) {
+  if (stream->delay_samples == 0) {
+    return 0;
+  }
+  uint32_t base = stream->base_delay[0];
+  for (int i = 1; i < UDP_LEDBAT_BASE_HISTORY; i++) {
+    if ((int32_t)(stream->base_delay[i] - base) < 0) {
+      base = stream->base_delay[i];
+    }
+  }
+
+  uint32_t samples = stream->delay_samples < UDP_LEDBAT_CURRENT_FILTER
+                         ? stream->delay_samples
+                         : UDP_LEDBAT_CURRENT_FILTER;
+  uint32_t current = stream->current_delay[0];
+  for (uint32_t i = 1; i < samples; i++) {
+    if ((int32_t)(stream->current_delay[i] - current) < 0) {
+      current = stream->current_delay[i];
+    }
+  }
+  return (int32_t)(current - base) > 0 ? current - base : 0;
+}
+
+static void limit_cwnd(udp_stream_t* stream) {
+  double max = (double)UDP_SEND_WINDOW * UDP_SEGMENT_SIZE;
+  if (stream->max_rate > 0 && stream->srtt_us > 0) {
+    double rate_window = (double)stream->max_rate * stream->srtt_us / 1e6;
+    max = rate_window < max ? rate_window : max;
+  }
+  double min = (double)UDP_LEDBAT_MIN_CWND * UDP_SEGMENT_SIZE;
+  stream->cwnd = stream->cwnd > max ? max : stream->cwnd;
+  stream->cwnd = stream->cwnd < min ? min : stream->cwnd;
+}
+
+/**
+ * @brief Grows or shrinks the window with how far the queuing delay is from
+ * the target, after an initial slow start that ends before the target.
+ */
+static void ledbat_on_ack(udp_stream_t* stream, uint64_t acked,
+                          uint64_t flight) {
+  double queuing = queuing_delay(stream);
+  double max;
+  if (stream->slow_start && (queuing > UDP_LEDBAT_TARGET_US * 3 / 4 ||
+                             stream->cwnd >= stream->ssthresh)) {
+    stream->slow_start = 0;
+  }
+  if (stream->slow_start) {
+    stream->cwnd += acked;
+    max = 2.0 * flight;
+  } else {
+    double off_target = (UDP_LEDBAT_TARGET_US - queuing) / UDP_LEDBAT_TARGET_US;
+    stream->cwnd +=
+        UDP_LEDBAT_GAIN * off_target * acked * UDP_SEGMENT_SIZE / stream->cwnd;
+    max = flight + UDP_LEDBAT_ALLOWED_INCREASE * UDP_SEGMENT_SIZE;
+  }
+  // An application that sends less than the window does not grow it
+  if (stream->cwnd > max) {
+    stream->cwnd = max;
+  }
+  limit_cwnd(stream);
+}
+
+static void mark_lost(udp_stream_t* stream, segment_t* segment) {
+  segment->lost = 1;
+  stream->lost++;
+  stream->in_flight -= segment->size;
+}
+
+/**
+ * @brief Accounts for a segment acknowledged for the first time.
+ *
+ * @return Its size.
+ */
+static uint64_t delivered(udp_stream_t* stream, segment_t* segment) {
+  if (segment->lost) {
+    stream->lost--;
+  } else {
+    stream->in_flight -= segment->size;
+  }
+  if ((int32_t)(segment->order - stream->acked_order) > 0) {
+    stream->acked_order = segment->order;
+    stream->acked_sent_us = segment->sent_us;
+  }
+  return segment->size;
+}
+
+/**
+ * @brief Applies the acknowledgement every packet carries, and the SACK
+ * bitmap of ACK packets.
+ */
+static void receive_ack(udp_stream_t* stream, const packet_header_t* header,
+                        const uint8_t* sack) {
+  uint64_t flight = stream->in_flight;
+  uint64_t acked = 0;
+  uint32_t ack = header->ack;
+
+  if (seq_before(stream->snd_una, ack) &&
+      !seq_before(stream->snd_nxt, ack)) {
+    for (uint32_t seq = stream->snd_una; seq != ack; seq++) {
+      segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+      if (segment->sacked) {
+        stream->sacked--;
+      } else {
+        acked += delivered(stream, segment);
+      }
+    }
+    uint64_t end = ack == stream->snd_nxt
+                       ? stream->unsent_offset
+                       : stream->segments[ack % UDP_SEND_WINDOW].offset;
+    ring_drop(&stream->unacked, end - stream->unacked_offset);
+    stream->unacked_offset = end;
+    stream->snd_una = ack;
+    stream->timeouts = 0;
+  }
+
+  for (uint32_t i = 0; sack && i < UDP_SACK_BYTES * 8; i++) {
+    uint32_t seq = ack + 1 + i;
+    if (!seq_before(seq, stream->snd_nxt)) {
+      break;
+    }
+    segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+    if (!(sack[i / 8] & (1 << (i % 8))) || seq_before(seq, stream->snd_una) ||
+        segment->sacked) {
+      continue;
+    }
+    segment->sacked = 1;
+    stream->sacked++;
+    acked += delivered(stream, segment);
+  }
+  stream->peer_window = header->window;
+
+  if (acked == 0) {
+    return;
+  }
+  stream->probed = 0;
+  if (header->flags & PACKET_FLAG_ECHO) {
+    update_rtt(stream, header->echo_us);
+    update_delay(stream, header->delay_us);
+  }
+
+  // A segment sent before others the peer already has is lost, the window
+  // is halved once per window of data
+  int loss = 0;
+  uint32_t reorder_us = stream->srtt_us / 4;
+  for (uint32_t seq = stream->snd_una;
+       stream->sacked > 0 && seq != stream->snd_nxt; seq++) {
+    segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+    int32_t later = (int32_t)(stream->acked_order - segment->order);
+    if (segment->sacked || segment->lost || later <= 0 ||
+        (later < UDP_DUP_THRESH &&
+         (int32_t)(stream->acked_sent_us - segment->sent_us) <=
+             (int32_t)reorder_us)) {
+      continue;
+    }
+    mark_lost(stream, segment);
+    if (!seq_before(seq, stream->recover)) {
+      loss = 1;
+    }
+  }
+  if (loss) {
+    stream->cwnd /= 2;
+    stream->ssthresh = stream->cwnd;
+    stream->slow_start = 0;
+    stream->recover = stream->snd_nxt;
+    limit_cwnd(stream);
+  } else {
+    ledbat_on_ack(stream, acked, flight);
+  }
+  arm_timer(stream, 1);
+}
+
+static int store_out_of_order(udp_stream_t* stream, uint32_t seq,
+                              const uint8_t* payload, size_t size) {
+  if (!stream->out_of_order) {
+    stream->out_of_order =
+        malloc((size_t)UDP_RECEIVE_WINDOW * UDP_SEGMENT_SIZE);
+    if (!stream->out_of_order) {
+      ERRNO_MSG("malloc failed");
+      return -1;
+    }
+  }
+  uint32_t slot = seq % UDP_RECEIVE_WINDOW;
+  memcpy(stream->out_of_order + (size_t)slot * UDP_SEGMENT_SIZE, payload,
+         size);
+  stream->out_of_order_size[slot] = (uint16_t)size;
+  return 0;
+}
+
+static void receive_data(udp_stream_t* stream, const packet_header_t* header,
+                         const uint8_t* payload, size_t size) {
+  stream->ack_pending = 1;
+  stream->has_echo = 1;
+  stream->echo_us = header->timestamp_us;
+  stream->delay_us = (uint32_t)now_us() - header->timestamp_us;
+
+  int32_t distance = (int32_t)(header->seq - stream->rcv_nxt);
+  if (size == 0 || size > UDP_SEGMENT_SIZE || distance < 0 ||
+      distance >= receive_window(stream)) {
+    // A duplicate, or no room: the ACK tells the peer where we are
+    return;
+  }
+  if (distance > 0) {
+    if (store_out_of_order(stream, header->seq, payload, size) != 0) {
+      stream->error = ENOMEM;
+    }
+    return;
+  }
+
+  if (ring_reserve(&stream->ready, stream->ready.size + size) != 0) {
+    stream->error = ENOMEM;
+    return;
+  }
+  ring_write(&stream->ready, payload, size);
+  stream->rcv_nxt++;
+
+  // The gap is filled, the segments held behind it follow
+  for (;;) {
+    uint32_t slot = stream->rcv_nxt % UDP_RECEIVE_WINDOW;
+    uint16_t held = stream->out_of_order_size[slot];
+    if (held == 0) {
+      break;
+    }
+    if (ring_reserve(&stream->ready, stream->ready.size + held) != 0) {
+      stream->error = ENOMEM;
+      return;
+    }
+    ring_write(&stream->ready,
+               stream->out_of_order + (size_t)slot * UDP_SEGMENT_SIZE, held);
+    stream->out_of_order_size[slot] = 0;
+    stream->rcv_nxt++;
+  }
+}
+
+static void receive_packet(udp_stream_t* stream, const uint8_t* packet,
+                           size_t size) {
+  packet_header_t header;
+  if (size < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, packet, sizeof(header));
+  header.window = ntohs(header.window);
+  header.conn_id = ntohl(header.conn_id);
+  header.seq = ntohl(header.seq);
+  header.ack = ntohl(header.ack);
+  header.timestamp_us = ntohl(header.timestamp_us);
+  header.echo_us = ntohl(header.echo_us);
+  header.delay_us = ntohl(header.delay_us);
+  if (header.conn_id != stream->conn_id) {
+    return;
+  }
+
+  const uint8_t* payload = packet + sizeof(header);
+  size_t payload_size = size - sizeof(header);
+  switch (header.type) {
+    case PACKET_SYN:
+      // Our answer was lost
+      stream->syn_ack_pending = stream->server;
+      return;
+    case PACKET_SYN_ACK:
+      if (stream->state == STREAM_CONNECTING) {
+        stream->state = STREAM_CONNECTED;
+        stream->peer_window = header.window;
+        stream->timeouts = 0;
+        if (header.flags & PACKET_FLAG_ECHO) {
+          update_rtt(stream, header.echo_us);
+        }
+        arm_timer(stream, 1);
+      }
+      return;
+    case PACKET_DATA:
+    case PACKET_ACK:
+    case PACKET_FIN:
+      if (stream->state != STREAM_CONNECTED) {
+        return;
+      }
+      receive_ack(stream, &header,
+                  header.type == PACKET_ACK && payload_size >= UDP_SACK_BYTES
+                      ? payload
+                      : NULL);
+      if (header.type == PACKET_DATA) {
+        receive_data(stream, &header, payload, payload_size);
+      } else if (header.type == PACKET_FIN) {
+        stream->peer_closed = 1;
+        stream->fin_seq = header.seq;
+      }
+      return;
+    default:
+      return;
+  }
+}
+
+/**
+ * @brief Reads every datagram waiting on the socket, then sends the ACK and
+ * the data the new window allows.
+ */
+static void pump(udp_stream_t* stream) {
+  struct mmsghdr messages[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+
+  while (!stream->error) {
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < UDP_BATCH; i++) {
+      iov[i].iov_base = stream->rx + (size_t)i * UDP_PACKET_SIZE;
+      iov[i].iov_len = UDP_PACKET_SIZE;
+      messages[i].msg_hdr.msg_iov = &iov[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = recvmmsg(stream->client->socket_fd, messages, UDP_BATCH,
+                         MSG_DONTWAIT, NULL);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        stream->error = errno;
+      }
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      receive_packet(stream, stream->rx + (size_t)i * UDP_PACKET_SIZE,
+                     messages[i].msg_len);
+    }
+    if (count < UDP_BATCH) {
+      break;
+    }
+  }
+  transmit(stream, 0);
+}
+
+/**
+ * @brief Retransmits after the peer went silent for a full timeout,
+ * everything in flight is presumed lost and the window starts over.
+ */
+static void on_timeout(udp_stream_t* stream) {
+  TCPClient_t* client = stream->client;
+  stream->deadline_us = 0;
+  if (client->socket_fd < 0 || stream->error) {
+    return;
+  }
+  if (stream->probing) {
+    // The ACK of the newest segment tells which ones are missing
+    uint32_t seq = stream->snd_nxt - 1;
+    while (seq != stream->snd_una &&
+           stream->segments[seq % UDP_SEND_WINDOW].sacked) {
+      seq--;
+    }
+    stream->probed = 1;
+    resend(stream, seq);
+    flush(stream);
+    arm_timer(stream, 1);
+    return;
+  }
+
+  stream->rto_ms = stream->rto_ms * 2 < UDP_MAX_RTO_MS ? stream->rto_ms * 2
+                                                       : UDP_MAX_RTO_MS;
+  if (stream->state == STREAM_CONNECTING) {
+    // The connect deadline decides when to give up
+    queue_control(stream, PACKET_SYN);
+    flush(stream);
+    arm_timer(stream, 1);
+    return;
+  }
+  if (++stream->timeouts > UDP_MAX_TIMEOUTS) {
+    LOG_WARN("%s:%d stopped acknowledging over UDP", client->ip,
+             client->port);
+    stream->error = ETIMEDOUT;
+    arm_timer(stream, 0);
+    return;
+  }
+
+  // Like TCP, slow start back to half of what was in flight
+  double half = stream->in_flight / 2.0;
+  stream->ssthresh = half > UDP_LEDBAT_MIN_CWND * UDP_SEGMENT_SIZE
+                         ? half
+                         : UDP_LEDBAT_MIN_CWND * UDP_SEGMENT_SIZE;
+  for (uint32_t seq = stream->snd_una; seq != stream->snd_nxt; seq++) {
+    segment_t* segment = &stream->segments[seq % UDP_SEND_WINDOW];
+    if (!segment->sacked && !segment->lost) {
+      mark_lost(stream, segment);
+    }
+  }
+  stream->cwnd = UDP_SEGMENT_SIZE;
+  stream->slow_start = 1;
+  stream->recover = stream->snd_nxt;
+  limit_cwnd(stream);
+  transmit(stream, 1);
+  arm_timer(stream, 1);
+}
+
+static void retransmit_timeout(wheel_timer_t* timer, void* arg) {
+  (void)arg;
+  on_timeout(TIMER_CONTAINER(timer, udp_stream_t, timer));
+}
+
+static int stream_ended(const udp_stream_t* stream) {
+  return stream->peer_closed && !seq_before(stream->rcv_nxt, stream->fin_seq);
+}
+
+static int can_receive(const udp_stream_t* stream) {
+  return stream->ready.size > 0 || stream_ended(stream);
+}
+
+static int can_queue(const udp_stream_t* stream) {
+  return stream->unacked.size < UDP_SEND_BUFFER;
+}
+
+static uint64_t receive_timeout_ms(int socket_fd) {
+  struct timeval timeout = {0};
+  socklen_t length = sizeof(timeout);
+  if (getsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &length) !=
+      0) {
+    return 0;
+  }
+  return (uint64_t)timeout.tv_sec * 1000 + (uint64_t)timeout.tv_usec / 1000;
+}
+
+/**
+ * @brief Blocks like a socket call until ready() holds, retransmitting on
+ * time since the event loop and its timers are not running meanwhile. A
+ * non-blocking stream only processes what already arrived.
+ *
+ * @return `0` once ready, `-1` with errno set on error, once the receive
+ * timeout of the socket expired or at once if non-blocking.
+ */
+static int wait_until(udp_stream_t* stream,
+                      int (*ready)(const udp_stream_t*)) {
+  int fd = stream->client->socket_fd;
+  uint64_t timeout_ms = receive_timeout_ms(fd);
+  uint64_t give_up = timeout_ms ? now_us() + timeout_ms * 1000 : 0;
+
+  for (;;) {
+    pump(stream);
+    if (ready(stream)) {
+      return 0;
+    }
+    if (stream->error) {
+      errno = stream->error;
+      return -1;
+    }
+    if (stream->non_blocking) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    uint64_t now = now_us();
+    if (give_up && now >= give_up) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (stream->deadline_us && now >= stream->deadline_us) {
+      on_timeout(stream);
+      continue;
+    }
+
+    uint64_t wake = stream->deadline_us;
+    if (give_up && (!wake || give_up < wake)) {
+      wake = give_up;
+    }
+    int wait_ms = wake ? (int)((wake - now + 999) / 1000) : UDP_MAX_RTO_MS;
+    struct pollfd poll_fd = {.fd = fd, .events = POLLIN};
+    if (poll(&poll_fd, 1, wait_ms) < 0 && errno != EINTR) {
+      stream->error = errno;
+    }
+  }
+}
+
+static udp_stream_t* stream_create(TCPClient_t* client, timer_wheel_t* wheel,
+                                   uint32_t conn_id, int server) {
+  udp_stream_t* stream = calloc(1, sizeof(udp_stream_t));
+  if (!stream) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  stream->segments = calloc(UDP_SEND_WINDOW, sizeof(segment_t));
+  stream->rx = malloc((size_t)UDP_BATCH * UDP_PACKET_SIZE);
+  stream->tx = malloc((size_t)UDP_BATCH * UDP_PACKET_SIZE);
+  if (!stream->segments || !stream->rx || !stream->tx) {
+    ERRNO_MSG("malloc failed");
+    free(stream->segments);
+    free(stream->rx);
+    free(stream->tx);
+    free(stream);
+    return NULL;
+  }
+
+  stream->client = client;
+  stream->wheel = wheel;
+  stream->conn_id = conn_id;
+  stream->server = server;
+  stream->state = server ? STREAM_CONNECTED : STREAM_CONNECTING;
+  stream->gso = 1;
+  stream->cwnd = UDP_LEDBAT_MIN_CWND * UDP_SEGMENT_SIZE;
+  stream->ssthresh = (double)UDP_SEND_WINDOW * UDP_SEGMENT_SIZE;
+  stream->slow_start = 1;
+  stream->peer_window = UDP_RECEIVE_WINDOW;
+  stream->rto_ms = UDP_INITIAL_RTO_MS;
+  timer_init(&stream->timer, retransmit_timeout, NULL);
+
+  // Best effort, the kernel caps them at net.core.[rw]mem_max
+  int size = UDP_SOCKET_BUFFER;
+  setsockopt(client->socket_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(client->socket_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  client->udp = stream;
+  return stream;
+}
+
+TCPClient_t* udp_stream_client_create(timer_wheel_t* wheel) {
+  TCPClient_t* client = calloc(1, sizeof(TCPClient_t));
+  if (!client) {
+    ERRNO_MSG("calloc failed");
+    return NULL;
+  }
+  client->source.fd = -1;
+
+  client->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (client->socket_fd < 0) {
+    ERRNO_MSG("socket failed");
+    free(client);
+    return NULL;
+  }
+
+  uint32_t conn_id = 0;
+  while (conn_id == 0) {
+    if (getrandom(&conn_id, sizeof(conn_id), 0) != sizeof(conn_id)) {
+      ERRNO_MSG("getrandom failed");
+      close(client->socket_fd);
+      free(client);
+      return NULL;
+    }
+  }
+  if (!stream_create(client, wheel, conn_id, 0)) {
+    close(client->socket_fd);
+    free(client);
+    return NULL;
+  }
+  return client;
+}
+
+int udp_stream_connect(TCPClient_t* client, const struct sockaddr_in* addr) {
+  if (!client || !client->udp || !addr) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  if (connect(client->socket_fd, (const struct sockaddr*)addr,
+              sizeof(*addr)) < 0) {
+    LOG_WARN("Failed to connect to %s:%d: %s", client->ip, client->port,
+             strerror(errno));
+    return -1;
+  }
+
+  udp_stream_t* stream = client->udp;
+  client->connect_started_ns = metrics_now_ns();
+  queue_control(stream, PACKET_SYN);
+  flush(stream);
+  arm_timer(stream, 1);
+  return 1;
+}
+
+int udp_stream_connect_finish(TCPClient_t* client) {
+  udp_stream_t* stream = client->udp;
+  pump(stream);
+  if (stream->error) {
+    LOG_WARN("Failed to connect to %s:%d: %s", client->ip, client->port,
+             strerror(stream->error));
+    client->connect_started_ns = 0;
+    return -1;
+  }
+  if (stream->state != STREAM_CONNECTED) {
+    return 1;
+  }
+
+  client->connect_started_ns = 0;
+  client->connected = 1;
+  LOG_INFO("Connected to %s:%d over UDP", client->ip, client->port);
+  return 0;
+}
+
+int udp_stream_listen(in_port_t port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    ERRNO_MSG("socket failed");
+    return -1;
+  }
+
+  // Connection sockets share the port
+  int reuse = 1;
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+      bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ERRNO_MSG("bind failed");
+    close(fd);
+    return -1;
+  }
+
+  LOG_INFO("UDP streams accepted on port: %d", port);
+  return fd;
+}
+
+int udp_stream_accept(int listen_fd, struct sockaddr_in* peer,
+                      uint32_t* conn_id) {
+  packet_header_t header;
+  for (;;) {
+    socklen_t length = sizeof(*peer);
+    ssize_t received = recvfrom(listen_fd, &header, sizeof(header), 0,
+                                (struct sockaddr*)peer, &length);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ERRNO_MSG("recvfrom failed");
+      }
+      return -1;
+    }
+    // Anything else belongs to a connection that is gone
+    if ((size_t)received == sizeof(header) && header.type == PACKET_SYN &&
+        header.conn_id != 0) {
+      *conn_id = ntohl(header.conn_id);
+      return 0;
+    }
+  }
+}
+
+int udp_stream_open(in_port_t port, const struct sockaddr_in* peer) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    ERRNO_MSG("socket failed");
+    return -1;
+  }
+
+  int reuse = 1;
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+      bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      connect(fd, (const struct sockaddr*)peer, sizeof(*peer)) < 0) {
+    ERRNO_MSG("Failed to open a UDP stream socket");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int udp_stream_attach(TCPClient_t* client, timer_wheel_t* wheel,
+                      uint32_t conn_id) {
+  if (!client || client->udp || !wheel) {
+    STDERR_MSG("Wrong parameters");
+    return -1;
+  }
+
+  udp_stream_t* stream = stream_create(client, wheel, conn_id, 1);
+  if (!stream) {
+    return -1;
+  }
+  stream->syn_ack_pending = 1;
+  transmit(stream, 0);
+  return 0;
+}
+
+int udp_stream_has_input(const TCPClient_t* client) {
+  udp_stream_t* stream = client->udp;
+  if (client->socket_fd < 0) {
+    return 0;
+  }
+  pump(stream);
+  return can_receive(stream) || stream->error != 0;
+}
+
+ssize_t udp_stream_send(TCPClient_t* client, const void* data, size_t size) {
+  udp_stream_t* stream = client->udp;
+  const uint8_t* bytes = data;
+  size_t queued = 0;
+
+  while (queued < size) {
+    if (stream->error || stream->peer_closed) {
+      errno = stream->error ? stream->error : EPIPE;
+      return -1;
+    }
+    if (!can_queue(stream)) {
+      if (wait_until(stream, can_queue) != 0) {
+        return queued > 0 ? (ssize_t)queued : -1;
+      }
+      continue;
+    }
+
+    size_t chunk = UDP_SEND_BUFFER - stream->unacked.size;
+    chunk = chunk < size - queued ? chunk : size - queued;
+    if (ring_reserve(&stream->unacked, stream->unacked.size + chunk) != 0) {
+      errno = ENOMEM;
+      return -1;
+    }
+    ring_write(&stream->unacked, bytes + queued, chunk);
+    queued += chunk;
+    transmit(stream, 0);
+  }
+  return (ssize_t)size;
+}
+
+void udp_stream_set_non_blocking(TCPClient_t* client, int on) {
+  client->udp->non_blocking = on;
+}
+
+ssize_t udp_stream_recv(TCPClient_t* client, void* buffer, size_t size) {
+  udp_stream_t* stream = client->udp;
+  if (wait_until(stream, can_receive) != 0) {
+    return -1;
+  }
+  if (stream->ready.size == 0) {
+    return 0;
+  }
+
+  size_t received = size < stream->ready.size ? size : stream->ready.size;
+  ring_read(&stream->ready, 0, buffer, received);
+  ring_drop(&stream->ready, received);
+
+  // A sender stopped by a small window waits for the room made here
+  if (stream->advertised_window < UDP_RECEIVE_WINDOW / 4 &&
+      receive_window(stream) >= UDP_RECEIVE_WINDOW / 2) {
+    stream->ack_pending = 1;
+    transmit(stream, 0);
+  }
+  return (ssize_t)received;
+}
+
+uint64_t udp_stream_delivery_rate(const TCPClient_t* client) {
+  const udp_stream_t* stream = client->udp;
+  if (stream->srtt_us == 0) {
+    return 0;
+  }
+  return (uint64_t)(stream->cwnd * 1e6 / stream->srtt_us);
+}
+
+void udp_stream_set_max_rate(TCPClient_t* client, uint64_t rate) {
+  client->udp->max_rate = rate;
+  limit_cwnd(client->udp);
+}
+
+void udp_stream_close(TCPClient_t* client) {
+  if (!client || !client->udp) {
+    return;
+  }
+
+  udp_stream_t* stream = client->udp;
+  timer_wheel_cancel(stream->wheel, &stream->timer);
+  if (client->socket_fd >= 0 && stream->state == STREAM_CONNECTED &&
+      !stream->error) {
+    // Not retransmitted, a peer that misses it times out
+    queue_control(stream, PACKET_FIN);
+    flush(stream);
+  }
+
+  free(stream->unacked.data);
+  free(stream->ready.data);
+  free(stream->out_of_order);
+  free(stream->segments);
+  free(stream->rx);
+  free(stream->tx);
+  free(stream);
+  client->udp = NULL;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file udp_stream.h
+ * @brief Reliable byte stream over UDP that yields to other traffic.
+ *
+ * A peer connection may run over UDP instead of TCP, so that bulk transfers
+ * only take the capacity other traffic leaves. The stream travels in
+ * numbered segments that fit a 1500 byte MTU. Each ACK carries the next
+ * segment expected and a bitmap of the segments received past it (selective
+ * ACKs), so a loss costs one retransmission.
+ *
+ * The congestion window follows LEDBAT (RFC 6817). Every ACK echoes the
+ * one-way delay of the newest segment, and the window grows while that
+ * delay stays within UDP_LEDBAT_TARGET_US of the lowest delay seen. It
+ * shrinks as soon as a queue builds up, well before the queue overflows and
+ * TCP would react, so TCP flows sharing the bottleneck keep it.
+ *
+ * Segments go out in batches: one sendmmsg() call carries several runs of
+ * segments, and each run is split by the kernel (UDP GSO). Kernels without
+ * GSO get one message per segment. Input is read with recvmmsg().
+ *
+ * Each connection has its own connected UDP socket. On the seeder it is
+ * bound to the listening port, so the kernel sorts the datagrams by peer
+ * and the socket goes into the event loop like a TCP one. The stream is
+ * attached to a TCPClient_t, and tcp_send(), tcp_recv() and
+ * tcp_has_input() use it in place of the socket. Sending and receiving
+ * block like they do on a TCP socket, honouring SO_RCVTIMEO, unless the
+ * stream is made non-blocking. Between calls, retransmissions are driven by
+ * a timer on the event loop's wheel.
+ */
+
+#ifndef NETWORK_UDP_STREAM_H_
+#define NETWORK_UDP_STREAM_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../common/timer_wheel.h"
+#include "common.h"
+
+/* Queuing delay the sender aims for, below the 100 ms ceiling of RFC 6817 */
+#define UDP_LEDBAT_TARGET_US 25000
+
+typedef struct udp_stream udp_stream_t;
+
+/**
+ * @brief Create a client whose connection will run over UDP
+ * @param wheel Wheel of the event loop, for retransmissions
+ * @return Client on success or NULL on error
+ */
+TCPClient_t* udp_stream_client_create(timer_wheel_t* wheel);
+
+/**
+ * @brief Send the connection request, the client is connected once
+ * udp_stream_connect_finish() returns `0`
+ * @param client Client from udp_stream_client_create()
+ * @param addr Address of the seeder
+ * @return `1` while waiting for the answer or `-1` on error
+ */
+int udp_stream_connect(TCPClient_t* client, const struct sockaddr_in* addr);
+
+/**
+ * @brief Process what arrived on a connecting client
+ * @param client Client
+ * @return `0` once connected, `1` while still waiting or `-1` if refused
+ */
+int udp_stream_connect_finish(TCPClient_t* client);
+
+/**
+ * @brief Create the socket connection requests arrive on
+ * @param port UDP port, the same number as the TCP listener's
+ * @return Non-blocking socket or `-1` on error
+ */
+int udp_stream_listen(in_port_t port);
+
+/**
+ * @brief Take one connection request from the listening socket. A request
+ * sent again before its connection was opened is taken again, the caller
+ * skips peers it already has
+ * @param listen_fd Socket from udp_stream_listen()
+ * @param peer Output parameter for the address of the leecher
+ * @param conn_id Output parameter for the connection id it chose
+ * @return `0` on success or `-1` with errno `EAGAIN` once none is left
+ */
+int udp_stream_accept(int listen_fd, struct sockaddr_in* peer,
+                      uint32_t* conn_id);
+
+/**
+ * @brief Open the socket of an accepted connection, the kernel then hands
+ * it every datagram of the peer instead of the listening socket
+ * @param port Listening port
+ * @param peer Address of the leecher
+ * @return Socket on success or `-1` on error
+ */
+int udp_stream_open(in_port_t port, const struct sockaddr_in* peer);
+
+/**
+ * @brief Attach the stream of an accepted connection and answer the request
+ * @param client Client holding the socket from udp_stream_open()
+ * @param wheel Wheel of the event loop, for retransmissions
+ * @param conn_id Connection id from udp_stream_accept()
+ * @return `0` on success or `-1` on error
+ */
+int udp_stream_attach(TCPClient_t* client, timer_wheel_t* wheel,
+                      uint32_t conn_id);
+
+/**
+ * @brief Process what arrived without blocking, sending ACKs and the data
+ * the window allows, then check whether a receive would return at once
+ * @param client Client with a stream
+ * @return `1` if stream data, its end or an error is pending, `0` otherwise
+ */
+int udp_stream_has_input(const TCPClient_t* client);
+
+/**
+ * @brief Queue data, blocking while the send buffer is full
+ * @param client Client with a connected stream
+ * @param data Data
+ * @param size Size of data
+ * @return size on success, less once the send buffer of a non-blocking
+ * stream is full, or `-1` on error, with errno `EAGAIN` if nothing fit
+ */
+ssize_t udp_stream_send(TCPClient_t* client, const void* data, size_t size);
+
+/**
+ * @brief Make sending and receiving return at once, with errno `EAGAIN` when
+ * they would wait, like on a non-blocking socket. Datagrams that arrived are
+ * still processed first. The socket itself is left alone
+ * @param client Client with a stream
+ * @param on `1` - enable, `0` - disable
+ */
+void udp_stream_set_non_blocking(TCPClient_t* client, int on);
+
+/**
+ * @brief Receive stream data, like recv() on a blocking socket
+ * @param client Client with a connected stream
+ * @param buffer Buffer
+ * @param size Size of buffer
+ * @return Amount of received bytes, `0` if closed or `-1` on error, with
+ * errno `EAGAIN` once SO_RCVTIMEO expires or if nothing arrived on a
+ * non-blocking stream
+ */
+ssize_t udp_stream_recv(TCPClient_t* client, void* buffer, size_t size);
+
+/**
+ * @brief Rate the window allows at the current round-trip time
+ * @param client Client with a stream
+ * @return Bytes per second or `0` if unknown
+ */
+uint64_t udp_stream_delivery_rate(const TCPClient_t* client);
+
+/**
+ * @brief Cap the congestion window to a rate at the current round-trip time
+ * @param client Client with a stream
+ * @param rate Bytes per second, `0` to remove the cap
+ */
+void udp_stream_set_max_rate(TCPClient_t* client, uint64_t rate);
+
+/**
+ * @brief Tell the peer the connection ends and free the stream, the socket
+ * is left open
+ * @param client Client, does nothing without a stream
+ */
+void udp_stream_close(TCPClient_t* client);
+
+#endif  // NETWORK_UDP_STREAM_H_
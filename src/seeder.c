@@ -1,175 +1,771 @@
 #include "seeder.h"
 
-static int is_path_exist(const char* path) { return access(path, F_OK) == 0; }
+LOG_DEFINE_MODULE(LOG_MODULE_SEEDER);
+
+static int init_torrent(eltextorrent_file_t* torrent, int* data_fd,
+                        const Config* cfg) {
+  char full_file_path[PATH_MAX];
+  struct stat st;
 
-static int init_torrent(eltextorrent_file_t* torrent, char* full_file_path,
-                        size_t path_size, const Config* cfg) {
   if (torrent_loader(torrent, cfg->torrent_path) < 0) {
-    fprintf(stderr, "Failed to load torrent: %s\n", cfg->torrent_path);
+    LOG_ERROR("Failed to load torrent: %s", cfg->torrent_path);
     return -1;
   }
 
-  if (build_full_path(full_file_path, path_size, cfg->data_path,
+  if (build_full_path(full_file_path, sizeof(full_file_path), cfg->data_path,
                       torrent->name) != 0 ||
-      !is_path_exist(full_file_path)) {
-    fprintf(stderr, "File not found: %s/%s\n", cfg->data_path, torrent->name);
-    return -1;
-  }
-
-  printf("Torrent loaded: [%s]\n", torrent->infohash);
-  return 0;
-}
-
-static int init_network(TCPServer_t** tcp_srv, udp_broadcast_t** udp_bcast,
-                        udp_broadcast_receiver_t** udp_recv, int epoll_fd) {
-  *tcp_srv = tcp_server_create(SEEDER_TCP_PORT);
-  if (!*tcp_srv || tcp_server_listen(*tcp_srv, 64) < 0 ||
-      add_to_epoll(epoll_fd, (*tcp_srv)->socket_fd) < 0) {
+      (*data_fd = open(full_file_path, O_RDONLY)) < 0) {
+    LOG_ERROR("File not found: %s/%s", cfg->data_path, torrent->name);
     return -1;
   }
 
-  *udp_bcast = udp_broadcast_create(UDP_BROADCAST_PORT);
-  *udp_recv = udp_broadcast_receiver_create(UDP_RECEIVE_PORT);
-  if (!*udp_bcast || !*udp_recv ||
-      add_to_epoll(epoll_fd, (*udp_recv)->socket_fd) < 0) {
+  if (fstat(*data_fd, &st) != 0 ||
+      (uint64_t)st.st_size != torrent->file_size) {
+    LOG_ERROR("File size does not match the torrent: %s", full_file_path);
+    close(*data_fd);
+    *data_fd = -1;
     return -1;
   }
 
+  LOG_INFO("Torrent loaded: [%s]", torrent->infohash);
   return 0;
 }
 
-static void handle_udp_broadcast(udp_broadcast_receiver_t* udp_recv,
-                                 udp_broadcast_t* udp_bcast,
-                                 Leechees_t** leechees,
-                                 const eltextorrent_file_t* torrent,
-                                 const char* lan_addr) {
+/* State of the seeding loop, shared by its event handlers */
+typedef struct {
+  reactor_t* reactor;
+  TCPServer_t* server;
+  udp_broadcast_t* udp_bcast;
+  udp_broadcast_receiver_t* udp_recv;
+  Leechees_t* leechees;
+  const eltextorrent_file_t* torrent;
+  int data_fd;
+  char* piece_buffer; /* Raw piece being compressed */
+  tls_context_t* tls; /* NULL for plaintext */
+  compress_mode_t compress;
+  piece_cache_t* compressed; /* NULL if compression is off */
+  double compress_ns_per_byte; /* Moving averages of the pieces compressed */
+  double compress_ratio;       /* so far, compressed size over raw size */
+  uint32_t raw_since_sample;
+  char lan_addr[INET_ADDRSTRLEN + 7];
+  char answer[NETWORK_BUFFER_SIZE]; /* Discovery answer, see init_answer() */
+  size_t answer_size;
+  reactor_source_t listener;
+  reactor_source_t udp_listener; /* UDP stream requests, fd -1 if TCP only */
+  reactor_source_t discovery;
+  reactor_source_t local_listener; /* Same-host leechers, fd -1 if off */
+  char host_id[LOCAL_PEER_HOST_ID_SIZE];
+  char local_name[LOCAL_PEER_NAME_SIZE]; /* Empty if off */
+  char local_path[LOCAL_PEER_NAME_SIZE]; /* Socket file, empty if none */
+  multicast_sender_t* multicast; /* NULL if off */
+  reactor_source_t multicast_naks;
+  wheel_timer_t multicast_send;   /* Paces the queued fragments */
+  wheel_timer_t multicast_status; /* Tells the group the state of the queue */
+} seeder_t;
+
+/* Request of a client and its answer, sent as the socket takes it */
+typedef struct answer_state {
+  char request[PIECE_INDEX_BUF_SIZE + 1];
+  uint32_t request_received;
+  char header[ANSWER_HEADER_SIZE];
+  uint8_t* frame;    /* Header, then the data, NULL until needed */
+  const char* out;   /* Header or frame, sent before the file range */
+  uint32_t out_size; /* 0 if no answer is in progress */
+  uint32_t out_sent;
+  uint64_t file_offset; /* Next byte sent straight from the file */
+  uint32_t file_left;
+  /* Reported once the answer is sent */
+  uint64_t index;
+  int block;
+  uint32_t size;
+  uint32_t compressed_size;
+  uint64_t started;
+} answer_state_t;
+
+static void handle_udp_broadcast(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  seeder_t* seeder = source->ctx;
   char buffer[NETWORK_BUFFER_SIZE], sender[INET_ADDRSTRLEN + 6],
       ip[INET_ADDRSTRLEN] = {0};
 
-  int len = udp_broadcast_receiver_receive(udp_recv, buffer, sizeof(buffer),
-                                           sender, sizeof(sender));
+  int len = udp_broadcast_receiver_receive(seeder->udp_recv, buffer,
+                                           sizeof(buffer), sender,
+                                           sizeof(sender));
   if (len <= 0) {
     return;
   }
 
   memcpy(ip, sender, strcspn(sender, ":"));
 
-  if (!find_leech(leechees, ip) &&
-      strncmp((char*)torrent->infohash, buffer, HASH_SIZE) == 0) {
-    add_leech(leechees, ip);
-    printf("UDP from [%s], added\n", sender);
-    udp_broadcast_send(udp_bcast, lan_addr, strlen(lan_addr));
+  if (strncmp((char*)seeder->torrent->infohash, buffer, HASH_SIZE) != 0) {
+    return;
+  }
+  if (!find_leech(&seeder->leechees, ip)) {
+    add_leech(&seeder->leechees, ip);
+    LOG_INFO("UDP from [%s], added", sender);
+  }
+  // Answer every request, several leechers may share an address
+  udp_broadcast_send(seeder->udp_bcast, seeder->answer,
+                     seeder->answer_size);
+}
+
+static void free_answer(TCPClient_t* client) {
+  if (client->answer) {
+    free(client->answer->frame);
+    free(client->answer);
+    client->answer = NULL;
+  }
+}
+
+static void close_client(seeder_t* seeder, TCPClient_t* client) {
+  timer_wheel_cancel(reactor_wheel(seeder->reactor), &client->deadline);
+  free_answer(client);
+  reactor_remove(seeder->reactor, &client->source);
+  metrics_add(METRIC_CONNECTIONS, NULL, -1);
+
+  Leechees_t* found = find_leech(&seeder->leechees, client->ip);
+  if (found) {
+    delete_leech(&seeder->leechees, found);
+  }
+  tcp_server_disclient(seeder->server, client);
+}
+
+/**
+ * @brief Closes a connection that sent no request for
+ * SEEDER_IDLE_TIMEOUT_MS, so a vanished leecher does not hold its slot.
+ */
+static void idle_timeout(wheel_timer_t* timer, void* arg) {
+  TCPClient_t* client = TIMER_CONTAINER(timer, TCPClient_t, deadline);
+  LOG_INFO("Client [%s:%d] idle, closing", client->ip, client->port);
+  close_client(arg, client);
+}
+
+/**
+ * @brief Reads what arrived of the next fixed-size request frame.
+ *
+ * @return `1` once the frame is complete, `0` if more is to come or `-1` if
+ * the client disconnected or on error.
+ */
+static int receive_request(TCPClient_t* client, answer_state_t* answer) {
+  while (answer->request_received < PIECE_INDEX_BUF_SIZE) {
+    ssize_t received = tcp_server_receive(
+        client, answer->request + answer->request_received,
+        PIECE_INDEX_BUF_SIZE - answer->request_received);
+    if (received < 0 && client->connected &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    answer->request_received += (uint32_t)received;
   }
+  answer->request[PIECE_INDEX_BUF_SIZE - 1] = '\0';
+  answer->request_received = 0;
+  return 1;
+}
+
+/**
+ * @brief Gets the frame of an answer, allocated on first use.
+ *
+ * @return The frame or NULL on error.
+ */
+static uint8_t* answer_frame(const seeder_t* seeder, answer_state_t* answer) {
+  if (!answer->frame) {
+    answer->frame = malloc(ANSWER_HEADER_SIZE +
+                           compress_bound(seeder->torrent->piece_size));
+  }
+  return answer->frame;
+}
+
+/**
+ * @brief Sends what the socket takes of the file range of an answer. If the
+ * file does not support sendfile(), the range is read into the frame and
+ * sent from there.
+ *
+ * @return Amount of sent bytes or `-1` on error.
+ */
+static ssize_t send_file_range(const seeder_t* seeder, TCPClient_t* client,
+                               answer_state_t* answer) {
+  uint64_t offset = answer->file_offset;
+  uint32_t size = answer->file_left;
+  uint64_t started = metrics_now_ns();
+  ssize_t sent = tcp_server_sendfile(client, seeder->data_fd, offset, size);
+  if (sent >= 0 || !client->connected ||
+      (errno != EINVAL && errno != ENOSYS)) {
+    metrics_observe(METRIC_DISK_READ_DURATION, metrics_now_ns() - started);
+    TRACE_SPAN("sendfile", offset, sent > 0 ? sent : 0, started);
+    if (sent > 0) {
+      answer->file_offset += (uint64_t)sent;
+      answer->file_left -= (uint32_t)sent;
+    }
+    return sent;
+  }
+
+  uint8_t* frame = answer_frame(seeder, answer);
+  int result = frame ? read_file_range(seeder->data_fd, offset, size, frame)
+                     : -1;
+  metrics_observe(METRIC_DISK_READ_DURATION, metrics_now_ns() - started);
+  TRACE_SPAN("disk read", offset, size, started);
+  if (result < 0) {
+    return -1;
+  }
+  answer->out = (const char*)frame;
+  answer->out_size = size;
+  answer->out_sent = 0;
+  answer->file_left = 0;
+  return 0;
 }
 
-static void handle_new_connection(TCPServer_t* tcp_srv, int epoll_fd) {
-  TCPClient_t* client = tcp_server_accept(tcp_srv);
-  if (!client) {
+/**
+ * @brief Decides whether compressing a piece saves more time on the link to
+ * the client than it costs, from the kernel's estimate of the link rate.
+ */
+static int worth_compressing(seeder_t* seeder, const TCPClient_t* client,
+                             uint32_t size) {
+  // Sampled now and then, the data or the link may have changed
+  if (seeder->compress == COMPRESS_ALWAYS ||
+      ++seeder->raw_since_sample >= COMPRESS_SAMPLE_INTERVAL ||
+      seeder->compress_ns_per_byte == 0) {
+    return 1;
+  }
+
+  uint64_t rate = tcp_delivery_rate(client);
+  if (rate == 0) {
+    return 1;
+  }
+  double saved_ns = size * (1 - seeder->compress_ratio) * 1e9 / (double)rate;
+  return saved_ns > size * seeder->compress_ns_per_byte;
+}
+
+/**
+ * @brief Gets a piece compressed into the frame of the answer, from the cache
+ * or by compressing it now.
+ *
+ * Pieces that do not shrink enough are remembered too, so they are never
+ * compressed again.
+ *
+ * @return Compressed size or `0` to send the piece raw.
+ */
+static uint32_t compressed_piece(seeder_t* seeder, const TCPClient_t* client,
+                                 uint64_t index, uint64_t offset,
+                                 uint32_t size, uint8_t* compressed) {
+  const uint8_t* cached;
+  uint32_t compressed_size;
+  if (piece_cache_get(seeder->compressed, index, &cached, &compressed_size)) {
+    memcpy(compressed, cached, compressed_size);
+    return compressed_size;
+  }
+  if (!worth_compressing(seeder, client, size)) {
+    return 0;
+  }
+
+  uint64_t started = metrics_now_ns();
+  disk_latency_inject(DISK_READ, size);
+  int result = read_file_range(seeder->data_fd, offset, size,
+                               (uint8_t*)seeder->piece_buffer);
+  metrics_observe(METRIC_DISK_READ_DURATION, metrics_now_ns() - started);
+  TRACE_SPAN("disk read", offset, size, started);
+  if (result < 0) {
+    return 0;
+  }
+
+  started = metrics_now_ns();
+  int64_t result_size =
+      compress_piece((uint8_t*)seeder->piece_buffer, size, compressed);
+  uint64_t elapsed = metrics_now_ns() - started;
+  TRACE_SPAN("compress", index, size, started);
+  if (result_size < 0) {
+    return 0;
+  }
+
+  double ns_per_byte = (double)elapsed / size;
+  double ratio = (double)result_size / size;
+  if (seeder->compress_ns_per_byte == 0) {
+    seeder->compress_ns_per_byte = ns_per_byte;
+    seeder->compress_ratio = ratio;
+  } else {
+    seeder->compress_ns_per_byte +=
+        (ns_per_byte - seeder->compress_ns_per_byte) / 8;
+    seeder->compress_ratio += (ratio - seeder->compress_ratio) / 8;
+  }
+  seeder->raw_since_sample = 0;
+
+  if ((uint64_t)result_size > size - (size >> COMPRESS_MIN_SAVING_SHIFT)) {
+    piece_cache_put(seeder->compressed, index, NULL, 0);
+    return 0;
+  }
+  piece_cache_put(seeder->compressed, index, compressed,
+                  (uint32_t)result_size);
+  return (uint32_t)result_size;
+}
+
+/**
+ * @brief Starts the answer to a complete request. A compressed piece is put
+ * in the frame after the header and leaves in one write, so a TLS session in
+ * user space makes one record of it. A raw piece follows its header straight
+ * from the file, and a leecher on the same host reads it from the shared
+ * file instead. Invalid requests are logged and left unanswered.
+ */
+static void start_answer(seeder_t* seeder, TCPClient_t* client,
+                         answer_state_t* answer) {
+  const eltextorrent_file_t* torrent = seeder->torrent;
+  char* request = answer->request;
+  uint64_t header, index, offset;
+  char* end = request;
+  uint32_t size;
+
+  if (request[0] == BLOCK_REQUEST_PREFIX) {
+    index = strtoull(request + 1, NULL, 10);
+    header = BLOCK_RESPONSE_FLAG | index;
+    offset = index * torrent->block_size;
+    size = torrent_block_length(torrent, index);
+  } else {
+    index = strtoull(request, &end, 10);
+    header = index;
+    offset = torrent_piece_offset(torrent, index);
+    size = torrent_piece_length(torrent, index);
+  }
+
+  if (size == 0) {
+    LOG_ERROR("Failed to read request [%s]", request);
     return;
   }
 
-  if (add_to_epoll_ptr(epoll_fd, client->socket_fd, client) >= 0) {
-    printf("Client connected: [%s:%d]\n", client->ip, client->port);
+  LOG_DEBUG("%s %lu requested, size: %u",
+            header & BLOCK_RESPONSE_FLAG ? "Block" : "Piece", index, size);
+
+  // Older leechers do not ask for compressed pieces
+  uint32_t compressed_size = 0;
+  if (client->local) {
+    header |= SHARED_RESPONSE_FLAG;
+  } else if (seeder->compressed && *end == COMPRESS_REQUEST_SUFFIX &&
+             answer_frame(seeder, answer)) {
+    compressed_size =
+        compressed_piece(seeder, client, index, offset, size,
+                         answer->frame + ANSWER_HEADER_SIZE);
+  }
+  if (compressed_size > 0) {
+    header |= COMPRESSED_RESPONSE_FLAG;
+  }
+
+  uint32_t wire_size = compressed_size > 0 ? compressed_size : size;
+  memcpy(answer->header, &header, sizeof(header));
+  memcpy(answer->header + sizeof(header), &wire_size, sizeof(wire_size));
+  answer->out = answer->header;
+  answer->out_size = ANSWER_HEADER_SIZE;
+  answer->out_sent = 0;
+  answer->file_left = 0;
+  if (compressed_size > 0) {
+    memcpy(answer->frame, answer->header, ANSWER_HEADER_SIZE);
+    answer->out = (const char*)answer->frame;
+    answer->out_size += compressed_size;
+  } else if (!client->local) {
+    disk_latency_inject(DISK_READ, size);
+    answer->file_offset = offset;
+    answer->file_left = size;
+  }
+
+  answer->index = index;
+  answer->block = (header & BLOCK_RESPONSE_FLAG) != 0;
+  answer->size = size;
+  answer->compressed_size = compressed_size;
+}
+
+/**
+ * @brief Sends what the socket takes of the answer in progress, the frame
+ * first, then the file range. The idle timer restarts as long as the client
+ * takes data.
+ *
+ * @return `1` once no answer is left to send, `0` if the socket is full or
+ * `-1` on error.
+ */
+static int send_pending(seeder_t* seeder, TCPClient_t* client,
+                        answer_state_t* answer) {
+  if (answer->out_size == 0) {
+    return 1;
+  }
+
+  int result = 1, progress = 0;
+  while (answer->out_sent < answer->out_size || answer->file_left > 0) {
+    ssize_t sent;
+    if (answer->out_sent < answer->out_size) {
+      // The header leaves in the same segment as the data, a small write on
+      // its own would wait for the ACK of the previous answer
+      sent = tcp_server_send_some(client, answer->out + answer->out_sent,
+                                  answer->out_size - answer->out_sent,
+                                  answer->file_left > 0);
+      if (sent > 0) {
+        answer->out_sent += (uint32_t)sent;
+      }
+    } else {
+      sent = send_file_range(seeder, client, answer);
+    }
+    if (sent < 0) {
+      result = client->connected && (errno == EAGAIN || errno == EWOULDBLOCK)
+                   ? 0
+                   : -1;
+      break;
+    }
+    progress |= sent > 0;
+  }
+
+  if (progress && result >= 0) {
+    timer_wheel_schedule(reactor_wheel(seeder->reactor), &client->deadline,
+                         SEEDER_IDLE_TIMEOUT_MS);
+  }
+  if (result <= 0) {
+    return result;
+  }
+
+  if (answer->compressed_size > 0) {
+    metrics_add(METRIC_PIECES_COMPRESSED, NULL, 1);
+    metrics_add(METRIC_COMPRESSION_SAVED_BYTES, NULL,
+                (int64_t)answer->size - answer->compressed_size);
+  }
+  metrics_add(METRIC_REQUESTS_SERVED, NULL, 1);
+  TRACE_SPAN(answer->block ? "serve block" : "serve piece", answer->index,
+             answer->size, answer->started);
+  answer->out_size = 0;
+  return 1;
+}
+
+/**
+ * @brief Continues the TLS handshake of a client, level-triggered until it is
+ * done.
+ *
+ * @return `0` once done, `1` while running or `-1` if the client was closed.
+ */
+static int continue_handshake(seeder_t* seeder, TCPClient_t* client) {
+  int wanted = tls_handshake(client);
+  if (wanted > 0) {
+    return reactor_modify(seeder->reactor, &client->source, wanted) == 0 ? 1
+                                                                         : -1;
+  }
+  if (wanted < 0 ||
+      reactor_modify(seeder->reactor, &client->source,
+                     EPOLLIN | EPOLLOUT | EPOLLET) != 0) {
+    close_client(seeder, client);
+    return -1;
+  }
+  return 0;
+}
+
+static void handle_client(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  TCPClient_t* client = REACTOR_CONTAINER(source, TCPClient_t, source);
+  if (tls_handshaking(client) &&
+      continue_handshake(source->ctx, client) != 0) {
+    return;
+  }
+
+  // Edge-triggered, so the answer in progress is sent as far as the socket
+  // takes it, then every request already received is served. A leecher may
+  // have several requests in flight
+  seeder_t* seeder = source->ctx;
+  answer_state_t* answer = client->answer;
+  int result;
+  while ((result = send_pending(seeder, client, answer)) > 0 &&
+         (result = receive_request(client, answer)) > 0) {
+    timer_wheel_schedule(reactor_wheel(seeder->reactor), &client->deadline,
+                         SEEDER_IDLE_TIMEOUT_MS);
+    answer->started = TRACE_NOW();
+    start_answer(seeder, client, answer);
+  }
+  if (result < 0) {
+    close_client(seeder, client);
+  }
+}
+
+/**
+ * @brief Registers an accepted client in the event loop and arms its idle
+ * timer, closing it on failure.
+ */
+static void add_client(seeder_t* seeder, TCPClient_t* client) {
+  // Edge-triggered, the handler serves every request already received and
+  // resumes answers once the socket takes more. The TLS handshake comes
+  // first, the leecher speaks first. Nothing leaves the host on a local
+  // connection, it needs no TLS
+  int tls = seeder->tls && !client->local;
+  client->answer = calloc(1, sizeof(answer_state_t));
+  if (client->answer && tcp_set_non_blocking(client, 1) == 0 &&
+      (!tls || tls_start(seeder->tls, client) == 0) &&
+      reactor_add(seeder->reactor, &client->source, client->socket_fd,
+                  tls ? EPOLLIN : EPOLLIN | EPOLLOUT | EPOLLET, handle_client,
+                  seeder) >= 0) {
+    LOG_INFO("Client connected: [%s:%d]", client->ip, client->port);
+    metrics_add(METRIC_CONNECTIONS, NULL, 1);
+    timer_init(&client->deadline, idle_timeout, seeder);
+    timer_wheel_schedule(reactor_wheel(seeder->reactor), &client->deadline,
+                         SEEDER_IDLE_TIMEOUT_MS);
   } else {
-    tcp_server_disclient(tcp_srv, client);
+    free_answer(client);
+    tcp_server_disclient(seeder->server, client);
+  }
+}
+
+static void handle_new_connection(reactor_source_t* source,
+                                  uint32_t events) {
+  (void)events;
+  seeder_t* seeder = source->ctx;
+  TCPClient_t* client = tcp_server_accept(seeder->server);
+  if (client) {
+    add_client(seeder, client);
+  }
+}
+
+static void handle_new_udp_connection(reactor_source_t* source,
+                                      uint32_t events) {
+  (void)events;
+  seeder_t* seeder = source->ctx;
+  TCPClient_t* client;
+  // Level-triggered, but each request is answered on its own socket
+  while ((client = tcp_server_accept_udp(seeder->server,
+                                         reactor_wheel(seeder->reactor)))) {
+    add_client(seeder, client);
+  }
+}
+
+static void handle_new_local_connection(reactor_source_t* source,
+                                        uint32_t events) {
+  (void)events;
+  seeder_t* seeder = source->ctx;
+  TCPClient_t* client =
+      tcp_server_accept_local(seeder->server, seeder->data_fd);
+  if (client) {
+    add_client(seeder, client);
   }
 }
 
-static void handle_client_request(TCPClient_t* client,
-                                  const char* full_file_path,
-                                  char* piece_buffer, size_t piece_size,
-                                  Leechees_t** leechees, int epoll_fd) {
-  char buffer[NETWORK_BUFFER_SIZE];
-  ssize_t received = tcp_server_receive(client, buffer, sizeof(buffer));
+/**
+ * @brief Sends the fragments the rate allows now, again every millisecond
+ * while some are queued.
+ */
+static void send_multicast(wheel_timer_t* timer, void* arg) {
+  seeder_t* seeder = arg;
+  // The upload limit caps the group, which every leecher shares
+  uint64_t rate = settings_upload_rate();
+  if (multicast_sender_send(seeder->multicast,
+                            rate ? rate : MULTICAST_DEFAULT_RATE) > 0) {
+    timer_wheel_schedule(reactor_wheel(seeder->reactor), timer, 1);
+  }
+}
 
-  if (received > 0) {
-    uint64_t piece_num = (uint64_t)atol(buffer);
-    uint32_t offset;
+static void send_multicast_status(wheel_timer_t* timer, void* arg) {
+  seeder_t* seeder = arg;
+  multicast_sender_status(seeder->multicast);
+  timer_wheel_schedule(reactor_wheel(seeder->reactor), timer,
+                       MULTICAST_STATUS_MS);
+}
 
-    read_file_piece(full_file_path, piece_num, piece_size,
-                    (unsigned char*)piece_buffer, piece_size, &offset);
+static void handle_multicast_nak(reactor_source_t* source, uint32_t events) {
+  (void)events;
+  seeder_t* seeder = source->ctx;
+  if (multicast_sender_receive(seeder->multicast) > 0 &&
+      !timer_pending(&seeder->multicast_send)) {
+    timer_wheel_schedule(reactor_wheel(seeder->reactor),
+                         &seeder->multicast_send, 0);
+  }
+}
+
+static int init_multicast(seeder_t* seeder, const Config* cfg) {
+  seeder->multicast =
+      multicast_sender_create(cfg->multicast_group, cfg->multicast_port,
+                              seeder->torrent, seeder->data_fd);
+  if (!seeder->multicast ||
+      reactor_add(seeder->reactor, &seeder->multicast_naks,
+                  multicast_sender_fd(seeder->multicast), EPOLLIN,
+                  handle_multicast_nak, seeder) < 0) {
+    return -1;
+  }
+  timer_init(&seeder->multicast_send, send_multicast, seeder);
+  timer_init(&seeder->multicast_status, send_multicast_status, seeder);
+  timer_wheel_schedule(reactor_wheel(seeder->reactor),
+                       &seeder->multicast_status, 0);
+  return 0;
+}
 
-    printf("Piece %lu requested, size: %u\n", piece_num, offset);
+/**
+ * @brief Listens for leechers on the same host unless turned off. Without
+ * the boot id of the host they could not tell, so they keep using TCP.
+ */
+static int init_local(seeder_t* seeder, const Config* cfg) {
+  if (strcmp(cfg->local_socket, LOCAL_PEER_OFF) == 0) {
+    return 0;
+  }
+  if (local_peer_host_id(seeder->host_id) != 0) {
+    LOG_WARN("Host id unknown, leechers on this host use TCP");
+    return 0;
+  }
 
-    tcp_server_send(client, (char*)&piece_num, sizeof(piece_num));
-    tcp_server_send(client, (char*)&offset, sizeof(offset));
-    tcp_server_send(client, piece_buffer, offset);
+  if (strlen(cfg->local_socket) > 0) {
+    // The configuration checked it fits
+    snprintf(seeder->local_name, sizeof(seeder->local_name), "%.*s",
+             (int)sizeof(seeder->local_name) - 1, cfg->local_socket);
   } else {
-    printf("Client disconnected\n");
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+    snprintf(seeder->local_name, sizeof(seeder->local_name),
+             "%celtextorrent-%d", LOCAL_PEER_ABSTRACT_PREFIX, cfg->port);
+  }
+  if (tcp_server_listen_local(seeder->server, seeder->local_name,
+                              seeder->local_path,
+                              sizeof(seeder->local_path)) < 0 ||
+      reactor_add(seeder->reactor, &seeder->local_listener,
+                  seeder->server->local_fd, EPOLLIN,
+                  handle_new_local_connection, seeder) < 0) {
+    seeder->local_name[0] = '\0';
+    return -1;
+  }
+  return 0;
+}
 
-    Leechees_t* found = find_leech(leechees, client->ip);
-    if (found) {
-      delete_leech(leechees, found);
-    }
+/**
+ * @brief Builds the discovery answer: the address of the seeder, then past
+ * a NUL byte, which older leechers stop at, the host id and the local
+ * socket.
+ */
+static void init_answer(seeder_t* seeder) {
+  size_t length = strlen(seeder->lan_addr);
+  memcpy(seeder->answer, seeder->lan_addr, length + 1);
+  seeder->answer_size = length;
+  if (strlen(seeder->local_name) > 0) {
+    int extra = snprintf(seeder->answer + length + 1,
+                         sizeof(seeder->answer) - length - 1, "%s %s",
+                         seeder->host_id, seeder->local_name);
+    seeder->answer_size = length + 1 + (size_t)extra;
   }
 }
 
-static char* get_lan_address(char* lan_addr, size_t size) {
+static char* get_lan_address(char* lan_addr, size_t size,
+                             const Config* cfg) {
+  if (strlen(cfg->announce_ip) > 0) {
+    snprintf(lan_addr, size, "%s:%d", cfg->announce_ip,
+             cfg->announce_port ? cfg->announce_port : cfg->port);
+    LOG_INFO("Listening on: %s", lan_addr);
+    return lan_addr;
+  }
+
   char* lan_ip = get_lan_ipv4();
   if (!lan_ip) {
     return NULL;
   }
 
-  snprintf(lan_addr, size, "%s:%d", lan_ip, SEEDER_TCP_PORT);
+  snprintf(lan_addr, size, "%s:%d", lan_ip, cfg->port);
   free(lan_ip);
 
-  printf("Listening on: %s\n", lan_addr);
+  LOG_INFO("Listening on: %s", lan_addr);
   return lan_addr;
 }
 
-void run_seeder_mode(int epoll_fd, int signal_fd, const Config* cfg) {
-  char full_file_path[PATH_MAX], lan_addr[INET_ADDRSTRLEN + 7];
-  struct epoll_event events[MAX_EPOLL_EVENTS];
+static int init_network(seeder_t* seeder, const Config* cfg) {
+  seeder->server = tcp_server_create(cfg->port);
+  if (!seeder->server || tcp_server_listen(seeder->server, 64) < 0 ||
+      reactor_add(seeder->reactor, &seeder->listener,
+                  seeder->server->socket_fd, EPOLLIN, handle_new_connection,
+                  seeder) < 0) {
+    return -1;
+  }
+  // UDP streams arrive on the same port number
+  if (cfg->transport == TRANSPORT_UDP &&
+      (tcp_server_listen_udp(seeder->server) < 0 ||
+       reactor_add(seeder->reactor, &seeder->udp_listener,
+                   seeder->server->udp_fd, EPOLLIN, handle_new_udp_connection,
+                   seeder) < 0)) {
+    return -1;
+  }
+
+  seeder->udp_bcast = udp_broadcast_create(cfg->discovery_port + 1);
+  seeder->udp_recv = udp_broadcast_receiver_create(cfg->discovery_port);
+  if (!seeder->udp_bcast || !seeder->udp_recv ||
+      reactor_add(seeder->reactor, &seeder->discovery,
+                  seeder->udp_recv->socket_fd, EPOLLIN, handle_udp_broadcast,
+                  seeder) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void run_seeder_mode(reactor_t* reactor, const Config* cfg) {
   eltextorrent_file_t torrent = {0};
-  Leechees_t* leechees = NULL;
-  int shutdown = 0;
+  seeder_t seeder = {0};
+  seeder.reactor = reactor;
+  seeder.torrent = &torrent;
+  seeder.data_fd = -1;
+  seeder.udp_listener.fd = -1;
+  seeder.local_listener.fd = -1;
+  seeder.multicast_naks.fd = -1;
 
-  if (init_torrent(&torrent, full_file_path, sizeof(full_file_path), cfg) < 0) {
+  if (init_torrent(&torrent, &seeder.data_fd, cfg) < 0) {
     exit(EXIT_FAILURE);
   }
 
-  char* piece_buffer = malloc(torrent.piece_size);
-  if (!piece_buffer) {
+  seeder.piece_buffer = malloc(torrent.piece_size);
+  if (!seeder.piece_buffer) {
     exit(EXIT_FAILURE);
   }
 
-  TCPServer_t* tcp_srv;
-  udp_broadcast_t* udp_bcast;
-  udp_broadcast_receiver_t* udp_recv;
+  seeder.compress = cfg->compress;
+  if (cfg->compress != COMPRESS_OFF) {
+    seeder.compressed = piece_cache_create(cfg->compress_cache);
+    if (!seeder.compressed) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (strlen(cfg->tls_cert_path) > 0) {
+    seeder.tls = tls_server_create(
+        cfg->tls_cert_path,
+        strlen(cfg->tls_key_path) > 0 ? cfg->tls_key_path : NULL);
+    if (!seeder.tls) {
+      free(seeder.piece_buffer);
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  if (init_network(&tcp_srv, &udp_bcast, &udp_recv, epoll_fd) < 0 ||
-      !get_lan_address(lan_addr, sizeof(lan_addr))) {
-    free(piece_buffer);
+  if (init_network(&seeder, cfg) < 0 || init_local(&seeder, cfg) < 0 ||
+      (strlen(cfg->multicast_group) > 0 && init_multicast(&seeder, cfg) < 0) ||
+      !get_lan_address(seeder.lan_addr, sizeof(seeder.lan_addr), cfg)) {
+    free(seeder.piece_buffer);
     exit(EXIT_FAILURE);
   }
+  init_answer(&seeder);
 
-  while (!shutdown) {
-    int nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, EPOLL_TIMEOUT_MS);
-    if (nfds < 0) {
-      break;
+  while (!reactor_stopped(reactor)) {
+    // May have been changed through the control socket
+    tcp_server_set_max_rate(seeder.server, settings_upload_rate());
+    if (seeder.compressed) {
+      piece_cache_set_capacity(seeder.compressed, settings_compress_cache());
     }
 
-    for (int i = 0; i < nfds; i++) {
-      int fd = events[i].data.fd;
-
-      if (fd == signal_fd) {
-        handle_signalfd_event(signal_fd, &shutdown);
-      } else if (fd == udp_recv->socket_fd) {
-        handle_udp_broadcast(udp_recv, udp_bcast, &leechees, &torrent,
-                             lan_addr);
-      } else if (fd == tcp_srv->socket_fd) {
-        handle_new_connection(tcp_srv, epoll_fd);
-      } else {
-        handle_client_request(events[i].data.ptr, full_file_path, piece_buffer,
-                              torrent.piece_size, &leechees, epoll_fd);
-      }
+    if (reactor_run_once(reactor, EPOLL_TIMEOUT_MS) < 0) {
+      break;
     }
   }
 
-  clean_hashtable(&leechees);
-  free(piece_buffer);
-  tcp_server_destroy(tcp_srv);
-  udp_broadcast_destroy(udp_bcast);
-  udp_broadcast_receiver_destroy(udp_recv);
-}
\ No newline at end of file
+  // The wheel outlives the clients, their timers must not stay linked
+  for (uint16_t i = 0; i < TCP_MAX_CLIENTS; i++) {
+    timer_wheel_cancel(reactor_wheel(reactor),
+                       &seeder.server->clients[i].deadline);
+    free_answer(&seeder.server->clients[i]);
+  }
+  reactor_remove(reactor, &seeder.listener);
+  reactor_remove(reactor, &seeder.udp_listener);
+  reactor_remove(reactor, &seeder.local_listener);
+  reactor_remove(reactor, &seeder.discovery);
+  reactor_remove(reactor, &seeder.multicast_naks);
+  timer_wheel_cancel(reactor_wheel(reactor), &seeder.multicast_send);
+  timer_wheel_cancel(reactor_wheel(reactor), &seeder.multicast_status);
+
+  clean_hashtable(&seeder.leechees);
+  free(seeder.piece_buffer);
+  piece_cache_destroy(seeder.compressed);
+  close(seeder.data_fd);
+  tcp_server_destroy(seeder.server);
+  if (strlen(seeder.local_path) > 0) {
+    unlink(seeder.local_path);
+  }
+  tls_context_destroy(seeder.tls);
+  udp_broadcast_destroy(seeder.udp_bcast);
+  udp_broadcast_receiver_destroy(seeder.udp_recv);
+  multicast_sender_destroy(seeder.multicast);
+}
@@ -2,6 +2,8 @@
 #define SEEDER_H_
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <ifaddrs.h>
 #include <inttypes.h>
 #include <net/if.h>
@@ -10,6 +12,7 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
@@ -17,23 +20,32 @@
 #include "bit_torrent.h"
 #include "common/bitfield.h"
 #include "common/client_list.h"
-#include "common/epoll_utils.h"
+#include "common/log.h"
+#include "common/metrics.h"
 #include "common/network_utils.h"
 #include "common/path_utils.h"
+#include "common/reactor.h"
+#include "common/trace.h"
 #include "config/config.h"
+#include "config/settings.h"
+#include "file/compress.h"
+#include "file/disk_latency.h"
 #include "file/file_assembler.h"
 #include "file/file_reader.h"
 #include "file/torrent_parser.h"
 #include "hash/hash.h"
 #include "hash/table.h"
 #include "leecher.h"
+#include "network/local_peer.h"
+#include "network/multicast.h"
 #include "network/tcp_client.h"
 #include "network/tcp_server.h"
+#include "network/tls.h"
 #include "network/udp_broadcast.h"
 #include "network/udp_broadcast_receiver.h"
 #include "signals/signals.h"
 #include "ui/progress_bar.h"
 
-void run_seeder_mode(int epoll_fd, int signal_fd, const Config* cfg);
+void run_seeder_mode(reactor_t* reactor, const Config* cfg);
 
 #endif  // SEEDER_H_
\ No newline at end of file
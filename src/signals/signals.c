@@ -5,12 +5,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "../common/log.h"
+
+LOG_DEFINE_MODULE(LOG_MODULE_MAIN);
+
+static void (*k_reload_handler)(void) = NULL;
+
 int setup_signal_handlers() {
   sigset_t mask;
   sigemptyset(&mask);
   sigaddset(&mask, SIGINT);
   sigaddset(&mask, SIGTERM);
   sigaddset(&mask, SIGPIPE);
+  sigaddset(&mask, SIGHUP);
 
   if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
     return -1;
@@ -26,6 +33,10 @@ int setup_signal_handlers() {
   return signal_fd;
 }
 
+void signals_set_reload_handler(void (*handler)(void)) {
+  k_reload_handler = handler;
+}
+
 int handle_signalfd_event(int fd, int* shutdown_requested) {
   struct signalfd_siginfo signal_info;
   ssize_t bytes_read;
@@ -36,8 +47,15 @@ int handle_signalfd_event(int fd, int* shutdown_requested) {
   }
 
   if (signal_info.ssi_signo == SIGINT || signal_info.ssi_signo == SIGTERM) {
-    printf("\nShutting down...\n");
+    LOG_INFO("Shutting down...");
     *shutdown_requested = 1;
+  } else if (signal_info.ssi_signo == SIGHUP) {
+    if (k_reload_handler) {
+      LOG_INFO("Reloading configuration...");
+      k_reload_handler();
+    } else {
+      LOG_INFO("SIGHUP ignored");
+    }
   }
 
   return 0;
@@ -11,12 +11,19 @@
  */
 int setup_signal_handlers();
 
+/**
+ * @brief Set the function called when SIGHUP is received
+ * @param handler Reload function, NULL to ignore SIGHUP
+ */
+void signals_set_reload_handler(void (*handler)(void));
+
 /**
  * @brief Process a signal event from signalfd
  * @param fd Signalfd file descriptor returned by setup_signal_handlers()
  * @param shutdown_requested Pointer to integer flag that will be set to 1
  *                          if shutdown is requested (SIGINT/SIGTERM)
  * @return 0 on successful signal processing, -1 on error
+ * @note SIGHUP runs the reload handler from the caller's thread
  */
 
 int handle_signalfd_event(int fd, int* shutdown_requested);
@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+#include "piece_hasher.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/worker_pool.h"
+#include "../hash/digest.h"
+#include "../hash/merkle.h"
+
+/* Pieces handed to a worker at once, so each thread reads sequentially */
+#define BATCH_BYTES (8 * 1024 * 1024)
+#define PROGRESS_POLL_NS (100 * 1000 * 1000)
+#define BYTES_PER_MB (1024.0 * 1024.0)
+/* Size of each of the two stream buffers, rounded to whole pieces */
+#define STREAM_CHUNK_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+  eltextorrent_file_t* torrent;
+  const uint8_t* data;
+  uint32_t batch_pieces;
+  unsigned digest_threads;
+  atomic_uint_fast64_t next_piece;
+  atomic_uint_fast64_t hashed_bytes;
+  atomic_uint running_workers;
+  atomic_int failed;
+} hash_job_t;
+
+typedef struct {
+  uint8_t* data;
+  size_t length;
+  int filled;
+  int eof;
+} stream_chunk_t;
+
+typedef struct {
+  int fd;
+  int tee_fd;
+  size_t chunk_size;
+  stream_chunk_t chunks[2];
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} stream_job_t;
+
+static double elapsed_seconds(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) +
+         (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_progress(uint64_t hashed, uint64_t total, double seconds,
+                           const char* end) {
+  double percentage = total ? (double)hashed * 100.0 / (double)total : 100.0;
+  double speed = seconds > 0 ? (double)hashed / BYTES_PER_MB / seconds : 0.0;
+
+  fprintf(stderr, "\rHashed %.1f / %.1f MB (%.1f%%) | %.1f MB/s%s",
+          (double)hashed / BYTES_PER_MB, (double)total / BYTES_PER_MB,
+          percentage, speed, end);
+}
+
+static void print_stream_progress(uint64_t hashed, double seconds,
+                                  const char* end) {
+  double speed = seconds > 0 ? (double)hashed / BYTES_PER_MB / seconds : 0.0;
+
+  fprintf(stderr, "\rHashed %.1f MB | %.1f MB/s%s",
+          (double)hashed / BYTES_PER_MB, speed, end);
+}
+
+/**
+ * @brief Offset of a piece, fixed or content-defined. The index may equal
+ * pieces_count to get the end of the file.
+ */
+static uint64_t piece_offset(const eltextorrent_file_t* torrent,
+                             uint64_t piece_index) {
+  if (torrent->pieces_offsets) {
+    return torrent->pieces_offsets[piece_index];
+  }
+
+  uint64_t offset = piece_index * torrent->piece_size;
+  return offset < torrent->file_size ? offset : torrent->file_size;
+}
+
+int hash_piece(eltextorrent_file_t* torrent, const uint8_t* data,
+               size_t length, uint32_t piece_index, unsigned threads) {
+  uint8_t* piece_hash =
+      &torrent->pieces_hashes[(size_t)piece_index * torrent->hash_size];
+  if (!torrent->blocks_hashes) {
+    return digest_calculate(torrent->digest, data, length, threads,
+                            piece_hash);
+  }
+
+  size_t first_block =
+      (size_t)piece_index * (torrent->piece_size / torrent->block_size);
+  uint8_t* leaves = &torrent->blocks_hashes[first_block * torrent->hash_size];
+  size_t blocks = 0;
+
+  for (size_t offset = 0; offset < length;
+       offset += torrent->block_size, blocks++) {
+    size_t block_length = length - offset < torrent->block_size
+                              ? length - offset
+                              : torrent->block_size;
+    if (merkle_leaf_hash(torrent->digest, data + offset, block_length,
+                         &leaves[blocks * torrent->hash_size]) != 0) {
+      return -1;
+    }
+  }
+
+  // Legacy SHA1 torrents keep piece hashes of the data for older clients,
+  // the others hash the few leaves instead of the data a second time
+  if (torrent->version == TORRENT_VERSION_LEAVES) {
+    return digest_calculate(torrent->digest, leaves,
+                            blocks * torrent->hash_size, 1, piece_hash);
+  }
+  return digest_calculate(torrent->digest, data, length, threads, piece_hash);
+}
+
+static void* hash_worker(void* arg) {
+  hash_job_t* job = arg;
+  eltextorrent_file_t* torrent = job->torrent;
+
+  while (!atomic_load(&job->failed)) {
+    uint64_t first = atomic_fetch_add(&job->next_piece, job->batch_pieces);
+    if (first >= torrent->pieces_count) {
+      break;
+    }
+
+    uint64_t last = first + job->batch_pieces;
+    if (last > torrent->pieces_count) {
+      last = torrent->pieces_count;
+    }
+
+    uint64_t batch_start = piece_offset(torrent, first);
+    uint64_t batch_end = piece_offset(torrent, last);
+
+    for (uint64_t i = first; i < last; i++) {
+      uint64_t offset = piece_offset(torrent, i);
+      uint64_t length = piece_offset(torrent, i + 1) - offset;
+
+      if (hash_piece(torrent, job->data + offset, length, (uint32_t)i,
+                     job->digest_threads) != 0) {
+        atomic_store(&job->failed, 1);
+        break;
+      }
+      atomic_fetch_add(&job->hashed_bytes, length);
+    }
+
+    // The batch is never read again, drop it instead of growing the RSS
+    madvise((void*)(job->data + batch_start), batch_end - batch_start,
+            MADV_DONTNEED);
+  }
+
+  atomic_fetch_sub(&job->running_workers, 1);
+  return NULL;
+}
+
+int hash_pieces_parallel(eltextorrent_file_t* torrent, const uint8_t* data,
+                         unsigned threads, int show_progress) {
+  if (!torrent || (!data && torrent->pieces_count > 0) || threads == 0) {
+    return -1;
+  }
+
+  // Several workers already keep every core busy, one thread per piece
+  hash_job_t job = {
+      .torrent = torrent,
+      .data = data,
+      .batch_pieces = torrent->piece_size >= BATCH_BYTES
+                          ? 1
+                          : BATCH_BYTES / torrent->piece_size,
+      .digest_threads = threads > 1 ? 1 : 0,
+  };
+  atomic_init(&job.next_piece, 0);
+  atomic_init(&job.hashed_bytes, 0);
+  atomic_init(&job.running_workers, threads);
+  atomic_init(&job.failed, 0);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  worker_pool_t pool;
+  unsigned started = worker_pool_start(&pool, threads, hash_worker, &job);
+  if (started == 0) {
+    worker_pool_join(&pool);
+    return -1;
+  }
+  atomic_fetch_sub(&job.running_workers, threads - started);
+
+  double last_report = 0;
+  struct timespec poll = {.tv_sec = 0, .tv_nsec = PROGRESS_POLL_NS};
+  while (atomic_load(&job.running_workers) > 0) {
+    nanosleep(&poll, NULL);
+
+    double seconds = elapsed_seconds(&start);
+    if (show_progress && seconds - last_report >= 1.0) {
+      print_progress(atomic_load(&job.hashed_bytes), torrent->file_size,
+                     seconds, "");
+      last_report = seconds;
+    }
+  }
+
+  worker_pool_join(&pool);
+
+  if (show_progress) {
+    print_progress(atomic_load(&job.hashed_bytes), torrent->file_size,
+                   elapsed_seconds(&start), "");
+    fprintf(stderr, " | %.2fs on %u threads\n", elapsed_seconds(&start),
+            started);
+  }
+
+  return atomic_load(&job.failed) ? -1 : 0;
+}
+
+static ssize_t read_full(int fd, uint8_t* buffer, size_t length) {
+  size_t total = 0;
+
+  while (total < length) {
+    ssize_t bytes = read(fd, buffer + total, length - total);
+    if (bytes == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes == -1) {
+      return -1;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    total += (size_t)bytes;
+  }
+  return (ssize_t)total;
+}
+
+static int write_full(int fd, const uint8_t* buffer, size_t length) {
+  while (length > 0) {
+    ssize_t bytes = write(fd, buffer, length);
+    if (bytes == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes == -1) {
+      return -1;
+    }
+    buffer += bytes;
+    length -= (size_t)bytes;
+  }
+  return 0;
+}
+
+static void* stream_reader(void* arg) {
+  stream_job_t* job = arg;
+
+  for (int i = 0;; i ^= 1) {
+    stream_chunk_t* chunk = &job->chunks[i];
+
+    pthread_mutex_lock(&job->lock);
+    while (chunk->filled && !job->failed) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    int failed = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (failed) {
+      break;
+    }
+
+    ssize_t bytes = read_full(job->fd, chunk->data, job->chunk_size);
+    if (bytes == -1) {
+      perror("read error");
+    } else if (job->tee_fd != -1 &&
+               write_full(job->tee_fd, chunk->data, (size_t)bytes) == -1) {
+      perror("write error");
+      bytes = -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (bytes == -1) {
+      job->failed = 1;
+    } else {
+      chunk->length = (size_t)bytes;
+      chunk->eof = (size_t)bytes < job->chunk_size;
+      chunk->filled = 1;
+    }
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    if (bytes == -1 || chunk->eof) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int grow_hashes(uint8_t** hashes, size_t* capacity, size_t needed,
+                       size_t hash_size) {
+  if (needed <= *capacity) {
+    return 0;
+  }
+
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+
+  uint8_t* grown = realloc(*hashes, new_capacity * hash_size);
+  if (!grown) {
+    return -1;
+  }
+  *hashes = grown;
+  *capacity = new_capacity;
+  return 0;
+}
+
+static int hash_stream_chunk(eltextorrent_file_t* torrent,
+                             const stream_chunk_t* chunk,
+                             size_t* pieces_capacity,
+                             size_t* blocks_capacity) {
+  uint64_t pieces = (chunk->length + torrent->piece_size - 1) /
+                    torrent->piece_size;
+  uint64_t size = torrent->file_size + chunk->length;
+  uint64_t blocks = (size + torrent->block_size - 1) / torrent->block_size;
+
+  if (torrent->pieces_count + pieces > UINT32_MAX) {
+    fprintf(stderr, "Error: Too many pieces, use a larger piece size.\n");
+    return -1;
+  }
+  if (grow_hashes(&torrent->pieces_hashes, pieces_capacity,
+                  torrent->pieces_count + pieces, torrent->hash_size) != 0 ||
+      grow_hashes(&torrent->blocks_hashes, blocks_capacity, blocks,
+                  torrent->hash_size) != 0) {
+    perror("Malloc error");
+    return -1;
+  }
+
+  for (size_t offset = 0; offset < chunk->length;
+       offset += torrent->piece_size) {
+    size_t length = chunk->length - offset < torrent->piece_size
+                        ? chunk->length - offset
+                        : torrent->piece_size;
+    if (hash_piece(torrent, chunk->data + offset, length,
+                   torrent->pieces_count, 0) != 0) {
+      return -1;
+    }
+    torrent->pieces_count++;
+  }
+
+  torrent->file_size = size;
+  torrent->blocks_count = (uint32_t)blocks;
+  return 0;
+}
+
+int hash_pieces_stream(eltextorrent_file_t* torrent, int fd, int tee_fd,
+                       int show_progress) {
+  if (!torrent || fd < 0 || torrent->piece_size == 0) {
+    return -1;
+  }
+
+  size_t chunk_size = STREAM_CHUNK_BYTES < torrent->piece_size
+                          ? torrent->piece_size
+                          : STREAM_CHUNK_BYTES / torrent->piece_size *
+                                torrent->piece_size;
+  stream_job_t job = {.fd = fd, .tee_fd = tee_fd, .chunk_size = chunk_size};
+  size_t pieces_capacity = 0;
+  size_t blocks_capacity = 0;
+  int result = 0;
+
+  torrent->file_size = 0;
+  torrent->pieces_count = 0;
+  torrent->blocks_count = 0;
+
+  job.chunks[0].data = malloc(chunk_size);
+  job.chunks[1].data = malloc(chunk_size);
+  if (!job.chunks[0].data || !job.chunks[1].data) {
+    free(job.chunks[0].data);
+    free(job.chunks[1].data);
+    perror("Malloc error");
+    return -1;
+  }
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  double last_report = 0;
+
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, stream_reader, &job) != 0) {
+    result = -1;
+    goto cleanup;
+  }
+
+  // The reader fills one buffer while this thread hashes the other
+  for (int i = 0;; i ^= 1) {
+    stream_chunk_t* chunk = &job.chunks[i];
+
+    pthread_mutex_lock(&job.lock);
+    while (!chunk->filled && !job.failed) {
+      pthread_cond_wait(&job.cond, &job.lock);
+    }
+    int failed = job.failed;
+    pthread_mutex_unlock(&job.lock);
+    if (failed) {
+      result = -1;
+      break;
+    }
+
+    int eof = chunk->eof;
+    result = hash_stream_chunk(torrent, chunk, &pieces_capacity,
+                               &blocks_capacity);
+
+    pthread_mutex_lock(&job.lock);
+    chunk->filled = 0;
+    if (result != 0) {
+      job.failed = 1;
+    }
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+
+    double seconds = elapsed_seconds(&start);
+    if (show_progress && seconds - last_report >= 1.0) {
+      print_stream_progress(torrent->file_size, seconds, "");
+      last_report = seconds;
+    }
+
+    if (result != 0 || eof) {
+      break;
+    }
+  }
+
+  pthread_join(reader, NULL);
+
+  if (show_progress && result == 0) {
+    print_stream_progress(torrent->file_size, elapsed_seconds(&start), "");
+    fprintf(stderr, " | %.2fs streamed\n", elapsed_seconds(&start));
+  }
+
+cleanup:
+  // An empty stream has no blocks and therefore no Merkle tree
+  if (torrent->blocks_count == 0) {
+    free(torrent->blocks_hashes);
+    torrent->blocks_hashes = NULL;
+  }
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  free(job.chunks[0].data);
+  free(job.chunks[1].data);
+  return result;
+}
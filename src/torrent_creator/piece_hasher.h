@@ -0,0 +1,61 @@
+/**
+ * @file piece_hasher.h
+ * @brief Piece and Merkle leaf hashing for the torrent creator.
+ *
+ * Pieces of a memory-mapped file are handed out to worker threads in
+ * contiguous batches, so every thread reads its own stretch of the file
+ * sequentially and the kernel readahead keeps the disk busy.
+ *
+ * Streams of unknown length (pipes, stdin) are read into two buffers in
+ * turn: a reader thread fills one while the caller hashes the other.
+ */
+
+#ifndef TORRENT_CREATOR_PIECE_HASHER_H_
+#define TORRENT_CREATOR_PIECE_HASHER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../bit_torrent.h"
+
+/**
+ * @brief Calculate the Merkle leaves and the hash of one piece, derived
+ * from the leaves for torrents of version TORRENT_VERSION_LEAVES
+ * @param torrent Torrent with digest, sizes and hash arrays set up
+ * @param data Piece data
+ * @param length Piece length in bytes
+ * @param piece_index Index of the piece within the file
+ * @param threads Thread limit of digest_calculate(), `0` for every online CPU
+ * @return `0` on success or `-1` on error
+ */
+int hash_piece(eltextorrent_file_t* torrent, const uint8_t* data,
+               size_t length, uint32_t piece_index, unsigned threads);
+
+/**
+ * @brief Hash every piece of a mapped file on several threads
+ * @param torrent Torrent with digest, sizes and hash arrays set up, and
+ * pieces_offsets for content-defined pieces
+ * @param data Mapped file contents (torrent->file_size bytes)
+ * @param threads Number of worker threads
+ * @param show_progress Print a progress and throughput line to stderr
+ * @return `0` on success or `-1` on error
+ */
+int hash_pieces_parallel(eltextorrent_file_t* torrent, const uint8_t* data,
+                         unsigned threads, int show_progress);
+
+/**
+ * @brief Hash a stream of unknown length piece by piece as it arrives
+ *
+ * The hash arrays of the torrent are grown while reading, file_size,
+ * pieces_count and blocks_count are set once the stream ends.
+ *
+ * @param torrent Torrent with digest, piece and block sizes set up
+ * @param fd Descriptor to read the data from
+ * @param tee_fd Descriptor the data is copied to, `-1` for none
+ * @param show_progress Print a progress and throughput line to stderr
+ * @return `0` on success or `-1` on error
+ */
+int hash_pieces_stream(eltextorrent_file_t* torrent, int fd, int tee_fd,
+                       int show_progress);
+
+#endif  // TORRENT_CREATOR_PIECE_HASHER_H_
@@ -1,13 +1,39 @@
 #define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
 #include <openssl/evp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "../bit_torrent.h"
-
-#define PIECE_SIZE_64KB (64 * 1024)
+#include "../common/worker_pool.h"
+#include "../hash/chunker.h"
+#include "../hash/digest.h"
+#include "../hash/merkle.h"
+#include "piece_hasher.h"
+
+/* Piece count the automatic piece size aims for */
+#define PIECES_TARGET_COUNT 2048
+/* Streams have no size to choose from */
+#define PIECE_SIZE_STREAM_DEFAULT (1024 * 1024)
+
+/* Suppresses per-piece hashes and the hashing progress line */
+static int k_quiet = 0;
+
+typedef struct {
+  const char* name;       /* Shared file name, NULL to derive from paths */
+  const char* tee_path;   /* Copy of the source written while hashing */
+  uint32_t piece_size;    /* Piece size, 0 to choose from the file size */
+  uint32_t target_pieces; /* Piece count the chosen piece size aims for */
+  uint32_t chunk_avg_size; /* Content-defined piece average, 0 if fixed */
+  digest_algo_t digest;
+  unsigned threads;
+} creator_options_t;
 
 /**
  * @brief Saves the torrent structure to a file.
@@ -27,6 +53,13 @@ int torrent_save(const eltextorrent_file_t* torrent, const char* torrent_name) {
     return -1;
   }
 
+  // SHA1 torrents keep the original layout so older clients can read them
+  if (torrent->version != TORRENT_VERSION_LEGACY) {
+    fwrite(TORRENT_MAGIC, 1, TORRENT_MAGIC_SIZE, file);
+    fwrite(&torrent->version, sizeof(torrent->version), 1, file);
+    fwrite(&torrent->digest, sizeof(torrent->digest), 1, file);
+  }
+
   // Encode and write infohash as base64
   {
     u_char base64[HASH_SIZE + 3];
@@ -41,45 +74,59 @@ int torrent_save(const eltextorrent_file_t* torrent, const char* torrent_name) {
   fwrite(&torrent->piece_size, sizeof(torrent->piece_size), 1, file);
   fwrite(&torrent->pieces_count, sizeof(torrent->pieces_count), 1, file);
 
-  // Encode and write pieces_hashes as base64
+  // Encode and write SHA1 pieces_hashes as base64, other digests as is
   for (uint32_t i = 0; i < torrent->pieces_count; i++) {
-    u_char base64[HASH_SIZE + 3];
-    EVP_EncodeBlock(base64, &torrent->pieces_hashes[i * HASH_SIZE], HASH_SIZE);
-    base64[HASH_SIZE] = '\0';
-    fwrite(base64, 1, strlen((char*)base64), file);
-    printf("PIECE <%4u> HASH: [%s]\n", i, base64);
+    const uint8_t* hash =
+        &torrent->pieces_hashes[(size_t)i * torrent->hash_size];
+    u_char base64[DIGEST_MAX_SIZE * 4 / 3 + 4];
+    EVP_EncodeBlock(base64, hash, torrent->hash_size);
+    if (torrent->digest == DIGEST_SHA1) {
+      base64[HASH_SIZE] = '\0';
+      fwrite(base64, 1, strlen((char*)base64), file);
+    } else {
+      fwrite(hash, 1, torrent->hash_size, file);
+    }
+    if (!k_quiet) {
+      printf("PIECE <%4u> HASH: [%s]\n", i, base64);
+    }
   }
 
-  fclose(file);
-  return 0;
-}
-
-/**
- * @brief Calculates the hash of one pieces.
- *
- * @param data Pointer to the input data buffer.
- * @param length Length of data in bytes.
- * @param output_hash Output buffer for the resulting hash.
- *
- * @return 0 on success, -1 on error
- */
-int calculate_piece_hash(const uint8_t* data, size_t length,
-                         uint8_t* output_hash) {
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-  int result = 0;
-  unsigned int hash_len = HASH_SIZE;
-  if (!ctx) {
-    return -1;
+  if (torrent->blocks_hashes) {
+    uint32_t type = TORRENT_EXT_MERKLE;
+    uint64_t leaves_size = (uint64_t)torrent->blocks_count * torrent->hash_size;
+    uint64_t length = sizeof(uint32_t) * 2 + torrent->hash_size + leaves_size;
+
+    fwrite(&type, sizeof(type), 1, file);
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(&torrent->block_size, sizeof(torrent->block_size), 1, file);
+    fwrite(&torrent->blocks_count, sizeof(torrent->blocks_count), 1, file);
+    fwrite(torrent->merkle_root, 1, torrent->hash_size, file);
+    fwrite(torrent->blocks_hashes, 1, leaves_size, file);
   }
 
-  if (EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) != 1 ||
-      EVP_DigestUpdate(ctx, data, length) != 1 ||
-      EVP_DigestFinal_ex(ctx, output_hash, &hash_len) != 1) {
-    result = -1;
+  if (torrent->pieces_offsets) {
+    uint32_t type = TORRENT_EXT_CHUNKS;
+    uint64_t length =
+        sizeof(uint32_t) * 2 +
+        (uint64_t)torrent->pieces_count * (sizeof(uint64_t) + sizeof(uint32_t));
+
+    fwrite(&type, sizeof(type), 1, file);
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(&torrent->chunk_min_size, sizeof(torrent->chunk_min_size), 1, file);
+    fwrite(&torrent->chunk_avg_size, sizeof(torrent->chunk_avg_size), 1, file);
+    for (uint32_t i = 0; i < torrent->pieces_count; i++) {
+      uint64_t offset = torrent->pieces_offsets[i];
+      uint32_t piece_length =
+          (uint32_t)(torrent->pieces_offsets[i + 1] - offset);
+      fwrite(&offset, sizeof(offset), 1, file);
+      fwrite(&piece_length, sizeof(piece_length), 1, file);
+    }
   }
 
-  EVP_MD_CTX_free(ctx);
-  return result;
+  if (fclose(file) != 0) {
+    return -1;
+  }
+  return 0;
 }
 
 /**
@@ -104,8 +151,15 @@ int calculate_infohash(const eltextorrent_file_t* torrent, uint8_t* infohash) {
       EVP_DigestUpdate(ctx, torrent->name, strlen(torrent->name)) != 1 ||
       EVP_DigestUpdate(ctx, &torrent->piece_size,
                        sizeof(torrent->piece_size)) != 1 ||
+      EVP_DigestUpdate(ctx, &torrent->digest, sizeof(torrent->digest)) != 1 ||
       EVP_DigestUpdate(ctx, torrent->pieces_hashes,
-                       torrent->pieces_count * HASH_SIZE) != 1 ||
+                       (size_t)torrent->pieces_count * torrent->hash_size) !=
+              1 ||
+      EVP_DigestUpdate(ctx, torrent->merkle_root, torrent->hash_size) != 1 ||
+      (torrent->pieces_offsets &&
+       EVP_DigestUpdate(ctx, torrent->pieces_offsets,
+                        ((size_t)torrent->pieces_count + 1) *
+                            sizeof(uint64_t)) != 1) ||
       EVP_DigestFinal_ex(ctx, infohash, &hash_len) != 1) {
     result = -1;
   }
@@ -123,6 +177,10 @@ void torrent_free(eltextorrent_file_t* torrent) {
   if (torrent) {
     free(torrent->pieces_hashes);
     torrent->pieces_hashes = NULL;
+    free(torrent->blocks_hashes);
+    torrent->blocks_hashes = NULL;
+    free(torrent->pieces_offsets);
+    torrent->pieces_offsets = NULL;
   }
 }
 
@@ -132,131 +190,440 @@ void torrent_free(eltextorrent_file_t* torrent) {
  * The function calculates the number of pieces in a file.
  * The calculation uses division with the last piece being calculated.
  *
- * @param file FILE pointer to the source file (must be open in binary mode)
- * @param file_size Output parameter for the total file size in bytes
+ * @param file_size Total file size in bytes
  * @param piece_size Size of each piece in bytes
  * @return Number of pieces on success, -1 on error
  */
-int calculate_pieces_count(FILE* file, uint64_t* file_size,
-                           uint32_t piece_size) {
-  if (!file || !file_size || piece_size == 0) {
+int64_t calculate_pieces_count(uint64_t file_size, uint32_t piece_size) {
+  if (piece_size == 0) {
     fprintf(stderr, "Error: Invalid parameters.\n");
     return -1;
   }
 
-  if (fseek(file, 0, SEEK_END) == -1) {
-    perror("fseek error");
+  uint64_t count = (file_size + piece_size - 1) / piece_size;
+  if (count > UINT32_MAX) {
+    fprintf(stderr, "Error: Too many pieces, use a larger piece size.\n");
     return -1;
   }
-  long size = ftell(file);
-  if (size == -1) {
-    perror("ftell error");
+  return (int64_t)count;
+}
+
+/**
+ * @brief Chooses the piece size for a file.
+ *
+ * Picks the smallest power of two in [PIECE_SIZE_MIN, PIECE_SIZE_MAX] that
+ * keeps the number of pieces within target_pieces.
+ *
+ * @param file_size Size of the source file in bytes.
+ * @param target_pieces Desired maximum number of pieces.
+ * @return Piece size in bytes.
+ */
+static uint32_t choose_piece_size(uint64_t file_size, uint32_t target_pieces) {
+  uint32_t piece_size = PIECE_SIZE_MIN;
+
+  while (piece_size < PIECE_SIZE_MAX &&
+         (file_size + piece_size - 1) / piece_size > target_pieces) {
+    piece_size <<= 1;
+  }
+  return piece_size;
+}
+
+/**
+ * @brief Parses a piece size with an optional K or M suffix.
+ *
+ * @param text Piece size, e.g. "65536", "256K" or "4M".
+ * @param piece_size Output parameter for the size in bytes.
+ * @return If valid, returns 0.  It returns -1 otherwise.
+ */
+static int parse_piece_size(const char* text, uint32_t* piece_size) {
+  char* end = NULL;
+  unsigned long long value = strtoull(text, &end, 10);
+
+  if (end == text) {
+    return -1;
+  }
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    value *= 1024 * 1024;
+    end++;
+  }
+
+  if (*end != '\0' || value < PIECE_SIZE_MIN || value > PIECE_SIZE_MAX ||
+      (value & (value - 1)) != 0) {
     return -1;
   }
-  if (fseek(file, 0, SEEK_SET) == -1) {
-    perror("fseek error");
+  *piece_size = (uint32_t)value;
+  return 0;
+}
+
+/**
+ * @brief Splits a mapped file into content-defined pieces.
+ *
+ * @param torrent Pointer to the torrent structure with chunk sizes set up.
+ * @param data Mapped file contents.
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int split_into_chunks(eltextorrent_file_t* torrent,
+                             const uint8_t* data) {
+  chunker_params_t params;
+  chunker_params_init(&params, torrent->chunk_avg_size);
+
+  int64_t count = chunker_split(&params, data, torrent->file_size,
+                                &torrent->pieces_offsets);
+  if (count < 0 || count > UINT32_MAX) {
+    fprintf(stderr, "Error: Failed to split the file into pieces.\n");
     return -1;
   }
+  torrent->pieces_count = (uint32_t)count;
+
+  if (!k_quiet) {
+    printf("Split into %u pieces of %u bytes on average\n",
+           torrent->pieces_count,
+           count ? (uint32_t)(torrent->file_size / (uint64_t)count) : 0);
+  }
+  return 0;
+}
+
+/**
+ * @brief Hashes a regular file mapped into memory.
+ *
+ * @param torrent Pointer to the torrent structure with sizes set up.
+ * @param fd Descriptor of the source file.
+ * @param threads Number of hashing threads.
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int hash_mapped_file(eltextorrent_file_t* torrent, int fd,
+                            unsigned threads) {
+  uint8_t* data = NULL;
+  int result = -1;
+
+  if (torrent->file_size > 0) {
+    data = mmap(NULL, torrent->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("mmap error");
+      return -1;
+    }
+    madvise(data, torrent->file_size, MADV_SEQUENTIAL);
+  }
+
+  if (torrent->chunk_avg_size) {
+    if (split_into_chunks(torrent, data) == -1) {
+      goto cleanup;
+    }
+  } else {
+    int64_t pieces_count =
+        calculate_pieces_count(torrent->file_size, torrent->piece_size);
+    if (pieces_count == -1) {
+      goto cleanup;
+    }
+    torrent->pieces_count = (uint32_t)pieces_count;
+    torrent->blocks_count = (uint32_t)(
+        (torrent->file_size + torrent->block_size - 1) / torrent->block_size);
+  }
+
+  torrent->pieces_hashes =
+      malloc((size_t)torrent->pieces_count * torrent->hash_size);
+  if (torrent->blocks_count > 0) {
+    torrent->blocks_hashes =
+        malloc((size_t)torrent->blocks_count * torrent->hash_size);
+  }
+  if (!torrent->pieces_hashes ||
+      (torrent->blocks_count > 0 && !torrent->blocks_hashes)) {
+    perror("Malloc error");
+    goto cleanup;
+  }
 
-  *file_size = (uint64_t)size;
-  return ((size + piece_size - 1) / piece_size);
+  result = hash_pieces_parallel(torrent, data, threads, !k_quiet);
+
+cleanup:
+  if (data) {
+    munmap(data, torrent->file_size);
+  }
+  return result;
+}
+
+/**
+ * @brief Hashes a stream of unknown length, optionally copying it to a file.
+ *
+ * @param torrent Pointer to the torrent structure with sizes set up.
+ * @param fd Descriptor of the stream.
+ * @param tee_path File the stream is copied to, or NULL.
+ * @return If successful, returns 0.  It returns -1 on failure.
+ */
+static int hash_stream(eltextorrent_file_t* torrent, int fd,
+                       const char* tee_path) {
+  int tee_fd = -1;
+
+  if (tee_path) {
+    tee_fd = open(tee_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tee_fd == -1) {
+      fprintf(stderr, "!file %s\n", tee_path);
+      return -1;
+    }
+  }
+
+  int result = hash_pieces_stream(torrent, fd, tee_fd, !k_quiet);
+
+  if (tee_fd != -1 && close(tee_fd) == -1) {
+    perror("close error");
+    result = -1;
+  }
+  return result;
 }
 
 /**
- * @brief Creates a torrent file from a source file.
+ * @brief Creates a torrent file from a source file or stream.
  *
- * @param filename Path to the source file.
- * @param piece_size Size of each piece in bytes.
+ * Regular files are mapped into memory and hashed on several threads.
+ * Pipes, stdin (`-`) and sources copied to tee_path are read as a stream
+ * and hashed as the data arrives.
+ *
+ * @param filename Path to the source file, `-` for stdin.
+ * @param options Piece size, digest, threads and naming options.
  * @param torrent_name Name for the resulting torrent file.
  * @return If successful, returns 0.  It returns -1 on failure.
  */
-int create_torrent_file(const char* filename, uint32_t piece_size,
+int create_torrent_file(const char* filename,
+                        const creator_options_t* options,
                         const char* torrent_name) {
-  FILE* file = fopen(filename, "rb");
   eltextorrent_file_t torrent = {0};
-  int pieces_count = 0;
-  uint64_t file_size;
-  uint8_t* buffer = NULL;
+  int from_stdin = strcmp(filename, "-") == 0;
+  const char* name = options->name;
+  const char* tee_path = options->tee_path;
+  digest_algo_t digest = options->digest;
+  struct stat st;
+  int result = -1;
+
+  if (!name) {
+    name = tee_path ? tee_path : (from_stdin ? NULL : filename);
+  }
+  if (!name) {
+    fprintf(stderr, "Error: Reading stdin needs --name or --output.\n");
+    return -1;
+  }
 
-  if (!file) {
+  int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+  if (fd == -1) {
     fprintf(stderr, "!file %s\n", filename);
     return -1;
   }
 
-  pieces_count = calculate_pieces_count(file, &file_size, piece_size);
-  if ((int)pieces_count == -1) {
-    fclose(file);
-    return -1;
+  if (fstat(fd, &st) == -1) {
+    perror("fstat error");
+    goto cleanup;
+  }
+
+  int stream = !S_ISREG(st.st_mode) || tee_path;
+  if (stream && options->chunk_avg_size) {
+    fprintf(stderr,
+            "Error: Content-defined pieces need a regular file, not a "
+            "stream.\n");
+    goto cleanup;
   }
 
-  torrent.file_size = file_size;
-  torrent.piece_size = piece_size;
-  torrent.pieces_count = (uint32_t)pieces_count;
-  const char* base = strrchr(filename, '/');
+  torrent.piece_size = options->piece_size;
+  if (options->chunk_avg_size) {
+    // Merkle blocks need pieces made of whole blocks, so chunked have none
+    torrent.chunk_avg_size = options->chunk_avg_size;
+    torrent.chunk_min_size = options->chunk_avg_size / CHUNK_MIN_DIVISOR;
+    torrent.piece_size = options->chunk_avg_size * CHUNK_MAX_MULTIPLIER;
+  } else if (torrent.piece_size == 0) {
+    torrent.piece_size =
+        stream ? PIECE_SIZE_STREAM_DEFAULT
+               : choose_piece_size((uint64_t)st.st_size,
+                                   options->target_pieces);
+  }
+  torrent.digest = digest;
+  torrent.hash_size = digest_size(digest);
+  torrent.block_size = options->chunk_avg_size ? 0 : MERKLE_BLOCK_SIZE_16KB;
+  if (options->chunk_avg_size) {
+    torrent.version = TORRENT_VERSION_CHUNKED;
+  } else {
+    torrent.version =
+        digest == DIGEST_SHA1 ? TORRENT_VERSION_LEGACY : TORRENT_VERSION_LEAVES;
+  }
+  const char* base = strrchr(name, '/');
   if (base) {
     base++;
   } else {
-    base = filename;
+    base = name;
   }
   strncpy(torrent.name, base, sizeof(torrent.name) - 1);
   torrent.name[sizeof(torrent.name) - 1] = '\0';
 
-  torrent.pieces_hashes = malloc(pieces_count * HASH_SIZE);
-
-  buffer = malloc(piece_size);
-  if (!buffer || !torrent.pieces_hashes) {
-    free(buffer);
-    free(torrent.pieces_hashes);
-    perror("Malloc error");
-    fclose(file);
-    return -1;
-  }
-
-  for (int i = 0; i < pieces_count; i++) {
-    size_t bytes_read = fread(buffer, 1, piece_size, file);
-    if (calculate_piece_hash(buffer, bytes_read,
-                             &torrent.pieces_hashes[i * HASH_SIZE]) == -1) {
+  if (!stream) {
+    torrent.file_size = (uint64_t)st.st_size;
+    if (hash_mapped_file(&torrent, fd, options->threads) == -1) {
       fprintf(stderr, "Error calculating piece hash for piece.\n");
-      free(buffer);
-      torrent_free(&torrent);
-      fclose(file);
-      return -1;
+      goto cleanup;
     }
+  } else if (hash_stream(&torrent, fd, tee_path) == -1) {
+    fprintf(stderr, "Error calculating piece hash for piece.\n");
+    goto cleanup;
+  }
+
+  // Size and piece count are only known here for streams
+  if (torrent.blocks_hashes &&
+      merkle_root(digest, torrent.blocks_hashes, torrent.blocks_count,
+                  torrent.merkle_root) == -1) {
+    fprintf(stderr, "Error calculating Merkle root\n");
+    goto cleanup;
   }
 
   if (calculate_infohash(&torrent, torrent.infohash) == -1) {
     fprintf(stderr, "Error calculating infohash\n");
-    free(buffer);
-    torrent_free(&torrent);
-    fclose(file);
-    return -1;
+    goto cleanup;
   }
 
   if (torrent_save(&torrent, torrent_name) == -1) {
     fprintf(stderr, "The resulting file is corrupted.\n");
-    free(buffer);
-    torrent_free(&torrent);
-    fclose(file);
-    return -1;
+    goto cleanup;
   }
 
-  free(buffer);
+  result = 0;
+
+cleanup:
   torrent_free(&torrent);
-  fclose(file);
+  if (!from_stdin) {
+    close(fd);
+  }
+  return result;
+}
 
-  return 0;
+static void print_help(const char* program_name) {
+  printf(
+      "Usage: %s [--digest <algorithm>] [--piece-size <size>] "
+      "[--pieces <N>]\n"
+      "          [--cdc <size>] [--threads <N>] [--quiet] [--name <name>]\n"
+      "          [--output <path>]\n"
+      "          <filename | ->\n\n"
+      "Creates torrent_file.torrent for the given file, or for stdin when\n"
+      "the filename is '-'. Pipes are hashed as the data arrives.\n"
+      "OPTIONS:\n"
+      "  -a, --digest <ALGORITHM> Piece and block hash algorithm\n"
+      "                           ALGORITHM can be:\n"
+      "                             sha1   - Compatible with older clients "
+      "(default)\n"
+      "                             sha256 - SHA-256\n"
+      "                             blake3 - Fastest with SSE4.1 or AVX2, "
+      "hashes\n"
+      "                                      large pieces on all cores\n\n"
+      "  -p, --piece-size <SIZE>  Power of two from 16K to 64M, e.g. 256K or "
+      "4M\n"
+      "                           (default: chosen from the file size, 1M for\n"
+      "                           streams)\n"
+      "  -c, --pieces <N>         Piece count the chosen size aims for "
+      "(default: 2048)\n"
+      "  -C, --cdc <SIZE>         Cut pieces at content-defined boundaries of\n"
+      "                           SIZE on average (16K to 16M, power of two),\n"
+      "                           so an insertion only changes nearby pieces.\n"
+      "                           Pieces range from SIZE/4 to SIZE*4. Regular\n"
+      "                           files only, needs a client that supports\n"
+      "                           them\n"
+      "  -j, --threads <N>        Hashing threads (default: online CPUs)\n"
+      "  -q, --quiet              Do not print piece hashes and progress\n"
+      "  -n, --name <NAME>        Name of the shared file (default: file "
+      "name)\n"
+      "  -o, --output <PATH>      Copy the data to PATH while hashing\n"
+      "  -h, --help               Show this help message and exit\n\n",
+      program_name);
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  static struct option long_options[] = {
+      {"digest", required_argument, 0, 'a'},
+      {"piece-size", required_argument, 0, 'p'},
+      {"pieces", required_argument, 0, 'c'},
+      {"cdc", required_argument, 0, 'C'},
+      {"threads", required_argument, 0, 'j'},
+      {"quiet", no_argument, 0, 'q'},
+      {"name", required_argument, 0, 'n'},
+      {"output", required_argument, 0, 'o'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  creator_options_t options = {
+      .target_pieces = PIECES_TARGET_COUNT,
+      .digest = DIGEST_SHA1,
+      .threads = worker_pool_cpus(),
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "a:p:c:C:j:qn:o:h", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        if (digest_parse(optarg, &options.digest) != 0) {
+          fprintf(stderr, "Error: Unknown digest '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      case 'j': {
+        char* end = NULL;
+        long value = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || value < 1 || value > 1024) {
+          fprintf(stderr, "Error: Invalid thread count '%s'\n", optarg);
+          return 1;
+        }
+        options.threads = (unsigned)value;
+        break;
+      }
+      case 'p':
+        if (parse_piece_size(optarg, &options.piece_size) != 0) {
+          fprintf(stderr,
+                  "Error: Piece size must be a power of two from 16K to 64M\n");
+          return 1;
+        }
+        break;
+      case 'c': {
+        char* end = NULL;
+        long value = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || value < 1 ||
+            value > UINT32_MAX) {
+          fprintf(stderr, "Error: Invalid piece count '%s'\n", optarg);
+          return 1;
+        }
+        options.target_pieces = (uint32_t)value;
+        break;
+      }
+      case 'C':
+        if (parse_piece_size(optarg, &options.chunk_avg_size) != 0 ||
+            options.chunk_avg_size > PIECE_SIZE_MAX / CHUNK_MAX_MULTIPLIER) {
+          fprintf(stderr,
+                  "Error: Average piece size must be a power of two from 16K "
+                  "to 16M\n");
+          return 1;
+        }
+        break;
+      case 'q':
+        k_quiet = 1;
+        break;
+      case 'n':
+        options.name = optarg;
+        break;
+      case 'o':
+        options.tee_path = optarg;
+        break;
+      case 'h':
+        print_help(argv[0]);
+        return 0;
+      default:
+        print_help(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind >= argc) {
     printf("Enter the path to the file as an argument.\n");
+    return 1;
   }
 
-  if (create_torrent_file(argv[1], PIECE_SIZE_64KB, "torrent_file") == 0) {
-    printf("Torrent file created.\n");
-  } else {
+  if (create_torrent_file(argv[optind], &options, "torrent_file") != 0) {
     printf("Error creating torrent file.\n");
+    return 1;
   }
 
+  printf("Torrent file created.\n");
   return 0;
 }
@@ -1,41 +1,53 @@
 #include "progress_bar.h"
 
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define PROGRESS_BAR_WIDTH 50
 #define BYTES_PER_KB 1024.0
+#define FRAME_SIZE 4096
 
 #define CLEAR_LINE "\033[K"
 #define CARRIAGE_RETURN "\r"
-#define SAVE_CURSOR "\033[s"
-#define RESTORE_CURSOR "\033[u"
-#define MOVE_CURSOR_UP "\033[1A"
+#define MOVE_CURSOR_UP "\033[%dA"
+
+typedef struct {
+  char ip[INET_ADDRSTRLEN];
+  uint64_t bytes;
+  uint64_t sampled_bytes; /* Bytes at the previous rate sample */
+  double rate;            /* Bytes per second, moving average */
+} peer_stats_t;
 
 typedef struct {
   uint64_t total_bytes;
-  uint64_t downloaded_bytes;
-  double percentage;
-  time_t start_time;
-  int is_first_update;
-  int is_completed;
+  uint64_t start_bytes; /* Present before the transfer */
+  uint64_t done_bytes;
+  uint64_t sampled_bytes;
+  double rate;
+  uint64_t start_ns;
+  uint64_t sample_ns;
+  uint64_t draw_ns;
+  int samples;
+  int is_tty;
+  int is_started;
+  int lines; /* Lines of the previous frame, redrawn in place */
+  /* The extra slot sums up peers past PROGRESS_MAX_PEERS */
+  peer_stats_t peers[PROGRESS_MAX_PEERS + 1];
+  int peers_count;
 } download_state_t;
 
-static void update_percentage(download_state_t* state) {
-  if (state->total_bytes == 0) {
-    state->percentage = 0.0;
-    return;
-  }
-
-  state->percentage =
-      (double)state->downloaded_bytes * 100.0 / (double)state->total_bytes;
-  if (state->percentage > 100.0) {
-    state->percentage = 100.0;
-  }
-}
+static download_state_t k_state;
+static const char* const k_units[] = {"B", "KB", "MB", "GB"};
 
-static int is_download_complete(const download_state_t* state) {
-  return state->downloaded_bytes >= state->total_bytes;
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
 }
 
 static void format_file_size(uint64_t bytes, double* size, int* unit_index) {
@@ -63,108 +75,244 @@ static void format_time(double seconds, char* buffer, size_t buffer_size) {
   }
 }
 
-static void display_progress(const download_state_t* state) {
-  printf(SAVE_CURSOR);
-  printf(MOVE_CURSOR_UP);
-  printf(CLEAR_LINE CARRIAGE_RETURN);
-
-  double downloaded_size, total_size;
-  int downloaded_unit, total_unit;
-
-  format_file_size(state->downloaded_bytes, &downloaded_size, &downloaded_unit);
-  format_file_size(state->total_bytes, &total_size, &total_unit);
+static void append(char* frame, size_t* length, const char* format, ...) {
+  if (*length >= FRAME_SIZE) {
+    return;
+  }
 
-  const char* units[] = {"B", "KB", "MB", "GB"};
-  int pos = (int)(state->percentage * PROGRESS_BAR_WIDTH / 100.0);
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(frame + *length, FRAME_SIZE - *length, format, args);
+  va_end(args);
 
-  printf("[");
-  for (int i = 0; i < PROGRESS_BAR_WIDTH; ++i) {
-    if (i < pos) {
-      printf("▉");
-    } else {
-      printf(" ");
+  if (written > 0) {
+    *length += (size_t)written;
+    if (*length > FRAME_SIZE - 1) {
+      *length = FRAME_SIZE - 1;
     }
   }
-  printf("] %.1f%%", state->percentage);
+}
 
-  printf(" | %.2f %s / %.2f %s", downloaded_size, units[downloaded_unit],
-         total_size, units[total_unit]);
+static double percentage(const download_state_t* state) {
+  if (state->total_bytes == 0) {
+    return 100.0;
+  }
+  return (double)state->done_bytes * 100.0 / (double)state->total_bytes;
+}
 
-  if (!state->is_first_update) {
-    time_t current_time = time(NULL);
-    double elapsed_seconds = difftime(current_time, state->start_time);
+/**
+ * @brief Seconds left at the average speed or `-1` if it is unknown
+ */
+static double eta_seconds(const download_state_t* state) {
+  if (state->done_bytes >= state->total_bytes) {
+    return 0;
+  }
+  if (state->rate <= 0) {
+    return -1;
+  }
+  return (double)(state->total_bytes - state->done_bytes) / state->rate;
+}
 
-    if (elapsed_seconds > 0) {
-      double speed = (double)state->downloaded_bytes / elapsed_seconds;
-      double speed_size;
-      int speed_unit;
-      format_file_size((uint64_t)speed, &speed_size, &speed_unit);
+static double moving_average(double average, double value, double seconds,
+                             int first) {
+  if (first) {
+    return value;
+  }
+  // First-order approximation of 1 - exp(-dt / tau)
+  double alpha = seconds / (PROGRESS_EWMA_SECONDS + seconds);
+  return average + alpha * (value - average);
+}
 
-      char time_buffer[32];
-      format_time(elapsed_seconds, time_buffer, sizeof(time_buffer));
+static void sample_rates(download_state_t* state, uint64_t now) {
+  double seconds = (double)(now - state->sample_ns) / 1e9;
+  if (seconds <= 0) {
+    return;
+  }
 
-      printf(" | %.2f %s/s | %s", speed_size, units[speed_unit], time_buffer);
-    }
+  int first = state->samples == 0;
+  state->rate = moving_average(
+      state->rate, (double)(state->done_bytes - state->sampled_bytes) / seconds,
+      seconds, first);
+  state->sampled_bytes = state->done_bytes;
+
+  for (int i = 0; i < state->peers_count; i++) {
+    peer_stats_t* peer = &state->peers[i];
+    peer->rate = moving_average(
+        peer->rate, (double)(peer->bytes - peer->sampled_bytes) / seconds,
+        seconds, first);
+    peer->sampled_bytes = peer->bytes;
   }
 
-  printf(RESTORE_CURSOR);
-  fflush(stdout);
+  state->sample_ns = now;
+  state->samples++;
 }
 
-void update_progress_bar(uint64_t total_bytes, uint64_t current_downloaded) {
-  static download_state_t state = {0};
+static void draw_terminal(download_state_t* state) {
+  char frame[FRAME_SIZE];
+  size_t length = 0;
+  double size, total_size, speed;
+  int unit, total_unit, speed_unit;
 
-  if (state.is_completed) {
-    return;
+  if (state->lines > 0) {
+    append(frame, &length, MOVE_CURSOR_UP, state->lines);
   }
 
-  if (state.total_bytes == 0 && total_bytes > 0) {
-    state.total_bytes = total_bytes;
-    state.start_time = time(NULL);
-    state.is_first_update = 1;
+  double percent = percentage(state);
+  int pos = (int)(percent * PROGRESS_BAR_WIDTH / 100.0);
+  append(frame, &length, CARRIAGE_RETURN CLEAR_LINE "[");
+  for (int i = 0; i < PROGRESS_BAR_WIDTH; ++i) {
+    append(frame, &length, i < pos ? "▉" : " ");
+  }
 
-    printf("\n");
-    fflush(stdout);
+  format_file_size(state->done_bytes, &size, &unit);
+  format_file_size(state->total_bytes, &total_size, &total_unit);
+  format_file_size((uint64_t)state->rate, &speed, &speed_unit);
+  append(frame, &length, "] %.1f%% | %.2f %s / %.2f %s | %.2f %s/s", percent,
+         size, k_units[unit], total_size, k_units[total_unit], speed,
+         k_units[speed_unit]);
+
+  double eta = eta_seconds(state);
+  char time_buffer[32] = "--";
+  if (eta >= 0) {
+    format_time(eta, time_buffer, sizeof(time_buffer));
   }
+  append(frame, &length, " | ETA %s\n", time_buffer);
+  state->lines = 1;
 
-  if (total_bytes == 0) {
-    fprintf(stderr, "Error: total_bytes cannot be zero\n");
-    return;
+  uint64_t received = 0;
+  for (int i = 0; i < state->peers_count; i++) {
+    received += state->peers[i].bytes;
+  }
+
+  for (int i = 0; i < state->peers_count; i++) {
+    const peer_stats_t* peer = &state->peers[i];
+    format_file_size(peer->bytes, &size, &unit);
+    format_file_size((uint64_t)peer->rate, &speed, &speed_unit);
+    append(frame, &length,
+           CARRIAGE_RETURN CLEAR_LINE "  %-15s %8.2f %-2s %5.1f%% %8.2f %s/s\n",
+           i < PROGRESS_MAX_PEERS ? peer->ip : "other", size, k_units[unit],
+           received ? (double)peer->bytes * 100.0 / (double)received : 0.0,
+           speed, k_units[speed_unit]);
+    state->lines++;
   }
 
-  state.downloaded_bytes = current_downloaded;
-  update_percentage(&state);
+  fwrite(frame, 1, length, stdout);
+  fflush(stdout);
+}
 
-  if (state.is_first_update) {
-    state.is_first_update = 0;
+static void draw_line(const download_state_t* state, uint64_t now) {
+  char frame[FRAME_SIZE];
+  size_t length = 0;
+
+  append(frame, &length,
+         "progress done=%" PRIu64 " total=%" PRIu64
+         " percent=%.1f rate=%.0f eta=%.0f elapsed=%.1f",
+         state->done_bytes, state->total_bytes, percentage(state),
+         state->rate, eta_seconds(state),
+         (double)(now - state->start_ns) / 1e9);
+
+  for (int i = 0; i < state->peers_count; i++) {
+    const peer_stats_t* peer = &state->peers[i];
+    append(frame, &length, " peer=%s,%" PRIu64 ",%.0f",
+           i < PROGRESS_MAX_PEERS ? peer->ip : "other", peer->bytes,
+           peer->rate);
   }
+  append(frame, &length, "\n");
+
+  fwrite(frame, 1, length, stdout);
+  fflush(stdout);
+}
+
+static void draw(download_state_t* state, uint64_t now) {
+  sample_rates(state, now);
+  if (state->is_tty) {
+    draw_terminal(state);
+  } else {
+    draw_line(state, now);
+  }
+  state->draw_ns = now;
+}
+
+void progress_bar_start(uint64_t total_bytes, uint64_t done_bytes) {
+  memset(&k_state, 0, sizeof(k_state));
+  k_state.total_bytes = total_bytes;
+  k_state.start_bytes = done_bytes;
+  k_state.done_bytes = done_bytes;
+  k_state.sampled_bytes = done_bytes;
+  k_state.start_ns = now_ns();
+  k_state.sample_ns = k_state.start_ns;
+  k_state.draw_ns = k_state.start_ns;
+  k_state.is_tty = isatty(STDOUT_FILENO);
+  k_state.is_started = 1;
+}
 
-  display_progress(&state);
+void progress_bar_set_done(uint64_t done_bytes) {
+  k_state.done_bytes = done_bytes;
+}
 
-  if (is_download_complete(&state)) {
-    state.is_completed = 1;
+void progress_bar_add_peer(const char* peer, uint64_t bytes) {
+  int i = 0;
+  while (i < k_state.peers_count && strcmp(k_state.peers[i].ip, peer) != 0) {
+    i++;
+  }
 
-    time_t end_time = time(NULL);
-    double total_seconds = difftime(end_time, state.start_time);
+  if (i == k_state.peers_count) {
+    if (k_state.peers_count < PROGRESS_MAX_PEERS) {
+      snprintf(k_state.peers[i].ip, sizeof(k_state.peers[i].ip), "%s", peer);
+      k_state.peers_count++;
+    } else {
+      k_state.peers_count = PROGRESS_MAX_PEERS + 1;
+      i = PROGRESS_MAX_PEERS;
+    }
+  }
+  k_state.peers[i].bytes += bytes;
+}
 
-    double total_size;
-    int total_unit;
-    format_file_size(state.total_bytes, &total_size, &total_unit);
+void progress_bar_tick(void) {
+  if (!k_state.is_started) {
+    return;
+  }
 
-    const char* units[] = {"B", "KB", "MB", "GB"};
+  uint64_t now = now_ns();
+  uint64_t interval_ms =
+      k_state.is_tty ? PROGRESS_REFRESH_MS : PROGRESS_LINE_MS;
+  if (now - k_state.draw_ns >= interval_ms * 1000000ULL) {
+    draw(&k_state, now);
+  }
+}
 
-    char time_buffer[32];
-    format_time(total_seconds, time_buffer, sizeof(time_buffer));
+void progress_bar_finish(void) {
+  if (!k_state.is_started) {
+    return;
+  }
 
-    double avg_speed = (double)state.total_bytes / total_seconds;
-    double avg_speed_size;
-    int avg_speed_unit;
-    format_file_size((uint64_t)avg_speed, &avg_speed_size, &avg_speed_unit);
+  uint64_t now = now_ns();
+  draw(&k_state, now);
+  k_state.is_started = 0;
 
-    printf("\nDownload completed! %.1f%% - %.2f %s downloaded\n",
-           state.percentage, total_size, units[total_unit]);
-    printf("Time: %s | Average speed: %.2f %s/s\n", time_buffer, avg_speed_size,
-           units[avg_speed_unit]);
-    fflush(stdout);
+  if (k_state.done_bytes < k_state.total_bytes) {
+    return;
   }
+
+  double total_seconds = (double)(now - k_state.start_ns) / 1e9;
+  double total_size;
+  int total_unit;
+  format_file_size(k_state.total_bytes, &total_size, &total_unit);
+
+  char time_buffer[32];
+  format_time(total_seconds, time_buffer, sizeof(time_buffer));
+
+  double avg_speed =
+      total_seconds > 0
+          ? (double)(k_state.done_bytes - k_state.start_bytes) / total_seconds
+          : 0;
+  double avg_speed_size;
+  int avg_speed_unit;
+  format_file_size((uint64_t)avg_speed, &avg_speed_size, &avg_speed_unit);
+
+  printf("Download completed! %.1f%% - %.2f %s downloaded\n",
+         percentage(&k_state), total_size, k_units[total_unit]);
+  printf("Time: %s | Average speed: %.2f %s/s\n", time_buffer, avg_speed_size,
+         k_units[avg_speed_unit]);
+  fflush(stdout);
 }
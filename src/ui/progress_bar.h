@@ -1,13 +1,54 @@
+/**
+ * @file progress_bar.h
+ * @brief Download progress with windowed speed, ETA and a per-peer table.
+ *
+ * The data path only updates counters. Drawing happens in
+ * progress_bar_tick(), called from the event loop, at most every
+ * PROGRESS_REFRESH_MS on a terminal, so the cost does not grow with the
+ * number of pieces. When stdout is not a terminal, one key=value line is
+ * printed every PROGRESS_LINE_MS instead.
+ */
+
 #ifndef UI_PROGRESS_BAR_H_
 #define UI_PROGRESS_BAR_H_
 
 #include <stdint.h>
 
+#define PROGRESS_REFRESH_MS 250
+#define PROGRESS_LINE_MS 1000
+/* Time constant of the moving average speed */
+#define PROGRESS_EWMA_SECONDS 2.0
+/* Peers listed separately, the rest are summed up as "other" */
+#define PROGRESS_MAX_PEERS 8
+
+/**
+ * @brief Start tracking a download
+ * @param total_bytes Size of the file
+ * @param done_bytes Bytes already present before the transfer started
+ */
+void progress_bar_start(uint64_t total_bytes, uint64_t done_bytes);
+
+/**
+ * @brief Record the number of verified bytes
+ * @param done_bytes Verified bytes including the ones present at start
+ */
+void progress_bar_set_done(uint64_t done_bytes);
+
+/**
+ * @brief Record payload received from a peer
+ * @param peer Peer address
+ * @param bytes Received bytes
+ */
+void progress_bar_add_peer(const char* peer, uint64_t bytes);
+
+/**
+ * @brief Redraw if the refresh interval has passed
+ */
+void progress_bar_tick(void);
+
 /**
- * @brief Update progress bar display
- * @param total_bytes Total bytes to download
- * @param current_downloaded Currently downloaded bytes
+ * @brief Draw the final state and a summary if the download is complete
  */
-void update_progress_bar(uint64_t total_bytes, uint64_t current_downloaded);
+void progress_bar_finish(void);
 
 #endif  // UI_PROGRESS_BAR_H_